@@ -58,8 +58,11 @@ loader_start:
 
     add di, cx ; 使 di 增加 20 字节指向缓冲区中新的 ARDS 结构位置
     inc word [ards_nr] ; 记录 ARDS 数量
+    cmp word [ards_nr], 12 ; ards_buf 只能放下 12 个 ARDS, 再多就会覆盖 ards_nr 和后面的代码
+    jae .e820_mem_get_done ; 缓冲区满了就不再读取
     cmp ebx, 0 ; 若 ebx 为 0 且 cf 不为 1, 说明 ards 已全部返回
     jnz .e820_mem_get_loop ; ebx != 0，循环读下一个 ARDS
+.e820_mem_get_done:
 
     ; 在所有 ARDS 结构中，找出 (base_add_low + length_low) 的最大值，即内存容量
     mov cx, [ards_nr] ; 循环次数是 ARDS 的数量
@@ -71,7 +74,7 @@ loader_start:
     add eax, [ebx+8] ; length_low
     add ebx, 20 ; 只想缓冲区中下一个 ARDS 结构
     cmp edx, eax ; edx 保存最大内存容量
-    jge .next_ards
+    jae .next_ards ; 按无符号数比较, 2GB 以上的地址最高位为 1
     mov edx, eax ; edx <= eax 则进行赋值 edx = eax
 .next_ards:
     loop .find_max_mem_area
@@ -149,11 +152,28 @@ p_mode_start:
     mov gs, ax
 
     ; 加载 kernel
+    ; 0x1f2 端口的扇区数只有 8 位, rd_disk_m_32 又用 16 位的 cx 计读入的字数,
+    ; 所以每次最多读 KERNEL_READ_CHUNK 个扇区, 分几次读完 KERNEL_SECTOR_CNT 个
     mov eax, KERNEL_START_SECTOR ; kernel.bin 所在的扇区号
     mov ebx, KERNEL_BIN_BASE_ADDR ; 从磁盘读出后，写入到 ebx 指定的地址
-    mov ecx, 200 ; 读入的扇区数
-
-    call rd_disk_m_32
+    mov ecx, KERNEL_SECTOR_CNT ; 还要读入的扇区数
+.read_kernel:
+    mov edx, ecx
+    cmp edx, KERNEL_READ_CHUNK
+    jbe .read_chunk
+    mov edx, KERNEL_READ_CHUNK
+.read_chunk:
+    push eax
+    push ecx
+    push edx
+    mov ecx, edx
+    call rd_disk_m_32 ; 读完后 ebx 已指向下一块要写入的地址
+    pop edx
+    pop ecx
+    pop eax
+    add eax, edx
+    sub ecx, edx
+    jnz .read_kernel
 
     ; 创建页目录及页表并初始化页内存位图
     call setup_page
@@ -224,18 +244,8 @@ setup_page:
     inc esi
     loop .create_pte
 
-; 创建内核其它页表的 PDE
-    mov eax, PAGE_DIR_TABLE_POS
-    add eax, 0x2000 ; eax = 第二个页表的位置
-    or eax, PG_US_U | PG_RW_W | PG_P
-    mov ebx, PAGE_DIR_TABLE_POS
-    mov ecx, 254 ; 范围为第 769 ~ 1022 的所有目录项数量
-    mov esi, 769
-.create_kernel_pde:
-    mov [ebx + esi * 4], eax
-    inc esi
-    add eax, 0x1000
-    loop .create_kernel_pde
+; 内核的其它页目录项(第 769 ~ 1022 项)不再在这里建立页表,
+; 内核在 mem_init 中用 4MB 大页把物理内存映射到 0xc0000000 起(见 direct_map_init)
     ret
 
 ; 保护模式的硬盘读取函数
@@ -1,6 +1,7 @@
 #include "syscall.h"
 #include "stdio.h"
 #include "string.h"
+#include "malloc.h"
 int main(int argc, char** argv) {
    if (argc > 2 || argc == 1) {
       printf("cat: only support 1 argument.\neg: cat filename\n");
@@ -25,6 +26,18 @@ int main(int argc, char** argv) {
       printf("cat: open: open %s failed\n", argv[1]);
       return -1;
    }
+   /* 把整个文件映射进来一次写出, 不用一块一块地读; 空文件或映射失败时退回到read */
+   struct stat file_stat;
+   if (stat(abs_path, &file_stat) == 0 && file_stat.st_size > 0) {
+      char* data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+         write(1, data, file_stat.st_size);
+         munmap(data, file_stat.st_size);
+         free(buf);
+         close(fd);
+         return 66;
+      }
+   }
    int read_bytes= 0;
    while (1) {
       read_bytes = read(fd, buf, buf_size);
@@ -11,14 +11,15 @@ if [[ ! -d "../lib" || ! -d "../build" ]];then
    exit
 fi
 
-BIN="prog_pipe"
+# 要编译的程序名作为第一个参数, 默认为prog_pipe, 例如 ./compile.sh malloc_bench
+BIN=${1:-"prog_pipe"}
 CFLAGS="-Wall -m32 -c -fno-builtin -W -Wstrict-prototypes \
       -Wmissing-prototypes -Wsystem-headers"
 LIBS="-I ../lib/ -I ../lib/kernel/ -I ../lib/user/ -I \
       ../kernel/ -I ../device/ -I ../thread/ -I \
       ../userprog/ -I ../fs/ -I ../shell/"
 OBJS="../build/string.o ../build/syscall.o \
-      ../build/stdio.o ../build/assert.o start.o"
+      ../build/stdio.o ../build/assert.o ../build/malloc.o start.o"
 DD_IN=$BIN
 DD_OUT="/root/bochs/hd60M.img" 
 
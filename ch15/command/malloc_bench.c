@@ -0,0 +1,49 @@
+#include "stdio.h"
+#include "syscall.h"
+#include "malloc.h"
+#include "string.h"
+
+// 比较用户态的malloc/free与每次都陷入内核的syscall_malloc/syscall_free
+// 每轮申请BATCH块不同大小的内存再全部释放, 结果为平均每次操作的时钟周期
+
+#define ROUNDS 2000
+#define BATCH 16
+
+static uint32_t sizes[BATCH] = {16, 24, 100, 32, 500, 64, 8, 1000, 200, 48, 3000, 128, 12, 256, 700, 2048};
+
+static inline uint64_t rdtsc(void) {
+   uint32_t lo, hi;
+   asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+   return ((uint64_t)hi << 32) | lo;
+}
+
+static uint32_t bench(void* (*alloc)(uint32_t), void (*release)(void*)) {
+   void* ptrs[BATCH];
+   uint32_t round = 0;
+   uint64_t start = rdtsc();
+   while (round++ < ROUNDS) {
+      uint32_t idx;
+      for (idx = 0; idx < BATCH; idx++) {
+         ptrs[idx] = alloc(sizes[idx]);
+         if (ptrs[idx] == NULL) {
+            printf("malloc_bench: out of memory\n");
+            exit(-1);
+         }
+      }
+      for (idx = 0; idx < BATCH; idx++) {
+         release(ptrs[idx]);
+      }
+   }
+   return (uint32_t)(rdtsc() - start) / (ROUNDS * BATCH * 2);
+}
+
+int main(void) {
+   uint32_t heap_start = (uint32_t)sbrk(0);
+   uint32_t user = bench(malloc, free);
+   uint32_t heap_pages = ((uint32_t)sbrk(0) - heap_start) / 4096;
+   uint32_t kernel = bench(syscall_malloc, syscall_free);
+   printf("malloc_bench: %d rounds of %d malloc + %d free, cycles per call\n", ROUNDS, BATCH, BATCH);
+   printf("    user malloc (brk heap %d pages): %d\n", heap_pages, user);
+   printf("    syscall malloc: %d\n", kernel);
+   return 0;
+}
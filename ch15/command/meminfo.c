@@ -0,0 +1,69 @@
+#include "stdio.h"
+#include "syscall.h"
+#include "malloc.h"
+
+// 显示两个物理内存池的用量, 预清零, 交换分区和堆的统计, 内核堆各规格的arena, 各slab对象缓存, 以及各用户进程的内存
+// 页数都以4KB为单位; 分配出去的块包括缓存在各任务弹匣中的块
+
+static void pool_print(const char* name, struct pool_info* pool) {
+   printf("%s pool: %d of %d pages free, largest free block %d pages\n", \
+          name, pool->free_pages, pool->total_pages, pool->largest_free);
+}
+
+static void heap_print(const char* name, struct heap_frag_stat* hs) {
+   printf("%s heap: requested %dK reserved %dK, in use %dK of %d pages\n", name, \
+          (uint32_t)(hs->requested >> 10), (uint32_t)(hs->reserved >> 10), hs->in_use >> 10, hs->arena_pages);
+}
+
+static void descs_print(struct desc_info* descs) {
+   uint32_t desc_idx;
+   for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++) {
+      struct desc_info* desc = &descs[desc_idx];
+      uint32_t blocks = desc->arenas * desc->blocks_per_arena;
+      printf("   %d bytes: %d arenas, %d free of %d blocks\n", \
+             desc->block_size, desc->arenas, desc->free_blocks, blocks);
+   }
+}
+
+int main(void) {
+   struct meminfo* info = malloc(sizeof(struct meminfo));
+   if (info == NULL) {
+      printf("meminfo: malloc memory failed\n");
+      return -1;
+   }
+   meminfo(info);
+   pool_print("kernel", &info->kernel_pool);
+   pool_print("user", &info->user_pool);
+   // 预清零的储备和命中情况, 清零耗时以千个时钟周期为单位
+   printf("zeroed pages: ready %d hits %d misses %d sync %dK cycles idle %dK cycles\n", \
+          info->zeroed_pages, info->zeroed_stat.hits, info->zeroed_stat.misses, \
+          (uint32_t)(info->zeroed_stat.sync_cycles >> 10), (uint32_t)(info->zeroed_stat.idle_cycles >> 10));
+   printf("swap %s: used %d of %d pages, in %d out %d aborted %d\n", \
+          info->swap_part[0] != 0 ? info->swap_part : "none", info->swap_stat.slots_used, info->swap_stat.slots, \
+          info->swap_stat.swap_ins, info->swap_stat.swap_outs, info->swap_stat.aborts);
+   // 堆的碎片: 累计申请与实际分出的字节数之差是内部碎片, arena占用的页多于在用的部分是闲置的块
+   heap_print("kernel", &info->kernel_heap);
+   heap_print("user", &info->user_heap);
+   // 小块内存走弹匣的次数, 以及获取内存池锁时的争用
+   printf("malloc: magazine hits %d pool lock %d contended %d\n", info->malloc_stat.mag_hits, \
+          info->malloc_stat.lock_acquires, info->malloc_stat.lock_contended);
+   printf("kernel heap:\n");
+   descs_print(info->kernel_descs);
+   printf("slab caches:\n");
+   uint32_t cache_idx;
+   for (cache_idx = 0; cache_idx < info->cache_cnt; cache_idx++) {
+      struct cache_info* cache = &info->caches[cache_idx];
+      printf("   %s: %d bytes, %d of %d objects in use, %d slabs, %d allocs\n", cache->name, \
+             cache->obj_size, cache->active_objs, cache->total_objs, cache->slabs, cache->allocs);
+   }
+
+   uint32_t proc_idx;
+   for (proc_idx = 0; proc_idx < info->proc_cnt; proc_idx++) {
+      struct proc_mem_info* proc = &info->procs[proc_idx];
+      printf("%d %s: resident %d swapped %d page tables %d vmas %d\n", proc->pid, proc->name, \
+             proc->resident_pages, proc->swapped_pages, proc->page_tables, proc->vmas);
+      descs_print(proc->descs);
+   }
+   free(info);
+   return 0;
+}
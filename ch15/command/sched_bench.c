@@ -0,0 +1,105 @@
+#include "stdio.h"
+#include "syscall.h"
+#include "string.h"
+
+// 计算任务在跑时交互任务的响应时间
+// 交互任务用读硬盘代替shell等键盘: 每次lseek回文件头读一个扇区, 进程阻塞在硬盘中断上, 被唤醒后要等调度器把它换上处理器,
+// 一次读的时钟周期数就是唤醒到运行的延迟加上读盘本身. 先在没有别的任务时测一遍作为基准,
+// 再fork出HOGS个只做计算的子进程, 在它们运行期间反复测, 比较两次的平均和最大延迟
+
+#define HOGS 3
+#define SAMPLES 200
+#define WINDOW_FACTOR 20     // 计算进程运行的时间是基准测试总耗时的这么多倍
+#define TMP_FILE "/sched_bench.tmp"
+
+static inline uint64_t rdtsc(void) {
+   uint32_t lo, hi;
+   asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+   return ((uint64_t)hi << 32) | lo;
+}
+
+struct latency {
+   uint32_t cnt;
+   uint64_t total;
+   uint64_t max;
+};
+
+// 读一个扇区, 返回花去的时钟周期数
+static uint64_t read_once(int32_t fd, char* buf) {
+   uint64_t start = rdtsc();
+   lseek(fd, 0, SEEK_SET);
+   if (read(fd, buf, 512) != 512) {
+      printf("sched_bench: read %s failed\n", TMP_FILE);
+      exit(-1);
+   }
+   return rdtsc() - start;
+}
+
+// 读到够SAMPLES次或者到了deadline为止, deadline为0表示不限时间
+static void measure(int32_t fd, char* buf, uint64_t deadline, struct latency* lat) {
+   memset(lat, 0, sizeof(struct latency));
+   while (lat->cnt < SAMPLES && (deadline == 0 || rdtsc() < deadline)) {
+      uint64_t cycles = read_once(fd, buf);
+      lat->cnt++;
+      lat->total += cycles;
+      if (cycles > lat->max) {
+         lat->max = cycles;
+      }
+   }
+}
+
+static void latency_print(const char* name, struct latency* lat) {
+   uint32_t avg = lat->cnt == 0 ? 0 : (uint32_t)(lat->total >> 10) / lat->cnt;
+   printf("    %s: %d reads, avg %dK max %dK cycles\n", name, lat->cnt, avg, (uint32_t)(lat->max >> 10));
+}
+
+// 计算进程: 空转到deadline后退出
+static void hog(uint64_t deadline) {
+   volatile uint32_t spins = 0;
+   while (rdtsc() < deadline) {
+      spins++;
+   }
+   exit(0);
+}
+
+int main(void) {
+   static char buf[512];
+   unlink(TMP_FILE);
+   int32_t fd = open(TMP_FILE, O_CREAT | O_RDWR);
+   if (fd == -1) {
+      printf("sched_bench: create %s failed\n", TMP_FILE);
+      return -1;
+   }
+   memset(buf, 'x', sizeof(buf));
+   write(fd, buf, sizeof(buf));
+
+   struct latency idle, busy;
+   uint64_t start = rdtsc();
+   measure(fd, buf, 0, &idle);
+   uint64_t deadline = rdtsc() + (rdtsc() - start) * WINDOW_FACTOR;
+
+   uint32_t hog_idx;
+   for (hog_idx = 0; hog_idx < HOGS; hog_idx++) {
+      int16_t pid = fork();
+      if (pid == -1) {
+         printf("sched_bench: fork failed\n");
+         break;
+      }
+      if (pid == 0) {
+         hog(deadline);
+      }
+   }
+   measure(fd, buf, deadline, &busy);
+
+   int32_t status;
+   while (hog_idx-- > 0) {
+      wait(&status);
+   }
+   close(fd);
+   unlink(TMP_FILE);
+
+   printf("sched_bench: read latency of an I/O bound task\n");
+   latency_print("alone", &idle);
+   latency_print("with hogs", &busy);
+   return 0;
+}
@@ -0,0 +1,67 @@
+#include "stdio.h"
+#include "syscall.h"
+#include "string.h"
+
+// 多处理器上计算任务的并行加速比
+// 总的计算量固定为WORK份, 分给1, 2, 4个子进程同时做, 每个子进程做WORK/n份后退出,
+// 父进程用单调时钟计从fork第一个子进程到回收完最后一个的时间. 在qemu -smp 4下运行,
+// 理想情况下n个进程的耗时是1个进程的1/n, 单处理器上各行耗时应当差不多
+
+#define WORK 64              // 总计算量的份数, 要能被各进程数整除
+#define SPINS_PER_WORK 2000000
+
+static const uint32_t workers[] = {1, 2, 4};
+
+// 计算进程: 做units份空转后退出
+static void worker(uint32_t units) {
+   volatile uint32_t sum = 0;
+   uint32_t i;
+   for (i = 0; i < units * SPINS_PER_WORK; i++) {
+      sum += i;
+   }
+   exit(0);
+}
+
+static uint32_t now_ms(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// 用n个进程做完WORK份计算, 返回耗时的毫秒数
+static uint32_t run(uint32_t n) {
+   uint32_t start = now_ms();
+   uint32_t forked;
+   for (forked = 0; forked < n; forked++) {
+      int16_t pid = fork();
+      if (pid == -1) {
+         printf("smp_bench: fork failed\n");
+         break;
+      }
+      if (pid == 0) {
+         worker(WORK / n);
+      }
+   }
+   int32_t status;
+   while (forked-- > 0) {
+      wait(&status);
+   }
+   return now_ms() - start;
+}
+
+int main(void) {
+   uint32_t base = 0;
+   uint32_t idx;
+   printf("smp_bench: %d units of cpu bound work split among n processes\n", WORK);
+   for (idx = 0; idx < sizeof(workers) / sizeof(workers[0]); idx++) {
+      uint32_t ms = run(workers[idx]);
+      if (idx == 0) {
+         base = ms;
+      }
+      // 加速比保留两位小数, printf只能打整数
+      uint32_t speedup = ms == 0 ? 0 : base * 100 / ms;
+      printf("    %d procs: %d ms, speedup %d.%d%d\n", workers[idx], ms, \
+             speedup / 100, speedup / 10 % 10, speedup % 10);
+   }
+   return 0;
+}
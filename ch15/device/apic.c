@@ -0,0 +1,190 @@
+#include "apic.h"
+#include "stdint.h"
+#include "global.h"
+#include "memory.h"
+#include "interrupt.h"
+#include "clock.h"
+#include "timer.h"
+
+// 本地APIC和IOAPIC: 每个处理器有一个本地APIC, 负责接收中断, 发处理器间中断(IPI), 还带一个定时器;
+// IOAPIC把设备的中断引脚按重定向表送到指定处理器的本地APIC. 两者的寄存器都映射在4GB下端的物理地址上(见mmio_map)
+//
+// 启用APIC后8259A被屏蔽, 时钟, 键盘和硬盘的中断由IOAPIC送到BSP, 仍用原来的向量号;
+// BSP的嘀嗒和时间轮仍由8253驱动, AP用本地APIC时钟做本处理器的时间片
+
+// 本地APIC的寄存器, 相对于基址的偏移, 都是32位的, 按16字节对齐
+#define LAPIC_ID         0x020
+#define LAPIC_TPR        0x080   // 任务优先级, 为0时接收所有中断
+#define LAPIC_EOI        0x0b0
+#define LAPIC_SVR        0x0f0   // 伪中断向量号, 第8位是软件使能位
+#define LAPIC_ESR        0x280
+#define LAPIC_ICR_LOW    0x300   // 中断命令寄存器, 写低32位时发出IPI
+#define LAPIC_ICR_HIGH   0x310   // 第24~31位是目标处理器的本地APIC ID
+#define LAPIC_LVT_TIMER  0x320
+#define LAPIC_LVT_LINT0  0x350
+#define LAPIC_LVT_LINT1  0x360
+#define LAPIC_LVT_ERROR  0x370
+#define LAPIC_TIMER_INIT 0x380   // 定时器计数初值, 写0停止
+#define LAPIC_TIMER_CUR  0x390
+#define LAPIC_TIMER_DIV  0x3e0
+
+#define SVR_ENABLE         0x100
+#define LVT_MASKED         0x10000
+#define LVT_NMI            0x400
+#define LVT_TIMER_PERIODIC 0x20000
+#define TIMER_DIV_16       0x3
+#define ICR_FIXED          0x000
+#define ICR_INIT           0x500
+#define ICR_STARTUP        0x600
+#define ICR_ASSERT         0x4000
+#define ICR_PENDING        0x1000   // 上一个IPI还没送出
+
+#define IA32_APIC_BASE_MSR 0x1b
+#define APIC_BASE_ENABLE   0x800    // 本地APIC的全局使能位
+
+// IOAPIC的寄存器: 先往IOREGSEL写寄存器号, 再读写IOWIN
+#define IOAPIC_REGSEL      0x00
+#define IOAPIC_WIN         0x10
+#define IOAPIC_VER         0x01     // 第16~23位是重定向表的项数减1
+#define IOAPIC_REDTBL      0x10     // 第i个引脚的重定向项是0x10+2i(低32位)和0x11+2i(高32位)
+#define REDTBL_ACTIVE_LOW  0x2000
+#define REDTBL_LEVEL       0x8000
+#define REDTBL_MASKED      0x10000
+
+#define CALIBRATE_US       10000    // 用TSC定10毫秒校准本地APIC时钟
+
+static volatile uint32_t* lapic;    // 本地APIC寄存器的虚拟地址, 为NULL表示没有启用APIC
+static volatile uint32_t* ioapic;
+static uint32_t lapic_timer_count;  // 本地APIC时钟每个嘀嗒的计数值
+
+static uint32_t lapic_read(uint32_t reg) {
+   return lapic[reg / 4];
+}
+
+static void lapic_write(uint32_t reg, uint32_t val) {
+   lapic[reg / 4] = val;
+}
+
+static uint32_t ioapic_read(uint32_t reg) {
+   ioapic[IOAPIC_REGSEL / 4] = reg;
+   return ioapic[IOAPIC_WIN / 4];
+}
+
+static void ioapic_write(uint32_t reg, uint32_t val) {
+   ioapic[IOAPIC_REGSEL / 4] = reg;
+   ioapic[IOAPIC_WIN / 4] = val;
+}
+
+bool apic_enabled(void) {
+   return lapic != NULL;
+}
+
+// 向本地APIC发送中断结束命令, 各处理器写自己的本地APIC
+void lapic_eoi(void) {
+   lapic_write(LAPIC_EOI, 0);
+}
+
+uint8_t lapic_id(void) {
+   return lapic_read(LAPIC_ID) >> 24;
+}
+
+static void intr_spurious_handler(void) {
+}
+
+// 初始化当前处理器的本地APIC: 软件使能, 接收所有优先级的中断, 屏蔽定时器和LINT0(8259A已不用)
+// BSP的LINT1接NMI, AP的屏蔽掉
+void lapic_init(bool bsp) {
+   uint32_t eax, edx;
+   asm volatile ("rdmsr" : "=a" (eax), "=d" (edx) : "c" (IA32_APIC_BASE_MSR));
+   asm volatile ("wrmsr" : : "a" (eax | APIC_BASE_ENABLE), "d" (edx), "c" (IA32_APIC_BASE_MSR));
+   lapic_write(LAPIC_SVR, SVR_ENABLE | SPURIOUS_VECTOR);
+   lapic_write(LAPIC_TPR, 0);
+   lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+   lapic_write(LAPIC_LVT_LINT0, LVT_MASKED);
+   lapic_write(LAPIC_LVT_LINT1, bsp ? LVT_NMI : LVT_MASKED);
+   lapic_write(LAPIC_LVT_ERROR, LVT_MASKED);
+   lapic_write(LAPIC_ESR, 0);      // 错误状态寄存器要连写两次才清空
+   lapic_write(LAPIC_ESR, 0);
+   lapic_eoi();
+}
+
+// 映射本地APIC的寄存器并初始化BSP的本地APIC, 此后中断入口改向本地APIC发EOI
+// 各处理器的本地APIC都在同一个物理地址上, 访问的总是自己的
+void lapic_setup(phys_addr_t base) {
+   lapic = mmio_map(base);
+   lapic_init(true);
+   register_handler(LAPIC_TIMER_VECTOR, sched_tick);
+   register_handler(SPURIOUS_VECTOR, intr_spurious_handler);
+   intr_eoi = lapic_eoi;
+}
+
+// 写中断命令寄存器发出IPI, 等它送出后返回. 写高低两半之间不能被打断, 须关中断调用
+static void lapic_send_icr(uint8_t apic_id, uint32_t icr_low) {
+   lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+   lapic_write(LAPIC_ICR_LOW, icr_low);
+   while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING) {
+      asm volatile ("pause");
+   }
+}
+
+// 向本地APIC ID为apic_id的处理器发vector号中断
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector) {
+   lapic_send_icr(apic_id, ICR_ASSERT | ICR_FIXED | vector);
+}
+
+// INIT IPI把目标处理器复位到等待SIPI的状态
+void lapic_send_init(uint8_t apic_id) {
+   lapic_send_icr(apic_id, ICR_ASSERT | ICR_INIT);
+}
+
+// SIPI让等待的处理器在实模式下从boot_addr(4KB对齐, 1MB以下)开始执行
+void lapic_send_startup(uint8_t apic_id, uint32_t boot_addr) {
+   lapic_send_icr(apic_id, ICR_ASSERT | ICR_STARTUP | (boot_addr >> 12));
+}
+
+// 以TSC为准测出本地APIC时钟每个嘀嗒的计数值, 在BSP上测一次
+// 本地APIC时钟按总线频率计数, 各处理器都一样
+void lapic_timer_calibrate(void) {
+   lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+   lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+   lapic_write(LAPIC_TIMER_INIT, 0xffffffff);
+   udelay(CALIBRATE_US);
+   uint32_t elapsed = 0xffffffff - lapic_read(LAPIC_TIMER_CUR);
+   lapic_write(LAPIC_TIMER_INIT, 0);
+   lapic_timer_count = (uint32_t)div_u64_rem((uint64_t)elapsed * (1000000 / CALIBRATE_US), HZ, NULL);
+}
+
+// 让当前处理器的本地APIC时钟以HZ的频率周期性地产生中断
+void lapic_timer_start(void) {
+   lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+   lapic_write(LAPIC_LVT_TIMER, LVT_TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
+   lapic_write(LAPIC_TIMER_INIT, lapic_timer_count);
+}
+
+void lapic_timer_stop(void) {
+   lapic_write(LAPIC_TIMER_INIT, 0);
+}
+
+// 映射IOAPIC的寄存器, 先屏蔽所有引脚, 要用的再由ioapic_route打开
+void ioapic_setup(phys_addr_t base) {
+   ioapic = mmio_map(base);
+   uint32_t pin_cnt = ((ioapic_read(IOAPIC_VER) >> 16) & 0xff) + 1;
+   uint32_t pin;
+   for (pin = 0; pin < pin_cnt; pin++) {
+      ioapic_write(IOAPIC_REDTBL + 2 * pin, REDTBL_MASKED);
+      ioapic_write(IOAPIC_REDTBL + 2 * pin + 1, 0);
+   }
+}
+
+// 把IOAPIC的引脚pin接到本地APIC ID为apic_id的处理器的vector号中断上, ISA设备是高电平有效, 边沿触发的
+void ioapic_route(uint8_t pin, uint8_t vector, uint8_t apic_id, bool active_low, bool level) {
+   uint32_t low = vector;
+   if (active_low) {
+      low |= REDTBL_ACTIVE_LOW;
+   }
+   if (level) {
+      low |= REDTBL_LEVEL;
+   }
+   ioapic_write(IOAPIC_REDTBL + 2 * pin + 1, (uint32_t)apic_id << 24);
+   ioapic_write(IOAPIC_REDTBL + 2 * pin, low);
+}
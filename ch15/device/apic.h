@@ -0,0 +1,24 @@
+#ifndef __DEVICE_APIC_H
+#define __DEVICE_APIC_H
+#include "stdint.h"
+#include "global.h"
+#include "memory.h"
+
+#define LAPIC_TIMER_VECTOR 0x30   // AP的本地APIC时钟
+#define RESCHED_VECTOR     0x31   // 处理器间中断: 通知目标处理器重新调度
+#define SPURIOUS_VECTOR    0x3f   // 本地APIC的伪中断, 什么也不用做
+
+bool apic_enabled(void);
+void lapic_setup(phys_addr_t base);
+void lapic_init(bool bsp);
+uint8_t lapic_id(void);
+void lapic_eoi(void);
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector);
+void lapic_send_init(uint8_t apic_id);
+void lapic_send_startup(uint8_t apic_id, uint32_t boot_addr);
+void lapic_timer_calibrate(void);
+void lapic_timer_start(void);
+void lapic_timer_stop(void);
+void ioapic_setup(phys_addr_t base);
+void ioapic_route(uint8_t pin, uint8_t vector, uint8_t apic_id, bool active_low, bool level);
+#endif
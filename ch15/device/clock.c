@@ -0,0 +1,152 @@
+#include "clock.h"
+#include "io.h"
+#include "stdio-kernel.h"
+#include "global.h"
+#include "interrupt.h"
+
+// 时钟源: 纳秒精度的时间都由时间戳计数器(TSC)换算, 嘀嗒数只有10毫秒的精度.
+// 启动时用8253的计数器2定一段已知长的时间, 数这段时间里TSC走了多少, 得出TSC的频率;
+// 再从CMOS的实时钟读出当前的日期时间作为墙上时间的起点, 之后的墙上时间是这个起点加上启动后经过的时间
+
+#define PIT_INPUT_FREQUENCY 1193180
+#define PIT_CONTROL_PORT    0x43
+#define PIT_COUNTER2_PORT   0x42
+#define PIT_GATE_PORT       0x61   // 位0是计数器2的GATE, 位1接扬声器, 位5读出计数器2的OUT
+#define CALIBRATE_MS        50
+#define CALIBRATE_LATCH     (PIT_INPUT_FREQUENCY / 1000 * CALIBRATE_MS)   // 不能超过0xffff
+
+#define CMOS_INDEX_PORT     0x70
+#define CMOS_DATA_PORT      0x71
+#define RTC_SECONDS         0x00
+#define RTC_MINUTES         0x02
+#define RTC_HOURS           0x04
+#define RTC_DAY             0x07
+#define RTC_MONTH           0x08
+#define RTC_YEAR            0x09
+#define RTC_STATUS_A        0x0a   // 位7为1表示实时钟正在更新, 这时读出的值可能不一致
+#define RTC_STATUS_B        0x0b   // 位1为1表示24小时制, 位2为1表示二进制, 否则是BCD码
+#define RTC_UIP             0x80
+#define RTC_24H             0x02
+#define RTC_BINARY          0x04
+#define RTC_PM              0x80   // 12小时制时小时的最高位表示下午
+
+uint32_t tsc_khz;                // TSC每毫秒走多少
+static uint64_t tsc_boot;        // clock_init时的TSC, 单调时钟的零点
+static uint32_t boot_epoch;      // clock_init时的墙上时间, 单位为秒
+
+// 用计数器2定CALIBRATE_MS毫秒, 返回TSC的频率(kHz)
+// 计数器2不产生中断, 模式0计到0时OUT变高, 从0x61口的位5读出, 期间关掉扬声器
+static uint32_t tsc_calibrate(void) {
+   outb(PIT_GATE_PORT, (inb(PIT_GATE_PORT) & ~0x02) | 0x01);
+   outb(PIT_CONTROL_PORT, 2 << 6 | 3 << 4 | 0 << 1);   // 计数器2, 先低后高字节, 模式0
+   outb(PIT_COUNTER2_PORT, (uint8_t)CALIBRATE_LATCH);
+   outb(PIT_COUNTER2_PORT, (uint8_t)(CALIBRATE_LATCH >> 8));
+   uint64_t start = rdtsc();
+   while (!(inb(PIT_GATE_PORT) & 0x20));
+   uint64_t cycles = rdtsc() - start;
+   return (uint32_t)div_u64_rem(cycles, CALIBRATE_MS, NULL);
+}
+
+// TSC的周期数换算成纳秒, 先按kHz换成整毫秒, 余下不足1毫秒的周期数再换, 以免乘法溢出
+uint64_t cycles_to_ns(uint64_t cycles) {
+   uint32_t rem;
+   uint64_t ms = div_u64_rem(cycles, tsc_khz, &rem);
+   return ms * 1000000 + div_u64_rem((uint64_t)rem * 1000000, tsc_khz, NULL);
+}
+
+// 忙等us微秒, 要在clock_init之后调用; 用于不能依赖时钟中断的地方, 如启动AP
+void udelay(uint32_t us) {
+   uint64_t end = rdtsc() + div_u64_rem((uint64_t)us * tsc_khz, 1000, NULL);
+   while (rdtsc() < end) {
+      asm volatile ("pause");
+   }
+}
+
+// 自启动(clock_init)起经过的纳秒数
+uint64_t clock_monotonic_ns(void) {
+   return cycles_to_ns(rdtsc() - tsc_boot);
+}
+
+// 自1970-01-01 00:00:00 UTC起的纳秒数
+uint64_t clock_realtime_ns(void) {
+   return (uint64_t)boot_epoch * NSEC_PER_SEC + clock_monotonic_ns();
+}
+
+static uint8_t cmos_read(uint8_t reg) {
+   outb(CMOS_INDEX_PORT, reg);
+   return inb(CMOS_DATA_PORT);
+}
+
+static uint8_t bcd2bin(uint8_t val) {
+   return (val & 0x0f) + (val >> 4) * 10;
+}
+
+// 公历日期距1970-01-01的天数, 把3月当作一年的第一个月, 闰日就落在年末
+static uint32_t days_from_epoch(uint32_t year, uint32_t month, uint32_t day) {
+   if (month <= 2) {
+      year--;
+      month += 12;
+   }
+   uint32_t days = year * 365 + year / 4 - year / 100 + year / 400;
+   days += (153 * (month - 3) + 2) / 5 + day - 1;
+   return days - 719468;     // 719468是0000-03-01到1970-01-01的天数
+}
+
+// 读实时钟, 返回自1970-01-01 00:00:00 UTC起的秒数, 实时钟按UTC设置(qemu默认如此)
+// 在不更新的时候连读两遍, 两遍相同才用
+static uint32_t rtc_read_epoch(void) {
+   uint8_t regs[6] = {RTC_SECONDS, RTC_MINUTES, RTC_HOURS, RTC_DAY, RTC_MONTH, RTC_YEAR};
+   uint8_t val[6], last[6];
+   uint32_t idx;
+   bool same = false;
+   while (!same) {
+      while (cmos_read(RTC_STATUS_A) & RTC_UIP);
+      for (idx = 0; idx < 6; idx++) {
+         val[idx] = cmos_read(regs[idx]);
+      }
+      while (cmos_read(RTC_STATUS_A) & RTC_UIP);
+      same = true;
+      for (idx = 0; idx < 6; idx++) {
+         last[idx] = cmos_read(regs[idx]);
+         same = same && last[idx] == val[idx];
+      }
+   }
+
+   uint8_t status_b = cmos_read(RTC_STATUS_B);
+   bool pm = val[2] & RTC_PM;
+   val[2] &= ~RTC_PM;
+   if (!(status_b & RTC_BINARY)) {
+      for (idx = 0; idx < 6; idx++) {
+         val[idx] = bcd2bin(val[idx]);
+      }
+   }
+   if (!(status_b & RTC_24H)) {    // 12小时制: 12点是0点或中午
+      val[2] = val[2] % 12 + (pm ? 12 : 0);
+   }
+   uint32_t days = days_from_epoch(2000 + val[5], val[4], val[3]);
+   return days * 86400 + val[2] * 3600 + val[1] * 60 + val[0];
+}
+
+// 取clock_id时钟的当前时间, 成功返回0, 不认识的时钟返回-1
+int32_t sys_clock_gettime(uint32_t clock_id, struct timespec* tp) {
+   uint64_t ns;
+   if (clock_id == CLOCK_REALTIME) {
+      ns = clock_realtime_ns();
+   } else if (clock_id == CLOCK_MONOTONIC) {
+      ns = clock_monotonic_ns();
+   } else {
+      return -1;
+   }
+   tp->tv_sec = div_u64_rem(ns, NSEC_PER_SEC, &tp->tv_nsec);
+   return 0;
+}
+
+// 校准TSC, 读实时钟, 要在开中断之前调用, 免得校准的时间被中断拉长
+void clock_init(void) {
+   printk("clock_init start\n");
+   tsc_khz = tsc_calibrate();
+   tsc_boot = rdtsc();
+   boot_epoch = rtc_read_epoch();
+   printk("   tsc %d kHz, epoch %d\n", tsc_khz, boot_epoch);
+   printk("clock_init done\n");
+}
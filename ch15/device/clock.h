@@ -0,0 +1,22 @@
+#ifndef __DEVICE_CLOCK_H
+#define __DEVICE_CLOCK_H
+#include "stdint.h"
+
+#define CLOCK_REALTIME 0    // 墙上时间, 自1970-01-01 00:00:00 UTC起
+#define CLOCK_MONOTONIC 1   // 自启动起, 不会倒退
+
+#define NSEC_PER_SEC 1000000000
+
+struct timespec {
+   uint32_t tv_sec;
+   uint32_t tv_nsec;
+};
+
+extern uint32_t tsc_khz;
+void clock_init(void);
+uint64_t cycles_to_ns(uint64_t cycles);
+void udelay(uint32_t us);
+uint64_t clock_monotonic_ns(void);
+uint64_t clock_realtime_ns(void);
+int32_t sys_clock_gettime(uint32_t clock_id, struct timespec* tp);
+#endif
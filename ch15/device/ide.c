@@ -135,12 +135,13 @@ static void write2sector(struct disk* hd, void* buf, uint8_t sec_cnt) {
 /* 等待30秒 */
 static bool busy_wait(struct disk* hd) {
    struct ide_channel* channel = hd->my_channel;
-   uint16_t time_limit = 30 * 1000;	     // 可以等待30000毫秒
-   while (time_limit -= 10 >= 0) {
+   int32_t time_limit = 30 * 1000;	     // 可以等待30000毫秒
+   while (time_limit > 0) {
       if (!(inb(reg_status(channel)) & BIT_STAT_BSY)) {
 	 return (inb(reg_status(channel)) & BIT_STAT_DRQ);
       } else {
-	 mtime_sleep(10);		     // 睡眠10毫秒
+	 mtime_sleep(10);		     // 阻塞睡眠10毫秒, 不占用处理器
+	 time_limit -= 10;
       }
    }
    return false;
@@ -295,6 +296,7 @@ static void partition_scan(struct disk* hd, uint32_t ext_lba) {
 	 if (ext_lba == 0) {	 // 此时全是主分区
 	    hd->prim_parts[p_no].start_lba = ext_lba + p->start_lba;
 	    hd->prim_parts[p_no].sec_cnt = p->sec_cnt;
+	    hd->prim_parts[p_no].fs_type = p->fs_type;
 	    hd->prim_parts[p_no].my_disk = hd;
 	    list_append(&partition_list, &hd->prim_parts[p_no].part_tag);
 	    sprintf(hd->prim_parts[p_no].name, "%s%d", hd->name, p_no + 1);
@@ -303,6 +305,7 @@ static void partition_scan(struct disk* hd, uint32_t ext_lba) {
 	 } else {
 	    hd->logic_parts[l_no].start_lba = ext_lba + p->start_lba;
 	    hd->logic_parts[l_no].sec_cnt = p->sec_cnt;
+	    hd->logic_parts[l_no].fs_type = p->fs_type;
 	    hd->logic_parts[l_no].my_disk = hd;
 	    list_append(&partition_list, &hd->logic_parts[l_no].part_tag);
 	    sprintf(hd->logic_parts[l_no].name, "%s%d", hd->name, l_no + 5);	 // 逻辑分区数字是从5开始,主分区是1～4.
@@ -336,7 +339,7 @@ void intr_hd_handler(uint8_t irq_no) {
  * 每次读写硬盘时会申请锁,从而保证了同步一致性 */
    if (channel->expecting_intr) {
       channel->expecting_intr = false;
-      sema_up(&channel->disk_done);
+      sema_up_io(&channel->disk_done);
 
 /* 读取状态寄存器使硬盘控制器认为此次的中断已被处理,
  * 从而硬盘可以继续执行新的读写 */
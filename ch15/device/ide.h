@@ -9,6 +9,7 @@
 struct partition {
    uint32_t start_lba;		 // 起始扇区
    uint32_t sec_cnt;		 // 扇区数
+   uint8_t fs_type;		 // 分区表中记录的分区类型
    struct disk* my_disk;	 // 分区所属的硬盘
    struct list_elem part_tag;	 // 用于队列中的标记
    char name[8];		 // 分区名称
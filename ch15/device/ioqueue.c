@@ -34,10 +34,10 @@ static void ioq_wait(struct task_struct** waiter) {
     thread_block(TASK_BLOCKED);
 }
 
-// 唤醒 waiter
+// 唤醒 waiter, 它等的是输入输出
 static void wakeup(struct task_struct** waiter) {
     ASSERT(*waiter != NULL);
-    thread_unblock(*waiter);
+    thread_unblock_io(*waiter);
     *waiter = NULL;
 }
 
@@ -4,20 +4,123 @@
 #include "interrupt.h"
 #include "thread.h"
 #include "debug.h"
+#include "global.h"
+#include "list.h"
+#include "smp.h"
+#include "apic.h"
 
-#define IRQ0_FREQUENCY	   100
+#define IRQ0_FREQUENCY	   HZ
 #define INPUT_FREQUENCY	   1193180
-#define COUNTER0_VALUE	   INPUT_FREQUENCY / IRQ0_FREQUENCY
+#define COUNTER0_VALUE	   (INPUT_FREQUENCY / IRQ0_FREQUENCY)
 #define CONTRER0_PORT	   0x40
 #define COUNTER0_NO	   0
 #define COUNTER_MODE	   2
 #define READ_WRITE_LATCH   3
 #define PIT_CONTROL_PORT   0x43
 
-#define mil_seconds_per_intr (1000 / IRQ0_FREQUENCY)
+// 8253的计数器只有16位, 频率太低时计数初值放不下
+#if IRQ0_FREQUENCY < 19 || IRQ0_FREQUENCY > 1000
+#error "CONFIG_HZ must be between 19 and 1000"
+#endif
 
 uint32_t ticks;          // ticks是内核自中断开启以来总共的嘀嗒数
 
+// 分级时间轮: 第0级TVR_SIZE个槽, 每槽对应一个嘀嗒; 往上每级TVN_SIZE个槽, 每槽对应下一级转一圈的时间.
+// 定时器按到期时间距现在的远近挂到某一级的槽上, 加入和取消都是O(1).
+// 第0级转完一圈时把第1级的下一个槽中的定时器按剩余时间重新分到第0级, 依此类推(cascade),
+// 所以每个嘀嗒只需处理第0级的一个槽, 不用扫描所有定时器
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVN_LEVELS 4
+
+static struct list tv1[TVR_SIZE];
+static struct list tvn[TVN_LEVELS][TVN_SIZE];
+static uint32_t wheel_ticks;    // 时间轮下一个要处理的嘀嗒, 此前到期的定时器都已经运行过了
+
+// 把定时器挂到时间轮上与它的到期时间对应的槽中, 须关中断调用
+static void wheel_add(struct timer* timer) {
+   uint32_t expires = timer->expires;
+   uint32_t idx = expires - wheel_ticks;
+   struct list* slot;
+   if ((int32_t)idx < 0) {      // 已经过期的放到下一个要处理的槽中
+      slot = &tv1[wheel_ticks & TVR_MASK];
+   } else if (idx < TVR_SIZE) {
+      slot = &tv1[expires & TVR_MASK];
+   } else {
+      uint32_t level = 0;
+      while (level < TVN_LEVELS - 1 && idx >= 1UL << (TVR_BITS + (level + 1) * TVN_BITS)) {
+         level++;
+      }
+      slot = &tvn[level][(expires >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK];
+   }
+   list_append(slot, &timer->tag);
+}
+
+// 把第level级(从0数, 不含第0级时间轮)第idx个槽中的定时器重新分到下面的级, 返回idx
+static uint32_t cascade(uint32_t level, uint32_t idx) {
+   struct list* slot = &tvn[level][idx];
+   while (!list_empty(slot)) {
+      wheel_add(elem2entry(struct timer, tag, list_pop(slot)));
+   }
+   return idx;
+}
+
+// 运行到ticks为止到期的定时器, 在时钟中断中调用
+static void run_timers(void) {
+   while ((int32_t)(ticks - wheel_ticks) >= 0) {
+      uint32_t idx = wheel_ticks & TVR_MASK;
+      // 第0级转完一圈, 从第1级取下一槽, 第1级也转完一圈就再往上取
+      uint32_t level = 0;
+      while (idx == 0 && level < TVN_LEVELS) {
+         idx = cascade(level, (wheel_ticks >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK);
+         level++;
+      }
+      struct list* slot = &tv1[wheel_ticks & TVR_MASK];
+      // 先推进wheel_ticks, 回调中重新加入的已到期定时器会落到下一个槽, 不会在这里反复运行
+      wheel_ticks++;
+      while (!list_empty(slot)) {
+         struct timer* timer = elem2entry(struct timer, tag, list_pop(slot));
+         timer->pending = false;
+         timer->func(timer->arg);
+      }
+   }
+}
+
+// 初始化定时器, 到期时在时钟中断中以关中断的状态调用func(arg), 所以func不能阻塞
+void timer_setup(struct timer* timer, timer_func* func, void* arg) {
+   timer->func = func;
+   timer->arg = arg;
+   timer->pending = false;
+}
+
+// 让定时器在嘀嗒数为expires时到期, 已经在等待的先取消
+void timer_arm(struct timer* timer, uint32_t expires) {
+   enum intr_status old_status = intr_disable();
+   if (timer->pending) {
+      list_remove(&timer->tag);
+   }
+   timer->expires = expires;
+   timer->pending = true;
+   wheel_add(timer);
+   intr_set_status(old_status);
+}
+
+// 取消定时器, 取消前它还没到期返回true, 已经运行过或者没有设置过返回false
+bool timer_cancel(struct timer* timer) {
+   enum intr_status old_status = intr_disable();
+   bool pending = timer->pending;
+   if (pending) {
+      list_remove(&timer->tag);
+      timer->pending = false;
+   }
+   intr_set_status(old_status);
+   return pending;
+}
+
 /* 把操作的计数器counter_no、读写锁属性rwl、计数器模式counter_mode写入模式控制寄存器并赋予初始值counter_value */
 static void frequency_set(uint8_t counter_port, \
 			  uint8_t counter_no, \
@@ -29,45 +132,171 @@ static void frequency_set(uint8_t counter_port, \
 /* 先写入counter_value的低8位 */
    outb(counter_port, (uint8_t)counter_value);
 /* 再写入counter_value的高8位 */
-   outb(counter_port, (uint8_t)counter_value >> 8);
+   outb(counter_port, (uint8_t)(counter_value >> 8));
 }
 
-/* 时钟的中断处理函数 */
-static void intr_timer_handler(void) {
+#ifdef CONFIG_NO_HZ
+// 动态时钟: 只有idle可运行时, 把计数器0改成单次触发模式(模式0), 到下一个定时器到期时才中断, 醒来后把ticks补上.
+// 计数初值最大0xffff, 一次最多停ONESHOT_MAX_TICKS个嘀嗒(约55毫秒), 更远的定时器要分几次睡.
+// 被别的中断提前唤醒时按计数器的剩余值补上已经过去的整嘀嗒数, 不足一个嘀嗒的部分丢掉
+#define ONESHOT_MODE	   0
+#define ONESHOT_MAX_TICKS  (0xffff / COUNTER0_VALUE)
+#define READ_BACK_COUNTER0 0xc2   // 读回命令: 锁存计数器0的状态和计数值
+#define STATUS_OUT	   0x80   // 状态字节中OUT引脚的电平, 模式0计数到0时变高
+#define STATUS_NULL_COUNT  0x40   // 新的计数初值还没装入计数器
+
+static uint32_t oneshot_ticks;   // 单次触发定时的嘀嗒数, 为0表示时钟处于周期模式
+
+// 从下一个嘀嗒起数, 第几个嘀嗒有定时器到期, 最多看limit个嘀嗒, 都没有时返回limit. 须关中断调用
+// 第0级转完一圈时才会从上面的级取下定时器, 所以最多看到这一圈的末尾
+static uint32_t next_timer_ticks(uint32_t limit) {
+   uint32_t idx = wheel_ticks & TVR_MASK;
+   if (limit > TVR_SIZE - idx) {
+      limit = TVR_SIZE - idx;
+   }
+   uint32_t delta = 0;
+   while (delta < limit && list_empty(&tv1[idx + delta])) {
+      delta++;
+   }
+   return delta;
+}
+
+// 停掉周期性的时钟中断, 只有idle可运行时由idle在hlt前调用, 须关中断
+// AP停掉自己的本地APIC时钟; BSP的嘀嗒是全局的, 要所有处理器都空闲才停
+void tick_stop(void) {
+   struct cpu* c = this_cpu();
+   if (c->id != 0) {
+      lapic_timer_stop();
+      c->tick_stopped = true;
+      return;
+   }
+   if (!cpus_idle()) {
+      return;
+   }
+   uint32_t sleep_ticks = next_timer_ticks(ONESHOT_MAX_TICKS - 1) + 1;
+   if (sleep_ticks < 2) {     // 下一个嘀嗒就有定时器到期, 不用停
+      return;
+   }
+   oneshot_ticks = sleep_ticks;
+   frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, ONESHOT_MODE, sleep_ticks * COUNTER0_VALUE);
+}
+
+// 恢复周期性的时钟中断, 并把停下期间过去的嘀嗒补到ticks上, 须关中断调用
+// 由唤醒idle的中断在入口处调用(见kernel_lock_enter), 中断处理函数和别的处理器看到的ticks都是补好的;
+// 唤醒它的正是单次触发时, 这个中断正在处理, 那一个嘀嗒留给中断处理函数加
+void tick_resume(void) {
+   struct cpu* c = this_cpu();
+   if (c->id != 0) {
+      if (c->tick_stopped) {
+         lapic_timer_start();
+         c->tick_stopped = false;
+      }
+      return;
+   }
+   if (oneshot_ticks == 0) {
+      return;
+   }
+   outb(PIT_CONTROL_PORT, READ_BACK_COUNTER0);
+   uint8_t status = inb(CONTRER0_PORT);
+   uint32_t count = inb(CONTRER0_PORT);
+   count |= (uint32_t)inb(CONTRER0_PORT) << 8;
+   if (status & STATUS_OUT) {
+      ticks += oneshot_ticks - 1;
+   } else if (!(status & STATUS_NULL_COUNT)) {
+      ticks += (oneshot_ticks * COUNTER0_VALUE - count) / COUNTER0_VALUE;
+   }
+   oneshot_ticks = 0;
+   frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE, COUNTER0_VALUE);
+}
+#else
+void tick_stop(void) {
+}
+
+void tick_resume(void) {
+}
+#endif
+
+// 每个处理器的时钟中断都要做的: 给当前任务计时, 时间片用完或者要抢占时调度
+// BSP在8253的中断中调用, AP的本地APIC时钟中断直接注册它
+void sched_tick(void) {
    struct task_struct* cur_thread = running_thread();
 
    ASSERT(cur_thread->stack_magic == 0x19870916);         // 检查栈是否溢出
 
    cur_thread->elapsed_ticks++;	  // 记录此线程占用的cpu时间嘀
-   ticks++;	  //从内核第一次处理时间中断后开始至今的滴哒数,内核态和用户态总共的嘀哒数
 
-   if (cur_thread->ticks == 0) {	  // 若进程时间片用完就开始调度新的进程上cpu
+   // 若进程时间片用完, 或者唤醒了级别更高的任务, 就开始调度新的进程上cpu
+   if (cur_thread->ticks == 0 || this_cpu()->need_resched) {
       schedule(); 
    } else {				  // 将当前进程的时间片-1
       cur_thread->ticks--;
    }
 }
 
-// 以tick为单位的sleep,任何时间形式的sleep会转换此ticks形式
-static void ticks_to_sleep(uint32_t sleep_ticks) {
-   uint32_t start_tick = ticks;
+/* 8253时钟的中断处理函数, 只送到BSP: 全局的嘀嗒数, 定时器和定期的调度工作都在这里做 */
+static void intr_timer_handler(void) {
+   ticks++;	  //从内核第一次处理时间中断后开始至今的滴哒数,内核态和用户态总共的嘀哒数
+   run_timers();
 
-   while (ticks - start_tick < sleep_ticks) {	   // 若间隔的ticks数不够便让出cpu
-      thread_yield();
+   if (ticks % MLFQ_BOOST_TICKS == 0) {	  // 定期把降了级的任务提回去
+      mlfq_boost();
+   }
+   if (ticks % LOAD_BALANCE_TICKS == 0) {	  // 定期在处理器之间平衡就绪任务
+      load_balance();
+   }
+   sched_tick();
+}
+
+// 睡眠到期, 唤醒睡眠的任务. 任务可能已经被别人唤醒了(如ksm_ctl唤醒ksmd), 还没来得及取消定时器
+static void sleep_timeout(void* arg) {
+   struct task_struct* pthread = arg;
+   if (pthread->status == TASK_BLOCKED) {
+      thread_unblock(pthread);
    }
 }
 
+// 以tick为单位的sleep,任何时间形式的sleep会转换此ticks形式
+// 任务阻塞在自己栈上的定时器上, 到期时由时钟中断唤醒, 睡眠期间不占用处理器
+static void ticks_to_sleep(uint32_t sleep_ticks) {
+   struct timer timer;
+   timer_setup(&timer, sleep_timeout, running_thread());
+   enum intr_status old_status = intr_disable();
+   timer_arm(&timer, ticks + sleep_ticks);
+   thread_block(TASK_BLOCKED);
+   timer_cancel(&timer);     // 提前被唤醒时定时器还挂在时间轮上, 而它在栈上
+   intr_set_status(old_status);
+}
+
 // 以毫秒为单位的sleep   1秒= 1000毫秒
 void mtime_sleep(uint32_t m_seconds) {
-  uint32_t sleep_ticks = DIV_ROUND_UP(m_seconds, mil_seconds_per_intr);
+  // 分开整秒和不足一秒的部分换算, 以免m_seconds * IRQ0_FREQUENCY溢出
+  uint32_t sleep_ticks = m_seconds / 1000 * IRQ0_FREQUENCY + DIV_ROUND_UP(m_seconds % 1000 * IRQ0_FREQUENCY, 1000);
   ASSERT(sleep_ticks > 0);
   ticks_to_sleep(sleep_ticks); 
 }
 
+// sleep系统调用, 为0时只让出处理器
+void sys_sleep(uint32_t m_seconds) {
+   if (m_seconds == 0) {
+      thread_yield();
+   } else {
+      mtime_sleep(m_seconds);
+   }
+}
+
 
 /* 初始化PIT8253 */
 void timer_init() {
    put_str("timer_init start\n");
+   uint32_t idx, level;
+   for (idx = 0; idx < TVR_SIZE; idx++) {
+      list_init(&tv1[idx]);
+   }
+   for (level = 0; level < TVN_LEVELS; level++) {
+      for (idx = 0; idx < TVN_SIZE; idx++) {
+         list_init(&tvn[level][idx]);
+      }
+   }
    /* 设置8253的定时周期,也就是发中断的周期 */
    frequency_set(CONTRER0_PORT, COUNTER0_NO, READ_WRITE_LATCH, COUNTER_MODE, COUNTER0_VALUE);
    register_handler(0x20, intr_timer_handler);
@@ -1,6 +1,34 @@
 #ifndef __DEVICE_TIME_H
 #define __DEVICE_TIME_H
 #include "stdint.h"
+#include "list.h"
+
+// 时钟中断的频率(每秒的嘀嗒数), 编译时用 DEFS=-DCONFIG_HZ=1000 修改, 范围19到1000
+#ifdef CONFIG_HZ
+#define HZ CONFIG_HZ
+#else
+#define HZ 100
+#endif
+
+typedef void timer_func(void*);
+
+// 内核定时器, 由时钟中断驱动, 精度为一个嘀嗒
+struct timer {
+   struct list_elem tag;      // 挂在时间轮的槽中
+   uint32_t expires;          // 到期时的嘀嗒数
+   timer_func* func;
+   void* arg;
+   bool pending;              // 已经设置, 还没到期
+};
+
+extern uint32_t ticks;
 void timer_init(void);
 void mtime_sleep(uint32_t m_seconds);
-#endif
\ No newline at end of file
+void sys_sleep(uint32_t m_seconds);
+void timer_setup(struct timer* timer, timer_func* func, void* arg);
+void timer_arm(struct timer* timer, uint32_t expires);
+bool timer_cancel(struct timer* timer);
+void tick_stop(void);
+void tick_resume(void);
+void sched_tick(void);
+#endif
@@ -10,8 +10,10 @@
 #include "string.h"
 #include "interrupt.h"
 #include "super_block.h"
+#include "slab.h"
 
 struct dir root_dir;
+struct kmem_cache* dir_cache;   // dir_open打开的目录都从这里分配
 
 /* 
     打开根目录 
@@ -28,7 +30,7 @@ void open_root_dir(struct partition* part) {
     本质是调用inode_open 将对应的inode的指针赋给dir结构的indode 指针
 */
 struct dir* dir_open(struct partition* part, uint32_t inode_no) {
-   struct dir* pdir = (struct dir*)sys_malloc(sizeof(struct dir));
+   struct dir* pdir = (struct dir*)kmem_cache_alloc(dir_cache);
    pdir->inode = inode_open(part, inode_no);
    pdir->dir_pos = 0;
    return pdir;
@@ -48,9 +50,9 @@ bool search_dir_entry(struct partition* part, struct dir* pdir, \
    uint32_t block_cnt = 140;	 // 12个直接块+128个一级间接块=140块
 
    /* 12个直接块大小+128个间接块,inode中用uint32（4字节）记录一个扇区地址，共560字节 */
-   uint32_t* all_blocks = (uint32_t*)sys_malloc(48 + 512);
+   uint32_t* all_blocks = (uint32_t*)kmem_cache_zalloc(blk_idx_cache);
    if (all_blocks == NULL) {
-      printk("search_dir_entry: sys_malloc for all_blocks failed");
+      printk("search_dir_entry: kmem_cache_zalloc for all_blocks failed");
       return false;
    }
 
@@ -68,7 +70,7 @@ bool search_dir_entry(struct partition* part, struct dir* pdir, \
 
    /* 写目录项的时候已保证目录项不跨扇区,
     * 这样读目录项时容易处理, 只申请容纳1个扇区的内存 */
-   uint8_t* buf = (uint8_t*)sys_malloc(SECTOR_SIZE);
+   uint8_t* buf = (uint8_t*)kmem_cache_alloc(sec_buf_cache);
    struct dir_entry* p_de = (struct dir_entry*)buf;	    // p_de为指向目录项的指针,值为buf起始地址
    uint32_t dir_entry_size = part->sb->dir_entry_size;
    uint32_t dir_entry_cnt = SECTOR_SIZE / dir_entry_size;   // 1扇区内可容纳的目录项个数
@@ -90,8 +92,8 @@ bool search_dir_entry(struct partition* part, struct dir* pdir, \
         if (!strcmp(p_de->filename, name)) {
             //找到了对应的目录及或者文件，将p_de后的dir_entry_size个字节的内容拷贝至传出参数中
             memcpy(dir_e, p_de, dir_entry_size);
-            sys_free(buf);
-            sys_free(all_blocks);
+            kmem_cache_free(sec_buf_cache, buf);
+            kmem_cache_free(blk_idx_cache, all_blocks);
             return true;
         }
         dir_entry_idx++;
@@ -101,8 +103,8 @@ bool search_dir_entry(struct partition* part, struct dir* pdir, \
       p_de = (struct dir_entry*)buf;  // 此时p_de已经指向扇区内最后一个完整目录项了,需要恢复p_de指向为buf
       memset(buf, 0, SECTOR_SIZE);	  // 将buf清0,下次再用
    }
-   sys_free(buf);
-   sys_free(all_blocks);
+   kmem_cache_free(sec_buf_cache, buf);
+   kmem_cache_free(blk_idx_cache, all_blocks);
    return false;
 }
 
@@ -120,7 +122,7 @@ void dir_close(struct dir* dir) {
       return;
    }
    inode_close(dir->inode);
-   sys_free(dir);
+   kmem_cache_free(dir_cache, dir);
 }
 
 /* 在内存中初始化目录项p_de 
@@ -427,7 +429,7 @@ int32_t dir_remove(struct dir* parent_dir, struct dir* child_dir) {
       ASSERT(child_dir_inode->i_sectors[block_idx] == 0);
       block_idx++;
    }
-   void* io_buf = sys_malloc(SECTOR_SIZE * 2);
+   void* io_buf = kmem_cache_zalloc(io_buf_cache);
    if (io_buf == NULL) {
       printk("dir_remove: malloc for io_buf failed\n");
       return -1;
@@ -437,6 +439,6 @@ int32_t dir_remove(struct dir* parent_dir, struct dir* child_dir) {
 
    /* 回收inode中i_secotrs中所占用的扇区,并同步inode_bitmap和block_bitmap  （内存）*/
    inode_release(cur_part, child_dir_inode->i_no);
-   sys_free(io_buf);
+   kmem_cache_free(io_buf_cache, io_buf);
    return 0;
 }
\ No newline at end of file
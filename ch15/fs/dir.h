@@ -29,6 +29,7 @@ struct dir_entry {//是连接文件名与inode的纽带，本结构体一开始
 };
 
 extern struct dir root_dir;             // 根目录
+extern struct kmem_cache* dir_cache;
 void open_root_dir(struct partition* part);
 struct dir* dir_open(struct partition* part, uint32_t inode_no);
 void dir_close(struct dir* dir);
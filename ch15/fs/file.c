@@ -6,6 +6,7 @@
 #include "memory.h"
 #include "debug.h"
 #include "interrupt.h"
+#include "slab.h"
 #include "string.h"
 #include "thread.h"
 #include "global.h"
@@ -113,9 +114,9 @@ void bitmap_sync(struct partition* part, uint32_t bit_idx, uint8_t btmp_type) {
 */
 int32_t file_create(struct dir* parent_dir, char* filename, uint8_t flag) {
    /* 后续操作的公共缓冲区 */
-   void* io_buf = sys_malloc(1024);//一般情况下，都是读写一个硬盘的扇区（512字节），考虑到有跨区的情况，这里申请2个扇区的缓冲区。
+   void* io_buf = kmem_cache_zalloc(io_buf_cache);//一般情况下，都是读写一个硬盘的扇区（512字节），考虑到有跨区的情况，这里申请2个扇区的缓冲区。
    if (io_buf == NULL) {
-      printk("in file_creat: sys_malloc for io_buf failed\n");
+      printk("in file_creat: malloc for io_buf failed\n");
       return -1;
    }
 
@@ -125,14 +126,15 @@ int32_t file_create(struct dir* parent_dir, char* filename, uint8_t flag) {
    int32_t inode_no = inode_bitmap_alloc(cur_part); //挂载文件系统时，mount_partition()已将cur_part初始化
    if (inode_no == -1) {
       printk("in file_creat: allocate inode failed\n");
+      kmem_cache_free(io_buf_cache, io_buf);
       return -1;
    }
 
-/* 此inode要从堆中申请内存,不可生成局部变量(函数退出时会释放)
+/* 此inode要从inode_cache中申请内存,不可生成局部变量(函数退出时会释放)
  * 因为file_table数组中的文件描述符的inode指针要指向它.*/
-   struct inode* new_file_inode = (struct inode*)sys_malloc(sizeof(struct inode)); 
+   struct inode* new_file_inode = (struct inode*)kmem_cache_zalloc(inode_cache); 
    if (new_file_inode == NULL) {
-      printk("file_create: sys_malloc for inode failded\n");//内存分配失败，需要回滚
+      printk("file_create: malloc for inode failded\n");//内存分配失败，需要回滚
       rollback_step = 1;
       goto rollback;//回滚至，case1，仅仅需要将inode位图重置就可以了
    }
@@ -180,7 +182,7 @@ int32_t file_create(struct dir* parent_dir, char* filename, uint8_t flag) {
    list_push(&cur_part->open_inodes, &new_file_inode->inode_tag);
    new_file_inode->i_open_cnts = 1;
 
-   sys_free(io_buf);
+   kmem_cache_free(io_buf_cache, io_buf);
    return pcb_fd_install(fd_idx);//在进程的本地描述符数组中添加新的描述符指向全局文件描述符
 
 /*创建文件需要创建相关的多个资源,若某步失败则会执行到下面的回滚步骤 */
@@ -190,13 +192,13 @@ rollback:
 	 /* 失败时,将file_table中的相应位清空 */
 	 memset(&file_table[fd_idx], 0, sizeof(struct file)); 
       case 2:
-	 sys_free(new_file_inode);
+	 kmem_cache_free(inode_cache, new_file_inode);
       case 1:
 	 /* 如果新文件的i结点创建失败,之前位图中分配的inode_no也要恢复 */
 	 bitmap_set(&cur_part->inode_bitmap, inode_no, 0);
 	 break;
    }
-   sys_free(io_buf);
+   kmem_cache_free(io_buf_cache, io_buf);
    return -1;
 }
 
@@ -260,14 +262,14 @@ int32_t file_write(struct file* file, const void* buf, uint32_t count) {
       printk("exceed max file_size 71680 bytes, write file failed\n");
       return -1;
    }
-   uint8_t* io_buf = sys_malloc(BLOCK_SIZE);
+   uint8_t* io_buf = kmem_cache_zalloc(sec_buf_cache);
    if (io_buf == NULL) {
-      printk("file_write: sys_malloc for io_buf failed\n");
+      printk("file_write: malloc for io_buf failed\n");
       return -1;
    }
-   uint32_t* all_blocks = (uint32_t*)sys_malloc(BLOCK_SIZE + 48);	  //(128个间接块+12个直接块)*4 .用来记录文件所有的块地址,注意是地址
+   uint32_t* all_blocks = (uint32_t*)kmem_cache_zalloc(blk_idx_cache);	  //(128个间接块+12个直接块)*4 .用来记录文件所有的块地址,注意是地址
    if (all_blocks == NULL) {
-      printk("file_write: sys_malloc for all_blocks failed\n");
+      printk("file_write: malloc for all_blocks failed\n");
       return -1;
    }
 
@@ -449,8 +451,8 @@ int32_t file_write(struct file* file, const void* buf, uint32_t count) {
       size_left -= chunk_size;
    }
    inode_sync(cur_part, file->fd_inode, io_buf);
-   sys_free(all_blocks);
-   sys_free(io_buf);
+   kmem_cache_free(blk_idx_cache, all_blocks);
+   kmem_cache_free(sec_buf_cache, io_buf);
    return bytes_written;
 }
 
@@ -468,13 +470,13 @@ int32_t file_read(struct file* file, void* buf, uint32_t count) {
       }
    }
 
-   uint8_t* io_buf = sys_malloc(BLOCK_SIZE);
+   uint8_t* io_buf = kmem_cache_zalloc(sec_buf_cache);
    if (io_buf == NULL) {
-      printk("file_read: sys_malloc for io_buf failed\n");
+      printk("file_read: malloc for io_buf failed\n");
    }
-   uint32_t* all_blocks = (uint32_t*)sys_malloc(BLOCK_SIZE + 48);	  // 用来记录文件所有的块地址
+   uint32_t* all_blocks = (uint32_t*)kmem_cache_zalloc(blk_idx_cache);	  // 用来记录文件所有的块地址
    if (all_blocks == NULL) {
-      printk("file_read: sys_malloc for all_blocks failed\n");
+      printk("file_read: malloc for all_blocks failed\n");
       return -1;
    }
 
@@ -544,7 +546,7 @@ int32_t file_read(struct file* file, void* buf, uint32_t count) {
       bytes_read += chunk_size;
       size_left -= chunk_size;
    }
-   sys_free(all_blocks);
-   sys_free(io_buf);
+   kmem_cache_free(blk_idx_cache, all_blocks);
+   kmem_cache_free(sec_buf_cache, io_buf);
    return bytes_read;
 }
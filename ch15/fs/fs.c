@@ -15,9 +15,29 @@
 #include "keyboard.h"
 #include "ioqueue.h"
 #include "pipe.h"
+#include "slab.h"
+#include "swap.h"
 
 struct partition* cur_part;	 // 默认情况下操作的是哪个分区
 
+/* 文件系统读写硬盘时用的临时缓冲区, 从专门的对象缓存中分配 */
+struct kmem_cache* sec_buf_cache;   // 1个扇区
+struct kmem_cache* io_buf_cache;    // 2个扇区, 用于可能跨扇区的inode
+struct kmem_cache* blk_idx_cache;   // 12个直接块+128个间接块的块地址数组
+
+/* 创建文件系统用到的对象缓存 */
+static void fs_cache_init(void) {
+   inode_cache = kmem_cache_create("inode", sizeof(struct inode), NULL);
+   dir_cache = kmem_cache_create("dir", sizeof(struct dir), NULL);
+   sec_buf_cache = kmem_cache_create("sec_buf", SECTOR_SIZE, NULL);
+   io_buf_cache = kmem_cache_create("io_buf", SECTOR_SIZE * 2, NULL);
+   blk_idx_cache = kmem_cache_create("blk_idx", BLOCK_SIZE + 48, NULL);
+   if (inode_cache == NULL || dir_cache == NULL || sec_buf_cache == NULL || \
+       io_buf_cache == NULL || blk_idx_cache == NULL) {
+      PANIC("fs_cache_init: create cache failed!");
+   }
+}
+
 /* 在分区链表中找到名为part_name的分区,并将其指针赋值给cur_part */
 static bool mount_partition(struct list_elem* pelem, int arg) {
    char* part_name = (char*)arg;
@@ -48,6 +68,7 @@ static bool mount_partition(struct list_elem* pelem, int arg) {
 	 PANIC("alloc memory failed!");
       }
       cur_part->block_bitmap.btmp_bytes_len = sb_buf->block_bitmap_sects * SECTOR_SIZE;
+      cur_part->block_bitmap.hint = 0;
       /* 从硬盘上读入块位图到分区的block_bitmap.bits */
       ide_read(hd, sb_buf->block_bitmap_lba, cur_part->block_bitmap.bits, sb_buf->block_bitmap_sects);   
       /*************************************************************/
@@ -58,6 +79,7 @@ static bool mount_partition(struct list_elem* pelem, int arg) {
 	 PANIC("alloc memory failed!");
       }
       cur_part->inode_bitmap.btmp_bytes_len = sb_buf->inode_bitmap_sects * SECTOR_SIZE;
+      cur_part->inode_bitmap.hint = 0;
       /* 从硬盘上读入inode位图到分区的inode_bitmap.bits */
       ide_read(hd, sb_buf->inode_bitmap_lba, cur_part->inode_bitmap.bits, sb_buf->inode_bitmap_sects);   
       /*************************************************************/
@@ -129,19 +151,14 @@ static void partition_format(struct partition* part) {
  * 2 将块位图初始化并写入sb.block_bitmap_lba *
  *************************************/
    /* 初始化块位图block_bitmap */
-   buf[0] |= 0x01;       // 第0个块预留给根目录,位图中先占位
-   uint32_t block_bitmap_last_byte = block_bitmap_bit_len / 8;
-   uint8_t  block_bitmap_last_bit  = block_bitmap_bit_len % 8;
-   uint32_t last_size = SECTOR_SIZE - (block_bitmap_last_byte % SECTOR_SIZE);	     // last_size是位图所在最后一个扇区中，不足一扇区的其余部分
-
-   /* 1 先将位图最后一字节到其所在的扇区的结束全置为1,即超出实际块数的部分直接置为已占用*/
-   memset(&buf[block_bitmap_last_byte], 0xff, last_size);
-   
-   /* 2 再将上一步中覆盖的最后一字节内的有效位重新置0 */
-   uint8_t bit_idx = 0;
-   while (bit_idx <= block_bitmap_last_bit) {
-      buf[block_bitmap_last_byte] &= ~(1 << bit_idx++);
-   }
+   struct bitmap block_bitmap;
+   block_bitmap.bits = buf;
+   block_bitmap.btmp_bytes_len = sb.block_bitmap_sects * SECTOR_SIZE;
+   bitmap_init(&block_bitmap);
+   bitmap_set(&block_bitmap, 0, 1);       // 第0个块预留给根目录,位图中先占位
+
+   /* 位图最后一个扇区中超出实际块数的部分直接置为已占用 */
+   bitmap_set_range(&block_bitmap, block_bitmap_bit_len, block_bitmap.btmp_bytes_len * 8 - block_bitmap_bit_len);
    ide_write(hd, sb.block_bitmap_lba, buf, sb.block_bitmap_sects);
 
 /***************************************
@@ -530,9 +547,21 @@ int32_t sys_unlink(const char* pathname) {
       return -1;
    }
    ASSERT(file_idx == MAX_FILE_OPEN);
+
+   /* 文件关闭后, mmap建立的映射仍可能打开着它的inode */
+   struct list_elem* elem = cur_part->open_inodes.head.next;
+   while (elem != &cur_part->open_inodes.tail) {
+      struct inode* inode = elem2entry(struct inode, inode_tag, elem);
+      if (inode->i_no == (uint32_t)inode_no) {
+         dir_close(searched_record.parent_dir);
+         printk("file %s is mapped, not allow to delete!\n", pathname);
+         return -1;
+      }
+      elem = elem->next;
+   }
    
    /* 为delete_dir_entry申请缓冲区 */
-   void* io_buf = sys_malloc(SECTOR_SIZE + SECTOR_SIZE);
+   void* io_buf = kmem_cache_zalloc(io_buf_cache);
    if (io_buf == NULL) {
       dir_close(searched_record.parent_dir);
       printk("sys_unlink: malloc for io_buf failed\n");
@@ -542,7 +571,7 @@ int32_t sys_unlink(const char* pathname) {
    struct dir* parent_dir = searched_record.parent_dir;  
    delete_dir_entry(cur_part, parent_dir, inode_no, io_buf);
    inode_release(cur_part, inode_no);
-   sys_free(io_buf);
+   kmem_cache_free(io_buf_cache, io_buf);
    dir_close(searched_record.parent_dir);
    return 0;   // 成功删除文件 
 }
@@ -550,9 +579,9 @@ int32_t sys_unlink(const char* pathname) {
 /* 创建目录pathname,成功返回0,失败返回-1 */
 int32_t sys_mkdir(const char* pathname) {
    uint8_t rollback_step = 0;	       // 用于操作失败时回滚各资源状态
-   void* io_buf = sys_malloc(SECTOR_SIZE * 2);
+   void* io_buf = kmem_cache_zalloc(io_buf_cache);
    if (io_buf == NULL) {
-      printk("sys_mkdir: sys_malloc for io_buf failed\n");
+      printk("sys_mkdir: malloc for io_buf failed\n");
       return -1;
    }
 
@@ -644,7 +673,7 @@ int32_t sys_mkdir(const char* pathname) {
    /* 将inode位图同步到硬盘 */
    bitmap_sync(cur_part, inode_no, INODE_BITMAP);
 
-   sys_free(io_buf);
+   kmem_cache_free(io_buf_cache, io_buf);
 
    /* 关闭所创建目录的父目录 */
    dir_close(searched_record.parent_dir);
@@ -660,7 +689,7 @@ rollback:	     // 因为某步骤操作失败而回滚
          dir_close(searched_record.parent_dir);
          break;
    }
-   sys_free(io_buf);
+   kmem_cache_free(io_buf_cache, io_buf);
    return -1;
 }
 
@@ -805,11 +834,6 @@ char* sys_getcwd(char* buf, uint32_t size) {
    /* 确保buf不为空,若用户进程提供的buf为NULL,
    系统调用getcwd中要为用户进程通过malloc分配内存 */
    ASSERT(buf != NULL);
-   void* io_buf = sys_malloc(SECTOR_SIZE);
-   if (io_buf == NULL) {
-      return NULL;
-   }
-
    struct task_struct* cur_thread = running_thread();
    int32_t parent_inode_nr = 0;
    int32_t child_inode_nr = cur_thread->cwd_inode_nr;
@@ -821,6 +845,11 @@ char* sys_getcwd(char* buf, uint32_t size) {
       return buf;
    }
 
+   void* io_buf = kmem_cache_zalloc(sec_buf_cache);
+   if (io_buf == NULL) {
+      return NULL;
+   }
+
    memset(buf, 0, size);
    char full_path_reverse[MAX_PATH_LEN] = {0};	  // 用来做全路径缓冲区
 
@@ -830,7 +859,7 @@ char* sys_getcwd(char* buf, uint32_t size) {
    while ((child_inode_nr)) {
       parent_inode_nr = get_parent_dir_inode_nr(child_inode_nr, io_buf);
       if (get_child_dir_name(parent_inode_nr, child_inode_nr, full_path_reverse, io_buf) == -1) {	  // 或未找到名字,失败退出
-         sys_free(io_buf);
+         kmem_cache_free(sec_buf_cache, io_buf);
          return NULL;
       }
       child_inode_nr = parent_inode_nr;
@@ -846,7 +875,7 @@ char* sys_getcwd(char* buf, uint32_t size) {
       /* 在full_path_reverse中添加结束字符,做为下一次执行strcpy中last_slash的边界 */
       *last_slash = 0;
    }
-   sys_free(io_buf);
+   kmem_cache_free(sec_buf_cache, io_buf);
    return buf;
 }
 
@@ -905,6 +934,8 @@ void sys_putchar(char char_asci) {
 void filesys_init() {
    uint8_t channel_no = 0, dev_no, part_idx = 0;
 
+   fs_cache_init();
+
    /* sb_buf用来存储从硬盘上读入的超级块 */
    struct super_block* sb_buf = (struct super_block*)sys_malloc(SECTOR_SIZE);
 
@@ -930,7 +961,7 @@ void filesys_init() {
 	  * partition又为disk的嵌套结构,因此partition中的成员默认也为0.
 	  * 若partition未初始化,则partition中的成员仍为0. 
 	  * 下面处理存在的分区. */
-	    if (part->sec_cnt != 0) {  // 如果分区存在
+	    if (part->sec_cnt != 0 && part != swap_part) {  // 如果分区存在, 交换分区不放文件系统
 	       memset(sb_buf, 0, SECTOR_SIZE);
 
 	       /* 读出分区的超级块,根据魔数是否正确来判断是否存在文件系统 */
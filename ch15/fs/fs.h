@@ -52,6 +52,9 @@ struct stat {
 };
 
 extern struct partition* cur_part;
+extern struct kmem_cache* sec_buf_cache;
+extern struct kmem_cache* io_buf_cache;
+extern struct kmem_cache* blk_idx_cache;
 void filesys_init(void);
 char* path_parse(char* pathname, char* name_store);
 int32_t path_depth_cnt(char* pathname);
@@ -9,6 +9,9 @@
 #include "stdio-kernel.h"
 #include "string.h"
 #include "super_block.h"
+#include "slab.h"
+
+struct kmem_cache* inode_cache;   // 内存中的inode都从这里分配, 由所有任务共享
 
 //存储inode位置
 struct inode_position {
@@ -91,7 +94,7 @@ void inode_sync(struct partition* part, struct inode* inode, void* io_buf) {
     如果找不到，说明之前没有打开过这个inode
     那就先在内存中开辟inode结构的内存空间，从硬盘中读对应的inode节点到内存中，并将其标签添加到inode队列首部，最后返回inode节点在内存中的地址
     --------------------------------
-    注意,这里调用inodeopen()的是用户进程，但是又希望inode结构存在内核物理空间中，所以在调用sys_malloc之前应该暂时将page_dir设为null，这样在内核中分配inode结构
+    注意,这里调用inodeopen()的可能是用户进程，但是inode结构要被所有任务共享，所以从内核的inode_cache中分配
  */
 struct inode* inode_open(struct partition* part, uint32_t inode_no) {
    /* 先在已打开inode链表中找inode,此链表是为提速在内存中创建的缓冲区，这样就没必要每次打开inode时都取硬盘读取了 */
@@ -112,26 +115,18 @@ struct inode* inode_open(struct partition* part, uint32_t inode_no) {
    /* inode位置信息会存入inode_pos, 包括inode所在扇区地址和扇区内的字节偏移量 */
    inode_locate(part, inode_no, &inode_pos);
 
-/* 为使通过sys_malloc创建的新inode被所有任务共享,
- * 需要将inode置于内核空间,故需要临时
- * 将cur_pbc->pgdir置为NULL */
-   struct task_struct* cur = running_thread();
-   uint32_t* cur_pagedir_bak = cur->pgdir;
-   cur->pgdir = NULL;
-   /* 以上三行代码完成后下面分配的内存将位于内核区 */
-   inode_found = (struct inode*)sys_malloc(sizeof(struct inode));
-   /* 恢复pgdir */
-   cur->pgdir = cur_pagedir_bak;
+/* inode要被所有任务共享, 从内核的inode_cache中分配 */
+   inode_found = (struct inode*)kmem_cache_alloc(inode_cache);
 
    char* inode_buf;
    if (inode_pos.two_sec) {	// 考虑跨扇区的情况
-      inode_buf = (char*)sys_malloc(1024);
+      inode_buf = (char*)kmem_cache_alloc(io_buf_cache);
 
    /* i结点表是被partition_format函数连续写入扇区的,
     * 所以下面可以连续读出来 */
       ide_read(part->my_disk, inode_pos.sec_lba, inode_buf, 2);
    } else {	// 否则,所查找的inode未跨扇区,一个扇区大小的缓冲区足够
-      inode_buf = (char*)sys_malloc(512);
+      inode_buf = (char*)kmem_cache_alloc(sec_buf_cache);
       ide_read(part->my_disk, inode_pos.sec_lba, inode_buf, 1);
    }
    memcpy(inode_found, inode_buf + inode_pos.off_size, sizeof(struct inode));
@@ -140,27 +135,20 @@ struct inode* inode_open(struct partition* part, uint32_t inode_no) {
    list_push(&part->open_inodes, &inode_found->inode_tag);
    inode_found->i_open_cnts = 1;
 
-   sys_free(inode_buf);//释放用于硬盘读取的缓冲区
+   //释放用于硬盘读取的缓冲区
+   kmem_cache_free(inode_pos.two_sec ? io_buf_cache : sec_buf_cache, inode_buf);
    return inode_found;
 }
 
 /* 关闭inode或减少inode的打开数 
    如果打开次数为0，那就释放inode在内存中占用的空间，同时也将对应的tag从inode队列中删除
-   这里也要注意在调用free()前将pgdir改为null，这样才能在内核空间中释放inode
 */
 void inode_close(struct inode* inode) {
    /* 若没有进程再打开此文件,将此inode去掉并释放空间 */
    enum intr_status old_status = intr_disable();
    if (--inode->i_open_cnts == 0) {
       list_remove(&inode->inode_tag);	  // 将I结点从part->open_inodes中去掉
-   /* inode_open时为实现inode被所有进程共享,
-    * 已经在sys_malloc为inode分配了内核空间,
-    * 释放inode时也要确保释放的是内核内存池 */
-      struct task_struct* cur = running_thread();
-      uint32_t* cur_pagedir_bak = cur->pgdir;
-      cur->pgdir = NULL;
-      sys_free(inode);
-      cur->pgdir = cur_pagedir_bak;
+      kmem_cache_free(inode_cache, inode);
    }
    intr_set_status(old_status);
 }
@@ -241,9 +229,9 @@ void inode_release(struct partition* part, uint32_t inode_no) {
    * 此函数会在inode_table中将此inode清0,
    * 但实际上是不需要的,inode分配是由inode位图控制的,
    * 硬盘上的数据不需要清0,可以直接覆盖*/
-   void* io_buf = sys_malloc(1024);
+   void* io_buf = kmem_cache_alloc(io_buf_cache);
    inode_delete(part, inode_no, io_buf);
-   sys_free(io_buf);
+   kmem_cache_free(io_buf_cache, io_buf);
    /***********************************************/
     
    inode_close(inode_to_del);
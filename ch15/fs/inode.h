@@ -23,6 +23,7 @@ struct inode {
 };
 
 
+extern struct kmem_cache* inode_cache;
 struct inode* inode_open(struct partition* part, uint32_t inode_no);
 void inode_sync(struct partition* part, struct inode* inode, void* io_buf);
 void inode_init(uint32_t inode_no, struct inode* new_inode);
@@ -0,0 +1,203 @@
+#include "bench.h"
+#include "stdint.h"
+#include "global.h"
+#include "io.h"
+#include "bitmap.h"
+#include "buddy.h"
+#include "memory.h"
+#include "interrupt.h"
+#include "debug.h"
+#include "stdio-kernel.h"
+#include "thread.h"
+#include "string.h"
+
+// 内核自测的性能基准, 只在编译时定义了CONFIG_BENCH才会在init_all的最后调用
+// 计时都用rdtsc, 单位是时钟周期; 测量期间关中断, 避免时钟中断和调度带来的误差
+
+#define BENCH_POOL_MAX_MB 64   // 最大的测试内存池, 64MB = 16384页
+#define BENCH_RUN_PAGES 16     // 多页分配时一次申请的页数
+#define BENCH_TLB_PAGES 64     // 每次切换页表后最多访问的内核大页数, 每个大页用一个tlb项
+#define BENCH_TLB_ROUNDS 1000  // 切换页表的次数
+#define BENCH_MALLOC_THREADS 4     // 同时做小块分配的内核线程数
+#define BENCH_MALLOC_ROUNDS 20000  // 每个线程分配释放的轮数
+
+// 旧的palloc: 每分配一页都从位图开头扫描一遍
+static uint32_t bench_bitmap_alloc(struct bitmap* btmp, uint32_t pg_cnt) {
+   uint64_t start = rdtsc();
+   uint32_t cnt = 0;
+   while (cnt++ < pg_cnt) {
+      int bit_idx = bitmap_scan(btmp, 1);
+      ASSERT(bit_idx != -1);
+      bitmap_set(btmp, bit_idx, 1);
+   }
+   return (uint32_t)(rdtsc() - start);
+}
+
+static uint32_t bench_bitmap_free(struct bitmap* btmp, uint32_t pg_cnt) {
+   uint64_t start = rdtsc();
+   uint32_t bit_idx = 0;
+   while (bit_idx < pg_cnt) {
+      bitmap_set(btmp, bit_idx++, 0);
+   }
+   return (uint32_t)(rdtsc() - start);
+}
+
+// 伙伴系统每次分配run页, 直到分完整个zone
+static uint32_t bench_buddy_alloc(struct buddy_zone* zone, uint32_t pg_cnt, uint32_t run) {
+   uint64_t start = rdtsc();
+   uint32_t cnt = 0;
+   while (cnt < pg_cnt) {
+      int32_t pg_idx = buddy_alloc_pages(zone, run);
+      ASSERT(pg_idx != -1);
+      cnt += run;
+   }
+   return (uint32_t)(rdtsc() - start);
+}
+
+// 逐页释放, 与mfree_page的用法一致
+static uint32_t bench_buddy_free(struct buddy_zone* zone, uint32_t pg_cnt) {
+   uint64_t start = rdtsc();
+   uint32_t pg_idx = 0;
+   while (pg_idx < pg_cnt) {
+      buddy_free(zone, pg_idx++, 0);
+   }
+   return (uint32_t)(rdtsc() - start);
+}
+
+// 物理页分配的延迟: 位图逐页扫描与伙伴系统的对比, 内存池从4MB增长到64MB
+// 结果为平均每页花费的时钟周期
+void mem_bench(void) {
+   uint32_t map_pg_cnt = DIV_ROUND_UP(BENCH_POOL_MAX_MB * 256 * sizeof(struct page), PG_SIZE);
+   uint32_t bm_pg_cnt = DIV_ROUND_UP(BENCH_POOL_MAX_MB * 256 / 8, PG_SIZE);
+   struct page* mem_map = get_kernel_pages(map_pg_cnt);
+   uint8_t* bits = get_kernel_pages(bm_pg_cnt);
+   if (mem_map == NULL || bits == NULL) {
+      printk("mem_bench: no memory\n");
+      return;
+   }
+
+   printk("mem_bench: cycles per page (alloc/free)\n");
+   uint32_t pool_mb;
+   for (pool_mb = 4; pool_mb <= BENCH_POOL_MAX_MB; pool_mb *= 4) {
+      uint32_t pg_cnt = pool_mb * 256;
+      enum intr_status old_status = intr_disable();
+      struct bitmap btmp;
+      btmp.bits = bits;
+      btmp.btmp_bytes_len = pg_cnt / 8;
+      bitmap_init(&btmp);
+      uint32_t bm_alloc = bench_bitmap_alloc(&btmp, pg_cnt);
+      uint32_t bm_free = bench_bitmap_free(&btmp, pg_cnt);
+
+      struct buddy_zone zone;
+      buddy_init(&zone, 0, pg_cnt, mem_map);
+      uint32_t bd_alloc = bench_buddy_alloc(&zone, pg_cnt, 1);
+      uint32_t bd_free = bench_buddy_free(&zone, pg_cnt);
+      uint32_t bd_run_alloc = bench_buddy_alloc(&zone, pg_cnt, BENCH_RUN_PAGES);
+      ASSERT(zone.free_pages == 0);
+      intr_set_status(old_status);
+
+      printk("    pool %dMB: bitmap %d/%d buddy %d/%d buddy(%d pages) %d\n", pool_mb, \
+             bm_alloc / pg_cnt, bm_free / pg_cnt, bd_alloc / pg_cnt, bd_free / pg_cnt, \
+             BENCH_RUN_PAGES, bd_run_alloc / pg_cnt);
+   }
+
+   free_kernel_pages(bits, bm_pg_cnt);
+   free_kernel_pages(mem_map, map_pg_cnt);
+}
+
+// 直接映射区用大页, 同一个大页中的内核页共用一个tlb项, 所以每个大页只访问一次.
+// 直接映射区只覆盖实际的内存, 返回其中存在的大页数, 最多BENCH_TLB_PAGES个
+static uint32_t bench_tlb_pages(void) {
+   uint32_t pg_cnt = 0;
+   while (pg_cnt < BENCH_TLB_PAGES && (*pde_ptr(KERNEL_BASE + pg_cnt * PDE_SPAN) & PG_P_1)) {
+      pg_cnt++;
+   }
+   return pg_cnt;
+}
+
+// 模拟一次进程切换: 重新加载cr3, 然后访问pg_cnt个内核大页, 返回平均每次的时钟周期
+static uint32_t bench_cr3_switch(uint32_t pg_cnt) {
+   uint32_t cr3, round = 0, sum = 0;
+   asm volatile ("movl %%cr3, %0" : "=r" (cr3));
+   uint64_t start = rdtsc();
+   while (round++ < BENCH_TLB_ROUNDS) {
+      asm volatile ("movl %0, %%cr3" : : "r" (cr3) : "memory");
+      uint32_t pg_idx = 0;
+      while (pg_idx < pg_cnt) {
+         sum += *(volatile uint32_t*)(KERNEL_BASE + pg_idx++ * PDE_SPAN);
+      }
+   }
+   return (uint32_t)(rdtsc() - start) / BENCH_TLB_ROUNDS;
+}
+
+// 上下文切换时的tlb开销: 内核页表项为全局页时, 重新加载cr3后内核的tlb项仍然有效,
+// 关掉cr4的PGE位再测一次, 两者之差就是每次切换省下的tlb重填开销
+void tlb_bench(void) {
+   uint32_t cr4;
+   asm volatile ("movl %%cr4, %0" : "=r" (cr4));
+   if (!(cr4 & 0x80)) {
+      printk("tlb_bench: PGE not enabled\n");
+      return;
+   }
+   uint32_t pg_cnt = bench_tlb_pages();
+   enum intr_status old_status = intr_disable();
+   uint32_t global = bench_cr3_switch(pg_cnt);
+   asm volatile ("movl %0, %%cr4" : : "r" (cr4 & ~0x80) : "memory");
+   uint32_t non_global = bench_cr3_switch(pg_cnt);
+   asm volatile ("movl %0, %%cr4" : : "r" (cr4) : "memory");
+   intr_set_status(old_status);
+   printk("tlb_bench: cr3 reload + %d kernel large pages: global %d cycles, non-global %d cycles\n", \
+          pg_cnt, global, non_global);
+}
+
+// 要用到只在CONFIG_BENCH下才有的mag_bypass
+#ifdef CONFIG_BENCH
+static uint32_t malloc_bench_done;   // 已经跑完的线程数
+
+// 每轮申请两个不同规格的小块再释放, 规格在16字节到4096字节之间轮换
+static void malloc_bench_thread(void* arg UNUSED) {
+   uint32_t round = 0;
+   while (round < BENCH_MALLOC_ROUNDS) {
+      void* a = sys_malloc(16 << (round % DESC_CNT));
+      void* b = sys_malloc(16 << ((round + 3) % DESC_CNT));
+      ASSERT(a != NULL && b != NULL);
+      sys_free(a);
+      sys_free(b);
+      round++;
+   }
+   enum intr_status old_status = intr_disable();
+   malloc_bench_done++;
+   intr_set_status(old_status);
+   thread_exit(running_thread(), true);
+}
+
+// 启动BENCH_MALLOC_THREADS个线程并等它们都结束, 返回总耗时
+static uint32_t bench_malloc_threads(void) {
+   malloc_bench_done = 0;
+   memset(&malloc_stat, 0, sizeof(malloc_stat));
+   uint64_t start = rdtsc();
+   uint32_t thread_idx = 0;
+   while (thread_idx++ < BENCH_MALLOC_THREADS) {
+      thread_start("malloc_bench", 31, malloc_bench_thread, NULL);
+   }
+   while (malloc_bench_done < BENCH_MALLOC_THREADS) {
+      thread_yield();
+   }
+   return (uint32_t)(rdtsc() - start);
+}
+
+// 多个内核线程同时sys_malloc/sys_free时内存池锁的争用: 不用弹匣(原先的做法)与用弹匣的对比
+// 要开着中断测, 争用来自持有锁时被时钟中断换下处理器
+void malloc_bench(void) {
+   printk("malloc_bench: %d threads x %d rounds of 2 malloc + 2 free\n", \
+          BENCH_MALLOC_THREADS, BENCH_MALLOC_ROUNDS);
+   mag_bypass = true;
+   uint32_t cycles = bench_malloc_threads();
+   printk("    magazine off: %dK cycles, pool lock %d contended %d\n", \
+          cycles >> 10, malloc_stat.lock_acquires, malloc_stat.lock_contended);
+   mag_bypass = false;
+   cycles = bench_malloc_threads();
+   printk("    magazine on: %dK cycles, pool lock %d contended %d, magazine hits %d\n", \
+          cycles >> 10, malloc_stat.lock_acquires, malloc_stat.lock_contended, malloc_stat.mag_hits);
+}
+#endif
@@ -0,0 +1,7 @@
+#ifndef __KERNEL_BENCH_H
+#define __KERNEL_BENCH_H
+#include "stdint.h"
+void mem_bench(void);
+void tlb_bench(void);
+void malloc_bench(void);
+#endif
@@ -0,0 +1,169 @@
+#include "buddy.h"
+#include "stdint.h"
+#include "global.h"
+#include "list.h"
+#include "debug.h"
+#include "interrupt.h"
+
+// 伙伴系统: 每一阶有一个空闲块链表, 第order阶的块由 2^order 个连续页框组成
+// 块的下标(相对zone起始的页号)总是按块大小对齐, 所以一个块的伙伴下标就是 pg_idx ^ (1 << order)
+// 分配时从能满足要求的最小阶取块, 多余的一半逐级挂回低阶链表;
+// 释放时只要伙伴也空闲且同阶, 就合并成高一阶的块, 直到不能再合并为止
+// 这样分配和释放都只需 O(MAX_ORDER) 步, 与内存池的大小无关
+
+// 将以pg_idx为首页的order阶空闲块挂到链表上
+static void free_area_add(struct buddy_zone* zone, uint32_t pg_idx, uint32_t order) {
+   struct page* pg = &zone->mem_map[pg_idx];
+   pg->order = order;
+   pg->flags |= PAGE_BUDDY;
+   list_push(&zone->free_area[order].free_list, &pg->free_tag);
+   zone->free_area[order].nr_free++;
+}
+
+// 将以pg_idx为首页的order阶空闲块从链表上摘下
+static void free_area_del(struct buddy_zone* zone, uint32_t pg_idx, uint32_t order) {
+   struct page* pg = &zone->mem_map[pg_idx];
+   list_remove(&pg->free_tag);
+   pg->flags &= ~PAGE_BUDDY;
+   zone->free_area[order].nr_free--;
+}
+
+// 求能容纳pg_cnt个页框的最小阶
+uint32_t buddy_order(uint32_t pg_cnt) {
+   uint32_t order = 0;
+   while ((1UL << order) < pg_cnt) {
+      order++;
+   }
+   return order;
+}
+
+// 初始化一个空的zone, mem_map由调用者提供, 至少要有pg_cnt个page结构
+// 开始时所有页框都是PAGE_RESERVED的, 只有经buddy_add_pages交给伙伴系统的页框才能被分配,
+// 这样zone中间可以有物理内存空洞
+void buddy_zone_init(struct buddy_zone* zone, uint32_t phy_addr_start, uint32_t pg_cnt, struct page* mem_map) {
+   uint32_t order;
+   zone->phy_addr_start = phy_addr_start;
+   zone->pg_cnt = pg_cnt;
+   zone->free_pages = 0;
+   zone->mem_map = mem_map;
+   for (order = 0; order < MAX_ORDER; order++) {
+      list_init(&zone->free_area[order].free_list);
+      zone->free_area[order].nr_free = 0;
+   }
+
+   uint32_t pg_idx = 0;
+   while (pg_idx < pg_cnt) {
+      mem_map[pg_idx].ref_cnt = 0;
+      mem_map[pg_idx].flags = PAGE_RESERVED;
+      pg_idx++;
+   }
+}
+
+// 把从pg_idx起的pg_cnt个页框交给伙伴系统, 与已在zone中的相邻空闲块合并
+void buddy_add_pages(struct buddy_zone* zone, uint32_t pg_idx, uint32_t pg_cnt) {
+   ASSERT(pg_idx + pg_cnt <= zone->pg_cnt);
+   uint32_t idx = pg_idx;
+   while (idx < pg_idx + pg_cnt) {
+      zone->mem_map[idx].flags = 0;
+      idx++;
+   }
+   buddy_free_pages(zone, pg_idx, pg_cnt);
+}
+
+// 初始化zone, 其中所有页框都空闲
+void buddy_init(struct buddy_zone* zone, uint32_t phy_addr_start, uint32_t pg_cnt, struct page* mem_map) {
+   buddy_zone_init(zone, phy_addr_start, pg_cnt, mem_map);
+   buddy_add_pages(zone, 0, pg_cnt);
+}
+
+// 分配一个order阶的块, 成功返回首页下标, 失败返回-1
+int32_t buddy_alloc(struct buddy_zone* zone, uint32_t order) {
+   ASSERT(order < MAX_ORDER);
+   enum intr_status old_status = intr_disable();
+   uint32_t cur_order = order;
+   while (cur_order < MAX_ORDER && list_empty(&zone->free_area[cur_order].free_list)) {
+      cur_order++;
+   }
+   if (cur_order == MAX_ORDER) {
+      intr_set_status(old_status);
+      return -1;
+   }
+
+   struct page* pg = elem2entry(struct page, free_tag, zone->free_area[cur_order].free_list.head.next);
+   uint32_t pg_idx = pg - zone->mem_map;
+   free_area_del(zone, pg_idx, cur_order);
+
+   // 大块一分为二, 后一半挂回低一阶的链表, 直到阶数满足要求
+   while (cur_order > order) {
+      cur_order--;
+      free_area_add(zone, pg_idx + (1UL << cur_order), cur_order);
+   }
+   pg->order = order;
+   zone->free_pages -= 1UL << order;
+   intr_set_status(old_status);
+   return pg_idx;
+}
+
+// 释放以pg_idx为首页的order阶块, 并尽可能与伙伴合并
+void buddy_free(struct buddy_zone* zone, uint32_t pg_idx, uint32_t order) {
+   ASSERT(order < MAX_ORDER && pg_idx < zone->pg_cnt);
+   ASSERT(!(zone->mem_map[pg_idx].flags & PAGE_BUDDY));
+   enum intr_status old_status = intr_disable();
+   zone->free_pages += 1UL << order;
+
+   while (order < MAX_ORDER - 1) {
+      uint32_t buddy_idx = pg_idx ^ (1UL << order);
+      if (buddy_idx + (1UL << order) > zone->pg_cnt) {
+         break;
+      }
+      struct page* buddy = &zone->mem_map[buddy_idx];
+      // 伙伴必须是空闲块的首页且阶相同才能合并
+      if (!(buddy->flags & PAGE_BUDDY) || buddy->order != order) {
+         break;
+      }
+      free_area_del(zone, buddy_idx, order);
+      pg_idx &= buddy_idx;
+      order++;
+   }
+   free_area_add(zone, pg_idx, order);
+   intr_set_status(old_status);
+}
+
+// 分配pg_cnt个物理上连续的页框, 成功返回首页下标, 失败返回-1
+// 先分配能容纳pg_cnt页的最小块, 再把尾部多余的页还回去
+int32_t buddy_alloc_pages(struct buddy_zone* zone, uint32_t pg_cnt) {
+   ASSERT(pg_cnt > 0);
+   uint32_t order = buddy_order(pg_cnt);
+   if (order >= MAX_ORDER) {
+      return -1;
+   }
+   int32_t pg_idx = buddy_alloc(zone, order);
+   if (pg_idx != -1 && pg_cnt < (1UL << order)) {
+      buddy_free_pages(zone, pg_idx + pg_cnt, (1UL << order) - pg_cnt);
+   }
+   return pg_idx;
+}
+
+// 释放从pg_idx起的pg_cnt个连续页框, 它们不必是一个完整的块
+// 拆成若干个对齐的块逐个释放, 合并由buddy_free完成
+void buddy_free_pages(struct buddy_zone* zone, uint32_t pg_idx, uint32_t pg_cnt) {
+   uint32_t end = pg_idx + pg_cnt;
+   ASSERT(end <= zone->pg_cnt);
+   while (pg_idx < end) {
+      uint32_t order = MAX_ORDER - 1;
+      while ((pg_idx & ((1UL << order) - 1)) || pg_idx + (1UL << order) > end) {
+         order--;
+      }
+      buddy_free(zone, pg_idx, order);
+      pg_idx += 1UL << order;
+   }
+}
+
+// 返回最大的空闲块的页数, 没有空闲页框时返回0
+uint32_t buddy_largest_free(struct buddy_zone* zone) {
+   int32_t order = MAX_ORDER - 1;
+   while (order >= 0 && zone->free_area[order].nr_free == 0) {
+      order--;
+   }
+   return order < 0 ? 0 : 1UL << order;
+}
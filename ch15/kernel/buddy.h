@@ -0,0 +1,48 @@
+#ifndef __KERNEL_BUDDY_H
+#define __KERNEL_BUDDY_H
+#include "stdint.h"
+#include "list.h"
+
+// 伙伴系统的最大阶, 最大的块为 2^(MAX_ORDER-1) 页 = 4MB
+#define MAX_ORDER 11
+
+#define PAGE_BUDDY 1   // 该页是某个空闲块的首页, 挂在free_area链表上
+#define PAGE_RESERVED 2   // 常驻页框, 不参与引用计数也不会被释放, 如共享零页
+#define PAGE_KSM 4   // ksmd合并出来的只读共享页框, 内容不会再变
+
+// 每个物理页框对应一个page结构, 所有page结构组成mem_map数组
+struct page {
+   union {
+      struct list_elem free_tag;   // 空闲块的首页通过它挂到对应阶的free_list中
+      uint32_t pt_cnt;             // 已分配出去作为用户页表时: 其中存在或已换出的页表项个数
+   };
+   uint16_t ref_cnt;            // 引用计数, 留给后续共享页框使用
+   uint8_t order;               // 空闲块首页: 块的阶
+   uint8_t flags;
+};
+
+// 每一阶的空闲块链表
+struct free_area {
+   struct list free_list;
+   uint32_t nr_free;            // 该阶空闲块的个数
+};
+
+// 伙伴系统管理的一段连续物理内存
+struct buddy_zone {
+   uint32_t phy_addr_start;     // 第0页的物理地址
+   uint32_t pg_cnt;             // 管理的页框数
+   uint32_t free_pages;         // 当前空闲页框数
+   struct page* mem_map;        // pg_cnt个page结构
+   struct free_area free_area[MAX_ORDER];
+};
+
+void buddy_zone_init(struct buddy_zone* zone, uint32_t phy_addr_start, uint32_t pg_cnt, struct page* mem_map);
+void buddy_add_pages(struct buddy_zone* zone, uint32_t pg_idx, uint32_t pg_cnt);
+void buddy_init(struct buddy_zone* zone, uint32_t phy_addr_start, uint32_t pg_cnt, struct page* mem_map);
+uint32_t buddy_order(uint32_t pg_cnt);
+int32_t buddy_alloc(struct buddy_zone* zone, uint32_t order);
+void buddy_free(struct buddy_zone* zone, uint32_t pg_idx, uint32_t order);
+int32_t buddy_alloc_pages(struct buddy_zone* zone, uint32_t pg_cnt);
+void buddy_free_pages(struct buddy_zone* zone, uint32_t pg_idx, uint32_t pg_cnt);
+uint32_t buddy_largest_free(struct buddy_zone* zone);
+#endif
@@ -90,4 +90,17 @@ struct gdt_desc {
 
 #define UNUSED __attribute__ ((unused))
 
+// 64位数除以32位数, 返回商, 余数存入remainder(可以为NULL)
+// 内核不链接libgcc, 64位的除法不能直接写'/', 这里用两次divl: 先除高32位, 余数和低32位拼起来再除
+static inline uint64_t div_u64_rem(uint64_t dividend, uint32_t divisor, uint32_t* remainder) {
+   uint32_t high = dividend >> 32;
+   uint32_t q_high = high / divisor;
+   uint32_t q_low, rem = high % divisor;
+   asm ("divl %4" : "=a" (q_low), "=d" (rem) : "a" ((uint32_t)dividend), "d" (rem), "rm" (divisor));
+   if (remainder != NULL) {
+      *remainder = rem;
+   }
+   return ((uint64_t)q_high << 32) | q_low;
+}
+
 #endif
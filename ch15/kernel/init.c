@@ -10,18 +10,36 @@
 #include "syscall-init.h"
 #include "ide.h"
 #include "fs.h"
+#include "bench.h"
+#include "page_fault.h"
+#include "ksm.h"
+#include "swap.h"
+#include "mmap.h"
+#include "clock.h"
+#include "smp.h"
 // 初始化所有模块
 void init_all() {
    put_str("init_all\n");
    idt_init();    // 初始化中断
    mem_init();	  // 初始化内存管理系统
+   page_fault_init(); // 注册缺页异常处理, 支持写时复制
    thread_init(); // 初始化线程相关结构
    timer_init();  // 初始化PIT
    console_init();//控制台初始化
    keyboard_init(); // 键盘初始化
+   clock_init();     // 校准TSC, 读实时钟
    tss_init();
    syscall_init(); //初始化系统调用
+   ksm_init();       // 启动同页合并线程ksmd, 默认不扫描
+   mmap_init();
+   smp_init();       // 启用APIC, 启动其余处理器
    intr_enable();    // 后面的ide_init需要打开中断
    ide_init();	     // 初始化硬盘
+   swap_init();      // 选定交换分区, 启动kswapd
    filesys_init();   // 初始化文件系统,挂载文件系统
+#ifdef CONFIG_BENCH
+   mem_bench();      // 物理页分配的性能基准
+   tlb_bench();      // 全局页对进程切换的影响
+   malloc_bench();   // 多线程小块分配时内存池锁的争用
+#endif
 }
\ No newline at end of file
@@ -36,6 +36,15 @@ char* intr_name[IDT_DESC_CNT]; // 用于保存异常的名字
 intr_handler idt_table[IDT_DESC_CNT]; // 定义中断处理程序数组
 extern intr_handler intr_entry_table[IDT_DESC_CNT]; // 声明引用定义在 kernel.S 中的中断处理入口函数数组
 
+// 向 8259A 发送中断结束命令, 从片上的中断除了往从片发 EOI, 还要往主片发
+static void pic_eoi(void) {
+   outb (PIC_S_CTRL, 0x20);
+   outb (PIC_M_CTRL, 0x20);
+}
+
+// kernel.S 中的中断入口调用它发送 EOI, 改用 APIC 后换成 lapic_eoi
+void (*intr_eoi)(void) = pic_eoi;
+
 // 初始化 8259A
 /* 初始化可编程中断控制器8259A */
 static void pic_init(void) {
@@ -62,6 +71,12 @@ static void pic_init(void) {
    put_str("   pic_init done\n");
 }
 
+// 屏蔽 8259A 上的所有中断, 外部中断改由 IOAPIC 送到各处理器的本地 APIC
+void pic_disable(void) {
+   outb (PIC_M_DATA, 0xff);
+   outb (PIC_S_DATA, 0xff);
+}
+
 // 创建中断门描述符
 static void make_idt_desc(struct gate_desc* p_gdesc, uint8_t attr, intr_handler function) {
     p_gdesc->func_offset_low_word = (uint32_t)function & 0x0000FFFF;
@@ -193,12 +208,15 @@ void idt_init() {
     idt_desc_init(); // 初始化中断描述符表
     exception_init(); // 异常名初始化并注册通常的中断处理函数
     pic_init();      // 初始化 8259A
+    idt_load();
+    put_str("idt_init donw\n");
+}
 
-    // 加载 idt
+// 加载 idt, 各处理器共用一个 idt, AP 启动后也调用它
+void idt_load(void) {
     // sizeof((idt) - 1)得到短截线limit，用作低16位的段界限
     // ((uint64_t)(uint32_t)idt << 16) 将idt的自制挪到高32位
     // m 表示使用内存约束，所以lidt 的操作数是&idt_operand 而不是idt_operand的值
     uint64_t idt_operand = ((sizeof(idt) - 1) | ((uint64_t)(uint32_t)idt << 16));
     asm volatile("lidt %0" : : "m" (idt_operand));
-    put_str("idt_init donw\n");
 }
\ No newline at end of file
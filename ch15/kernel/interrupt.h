@@ -2,7 +2,10 @@
 #define __KERNEL_INTERRUPT_H
 #include "stdint.h"
 typedef void* intr_handler;
+extern void (*intr_eoi)(void);
 void idt_init(void);
+void idt_load(void);
+void pic_disable(void);
 
 // 中断状态
 enum intr_status {
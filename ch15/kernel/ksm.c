@@ -0,0 +1,267 @@
+#include "ksm.h"
+#include "stdint.h"
+#include "global.h"
+#include "debug.h"
+#include "interrupt.h"
+#include "memory.h"
+#include "thread.h"
+#include "timer.h"
+#include "slab.h"
+#include "string.h"
+#include "io.h"
+
+// 同页合并: ksmd线程在后台逐页扫描所有用户进程, 把内容相同的页框合并成一个只读的共享页框,
+// 多余的页框还给内存池. 合并后可写的页和fork后一样是写时复制的, 谁写谁就在缺页异常中分到自己的副本
+//
+// 扫描到的页按内容的哈希先查稳定表, 其中都是已经合并过的页框, 只读所以内容不会再变;
+// 查不到再查不稳定表, 它记录本轮扫描过但还没遇到相同内容的页, 这些页随时可能被改写或释放,
+// 命中后要重新确认页表项和内容, 每轮扫描结束时清空
+//
+// 系统调用和异常都经中断门进入, 处理期间是关中断的, 所以ksmd关中断检查一页时看到的页表总是一致的;
+// ksmd是内核线程, 运行时cr3指向内核页目录, 本处理器的tlb中没有用户页的项, 改页表项不用invlpg;
+// 正在别的处理器上运行的进程的页表项可能缓存在那边的tlb中, task_pte_ptr和task_next_pte对它返回NULL,
+// ksmd既不合并它的页, 也不把它的页当作不稳定表中的合并对象, 等它换下来再说
+
+#define KSM_HASH_BUCKETS 256
+
+// 稳定表和不稳定表的表项
+struct ksm_item {
+   struct ksm_item* next;   // 同一个哈希桶中的下一项
+   uint32_t hash;           // 页框内容的哈希
+   phys_addr_t frame;       // 页框的物理地址
+   pid_t pid;               // 下面两项只用于不稳定表: 页所在的进程和用户虚拟地址
+   uint32_t vaddr;
+};
+
+struct ksm_stat ksm_stat;
+static uint32_t ksm_run;                  // 为0时ksmd阻塞, 默认不扫描
+static uint32_t ksm_pages_to_scan = 64;
+static uint32_t ksm_sleep_ms = 100;
+static struct task_struct* ksmd_thread;
+
+static struct kmem_cache* ksm_item_cache;
+static struct ksm_item* stable_table[KSM_HASH_BUCKETS];
+static struct ksm_item* unstable_table[KSM_HASH_BUCKETS];
+static uint8_t cmp_buf[PG_SIZE];   // kmap只有一个槽位, 比较两个页框时先把其中一个复制到这里
+
+// 上面的统计, 哈希表, cmp_buf和下面的扫描位置都只靠关中断互斥, 多处理器上还依赖大内核锁(见smp.c)
+static pid_t scan_pid;        // 正在扫描的进程, 为0表示新的一轮还没开始
+static uint32_t scan_vaddr;   // 该进程中下一个要检查的用户虚拟地址
+
+// 页框内容的哈希(FNV-1a, 每次取4字节)
+static uint32_t page_hash(phys_addr_t frame) {
+   uint32_t* p = kmap(frame);
+   uint32_t h = 2166136261U;
+   uint32_t idx;
+   for (idx = 0; idx < PG_SIZE / 4; idx++) {
+      h = (h ^ p[idx]) * 16777619U;
+   }
+   kunmap(p);
+   return h;
+}
+
+// 两个页框的内容是否相同
+static bool pages_same(phys_addr_t frame_a, phys_addr_t frame_b) {
+   void* a = kmap(frame_a);
+   memcpy(cmp_buf, a, PG_SIZE);
+   kunmap(a);
+   void* b = kmap(frame_b);
+   bool same = memcmp(cmp_buf, b, PG_SIZE) == 0;
+   kunmap(b);
+   return same;
+}
+
+// 去掉页表项的写权限, 可写的页改为写时复制, 本来只读的页仍然只读
+static pte_t pte_wrprotect(pte_t pte) {
+   if (pte & PG_RW_W) {
+      pte = (pte & ~PG_RW_W) | PG_COW;
+   }
+   return pte;
+}
+
+// 让页表项pte改为映射共享页框frame, 释放原来的页框
+static void pte_merge(pte_t* pte, phys_addr_t frame) {
+   phys_addr_t old_frame = PTE_ADDR(*pte);
+   page_ref_get(frame);
+   *pte = frame | pte_wrprotect(*pte & ~PTE_ADDR_MASK);
+   pfree(old_frame);
+}
+
+// 检查页表项pte映射的页, 能合并就合并, 否则记入不稳定表, 这时用掉*spare; 须关中断调用
+static void scan_page(pte_t* pte, struct ksm_item** spare) {
+   phys_addr_t frame = PTE_ADDR(*pte);
+   if (!page_mergeable(frame)) {
+      return;
+   }
+   uint32_t hash = page_hash(frame);
+   uint32_t bucket = hash % KSM_HASH_BUCKETS;
+
+   /* 稳定表中的页框已被释放或独占的话page_is_ksm为假, 这样的表项留到一轮结束时清理 */
+   struct ksm_item* item = stable_table[bucket];
+   while (item != NULL) {
+      if (item->hash == hash && page_is_ksm(item->frame) && pages_same(item->frame, frame)) {
+         pte_merge(pte, item->frame);
+         return;
+      }
+      item = item->next;
+   }
+
+   /* 不稳定表中的页可能已经被改写, 释放, 甚至连进程都已退出, 都要重新确认 */
+   struct ksm_item** pprev = &unstable_table[bucket];
+   while (*pprev != NULL) {
+      item = *pprev;
+      if (item->hash == hash && item->frame != frame) {
+         struct task_struct* owner = pid2thread(item->pid);
+         pte_t* owner_pte = (owner != NULL && owner->pgdir != NULL) ? task_pte_ptr(owner, item->vaddr) : NULL;
+         if (owner_pte != NULL && (*owner_pte & PG_P_1) && PTE_ADDR(*owner_pte) == item->frame && \
+             page_mergeable(item->frame) && pages_same(item->frame, frame)) {
+            // 对方的页框成为共享页框, 从不稳定表移到稳定表
+            *owner_pte = pte_wrprotect(*owner_pte);
+            page_set_ksm(item->frame);
+            *pprev = item->next;
+            item->next = stable_table[bucket];
+            stable_table[bucket] = item;
+            pte_merge(pte, item->frame);
+            return;
+         }
+      }
+      pprev = &item->next;
+   }
+
+   item = *spare;
+   *spare = NULL;
+   item->hash = hash;
+   item->frame = frame;
+   item->pid = scan_pid;
+   item->vaddr = scan_vaddr;
+   item->next = unstable_table[bucket];
+   unstable_table[bucket] = item;
+}
+
+// 一轮扫描结束: 清空不稳定表, 清理稳定表中已经不再共享的页框
+static void scan_round_end(void) {
+   uint32_t bucket;
+   for (bucket = 0; bucket < KSM_HASH_BUCKETS; bucket++) {
+      struct ksm_item* item = unstable_table[bucket];
+      while (item != NULL) {
+         struct ksm_item* next = item->next;
+         kmem_cache_free(ksm_item_cache, item);
+         item = next;
+      }
+      unstable_table[bucket] = NULL;
+
+      struct ksm_item** pprev = &stable_table[bucket];
+      while (*pprev != NULL) {
+         item = *pprev;
+         if (page_is_ksm(item->frame)) {
+            pprev = &item->next;
+         } else {
+            *pprev = item->next;
+            kmem_cache_free(ksm_item_cache, item);
+         }
+      }
+   }
+   ksm_stat.full_scans++;
+}
+
+// 扫描一批ksm_pages_to_scan个页, 每页单独关一次中断
+static void scan_batch(void) {
+   uint64_t start = rdtsc();
+   struct ksm_item* spare = NULL;
+   uint32_t scanned = 0;
+   while (scanned < ksm_pages_to_scan) {
+      // 表项要在开中断时分配, 分配时可能要等slab的锁
+      if (spare == NULL && (spare = kmem_cache_alloc(ksm_item_cache)) == NULL) {
+         break;
+      }
+      enum intr_status old_status = intr_disable();
+      struct task_struct* proc = scan_pid == 0 ? NULL : pid2thread(scan_pid);
+      pte_t* pte = (proc != NULL && proc->pgdir != NULL) ? task_next_pte(proc, &scan_vaddr) : NULL;
+      if (pte == NULL) {
+         // 这个进程扫完了或者已经退出, 换下一个
+         proc = next_process(scan_pid);
+         scan_pid = proc != NULL ? proc->pid : 0;
+         scan_vaddr = 0;
+         intr_set_status(old_status);
+         if (proc == NULL) {
+            scan_round_end();
+            break;
+         }
+         continue;
+      }
+      scan_page(pte, &spare);
+      scan_vaddr += PG_SIZE;
+      intr_set_status(old_status);
+      scanned++;
+   }
+   if (spare != NULL) {
+      kmem_cache_free(ksm_item_cache, spare);
+   }
+   ksm_stat.pages_scanned += scanned;
+   ksm_stat.scan_cycles += rdtsc() - start;
+}
+
+// ksmd线程: 扫描一批就休眠一会儿, 关掉时阻塞, 由ksm_ctl唤醒
+static void ksmd(void* arg UNUSED) {
+   while (1) {
+      enum intr_status old_status = intr_disable();
+      if (!ksm_run) {
+         thread_block(TASK_BLOCKED);
+      }
+      intr_set_status(old_status);
+      scan_batch();
+      mtime_sleep(ksm_sleep_ms);
+   }
+}
+
+// 设置或查询ksmd, 成功返回0, 命令或参数不对返回-1
+int32_t sys_ksm_ctl(uint32_t cmd, uint32_t arg) {
+   switch (cmd) {
+      case KSM_INFO: {
+         struct ksm_info* info = (struct ksm_info*)arg;
+         info->run = ksm_run;
+         info->pages_to_scan = ksm_pages_to_scan;
+         info->sleep_ms = ksm_sleep_ms;
+         info->pages_shared = ksm_stat.pages_shared;
+         info->pages_saved = ksm_stat.pages_saved;
+         info->pages_scanned = ksm_stat.pages_scanned;
+         info->full_scans = ksm_stat.full_scans;
+         info->scan_kcycles = (uint32_t)(ksm_stat.scan_cycles >> 10);
+         return 0;
+      }
+      case KSM_RUN: {
+         if (arg > 1) {
+            return -1;
+         }
+         enum intr_status old_status = intr_disable();
+         if (arg && !ksm_run && ksmd_thread->status == TASK_BLOCKED) {
+            thread_unblock(ksmd_thread);
+         }
+         ksm_run = arg;
+         intr_set_status(old_status);
+         return 0;
+      }
+      case KSM_PAGES_TO_SCAN:
+         if (arg == 0) {
+            return -1;
+         }
+         ksm_pages_to_scan = arg;
+         return 0;
+      case KSM_SLEEP_MS:
+         if (arg == 0) {
+            return -1;
+         }
+         ksm_sleep_ms = arg;
+         return 0;
+   }
+   return -1;
+}
+
+// 创建表项的对象缓存并启动ksmd
+void ksm_init(void) {
+   ksm_item_cache = kmem_cache_create("ksm_item", sizeof(struct ksm_item), NULL);
+   if (ksm_item_cache == NULL) {
+      PANIC("ksm_init: create cache failed!");
+   }
+   ksmd_thread = thread_start("ksmd", 8, ksmd, NULL);
+}
@@ -0,0 +1,37 @@
+#ifndef __KERNEL_KSM_H
+#define __KERNEL_KSM_H
+#include "stdint.h"
+
+// ksm_ctl的命令
+enum ksm_cmd {
+   KSM_INFO,            // 把当前的设置和统计填到arg指向的struct ksm_info中
+   KSM_RUN,             // arg为1时ksmd开始扫描, 为0时停止; 已经合并的页保持共享
+   KSM_PAGES_TO_SCAN,   // 每批扫描的页数, 即扫描速度
+   KSM_SLEEP_MS         // 两批之间休眠的毫秒数, 和每批的页数一起决定ksmd占用多少cpu
+};
+
+// ksmd的统计, pages_shared和pages_saved由页框的引用计数变化时维护(见memory.c)
+struct ksm_stat {
+   uint32_t pages_shared;    // 合并出来的共享页框数
+   uint32_t pages_saved;     // 合并省下的页框数, 即共享页框多出来的引用数之和
+   uint32_t pages_scanned;   // 累计检查过的页数
+   uint32_t full_scans;      // 扫描完所有进程的轮数
+   uint64_t scan_cycles;     // 扫描花费的时钟周期
+};
+
+// KSM_INFO返回给用户的信息
+struct ksm_info {
+   uint32_t run;
+   uint32_t pages_to_scan;
+   uint32_t sleep_ms;
+   uint32_t pages_shared;
+   uint32_t pages_saved;
+   uint32_t pages_scanned;
+   uint32_t full_scans;
+   uint32_t scan_kcycles;    // 以千个时钟周期为单位
+};
+
+extern struct ksm_stat ksm_stat;
+void ksm_init(void);
+int32_t sys_ksm_ctl(uint32_t cmd, uint32_t arg);
+#endif
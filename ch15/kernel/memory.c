@@ -7,47 +7,138 @@
 #include "string.h"
 #include "sync.h"
 #include "interrupt.h"
+#include "buddy.h"
+#include "slab.h"
+#include "vma.h"
+#include "process.h"
+#include "io.h"
+#include "ksm.h"
+#include "swap.h"
+#include "mmap.h"
+#include "smp.h"
 
 #define PG_SIZE 4096 //页面的大小 = 4096字节 = 4KB
 
-//定义位图地址
-#define MEM_BITMAP_BASE 0xc009a000 
-//此地址映射到物理内存低端1MB的9a000处，
-// 每个进程都有一个PCB，PCB要占用4KB也就是一页大小的内存空间
-// 而且PCB所占的内存必须时自然页，也就是页的起始地址为0xxxxxx000---12位为0；
-// 程序都有个主线程，内核也是一样有个main线程，它一直存在，它也需要一个PCB
-// LOADER.S中，在进入内核前，通过mov esp, 0x9f000作为内核栈顶
-// 而栈在PCB的最顶端， 所以main线程的PCB其实地址是 栈顶指针地址减去一页的大小 = 0x9e00；
-// 也就是说PCB起始地址在 0x9e00
-// 我们需要在卖弄线程的PCB起始地址更低的物理地址上给位图分配地址，下面来看看我们需要分配多大的位图
-// 32MB的内存 需要1024个字节（32MB/4KB = 8KB 个位； 8KB个字节 / 8 = 1024 个字节)的位图，也就是仅仅占用四分之一个页
-// 也就是说，一页可以管理128MB内存，书上使用一个四个页存储位图，也就是说一共可以管理512MB的内存
-// 那么位图的起始位置为PCB页的起始地址减去4个页的大小，就等于9a000
-
-// 0xc0100000是内核从虚拟地址3G起，如果内核要申请额外的堆内存，这是起始地址
-#define K_HEAP_START 0xc0100000
-
-#define PDE_IDX(addr) ((addr & 0xffc00000) >> 22) // 取得高10位，获取页目录表下标
-#define PTE_IDX(addr) ((addr & 0x003ff000) >> 12) // 取得中间10位，注意先屏蔽高10位，获取页表下标
+// loader在低端1MB之上建立了页目录(0x100000)和页表, 原来紧随其后的1MB都留给页表, 改用大页后除第一页外都还给内核池,
+// 第一个(原来第0和第768个页目录项共用的页表)改作kmap的页表
+#define KMAP_PT_PHYADDR 0x101000
+
+#ifdef CONFIG_PAE
+// 第4个页目录(3GB~4GB)中: 前507项是直接映射区, 第507项的2MB留给kmap, 最后4项依次指向4个页目录自身
+#define DIRECT_MAP_PDES 507
+#define KMAP_VADDR 0xff600000
+#define PTE_BASE 0xff800000   // 经最后4项自映射, 所有页表连续地出现在这里
+#define PDE_BASE 0xffffc000   // 4个页目录连续地出现在这里
+// 内核的4个页目录紧接在kmap的页表之后
+#define KERNEL_PD_PHYADDR 0x102000
+#define BOOT_PT_END (KERNEL_PD_PHYADDR + PGDIR_PAGES * PG_SIZE)
+// 可用的物理地址上限, 按36位物理地址算
+#define MAX_PHYS_ADDR (1ULL << 36)
+#else
+// 直接映射区最多用到第1021个页目录项, 第1022个页目录项的4MB留给kmap, 第1023项是页目录自身
+#define DIRECT_MAP_PDES 254
+#define KMAP_VADDR 0xff800000
+#define PTE_BASE 0xffc00000
+#define PDE_BASE 0xfffff000
+#define BOOT_PT_END (KMAP_PT_PHYADDR + PG_SIZE)
+// 最后一页不用, 保证页框的字节地址和内存段的字节长度都不会溢出
+#define MAX_PHYS_ADDR 0xfffff000ULL
+#endif
+
+// loader把int 15h e820返回的ARDS结构存放在0xb0a处, 个数(16位)存放在0xbfe处, 缓冲区最多能放12个
+#define ARDS_BUF_ADDR 0xb0a
+#define ARDS_NR_ADDR 0xbfe
+#define ARDS_MAX 12
+#define ARDS_TYPE_RAM 1   // 操作系统可以使用的内存, 其余类型都是保留的
+
+// 可用内存中内核池所占的百分比, 可以用 make DEFS=-DCONFIG_KERNEL_POOL_PERCENT=25 修改
+// 内核池只能在直接映射区内, 所以内存较大时实际比例会更小
+#ifndef CONFIG_KERNEL_POOL_PERCENT
+#define CONFIG_KERNEL_POOL_PERCENT 50
+#endif
+
+// 预清零页框: 每个内存池储备一些已经清零的页框, 由idle线程在系统空闲时补充,
+// 需要清零页的单页分配先从储备中取, 取不到才当场清零
+#define ZEROED_RESERVE_PAGES 64   // 每个内存池最多储备的页框数
+#define ZEROED_REFILL_BATCH 4     // idle线程每次最多清零的页框数, 清零时开中断, 批与批之间让调度器检查其他任务
+
+// 弹匣最多缓存的块数, 超过后还回去一半; 空了一次取回一半
+#define MAG_CAPACITY 8
+
+// 2KB和4KB的内存块所在的多页arena的大小, 32KB, 分别可放15和7个块
+#define ARENA_SPAN (8 * PG_SIZE)
+#ifdef CONFIG_BENCH
+bool mag_bypass;    // 基准测试置为true时弹匣不缓存, 每次分配释放都要持有内存池的锁, 用来对比
+#define MAG_SIZE (mag_bypass ? 0 : MAG_CAPACITY)
+#define MAG_REFILL_CNT (mag_bypass ? 1 : MAG_CAPACITY / 2)
+#else
+#define MAG_SIZE MAG_CAPACITY
+#define MAG_REFILL_CNT (MAG_CAPACITY / 2)
+#endif
 
 // 内存池结构，生成两个实例用于管理内核池和用户内存池
 // 与虚拟内存管理结构相比，物理池管理结构多了一个pool_size，而虚拟内存管理结构就没有这个属性，因为虚拟地址相对来说是不受限制的
 struct pool {
-    struct bitmap pool_bitmap; //本内存池位图结构，管理物理内存
+    struct buddy_zone zone; //本内存池的伙伴系统，管理物理内存
     uint32_t phy_addr_start; //本内存池所管理物理内存的起始地址
-    uint32_t pool_size; // 本内存池字节容量
+    phys_addr_t pool_size; // 本内存池字节容量, PAE下用户池可以超过4GB
 
     struct lock lock;    
+
+    // 预清零页框的储备, 当作栈使用, 只在关中断时访问, 因为idle线程不能持有会阻塞的锁
+    phys_addr_t zeroed[ZEROED_RESERVE_PAGES];
+    uint32_t zeroed_cnt;
 };
 
 //内核与用户物理池管理结构，都是全局变量，在mem_pool_init中被初始化
 struct pool kernel_pool, user_pool;
 
-struct virtual_addr kernel_vaddr;
+// 直接映射区覆盖的物理内存上限, 其下的物理页都可以用P2V直接访问
+static uint32_t direct_map_end;
+
+// 预清零页框的命中和清零耗时统计, malloc和堆的统计
+// 它们只靠关中断或内存池锁互斥, 多处理器上还依赖大内核锁(见smp.c)
+struct zeroed_page_stat zeroed_stat;
+struct malloc_stat malloc_stat;
+struct heap_frag_stat kernel_heap_stat, user_heap_stat;
+
+// 内核线程使用的cr3, 在direct_map_init中设置
+uint32_t kernel_cr3;
+
+#ifdef CONFIG_PAE
+// 内核线程的页目录指针表, 它的4项依次指向KERNEL_PD_PHYADDR起的4个页目录
+static uint64_t kernel_pdpt[4] __attribute__((aligned(32)));
+// cpu支持NX时为PG_NX, 否则为0, 用来给不可执行的用户页加上NX位
+pte_t pg_nx;
+#endif
+
+// 地址范围描述符, 由bios的int 15h e820子功能返回
+struct ards {
+    uint32_t base_low;
+    uint32_t base_high;
+    uint32_t length_low;
+    uint32_t length_high;
+    uint32_t type;
+};
+
+// 一段可用的物理内存[start_pfn, end_pfn), 以页框号表示, 4GB处的页框号也不会溢出
+struct mem_range {
+    uint32_t start_pfn;
+    uint32_t end_pfn;
+};
+
+// 按起始地址排好序且互不相邻的可用内存段, 它们之间是空洞或保留区
+static struct mem_range mem_ranges[ARDS_MAX];
+static uint32_t mem_range_cnt;
+
+// 共享零页的物理地址, 用户进程首次读尚未分配的页时都映射到这里
+static uint32_t zero_page_phyaddr;
 
 // arena结构的元信息
+// fork出的子进程复制了父进程的堆, 其中的arena归子进程自己的描述符管理, 所以arena只记规格的下标,
+// 用到描述符时按下标在当前任务的描述符数组中找(见heap_descs)
 struct arena {
-   struct mem_block_desc* desc;	 // 此arena关联的mem_block_desc
+   uint32_t desc_idx;	 // 此arena的内存块规格在描述符数组中的下标, 大块内存不用
     // large 为 true 时, cnt 表示的是页框数
     // 否则 cnt 表示空闲的 mem_block 数量
    uint32_t cnt;
@@ -56,90 +147,472 @@ struct arena {
 
 struct mem_block_desc k_block_descs[DESC_CNT];//内核内存块描述，注意这是内核的；不会同进程共享，进程会自己创建一个新的快描述符
 
-static void* vaddr_get(enum pool_flags pf, uint32_t pg_cnt) {
-    int vaddr_start = 0, bit_idx_start = -1;
-    uint32_t cnt = 0;
-    if(pf == PF_KERNEL) { // 内核内存池
-        bit_idx_start = bitmap_scan(&kernel_vaddr.vaddr_bitmap, pg_cnt);
-        if(bit_idx_start == -1) {
-            return NULL;
-        }
-        while(cnt < pg_cnt) {
-            bitmap_set(&kernel_vaddr.vaddr_bitmap, bit_idx_start + cnt++, 1);
-        }
-        vaddr_start = kernel_vaddr.vaddr_start + bit_idx_start * PG_SIZE;
-    } else { // 用户内存池
-        //首先取出PCB
-        struct task_struct* cur = running_thread();
-        bit_idx_start = bitmap_scan(&cur->userprog_vaddr.vaddr_bitmap, pg_cnt);
-        if(bit_idx_start == -1) {
-            return NULL;
-        }
-        while(cnt < pg_cnt) {
-            bitmap_set(&cur->userprog_vaddr.vaddr_bitmap, bit_idx_start+cnt++, 1);
-        }
-        vaddr_start = cur->userprog_vaddr.vaddr_start + bit_idx_start * PG_SIZE;
-        ASSERT((uint32_t)vaddr_start < (0xc0000000 - PG_SIZE));
+// 在当前进程的用户空间中申请pg_cnt页的虚拟地址, 起始地址按align字节对齐
+// 内核内存在直接映射区中, 虚拟地址由物理地址决定, 不需要另外管理
+static void* vaddr_get(enum pool_flags pf, uint32_t pg_cnt, uint32_t align) {
+    ASSERT(pf == PF_USER);
+    //首先取出PCB, 在进程的区域链表中找一段空闲地址, 作为一个新区域加进去
+    struct task_struct* cur = running_thread();
+    uint32_t vaddr_start = vma_get_unmapped(&cur->vma_list, pg_cnt * PG_SIZE, align);
+    if(vaddr_start == 0 || !vma_add(&cur->vma_list, vaddr_start, vaddr_start + pg_cnt * PG_SIZE, VM_HEAP)) {
+        return NULL;
     }
+    ASSERT(vaddr_start < (0xc0000000 - PG_SIZE));
     return (void*)vaddr_start;
 }
 
 // 得到虚拟地址vaddr对应的pte指针
 // 注意得到的pte指针也应该是虚拟地址，但是它现在已经对应一份物理内存了
-// 分成三部分拼凑这个pte指针
-// 首先pte虚拟地址的高10位应该指向第1023个目录项，因为最后一个目录项中的地址存放的是页目录的地址0x100000，这样处理器访问的时候就会认为它在访问页表，单实际上还是在访问页目录表
-    // 1023 = 0x3ff, 右移10位后得0xffc00000，这就是pte虚拟指针的高10位
-// 然后处理器认为虚拟地址的中间10位是页表项索引，但其实它现在要处理的是页目录项索引，这样才能找到页表的物理地址。如何得到页目录项索引?
-    //将虚拟地址的pde索引抽出来就行了， vaddr & 0xffc00000 >> 10
-// 最后处理器认为它现在已经在普通页表中了，但实际上它还在页表中，为了得到页表项的物理地址，首先得知道vaddr的pte索引，然后乘以四，作为pte指针虚拟地址的最后12位
-uint32_t* pte_ptr(uint32_t vaddr) {
-    uint32_t* pte = (uint32_t*) (0xffc00000 + ((vaddr & 0xffc00000) >> 10) + PTE_IDX(vaddr) *4 );
+// 页目录的最后一项(PAE下是第4个页目录的最后4项)指向页目录自己, 处理器经过它访问时会把页目录当作页表,
+// 于是所有页表都按虚拟地址的顺序连续地出现在PTE_BASE处, vaddr的pte就是其中第(vaddr >> 12)项
+    // 非PAE下即 0xffc00000 + (vaddr的pde索引 << 12) + (vaddr的pte索引 * 4)
+// 直接映射区的地址由大页映射, 没有页表, 不能用pte_ptr, 调用前要确认pde不是大页
+pte_t* pte_ptr(uint32_t vaddr) {
+    pte_t* pte = (pte_t*)(PTE_BASE + (vaddr >> 12) * sizeof(pte_t));
     return pte;
 }
 
 //得到虚拟地址vaddr的pde指针
 //pte_ptr和pde_ptr这两个函数中的参数vaddr，可以是已分配、在页表中，也可以是尚未分配，目前页表中不存在的虚拟地址
-uint32_t* pde_ptr(uint32_t vaddr) {
-    uint32_t* pde = (uint32_t*)((0xfffff000) + PDE_IDX(vaddr) * 4);
+// 同理页目录自己也出现在PDE_BASE处
+pte_t* pde_ptr(uint32_t vaddr) {
+    pte_t* pde = (pte_t*)(PDE_BASE + PDE_IDX(vaddr) * sizeof(pte_t));
     return pde;
 }
 
-//在mpool指向的物理内存池中分配1个物理页，成功则返回物理页框的物理地址，失败则返回NULL
-static void* palloc(struct pool* m_pool) {
-    int bit_idx = bitmap_scan(&m_pool->pool_bitmap, 1);
-    if(bit_idx == -1) {
+// 进程pthread是否正在别的处理器上运行. 那个处理器可能在用户态, 不持有大内核锁,
+// tlb中缓存着它的页表项, 这边改了页表项没法让那边的tlb项作废, 也就不能释放或共享原来的页框.
+// 没有用处理器间中断做tlb shootdown: 那边的中断处理要先拿大内核锁, 而发送方正持有它, 等应答会死锁.
+// 进程换下时处理器重新加载cr3, 用户页不是全局页, tlb项随之作废, 所以等它换下来再处理就是安全的
+static bool task_on_other_cpu(struct task_struct* pthread) {
+    return pthread->status == TASK_RUNNING && pthread != running_thread();
+}
+
+// 返回进程pthread中用户虚拟地址vaddr的页表项, 所在的页表不存在时返回NULL
+// 供ksmd, kswapd这样的内核线程访问别的进程的页表, 须关中断调用
+// 正在别的处理器上运行的进程也返回NULL, 调用者改页表项前都经过这里, 见task_on_other_cpu
+pte_t* task_pte_ptr(struct task_struct* pthread, uint32_t vaddr) {
+    uint32_t pde_idx = PDE_IDX(vaddr);
+    if(task_on_other_cpu(pthread)) {
+        return NULL;
+    }
+    if(!(pthread->pde_bitmap[pde_idx / 32] & (1UL << (pde_idx % 32)))) {
+        return NULL;
+    }
+    pte_t* pt = P2V(PTE_ADDR(pthread->pgdir[pde_idx]));
+    return &pt[PTE_IDX(vaddr)];
+}
+
+// 从*vaddr起找进程pthread中下一个存在的页, 找到时*vaddr停在这一页上, 到用户空间末尾都没有返回NULL
+// 正在别的处理器上运行的进程直接返回NULL, 扫描者就跳过它, 下一圈再来. 须关中断调用
+pte_t* task_next_pte(struct task_struct* pthread, uint32_t* vaddr) {
+    if(task_on_other_cpu(pthread)) {
         return NULL;
     }
-    bitmap_set(&m_pool->pool_bitmap, bit_idx, 1);
-    uint32_t page_phyaddr = ((bit_idx * PG_SIZE) + m_pool->phy_addr_start);
-    return (void*)page_phyaddr;
+    while(*vaddr < KERNEL_BASE) {
+        pte_t* pte = task_pte_ptr(pthread, *vaddr);
+        if(pte == NULL) {   // 整个页表都不存在, 跳到下一个页目录项
+            *vaddr = (PDE_IDX(*vaddr) + 1) << PDE_SHIFT;
+            continue;
+        }
+        if(*pte & PG_P_1) {
+            return pte;
+        }
+        *vaddr += PG_SIZE;
+    }
+    return NULL;
+}
+
+//在mpool指向的物理内存池中分配1个物理页，成功则返回物理页框的物理地址，失败则返回0
+//新分配的页框引用计数为1
+static phys_addr_t palloc(struct pool* m_pool) {
+    int32_t pg_idx = buddy_alloc(&m_pool->zone, 0);
+    if(pg_idx == -1) {
+        // 伙伴系统分完了, 预清零的储备也可以当普通页框用
+        enum intr_status old_status = intr_disable();
+        phys_addr_t page_phyaddr = m_pool->zeroed_cnt > 0 ? m_pool->zeroed[--m_pool->zeroed_cnt] : 0;
+        intr_set_status(old_status);
+        return page_phyaddr;
+    }
+    m_pool->zone.mem_map[pg_idx].ref_cnt = 1;
+    phys_addr_t page_phyaddr = (((phys_addr_t)pg_idx * PG_SIZE) + m_pool->phy_addr_start);
+    return page_phyaddr;
+}
+
+// 将物理页框清零, 直接映射区外的页框要临时kmap
+static void page_zero(phys_addr_t pg_phy_addr) {
+    if(pg_phy_addr < direct_map_end) {
+        memset(P2V(pg_phy_addr), 0, PG_SIZE);
+        return;
+    }
+    enum intr_status old_status = intr_disable();
+    void* vaddr = kmap(pg_phy_addr);
+    memset(vaddr, 0, PG_SIZE);
+    kunmap(vaddr);
+    intr_set_status(old_status);
+}
+
+// 在m_pool中分配1个已清零的物理页: 先从预清零的储备中取, 储备为空时分配后当场清零
+// 成功返回物理地址, 失败返回0
+static phys_addr_t palloc_zeroed(struct pool* m_pool) {
+    enum intr_status old_status = intr_disable();
+    if(m_pool->zeroed_cnt > 0) {
+        phys_addr_t page_phyaddr = m_pool->zeroed[--m_pool->zeroed_cnt];
+        zeroed_stat.hits++;
+        intr_set_status(old_status);
+        return page_phyaddr;
+    }
+    zeroed_stat.misses++;
+    intr_set_status(old_status);
+
+    phys_addr_t page_phyaddr = palloc(m_pool);
+    if(page_phyaddr != 0) {
+        uint64_t start = rdtsc();
+        page_zero(page_phyaddr);
+        zeroed_stat.sync_cycles += rdtsc() - start;
+    }
+    return page_phyaddr;
+}
+
+// 为m_pool补充至多batch个预清零的页框, 返回实际补充的个数
+// 清零时开着中断, 分配和入栈都是关中断完成的, 不需要持有内存池的锁
+static uint32_t zeroed_pool_refill(struct pool* m_pool, uint32_t batch) {
+    uint32_t filled = 0;
+    while(filled < batch && m_pool->zeroed_cnt < ZEROED_RESERVE_PAGES) {
+        int32_t pg_idx = buddy_alloc(&m_pool->zone, 0);
+        if(pg_idx == -1) {
+            break;
+        }
+        m_pool->zone.mem_map[pg_idx].ref_cnt = 1;
+        phys_addr_t page_phyaddr = ((phys_addr_t)pg_idx * PG_SIZE) + m_pool->phy_addr_start;
+        uint64_t start = rdtsc();
+        page_zero(page_phyaddr);
+        zeroed_stat.idle_cycles += rdtsc() - start;
+
+        enum intr_status old_status = intr_disable();
+        if(m_pool->zeroed_cnt < ZEROED_RESERVE_PAGES) {
+            m_pool->zeroed[m_pool->zeroed_cnt++] = page_phyaddr;
+        } else {
+            pfree(page_phyaddr);   // 清零期间别人已经补满了
+        }
+        intr_set_status(old_status);
+        filled++;
+    }
+    return filled;
+}
+
+// 由idle线程调用, 给两个内存池补充一小批预清零的页框
+// 返回true表示这次补充了页框, 储备可能还没满, 应该在下次空闲时继续
+bool zeroed_page_refill(void) {
+    uint32_t filled = zeroed_pool_refill(&kernel_pool, ZEROED_REFILL_BATCH);
+    if(filled < ZEROED_REFILL_BATCH) {
+        filled += zeroed_pool_refill(&user_pool, ZEROED_REFILL_BATCH - filled);
+    }
+    return filled > 0;
+}
+
+// 返回两个内存池储备中的预清零页框总数
+uint32_t zeroed_page_cnt(void) {
+    return kernel_pool.zeroed_cnt + user_pool.zeroed_cnt;
+}
+
+// 返回用户内存池中还能分配的页框数, 预清零的储备也算在内
+uint32_t user_pool_free_pages(void) {
+    return user_pool.zone.free_pages + user_pool.zeroed_cnt;
+}
+
+// 为用户页分配页框, 只能在可以阻塞的上下文(缺页异常, 系统调用)中调用
+// 空闲页框不多时唤醒kswapd在后台换出, 已经分不到时当场换出一页再试
+static phys_addr_t user_palloc(bool zeroed) {
+    phys_addr_t page_phyaddr = zeroed ? palloc_zeroed(&user_pool) : palloc(&user_pool);
+    while(page_phyaddr == 0 && swap_out_page()) {
+        page_phyaddr = zeroed ? palloc_zeroed(&user_pool) : palloc(&user_pool);
+    }
+    if(user_pool_free_pages() < SWAP_LOW_PAGES) {
+        kswapd_wakeup();
+    }
+    return page_phyaddr;
+}
+
+// 根据物理地址判断它属于哪个物理内存池
+static struct pool* phy_addr2pool(phys_addr_t pg_phy_addr) {
+    return pg_phy_addr >= user_pool.phy_addr_start ? &user_pool : &kernel_pool;
+}
+
+// 返回物理页框对应的page结构
+static struct page* phy_addr2page(phys_addr_t pg_phy_addr) {
+    struct pool* mem_pool = phy_addr2pool(pg_phy_addr);
+    return &mem_pool->zone.mem_map[(pg_phy_addr - mem_pool->phy_addr_start) / PG_SIZE];
+}
+
+// 增加物理页框的引用计数, 用于多个页表项共享同一页框(写时复制)
+void page_ref_get(phys_addr_t pg_phy_addr) {
+    struct page* pg = phy_addr2page(pg_phy_addr);
+    if(pg->flags & PAGE_RESERVED) {
+        return;
+    }
+    enum intr_status old_status = intr_disable();
+    ASSERT(pg->ref_cnt > 0);
+    pg->ref_cnt++;
+    if(pg->flags & PAGE_KSM) {
+        ksm_stat.pages_saved++;
+    }
+    intr_set_status(old_status);
+}
+
+// 返回物理页框的引用计数
+uint32_t page_ref_cnt(phys_addr_t pg_phy_addr) {
+    return phy_addr2page(pg_phy_addr)->ref_cnt;
+}
+
+// 页框能否被ksmd合并: 只有一个页表项在用的普通用户页框, 共享零页和已经共享的页框都不算
+bool page_mergeable(phys_addr_t pg_phy_addr) {
+    if(pg_phy_addr < user_pool.phy_addr_start) {
+        return false;
+    }
+    struct page* pg = phy_addr2page(pg_phy_addr);
+    return pg->ref_cnt == 1 && !(pg->flags & (PAGE_RESERVED | PAGE_KSM));
+}
+
+// 页框是否是ksmd合并出来的共享页框, 最后一个引用释放或者被写时复制独占后就不再是了
+bool page_is_ksm(phys_addr_t pg_phy_addr) {
+    return (phy_addr2page(pg_phy_addr)->flags & PAGE_KSM) != 0;
+}
+
+// 把页框标记为ksmd合并出来的共享页框, 此后它的引用计数每多1就省下一个页框
+void page_set_ksm(phys_addr_t pg_phy_addr) {
+    struct page* pg = phy_addr2page(pg_phy_addr);
+    ASSERT(!(pg->flags & PAGE_KSM));
+    pg->flags |= PAGE_KSM;
+    ksm_stat.pages_shared++;
+}
+
+// 用户页表的登记: 进程pcb中的pde_bitmap记录哪些用户页目录项存在,
+// 页表页框的page结构中的pt_cnt记录该页表中存在或已换出的页表项个数, 这样进程退出时只需访问存在的页表
+// 内核页表为所有进程共享, 不登记
+
+// 返回页表中存在的页表项个数
+uint32_t page_table_cnt(uint32_t pt_phy_addr) {
+    return phy_addr2page(pt_phy_addr)->pt_cnt;
+}
+
+// 设置页表中存在的页表项个数, fork复制页表时使用
+void page_table_set_cnt(uint32_t pt_phy_addr, uint32_t cnt) {
+    phy_addr2page(pt_phy_addr)->pt_cnt = cnt;
+}
+
+// 批量释放cnt个页框的引用, 只关一次中断
+void pfree_batch(phys_addr_t* pg_phy_addrs, uint32_t cnt) {
+    enum intr_status old_status = intr_disable();
+    uint32_t idx = 0;
+    while(idx < cnt) {
+        pfree(pg_phy_addrs[idx++]);
+    }
+    intr_set_status(old_status);
+}
+
+// 在pf对应的物理内存池中分配pg_cnt个物理上连续的页框, 用pfree_contig整段释放
+// 成功则返回首个页框的物理地址, 失败则返回0
+phys_addr_t palloc_contig(enum pool_flags pf, uint32_t pg_cnt) {
+    struct pool* mem_pool = pf & PF_KERNEL ? &kernel_pool : &user_pool;
+    int32_t pg_idx = buddy_alloc_pages(&mem_pool->zone, pg_cnt);
+    if(pg_idx == -1) {
+        return 0;
+    }
+    uint32_t idx = 0;
+    while(idx < pg_cnt) {
+        mem_pool->zone.mem_map[pg_idx + idx++].ref_cnt = 1;
+    }
+    return (phys_addr_t)pg_idx * PG_SIZE + mem_pool->phy_addr_start;
+}
+
+// 释放palloc_contig分配的pg_cnt个连续页框, 这些页框不能被共享
+// 整段交给伙伴系统, 不必像pfree那样逐页释放再一级级合并
+void pfree_contig(phys_addr_t pg_phy_addr, uint32_t pg_cnt) {
+    struct pool* mem_pool = phy_addr2pool(pg_phy_addr);
+    uint32_t pg_idx = (pg_phy_addr - mem_pool->phy_addr_start) / PG_SIZE;
+    enum intr_status old_status = intr_disable();
+    uint32_t idx = 0;
+    while(idx < pg_cnt) {
+        ASSERT(mem_pool->zone.mem_map[pg_idx + idx].ref_cnt == 1);
+        mem_pool->zone.mem_map[pg_idx + idx++].ref_cnt = 0;
+    }
+    buddy_free_pages(&mem_pool->zone, pg_idx, pg_cnt);
+    intr_set_status(old_status);
+}
+
+// 返回物理页框pg_phy_addr在内核中的虚拟地址
+// 直接映射区内的页直接用P2V; 其外的页临时映射到KMAP_VADDR处,
+// 这样的映射只有一个槽位, 调用者须关中断, 且在kunmap之前不能再次kmap
+// 关中断只挡得住本处理器, 各处理器共用这个槽位, 多处理器上靠大内核锁互斥(见smp.c)
+void* kmap(phys_addr_t pg_phy_addr) {
+    if(pg_phy_addr < direct_map_end) {
+        return P2V(pg_phy_addr);
+    }
+    ASSERT(intr_get_status() == INTR_OFF && (cpu_cnt <= 1 || kernel_lock_held()));
+    pte_t* pte = pte_ptr(KMAP_VADDR);
+    ASSERT(!(*pte & PG_P_1));
+    *pte = pg_phy_addr | PG_G | PG_RW_W | PG_P_1;
+    asm volatile ("invlpg %0"::"m" (*(char*)KMAP_VADDR):"memory");
+    return (void*)KMAP_VADDR;
+}
+
+// 解除kmap建立的临时映射
+void kunmap(void* vaddr) {
+    if((uint32_t)vaddr != KMAP_VADDR) {
+        return;   // 直接映射区的地址无须解除
+    }
+    *pte_ptr(KMAP_VADDR) = 0;
+    asm volatile ("invlpg %0"::"m" (*(char*)KMAP_VADDR):"memory");
+}
+
+// 把设备寄存器所在的物理页映射到kmap页表中kmap槽位之后的空闲项上, 返回paddr对应的虚拟地址
+// 这样的映射在所有进程中都有效, 建立后不再解除; 设备寄存器不能缓存, 页表项带PG_PCD和PG_PWT
+void* mmio_map(phys_addr_t paddr) {
+    static uint32_t mmio_slot = 1;   // 第0项是kmap的槽位
+    ASSERT(mmio_slot < PG_SIZE / sizeof(pte_t));
+    uint32_t vaddr = KMAP_VADDR + mmio_slot++ * PG_SIZE;
+    *pte_ptr(vaddr) = (paddr & ~(phys_addr_t)(PG_SIZE - 1)) | PG_PCD | PG_PWT | PG_G | PG_RW_W | PG_P_1;
+    asm volatile ("invlpg %0"::"m" (*(char*)vaddr):"memory");
+    return (void*)(vaddr + ((uint32_t)paddr & (PG_SIZE - 1)));
+}
+
+// 临时恢复(enable为true)或去掉低端的恒等映射, 只改内核的页目录, 要在内核线程中调用
+// AP从实模式开启分页时还在低端的物理地址上执行, 启动AP期间要有这个映射(见smp.c)
+void identity_map_low(bool enable) {
+    *pde_ptr(0) = enable ? PG_PS | PG_RW_W | PG_P_1 : 0;
+    uint32_t cr3;
+    asm volatile ("movl %%cr3, %0" : "=r" (cr3));
+    asm volatile ("movl %0, %%cr3" : : "r" (cr3) : "memory");
+}
+
+// 处理对写时复制页的写操作, 成功返回true
+// 页框只剩当前进程在用时直接恢复可写, 否则复制出一个新页框给当前进程独占
+// 共享零页总是要复制的
+bool cow_page_fault(uint32_t vaddr) {
+    pte_t* pde = pde_ptr(vaddr);
+    pte_t* pte = pte_ptr(vaddr);
+    if(!(*pde & PG_P_1) || (*pte & (PG_P_1 | PG_COW)) != (PG_P_1 | PG_COW)) {
+        return false;
+    }
+    pte_t old_pte = *pte;
+    phys_addr_t old_phyaddr = PTE_ADDR(old_pte);
+    pte_t flags = (old_pte & ~PTE_ADDR_MASK & ~PG_COW) | PG_RW_W;   // 保留NX等属性位
+    if(old_phyaddr != zero_page_phyaddr && page_ref_cnt(old_phyaddr) == 1) {
+        struct page* pg = phy_addr2page(old_phyaddr);
+        if(pg->flags & PAGE_KSM) {   // 合并过的页框只剩这一个引用, 变回普通页框
+            pg->flags &= ~PAGE_KSM;
+            ksm_stat.pages_shared--;
+        }
+        *pte = old_phyaddr | flags;
+    } else {
+        phys_addr_t new_phyaddr = user_palloc(false);
+        if(new_phyaddr == 0) {
+            return false;
+        }
+        if(*pte != old_pte) {   // 分配时换出过页, 期间页表项被kswapd或ksmd改了, 回去重新访问一次
+            pfree(new_phyaddr);
+            return true;
+        }
+        // 旧页框仍映射在vaddr处(只读), 从这里复制到新页框
+        void* dst = kmap(new_phyaddr);
+        memcpy(dst, (void*)(vaddr & 0xfffff000), PG_SIZE);
+        kunmap(dst);
+        pfree(old_phyaddr);
+        *pte = new_phyaddr | flags;
+    }
+    asm volatile ("invlpg %0"::"m" (*(char*)vaddr):"memory");
+    return true;
 }
 
 // 在页表中添加虚拟地址_vaddr与物理地址page-phyaddr映射 --- 就是在页表项和页表中填上相应的物理地址
-static void page_table_add(void* _vaddr, void* _page_phyaddr) {
-    uint32_t vaddr = (uint32_t)_vaddr, page_phyaddr = (uint32_t)_page_phyaddr;
-    uint32_t* pde = pde_ptr(vaddr);
-    uint32_t* pte = pte_ptr(vaddr);
+// 只用于用户空间, 内核空间都在直接映射区中
+static void page_table_add(void* _vaddr, phys_addr_t page_phyaddr) {
+    uint32_t vaddr = (uint32_t)_vaddr;
+    pte_t* pde = pde_ptr(vaddr);
+    pte_t* pte = pte_ptr(vaddr);
+    ASSERT(vaddr < KERNEL_BASE);
     
     if(*pde & 0x00000001) { // 页目录项存在
         ASSERT(!(*pte & 0x00000001));
 
+        if(*pte & PG_SWAP) {   // 换出过的旧内容不要了, 这个页表项已经算在页表的pt_cnt中
+            swap_free(SWAP_SLOT(*pte));
+            *pte = (page_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
+            return;
+        }
         if(!(*pte & 0x00000001)) {
             *pte = (page_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
         } else {
             PANIC("pte repeat");
         }
     } else { // 页目录项不存在
-        // 页表中用到的页框一律从内核空间分配        
-        uint32_t pde_phyaddr = (uint32_t)palloc(&kernel_pool);
+        // 页表中用到的页框一律从内核空间分配, 新页表要全部清零
+        uint32_t pde_phyaddr = (uint32_t)palloc_zeroed(&kernel_pool);
 
         *pde = (pde_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
-
-        memset((void*)((int)pte & 0xfffff000), 0, PG_SIZE);
+        uint32_t* pde_bitmap = running_thread()->pde_bitmap;
+        pde_bitmap[PDE_IDX(vaddr) / 32] |= 1UL << (PDE_IDX(vaddr) % 32);
+        page_table_set_cnt(pde_phyaddr, 0);
 
         ASSERT(!(*pte & 0x00000001));
         *pte = (page_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
     }
+    phy_addr2page(PTE_ADDR(*pde))->pt_cnt++;
+}
+
+// 处理对已经用vaddr_get保留、但还没有映射物理页的用户地址的访问, 成功返回true
+// 读操作只映射只读的共享零页(写时复制), 写操作才从user_pool中分配一个清零的页框
+// 已换出的页从交换分区读回, 页表项的属性不变; mmap映射文件的页从文件读入, 只读
+bool demand_page_fault(uint32_t vaddr, bool write) {
+    struct vm_area* vma = vma_find(&running_thread()->vma_list, vaddr);
+    if(vma == NULL || (write && (vma->vm_flags & VM_RDONLY))) {
+        return false;   // 地址没有被保留或者写只读区域, 是非法访问
+    }
+    pte_t* pde = pde_ptr(vaddr);
+    pte_t* pte = pte_ptr(vaddr);
+    if((*pde & PG_P_1) && (*pte & PG_P_1)) {
+        return false;
+    }
+    vaddr &= 0xfffff000;
+    if((*pde & PG_P_1) && (*pte & PG_SWAP)) {
+        pte_t entry = *pte;
+        phys_addr_t page_phyaddr = user_palloc(false);
+        if(page_phyaddr == 0) {
+            return false;
+        }
+        swap_read(SWAP_SLOT(entry), page_phyaddr);
+        // 只有进程自己会改换出的页表项, 读盘期间它不会变
+        ASSERT(*pte == entry);
+        *pte = page_phyaddr | (entry & ~PTE_ADDR_MASK & ~PG_SWAP) | PG_P_1;
+        swap_free(SWAP_SLOT(entry));
+        return true;
+    }
+    if(vma->vm_inode != NULL) {
+        phys_addr_t page_phyaddr = user_palloc(false);
+        if(page_phyaddr == 0) {
+            return false;
+        }
+        if(!mmap_file_read(vma, vaddr, page_phyaddr)) {
+            pfree(page_phyaddr);
+            return false;
+        }
+        page_table_add((void*)vaddr, page_phyaddr);
+        *pte &= ~PG_RW_W;
+        return true;
+    }
+    if(!write) {
+        // 只读区域的页永远不会被写, 不用写时复制
+        page_table_add((void*)vaddr, zero_page_phyaddr);
+        *pte = zero_page_phyaddr | PG_US_U | (vma->vm_flags & VM_RDONLY ? 0 : PG_COW) | PG_P_1;
+        return true;
+    }
+    phys_addr_t page_phyaddr = user_palloc(true);
+    if(page_phyaddr == 0) {
+        return false;
+    }
+    page_table_add((void*)vaddr, page_phyaddr);
+    return true;
 }
 
   //分配 pg_cnt 个页空间, 成功则返回起始虚拟地址, 失败时返回 NULL
@@ -147,33 +620,15 @@ void* malloc_page(enum pool_flags pf, uint32_t pg_cnt) {
     // 内核和用户空间各约16MB的空间（内存一共配置了32MB大小），保守起见，用15MB来限制
     ASSERT(pg_cnt > 0 && pg_cnt <3840);
 
-    //1. 通过 vaddr_get 在虚拟内存池中申请虚拟地址
-    //2. 通过palloc在物理内存池中申请物理页
-    //3. 通过pege_table_add 将以上得到的虚拟地址和物理地址在页表中完成映射
-    // 注意，1.2.两步得到的虚拟地址都是页对齐的，最后12位都是0
-    void* vaddr_start = vaddr_get(pf, pg_cnt);
-
-    if( vaddr_start == NULL) {
-        return NULL;
+    // 内核内存: 向伙伴系统要pg_cnt个物理上连续的页, 它们在直接映射区中的虚拟地址自然也是连续的,
+    // 不用申请虚拟地址, 也不用改页表. 释放时由mfree_page用pfree_contig整段还回去
+    if(pf == PF_KERNEL) {
+        uint32_t page_phyaddr = palloc_contig(PF_KERNEL, pg_cnt);
+        return page_phyaddr == 0 ? NULL : P2V(page_phyaddr);
     }
 
-    uint32_t vaddr = (uint32_t) vaddr_start, cnt = pg_cnt;
-    struct pool* mem_pool = pf & PF_KERNEL ? &kernel_pool : &user_pool;
-
-    //虚拟地址连续，但是物理地址可以不连续，所以逐个做映射
-    while(cnt-- > 0){
-        void* page_phyaddr = palloc(mem_pool);
-
-        //分配物理页
-        if(page_phyaddr == NULL) {//如果内存池中没有空间了，就会返回null
-            //TODO. 失败时要将全部的页滚回
-             return NULL;
-        }
-
-        page_table_add((void*)vaddr, page_phyaddr);//物理页与虚拟页做匹配
-        vaddr += PG_SIZE; //vaddr写到一个虚拟页面，虚拟地址是连续的，所以可以直接像这样加
-    }
-    return vaddr_start;
+    // 用户内存只保留虚拟地址, 物理页在第一次访问时由缺页异常分配(见demand_page_fault)
+    return vaddr_get(pf, pg_cnt, PG_SIZE);
 }
 
 
@@ -181,21 +636,33 @@ void* malloc_page(enum pool_flags pf, uint32_t pg_cnt) {
 //成功则返回对应的页的起始虚拟地址
 // 从内核物理内存池中申请 1 页内存
 // 成功则返回其虚拟地址, 失败则返回 NULL
+// 得到的内存已清零: 单页从预清零的储备中取, 多页在释放锁之后再清零
 void* get_kernel_pages(uint32_t pg_cnt) {
+    if(pg_cnt == 1) {
+        phys_addr_t page_phyaddr = palloc_zeroed(&kernel_pool);
+        return page_phyaddr == 0 ? NULL : P2V(page_phyaddr);
+    }
     lock_acquire(&kernel_pool.lock);
     void* vaddr = malloc_page(PF_KERNEL, pg_cnt);
+    lock_release(&kernel_pool.lock);
     if(vaddr != NULL) {
         memset(vaddr, 0, pg_cnt*PG_SIZE);
     }
-    lock_release(&kernel_pool.lock);
     return vaddr;
 }
 
+// 释放get_kernel_pages申请的pg_cnt页内核内存
+void free_kernel_pages(void* vaddr, uint32_t pg_cnt) {
+    lock_acquire(&kernel_pool.lock);
+    mfree_page(PF_KERNEL, vaddr, pg_cnt);
+    lock_release(&kernel_pool.lock);
+}
+
 // 在用户空间中申请 4k 内存, 并返回其虚拟地址
+// 只保留虚拟地址, 页在第一次访问时才分配, 读到的内容总是0
 void* get_user_pages(uint32_t pg_cnt) {
     lock_acquire(&user_pool.lock);
     void* vaddr = malloc_page(PF_USER, pg_cnt);
-    memset(vaddr, 0, pg_cnt*PG_SIZE);
     lock_release(&user_pool.lock);
     return vaddr;
 }
@@ -206,26 +673,24 @@ void* get_user_pages(uint32_t pg_cnt) {
 void* get_a_page(enum pool_flags pf, uint32_t vaddr) {
     struct pool* mem_pool = pf & PF_KERNEL ? &kernel_pool : &user_pool;
     lock_acquire(&mem_pool->lock);
-    // 先将虚拟地址对应的位图置 1
+    // 先保留虚拟地址
     struct task_struct* cur = running_thread();
-    int32_t bit_idx = -1;
     
     if(cur->pgdir != NULL && pf == PF_USER) {
-        // 若当前是用户进程申请用户内存, 就修改用户进程自己的虚拟地址位图
-        bit_idx = (vaddr - cur->userprog_vaddr.vaddr_start) / PG_SIZE;
-        ASSERT(bit_idx > 0);
-        bitmap_set(&cur->userprog_vaddr.vaddr_bitmap, bit_idx, 1);
-    } else if(cur->pgdir == NULL && pf == PF_KERNEL) {
-        // 如果是内核线程申请内核内存, 就修改 kernel_vaddr
-        bit_idx = (vaddr - kernel_vaddr.vaddr_start) / PG_SIZE;
-        ASSERT(bit_idx > 0);
-        bitmap_set(&kernel_vaddr.vaddr_bitmap, bit_idx, 1);
+        // 若当前是用户进程申请用户内存, 就加到用户进程自己的区域链表中
+        ASSERT(vaddr >= USER_VADDR_START);
+        if(!vma_add(&cur->vma_list, vaddr, vaddr + PG_SIZE, VM_FIXED)) {
+            lock_release(&mem_pool->lock);
+            return NULL;
+        }
     } else {
-        PANIC("get_a_page: not allow kernel alloc userspace or user alloc kernelspace by get_a_page");
+        // 内核内存都在直接映射区中, 地址由物理页决定, 不能指定
+        PANIC("get_a_page: only user process can alloc userspace by get_a_page");
     }
 
-    void* page_phyaddr = palloc(mem_pool);
-    if(page_phyaddr == NULL) {
+    phys_addr_t page_phyaddr = user_palloc(false);
+    if(page_phyaddr == 0) {
+        lock_release(&mem_pool->lock);
         return NULL;
     }
     page_table_add((void*)vaddr, page_phyaddr);
@@ -233,43 +698,276 @@ void* get_a_page(enum pool_flags pf, uint32_t vaddr) {
     return (void*)vaddr;
 }
 
-/* 安装1页大小的vaddr,专门针对fork时虚拟地址位图无须操作的情况 */
-void* get_a_page_without_opvaddrbitmap(enum pool_flags pf, uint32_t vaddr) {
-   struct pool* mem_pool = pf & PF_KERNEL ? &kernel_pool : &user_pool;
-   lock_acquire(&mem_pool->lock);
-   void* page_phyaddr = palloc(mem_pool);
-   if (page_phyaddr == NULL) {
-      lock_release(&mem_pool->lock);
-      return NULL;
-   }
-   page_table_add((void*)vaddr, page_phyaddr); 
-   lock_release(&mem_pool->lock);
-   return (void*)vaddr;
+#define MAP_GAPS_MAX 8   // map_user_pages的范围内最多允许几段还没有区域的地址
+
+// 把当前进程用户空间[vaddr, vaddr + pg_cnt * PG_SIZE)中还不存在的页都映射上页框, 页表项属性为attr | PG_P_1
+// 已经存在的页保持不变, 新页的内容不确定, 由调用者填写. 成功返回true
+// 分两步完成: 先补上缺少的区域, 数出要分配的页框和页表, 确认两个内存池都够用(用户页框不够时当场换出);
+// 再在同一段关中断期间分好全部页框并填好页表, 每个页目录项只定位一次页表, 这一步不会失败.
+// 所以页框不够时只需撤销补上的区域, 不会留下映射了一半的页
+bool map_user_pages(uint32_t vaddr, uint32_t pg_cnt, pte_t attr) {
+    uint32_t end = vaddr + pg_cnt * PG_SIZE;
+    struct task_struct* cur = running_thread();
+    ASSERT(cur->pgdir != NULL && vaddr % PG_SIZE == 0 && vaddr >= USER_VADDR_START);
+    ASSERT(pg_cnt > 0 && end > vaddr && end <= KERNEL_BASE);
+    lock_acquire(&user_pool.lock);
+
+    /* 保留: 记下还没有区域的地址段, 数出要分配的页框和页表 */
+    struct { uint32_t start, end; } gaps[MAP_GAPS_MAX];
+    uint32_t gap_cnt = 0;
+    uint32_t pg_need = 0, pt_need = 0;
+    uint32_t addr;
+    for(addr = vaddr; addr < end; addr += PG_SIZE) {
+        if(vma_find(&cur->vma_list, addr) == NULL) {
+            if(gap_cnt > 0 && gaps[gap_cnt - 1].end == addr) {
+                gaps[gap_cnt - 1].end += PG_SIZE;
+            } else if(gap_cnt < MAP_GAPS_MAX) {
+                gaps[gap_cnt].start = addr;
+                gaps[gap_cnt].end = addr + PG_SIZE;
+                gap_cnt++;
+            } else {
+                lock_release(&user_pool.lock);
+                return false;
+            }
+        }
+        // 页目录项不存在时不能读页表项
+        if(!(*pde_ptr(addr) & PG_P_1)) {
+            if(addr == vaddr || PTE_IDX(addr) == 0) {
+                pt_need++;
+            }
+            pg_need++;
+        } else if(!(*pte_ptr(addr) & PG_P_1)) {
+            pg_need++;
+        }
+    }
+    uint32_t added = 0;
+    while(added < gap_cnt && vma_add(&cur->vma_list, gaps[added].start, gaps[added].end, VM_FIXED)) {
+        added++;
+    }
+    bool ok = added == gap_cnt;
+
+    // 换出只能腾出用户页框, 页表用的内核页框不够就只能失败
+    enum intr_status old_status = intr_disable();
+    while(ok && user_pool_free_pages() < pg_need) {
+        intr_set_status(old_status);
+        ok = swap_out_page();
+        old_status = intr_disable();
+    }
+    if(!ok || kernel_pool.zone.free_pages + kernel_pool.zeroed_cnt < pt_need) {
+        intr_set_status(old_status);
+        while(added > 0) {
+            added--;
+            vma_remove(&cur->vma_list, gaps[added].start, gaps[added].end);
+        }
+        lock_release(&user_pool.lock);
+        return false;
+    }
+
+    /* 提交: 从这里到开中断, 别人分不走页框, 下面的分配都会成功 */
+    addr = vaddr;
+    while(addr < end) {
+        pte_t* pde = pde_ptr(addr);
+        if(!(*pde & PG_P_1)) {
+            // 页表中用到的页框一律从内核空间分配, 新页表要全部清零
+            uint32_t pt_phyaddr = (uint32_t)palloc_zeroed(&kernel_pool);
+            *pde = (pt_phyaddr | PG_US_U | PG_RW_W | PG_P_1);
+            cur->pde_bitmap[PDE_IDX(addr) / 32] |= 1UL << (PDE_IDX(addr) % 32);
+            page_table_set_cnt(pt_phyaddr, 0);
+        }
+        struct page* pt = phy_addr2page(PTE_ADDR(*pde));
+        uint32_t pde_end = (PDE_IDX(addr) + 1) << PDE_SHIFT;
+        pte_t* pte = pte_ptr(addr);
+        for(; addr < end && addr < pde_end; addr += PG_SIZE, pte++) {
+            if(*pte & PG_P_1) {
+                continue;
+            }
+            if(*pte & PG_SWAP) {   // 换出过的旧内容不要了, 这个页表项已经算在页表的pt_cnt中
+                swap_free(SWAP_SLOT(*pte));
+            } else {
+                pt->pt_cnt++;
+            }
+            *pte = palloc(&user_pool) | attr | PG_P_1;
+        }
+    }
+    intr_set_status(old_status);
+    if(user_pool_free_pages() < SWAP_LOW_PAGES) {
+        kswapd_wakeup();
+    }
+    lock_release(&user_pool.lock);
+    return true;
 }
 
 //将虚拟地址转化为物理地址
 //  对vaddr相应的pte指针解引用，然后取结果的前二十位， 再加上vaddr后十二位即可得到物理地址
-uint32_t addr_v2p(uint32_t vaddr) {
-    uint32_t* pte = pte_ptr(vaddr);
-    return ((*pte & 0xfffff000) + (vaddr & 0x00000fff));
+//  若pde是大页, 则取pde中大页的地址, 再加上vaddr在大页内的偏移
+phys_addr_t addr_v2p(uint32_t vaddr) {
+    pte_t* pde = pde_ptr(vaddr);
+    if(*pde & PG_PS) {
+        return ((*pde & PTE_ADDR_MASK & ~(pte_t)(PDE_SPAN - 1)) + (vaddr & (PDE_SPAN - 1)));
+    }
+    pte_t* pte = pte_ptr(vaddr);
+    return (PTE_ADDR(*pte) + (vaddr & 0x00000fff));
 }
 
-// 返回 arena 中第 idx 个内存块的地址
-static struct mem_block* arena2block(struct arena* a, uint32_t idx) {
-    //要跳过arena的元信息
-  return (struct mem_block*)((uint32_t)a + sizeof(struct arena) + idx * a->desc->block_size);
+// 返回 arena 中第 idx 个内存块的地址, desc是arena的描述符
+static struct mem_block* arena2block(struct mem_block_desc* desc, struct arena* a, uint32_t idx) {
+    //要跳过arena的元信息; 多页arena中的块按块大小对齐, 元信息占掉第一个块的位置
+    if (desc->arena_pages > 1) {
+        return (struct mem_block*)((uint32_t)a + (idx + 1) * desc->block_size);
+    }
+  return (struct mem_block*)((uint32_t)a + sizeof(struct arena) + idx * desc->block_size);
 }
 
 // 返回内存块b所在的arena地址
+// 单页arena和大块内存中的块都紧跟在12字节的元信息之后, 块大小又是16的倍数, 所以页内偏移总是16n+12;
+// 页内偏移为2048的倍数的只能是多页arena中的块, arena按ARENA_SPAN对齐, 据此找到元信息
 static struct arena* block2arena(struct mem_block* b) {
-   return (struct arena*)((uint32_t)b & 0xfffff000);
+   uint32_t addr = (uint32_t)b;
+   if (addr & (PG_SIZE / 2 - 1)) {
+      return (struct arena*)(addr & 0xfffff000);
+   }
+   // 内核的多页arena是伙伴系统分配的块, 只是相对内核池的起始地址对齐
+   uint32_t base = addr >= KERNEL_BASE ? (uint32_t)P2V(kernel_pool.phy_addr_start) : 0;
+   return (struct arena*)(base + ((addr - base) & ~(ARENA_SPAN - 1)));
+}
+
+// 为arena申请页框, 多页的arena要按ARENA_SPAN对齐
+static struct arena* arena_pages_get(enum pool_flags PF, uint32_t pg_cnt) {
+   if (PF == PF_USER && pg_cnt > 1) {
+      return vaddr_get(PF, pg_cnt, ARENA_SPAN);
+   }
+   return malloc_page(PF, pg_cnt);   // 伙伴系统分配的块本身就是对齐的
+}
+
+static struct heap_frag_stat* heap_stat(enum pool_flags PF) {
+   return PF == PF_KERNEL ? &kernel_heap_stat : &user_heap_stat;
+}
+
+// 当前任务所用的内存块描述符数组: 内核线程共用k_block_descs, 进程用自己pcb中的
+// fork时子进程的描述符随pcb从父进程复制过来, free_list两端的块还连着父进程pcb中的头尾结点,
+// 在子进程中第一次用到时才接到自己的头尾上, 因为这两个块在子进程中要写时复制
+static struct mem_block_desc* heap_descs(enum pool_flags PF, uint32_t desc_idx) {
+   if (PF == PF_KERNEL) {
+      return &k_block_descs[desc_idx];
+   }
+   struct mem_block_desc* desc = &running_thread()->u_block_desc[desc_idx];
+   struct list* plist = &desc->free_list;
+   if ((uint32_t)plist->head.next >= KERNEL_BASE) {
+      if (plist->head.next != &plist->tail) {   // 父进程的空链表, 指向的是父进程的尾结点
+         list_init(plist);
+      }
+   } else if (plist->head.next->prev != &plist->head) {
+      plist->head.next->prev = &plist->head;
+      plist->tail.prev->next = &plist->tail;
+   }
+   return desc;
+}
+
+// 获取内存池的锁, 顺便统计争用: 锁已被别的任务持有, 当前任务就要阻塞等待
+static void pool_lock_acquire(struct pool* m_pool) {
+   struct task_struct* holder = m_pool->lock.holder;
+   malloc_stat.lock_acquires++;
+   if (holder != NULL && holder != running_thread()) {
+      malloc_stat.lock_contended++;
+   }
+   lock_acquire(&m_pool->lock);
+}
+
+static void mag_push(struct mem_magazine* mag, struct mem_block* b) {
+   b->free_elem.next = mag->top;
+   mag->top = &b->free_elem;
+   mag->cnt++;
+}
+
+static struct mem_block* mag_pop(struct mem_magazine* mag) {
+   struct list_elem* elem = mag->top;
+   mag->top = elem->next;
+   mag->cnt--;
+   return elem2entry(struct mem_block, free_elem, elem);
+}
+
+// 持有锁时从第desc_idx种规格的free_list中取blk_cnt个块装进弹匣, free_list空了就新建arena, 返回弹匣中的块数
+static uint32_t mag_refill(enum pool_flags PF, struct pool* mem_pool, uint32_t desc_idx, \
+                           struct mem_magazine* mag, uint32_t blk_cnt) {
+   struct arena* a;
+   struct mem_block* b;
+   pool_lock_acquire(mem_pool);
+   struct mem_block_desc* desc = heap_descs(PF, desc_idx);
+   while (blk_cnt-- > 0) {
+   /* 若mem_block_desc的free_list中已经没有可用的mem_block,
+    * 就创建新的arena提供mem_block */
+      if (list_empty(&desc->free_list)) {
+        a = arena_pages_get(PF, desc->arena_pages);       // 分配页框做为arena
+        if (a == NULL) {
+            break;
+        }
+        heap_stat(PF)->arena_pages += desc->arena_pages;
+        // 不用清零整页, 内存块在分配出去时才逐个清零
+
+        /* 对于分配的小块内存,将desc置为相应内存块描述符, 
+        * cnt置为此arena可用的内存块数,large置为false */
+        a->desc_idx = desc_idx;
+        a->large = false;
+        a->cnt = desc->blocks_per_arena;
+        desc->arena_cnt++;
+        desc->free_cnt += desc->blocks_per_arena;
+        uint32_t block_idx;
+
+        enum intr_status old_status = intr_disable();
+
+        /* 开始将arena拆分成内存块,并添加到内存块描述符的free_list中 */
+        for (block_idx = 0; block_idx < desc->blocks_per_arena; block_idx++) {
+            b = arena2block(desc, a, block_idx);
+            ASSERT(!elem_find(&desc->free_list, &b->free_elem));
+            list_append(&desc->free_list, &b->free_elem);	
+        }
+        intr_set_status(old_status);
+      }
+      // 在弹匣中的块对arena来说就是已分配出去的
+      b = elem2entry(struct mem_block, free_elem, list_pop(&desc->free_list));
+      desc->free_cnt--;
+      a = block2arena(b);  // 获取内存块b所在的arena
+      a->cnt--;		   // 将此arena中的空闲内存块数减1
+      mag_push(mag, b);
+   }
+   lock_release(&mem_pool->lock);
+   return mag->cnt;
+}
+
+// 持有锁时把弹匣中的块还给各自arena的free_list, 只留下keep个;
+// arena中的块都空闲了, 就释放arena所在的页框
+static void mag_flush(enum pool_flags PF, struct pool* mem_pool, struct mem_magazine* mag, uint32_t keep) {
+   pool_lock_acquire(mem_pool);
+   while (mag->cnt > keep) {
+      struct mem_block* b = mag_pop(mag);
+      struct arena* a = block2arena(b);
+      struct mem_block_desc* desc = heap_descs(PF, a->desc_idx);
+      //先将内存块回收到free_list
+      list_append(&desc->free_list, &b->free_elem);
+      desc->free_cnt++;
+
+      //再判断此arena中的内存块是否都空闲，如果是的话就是放arena对应的物理页框，但在这之前，要将对饮描述符的空闲链表中的对应元素删除掉
+      if (++a->cnt == desc->blocks_per_arena) {
+         uint32_t block_idx;
+         for (block_idx = 0; block_idx < desc->blocks_per_arena; block_idx++) {
+            struct mem_block*  b = arena2block(desc, a, block_idx);
+            ASSERT(elem_find(&desc->free_list, &b->free_elem));
+            list_remove(&b->free_elem);//将内存块从对应的描述符的空闲链表中删除
+         }
+         desc->arena_cnt--;
+         desc->free_cnt -= desc->blocks_per_arena;
+         heap_stat(PF)->arena_pages -= desc->arena_pages;
+         mfree_page(PF, a, desc->arena_pages); 
+      } 
+   }
+   lock_release(&mem_pool->lock);
 }
 
 /* 在堆中申请size字节内存 */
 void* sys_malloc(uint32_t size) {
    enum pool_flags PF;
    struct pool* mem_pool;
-   uint32_t pool_size;
+   phys_addr_t pool_size;
    struct mem_block_desc* descs;
    struct task_struct* cur_thread = running_thread();
 
@@ -292,28 +990,10 @@ void* sys_malloc(uint32_t size) {
    }
    struct arena* a;
    struct mem_block* b;	
-   lock_acquire(&mem_pool->lock);
-
-/* 超过最大内存块1024, 就分配页框 */
-   if (size > 1024) {
-      uint32_t page_cnt = DIV_ROUND_UP(size + sizeof(struct arena), PG_SIZE);    // 向上取整需要的页框数
+   struct heap_frag_stat* hs = heap_stat(PF);
 
-      a = malloc_page(PF, page_cnt);
-
-      if (a != NULL) {
-        memset(a, 0, page_cnt * PG_SIZE);	 // 将分配的内存清0  
-
-        /* 对于分配的大块页框,将desc置为NULL, cnt置为页框数,large置为true */
-        a->desc = NULL;
-        a->cnt = page_cnt;
-        a->large = true;
-        lock_release(&mem_pool->lock);
-        return (void*)(a + 1);		 // 跨过arena大小，把剩下的内存返回
-      } else { 
-        lock_release(&mem_pool->lock);
-        return NULL; 
-      }
-   } else {    // 若申请的内存小于等于1024,可在各种规格的mem_block_desc中去适配
+/* 不超过最大内存块4096, 在各种规格的mem_block_desc中去适配 */
+   if (size <= descs[DESC_CNT - 1].block_size) {
       uint8_t desc_idx;
       
       /* 从内存块描述符中匹配合适的内存块规格 */
@@ -323,138 +1003,144 @@ void* sys_malloc(uint32_t size) {
         }
       }
 
-   /* 若mem_block_desc的free_list中已经没有可用的mem_block,
-    * 就创建新的arena提供mem_block */
-      if (list_empty(&descs[desc_idx].free_list)) {
-        a = malloc_page(PF, 1);       // 分配1页框做为arena
-        if (a == NULL) {
-            lock_release(&mem_pool->lock);
-            return NULL;
-        }
-        memset(a, 0, PG_SIZE);
-
-        /* 对于分配的小块内存,将desc置为相应内存块描述符, 
-        * cnt置为此arena可用的内存块数,large置为false */
-        a->desc = &descs[desc_idx];
-        a->large = false;
-        a->cnt = descs[desc_idx].blocks_per_arena;
-        uint32_t block_idx;
-
-        enum intr_status old_status = intr_disable();
-
-        /* 开始将arena拆分成内存块,并添加到内存块描述符的free_list中 */
-        for (block_idx = 0; block_idx < descs[desc_idx].blocks_per_arena; block_idx++) {
-            b = arena2block(a, block_idx);
-            ASSERT(!elem_find(&a->desc->free_list, &b->free_elem));
-            list_append(&a->desc->free_list, &b->free_elem);	
-        }
-        intr_set_status(old_status);
-    }    
-
+      /* 先从本任务的弹匣中取, 弹匣空了才持有锁一次取回半个弹匣 */
+      struct mem_magazine* mag = &cur_thread->mag[desc_idx];
+      if (mag->cnt > 0) {
+        malloc_stat.mag_hits++;
+      }
+      if (mag->cnt > 0 || mag_refill(PF, mem_pool, desc_idx, mag, MAG_REFILL_CNT) > 0) {
    /* 开始分配内存块 */
-      b = elem2entry(struct mem_block, free_elem, list_pop(&(descs[desc_idx].free_list)));
-      memset(b, 0, descs[desc_idx].block_size);
+        b = mag_pop(mag);
+        memset(b, 0, descs[desc_idx].block_size);
+        hs->requested += size;
+        hs->reserved += descs[desc_idx].block_size;
+        hs->in_use += descs[desc_idx].block_size;
+        return (void*)b;
+      }
+      // 多页arena要求32KB连续且对齐, 拿不到时一页放得下的申请仍可以按大块内存分配
+      if (descs[desc_idx].arena_pages == 1 || size + sizeof(struct arena) > PG_SIZE) {
+        return NULL;
+      }
+   }
 
-      a = block2arena(b);  // 获取内存块b所在的arena
-      a->cnt--;		   // 将此arena中的空闲内存块数减1
-      lock_release(&mem_pool->lock);
-      return (void*)b;
+/* 超过最大内存块, 就分配页框 */
+   uint32_t page_cnt = DIV_ROUND_UP(size + sizeof(struct arena), PG_SIZE);    // 向上取整需要的页框数
+
+   /* 得到的内存都已清0: 内核页由get_kernel_pages清零(不持有锁),
+    * 用户页是按需分配的, 第一次访问时映射的就是清零的页框, 不用再逐页写一遍 */
+   a = PF == PF_KERNEL ? get_kernel_pages(page_cnt) : get_user_pages(page_cnt);
+   if (a == NULL) {
+      return NULL;
    }
+   /* 对于分配的大块页框,cnt置为页框数,large置为true */
+   a->desc_idx = 0;
+   a->cnt = page_cnt;
+   a->large = true;
+   hs->requested += size;
+   hs->reserved += page_cnt * PG_SIZE;
+   hs->in_use += page_cnt * PG_SIZE;
+   hs->arena_pages += page_cnt;
+   return (void*)(a + 1);		 // 跨过arena大小，把剩下的内存返回
 }
 
-//释放物理地址为pg_phy_addr的一个自然页，仅仅将对应的位图置为0即可
-void pfree(uint32_t pg_phy_addr) {
-    struct pool* mem_pool;
-    uint32_t bit_idx = 0;
-    if(pg_phy_addr >= user_pool.phy_addr_start) {//是用户物理内存池
-        mem_pool = &user_pool;
-        bit_idx = (pg_phy_addr - user_pool.phy_addr_start) / PG_SIZE;
-    } else {
-        mem_pool = &kernel_pool;
-        bit_idx = (pg_phy_addr - kernel_pool.phy_addr_start) / PG_SIZE;
+//释放物理地址为pg_phy_addr的一个自然页：引用计数减1，减到0时才还给所在内存池的伙伴系统
+void pfree(phys_addr_t pg_phy_addr) {
+    struct pool* mem_pool = phy_addr2pool(pg_phy_addr);
+    uint32_t pg_idx = (pg_phy_addr - mem_pool->phy_addr_start) / PG_SIZE;
+    struct page* pg = &mem_pool->zone.mem_map[pg_idx];
+    if(pg->flags & PAGE_RESERVED) {
+        return;
+    }
+    enum intr_status old_status = intr_disable();
+    ASSERT(pg->ref_cnt > 0);
+    if(--pg->ref_cnt == 0) {
+        if(pg->flags & PAGE_KSM) {
+            pg->flags &= ~PAGE_KSM;
+            ksm_stat.pages_shared--;
+        }
+        buddy_free(&mem_pool->zone, pg_idx, 0);
+    } else if(pg->flags & PAGE_KSM) {
+        ksm_stat.pages_saved--;
     }
-    bitmap_set(&mem_pool->pool_bitmap, bit_idx, 0);//将对应的一页的位图置零
+    intr_set_status(old_status);
 }
 
 //去掉页表中虚拟地址vaddr的映射，将对应pte的p位置为0即可；
 //最后一定要跟新tlb缓存
+//用户页表中的页表项都去掉后, 页表本身也释放掉
 static void page_table_pte_remove(uint32_t vaddr)  {
-    uint32_t* pte = pte_ptr(vaddr);
+    pte_t* pte = pte_ptr(vaddr);
     *pte &= ~PG_P_1;	// 将页表项pte的P位置0
-    asm volatile ("invlpg %0"::"m" (vaddr):"memory");    //更新tlb!!,一定得跟新！！
+    asm volatile ("invlpg %0"::"m" (*(char*)vaddr):"memory");    //更新tlb!!,一定得跟新！！
+    pte_t* pde = pde_ptr(vaddr);
+    uint32_t pt_phyaddr = PTE_ADDR(*pde);
+    if(--phy_addr2page(pt_phyaddr)->pt_cnt == 0) {
+        uint32_t* pde_bitmap = running_thread()->pde_bitmap;
+        pde_bitmap[PDE_IDX(vaddr) / 32] &= ~(1UL << (PDE_IDX(vaddr) % 32));
+        *pde = 0;
+        // 页表通过自映射在pte所在的页被访问过, 也要刷新
+        asm volatile ("invlpg %0"::"m" (*(char*)((uint32_t)pte & 0xfffff000)):"memory");
+        pfree(pt_phyaddr);
+    }
 }
 
-//在虚拟地址池中释放以_Vaddr起始的连续pg_cnt个虚拟页地址
-//也只是简单地将对应的位图置为0即可，只不过虚拟地址是连续的，所以可以连续释放
+//在当前进程的用户空间中释放以_Vaddr起始的连续pg_cnt个虚拟页地址, 即从进程的区域链表中删除
 // 而pfree释放的是物理内存，物理内存可以不连续，所以只能一页一页地释放
 static void vaddr_remove(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt) {
-    uint32_t bit_idx_start = 0, vaddr = (uint32_t)_vaddr, cnt = 0;
-
-    if(pf == PF_KERNEL) {
-        bit_idx_start = (vaddr - kernel_vaddr.vaddr_start) / PG_SIZE;
-        while(cnt < pg_cnt) {
-            bitmap_set(&kernel_vaddr.vaddr_bitmap, bit_idx_start + cnt++, 0);
-        }
-    } else {
-        struct task_struct* cur_thread = running_thread();
-        bit_idx_start = (vaddr - cur_thread->userprog_vaddr.vaddr_start) / PG_SIZE;
-        while(cnt < pg_cnt) {
-            bitmap_set(&cur_thread->userprog_vaddr.vaddr_bitmap,bit_idx_start + cnt++, 0);
-        }
-    }
+    uint32_t vaddr = (uint32_t)_vaddr;
+    ASSERT(pf == PF_USER);
+    vma_remove(&running_thread()->vma_list, vaddr, vaddr + pg_cnt * PG_SIZE);
 }
 
 /* 释放以虚拟地址vaddr为起始的cnt个物理页框 */
 void mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt) {
-    uint32_t pg_phy_addr;
+    phys_addr_t pg_phy_addr;
     uint32_t vaddr = (int32_t)_vaddr,page_cnt = 0;
     ASSERT(pg_cnt >= 1 && vaddr % PG_SIZE == 0);
-    pg_phy_addr = addr_v2p(vaddr);
-
-/* 确保待释放的物理内存在低端1M+1k大小的页目录+1k大小的页表地址范围外 */
-    ASSERT((pg_phy_addr % PG_SIZE) == 0 && pg_phy_addr >= 0x102000);
 
-    //判断物理地址属于物理池还是用户池
-    if (pg_phy_addr >= user_pool.phy_addr_start) {//用户池处理
+    //用户内存是按需分配的, 页不一定已经映射, 所以按pf而不是按物理地址区分内存池
+    if (pf == PF_USER) {//用户池处理
         vaddr -= PG_SIZE;
-        //循环释放物理地址池，并将对应的pte的p位置1
+        //循环释放物理地址池，并将对应的pte的p位置0
         while( page_cnt < pg_cnt ) {
             vaddr += PG_SIZE;
+            page_cnt++;
+            // 从未访问过的页没有物理页框
+            if (!(*pde_ptr(vaddr) & PG_P_1)) {
+                continue;
+            }
+            pte_t* pte = pte_ptr(vaddr);
+            if (*pte & PG_SWAP) {   // 已换出的页只释放槽位
+                swap_free(SWAP_SLOT(*pte));
+                *pte &= ~PG_SWAP;
+                page_table_pte_remove(vaddr);
+                continue;
+            }
+            if (!(*pte & PG_P_1)) {
+                continue;
+            }
             pg_phy_addr = addr_v2p(vaddr);
 
-            //确保物理地址属于用户物理内存池 
-            ASSERT((pg_phy_addr % PG_SIZE) == 0 && pg_phy_addr >= user_pool.phy_addr_start);
+            //确保物理地址属于用户物理内存池, 或者是共享零页
+            ASSERT((pg_phy_addr % PG_SIZE) == 0 && \
+                (pg_phy_addr >= user_pool.phy_addr_start || pg_phy_addr == zero_page_phyaddr));
 
             // 先将对应的物理页框(只是一页)归还到内存池
             pfree(pg_phy_addr);
 
             /* 再从页表中清除此虚拟地址所在的页表项pte */
             page_table_pte_remove(vaddr);
-
-            page_cnt++;
         }
         // 因为虚拟地址是连续的，所以可以不用循环释放
         vaddr_remove(pf, _vaddr, pg_cnt);
-    } else {//kernel内存池
-        vaddr -= PG_SIZE;	      
-        while (page_cnt < pg_cnt) {
-            vaddr += PG_SIZE;
-            pg_phy_addr = addr_v2p(vaddr);
-            // 确保待释放的物理内存只属于内核物理内存池 
-            ASSERT((pg_phy_addr % PG_SIZE) == 0 && \
-                pg_phy_addr >= kernel_pool.phy_addr_start && \
-                pg_phy_addr < user_pool.phy_addr_start);
-            
-            // 先将对应的物理页框归还到内存池 
-            pfree(pg_phy_addr);
-
-            /* 再从页表中清除此虚拟地址所在的页表项pte */
-            page_table_pte_remove(vaddr);
-
-            page_cnt++;
-        }
-   // 清空虚拟地址的位图中的相应位
-        vaddr_remove(pf, _vaddr, pg_cnt);
+    } else {//kernel内存池, 页在直接映射区中, 不用改页表
+        pg_phy_addr = V2P(vaddr);
+        // 确保待释放的物理内存只属于内核物理内存池 
+        ASSERT(pg_phy_addr >= kernel_pool.phy_addr_start && \
+            pg_phy_addr + pg_cnt * PG_SIZE <= kernel_pool.phy_addr_start + kernel_pool.pool_size);
+
+        // 内核页不会被共享, 连续的页框整段归还到内存池
+        pfree_contig(pg_phy_addr, pg_cnt);
     }
 
 }
@@ -467,10 +1153,11 @@ void sys_free(void* ptr) {
     if(ptr != NULL) {
         enum pool_flags PF;
         struct pool* mem_pool;
+        struct task_struct* cur_thread = running_thread();
 
         //判断是进程还是线程
-        if(running_thread()->pgdir == NULL) {
-            ASSERT((uint32_t)ptr >= K_HEAP_START);
+        if(cur_thread->pgdir == NULL) {
+            ASSERT((uint32_t)ptr >= (uint32_t)P2V(kernel_pool.phy_addr_start));
             PF = PF_KERNEL;
             mem_pool = &kernel_pool;
         } else {
@@ -478,113 +1165,454 @@ void sys_free(void* ptr) {
             mem_pool = &user_pool;
         }
 
-        lock_acquire(&mem_pool->lock);
         struct mem_block* b = ptr;
         struct arena*  a= block2arena(b);
 
         ASSERT(a->large == 0 || a->large == 1);
 
-        if(a->desc == NULL && a->large == true) {
-            //大于1024字节的是直接按页分配的，所以在回收时，也使用mfree_page回收相应的页框即可
+        struct heap_frag_stat* hs = heap_stat(PF);
+        if(a->large == true) {
+            //大块内存是直接按页分配的，所以在回收时，也使用mfree_page回收相应的页框即可
+            hs->in_use -= a->cnt * PG_SIZE;
+            hs->arena_pages -= a->cnt;
+            pool_lock_acquire(mem_pool);
             mfree_page(PF,a,a->cnt);
+            lock_release(&mem_pool->lock);
         } else{
-            //先将内存块回收到free_list
-            list_append(&a->desc->free_list, &b->free_elem);
-
-            //再判断此arena中的内存块是否都空闲，如果是的话就是放arena对应的物理页框，但在这之前，要将对饮描述符的空闲链表中的对应元素删除掉
-            if (++a->cnt == a->desc->blocks_per_arena) {
-                uint32_t block_idx;
-                for (block_idx = 0; block_idx < a->desc->blocks_per_arena; block_idx++) {
-                    struct mem_block*  b = arena2block(a, block_idx);
-                    ASSERT(elem_find(&a->desc->free_list, &b->free_elem));
-                    list_remove(&b->free_elem);//将内存块从对应的描述符的空闲链表中删除
-                }
-                mfree_page(PF, a, 1); 
-            } 
+            hs->in_use -= k_block_descs[a->desc_idx].block_size;   // 各任务同一规格的块大小都一样
+            // 先放进本任务的弹匣, 弹匣满了才持有锁把一半还给free_list
+            struct mem_magazine* mag = &cur_thread->mag[a->desc_idx];
+            mag_push(mag, b);
+            if (mag->cnt > MAG_SIZE) {
+                mag_flush(PF, mem_pool, mag, MAG_SIZE / 2);
+            } else {
+                malloc_stat.mag_hits++;
+            }
         }
-        lock_release(&mem_pool->lock);
     }
 }
-// 根据物理页框地址 pg_phy_addr 在相应的内存池的位图清 0, 不改动页表
-void free_a_phy_page(uint32_t pg_phy_addr) {
-    struct pool* mem_pool;
-    uint32_t bit_idx = 0;
-    if (pg_phy_addr >= user_pool.phy_addr_start) {
-        mem_pool = &user_pool;
-        bit_idx = (pg_phy_addr - user_pool.phy_addr_start) / PG_SIZE;
-    } else {
-        mem_pool = &kernel_pool;
-        bit_idx = (pg_phy_addr - kernel_pool.phy_addr_start) / PG_SIZE;
+
+// 把内核线程弹匣中缓存的块全部还回去, 线程退出时调用;
+// 进程的弹匣在它自己的用户空间中, 随地址空间一起回收, 不用处理
+void mem_magazine_drain(struct task_struct* pthread) {
+    ASSERT(pthread->pgdir == NULL);
+    uint8_t desc_idx;
+    for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++) {
+        if (pthread->mag[desc_idx].cnt > 0) {
+            mag_flush(PF_KERNEL, &kernel_pool, &pthread->mag[desc_idx], 0);
+        }
+    }
+}
+// 把进程堆的末尾移到new_brk, 返回新的末尾; new_brk不合法或无法扩展时不做改动, 返回原来的末尾
+// 堆是一个VM_BRK区域, 扩展时只保留虚拟地址, 物理页在首次访问时才分配; 缩小时释放末尾的页框
+uint32_t sys_brk(uint32_t new_brk) {
+    struct task_struct* cur = running_thread();
+    if (cur->pgdir == NULL || new_brk < cur->start_brk || new_brk > USER_STACK3_VADDR) {
+        return cur->brk;
+    }
+    uint32_t old_top = DIV_ROUND_UP(cur->brk, PG_SIZE) * PG_SIZE;
+    uint32_t new_top = DIV_ROUND_UP(new_brk, PG_SIZE) * PG_SIZE;
+    if (new_top > old_top) {
+        // 堆只能向上长到下一个区域为止
+        if (vma_overlap(&cur->vma_list, old_top, new_top) || \
+            !vma_add(&cur->vma_list, old_top, new_top, VM_BRK)) {
+            return cur->brk;
+        }
+    } else if (new_top < old_top) {
+        mfree_page(PF_USER, (void*)new_top, (old_top - new_top) / PG_SIZE);
     }
-    bitmap_set(&mem_pool->pool_bitmap, bit_idx, 0);
-}//15章，exit、waiy系统调用
+    cur->brk = new_brk;
+    return new_brk;
+}
 
-// 初始化内存池
-static void mem_pool_init(uint32_t all_mem) {
-    put_str("mem_pool_init_start\n");
-    //page_table_size是目前页表占用的大小
-    // 目前页的数量 = 1页页目录表 + 第0和768个页目录项指向同一个页表 + 第769 ~ 1022个页目录项共指向254个也页表，所以一共256个页
-    uint32_t page_table_size = PG_SIZE * 256;
-    uint32_t used_mem = page_table_size +  0x100000;//0x100000 为低端 1MB 内存
-    uint32_t free_mem = all_mem - used_mem;
+// 读取一个内存池的情况
+static void pool_info_get(struct pool* m_pool, struct pool_info* info) {
+    enum intr_status old_status = intr_disable();
+    info->total_pages = (uint32_t)(m_pool->pool_size >> 12);
+    info->free_pages = m_pool->zone.free_pages + m_pool->zeroed_cnt;
+    info->largest_free = buddy_largest_free(&m_pool->zone);
+    intr_set_status(old_status);
+}
 
-    uint16_t all_free_pages = free_mem / PG_SIZE;//所有空闲页的数量
-    uint16_t kernel_free_pages = all_free_pages / 2; //内核与用户能够使用的内存对半分。
-    uint16_t user_free_pages = all_free_pages - kernel_free_pages;
+// 读取各规格内存块的arena数和空闲块数
+static void desc_info_get(struct mem_block_desc* descs, struct desc_info* info) {
+    uint32_t desc_idx;
+    for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++) {
+        info[desc_idx].block_size = descs[desc_idx].block_size;
+        info[desc_idx].blocks_per_arena = descs[desc_idx].blocks_per_arena;
+        info[desc_idx].arenas = descs[desc_idx].arena_cnt;
+        info[desc_idx].free_blocks = descs[desc_idx].free_cnt;
+    }
+}
 
-    uint32_t kbm_length = kernel_free_pages / 8; // 内核物理内存位图的长度
-    uint32_t ubm_length = user_free_pages / 8; // 用户物理内存位图的长度
+// 统计进程pthread的页表和其中存在或已换出的页, 须关中断调用
+static void task_pages_count(struct task_struct* pthread, struct proc_mem_info* info) {
+    uint32_t pde_idx;
+    for (pde_idx = 0; pde_idx < USER_PDE_CNT; pde_idx++) {
+        if (!(pthread->pde_bitmap[pde_idx / 32] & (1UL << (pde_idx % 32)))) {
+            continue;
+        }
+        info->page_tables++;
+        pte_t* pt = P2V(PTE_ADDR(pthread->pgdir[pde_idx]));
+        uint32_t pte_idx;
+        for (pte_idx = 0; pte_idx < PT_ENTRIES; pte_idx++) {
+            if (pt[pte_idx] & PG_P_1) {
+                info->resident_pages++;
+            } else if (pt[pte_idx] & PG_SWAP) {
+                info->swapped_pages++;
+            }
+        }
+    }
+}
 
-    uint32_t kp_start = used_mem;//内核内存池的起始地址
-    uint32_t up_start = kp_start + kernel_free_pages * PG_SIZE;//用户内存池的起始地址
-    
-    kernel_pool.phy_addr_start = kp_start;
-    user_pool.phy_addr_start = up_start;
+// 把内存池, 内核堆和各用户进程的内存情况填到info中, 返回0
+// 写用户缓冲区可能引起缺页, 所以关中断读到的内容先放在内核栈上, 开中断后再复制过去
+int32_t sys_meminfo(struct meminfo* info) {
+    struct pool_info pool;
+    pool_info_get(&kernel_pool, &pool);
+    info->kernel_pool = pool;
+    pool_info_get(&user_pool, &pool);
+    info->user_pool = pool;
+    desc_info_get(k_block_descs, info->kernel_descs);
+
+    struct proc_mem_info proc;
+    pid_t pid = 0;
+    info->proc_cnt = 0;
+    while (info->proc_cnt < MEMINFO_PROCS) {
+        enum intr_status old_status = intr_disable();
+        struct task_struct* pthread = next_process(pid);
+        if (pthread != NULL) {
+            memset(&proc, 0, sizeof(proc));
+            proc.pid = pid = pthread->pid;
+            memcpy(proc.name, pthread->name, TASK_NAME_LEN);
+            proc.vmas = list_len(&pthread->vma_list);
+            task_pages_count(pthread, &proc);
+            desc_info_get(pthread->u_block_desc, proc.descs);
+        }
+        intr_set_status(old_status);
+        if (pthread == NULL) {
+            break;
+        }
+        info->procs[info->proc_cnt++] = proc;
+    }
 
-    kernel_pool.pool_size = kernel_free_pages * PG_SIZE; //内核池（物理）大小  单位：字节
-    user_pool.pool_size = user_free_pages * PG_SIZE; //用户池（物理）大小
-    
-    kernel_pool.pool_bitmap.btmp_bytes_len = kbm_length;
-    user_pool.pool_bitmap.btmp_bytes_len = ubm_length;
+    info->zeroed_pages = zeroed_page_cnt();
+    info->zeroed_stat = zeroed_stat;
+    info->malloc_stat = malloc_stat;
+    info->kernel_heap = kernel_heap_stat;
+    info->user_heap = user_heap_stat;
+    memset(info->swap_part, 0, sizeof(info->swap_part));
+    if (swap_part != NULL) {
+        memcpy(info->swap_part, swap_part->name, sizeof(info->swap_part));
+    }
+    info->swap_stat = swap_stat;
+    info->cache_cnt = kmem_cache_info(info->caches, MEMINFO_CACHES);
+    return 0;
+}
 
-    //内核内存池的位图在MEM_BITMAP_BASE（0x9a000）处
-    kernel_pool.pool_bitmap.bits = (void*)MEM_BITMAP_BASE;
-    //用户内存池的位图紧跟在内核内存池的位图之后
-    user_pool.pool_bitmap.bits = (void*)(MEM_BITMAP_BASE + kbm_length);
+#ifdef CONFIG_PAE
+// 从loader建立的二级分页切换到PAE分页, pdpt_phyaddr是页目录指针表的物理地址
+// 切换时要先关闭分页, 所以这段代码跳到它的恒等映射地址(物理地址)上执行, 开启分页后再跳回内核地址
+// 分页关闭期间不能访问栈和全局变量, 调用前要关中断
+static void pae_enable(uint32_t pdpt_phyaddr) {
+    asm volatile (
+        "movl $1f - 0xc0000000, %%eax\n\t"
+        "jmp *%%eax\n"
+        "1:\n\t"
+        "movl %%cr0, %%eax\n\t"
+        "andl $0x7fffffff, %%eax\n\t"   // 关闭分页
+        "movl %%eax, %%cr0\n\t"
+        "movl %%cr4, %%eax\n\t"
+        "orl $0x20, %%eax\n\t"          // PAE位
+        "movl %%eax, %%cr4\n\t"
+        "movl %0, %%cr3\n\t"
+        "movl %%cr0, %%eax\n\t"
+        "orl $0x80000000, %%eax\n\t"
+        "movl %%eax, %%cr0\n\t"
+        "movl $2f, %%eax\n\t"
+        "jmp *%%eax\n"
+        "2:"
+        : : "d" (pdpt_phyaddr) : "eax", "memory");
+}
 
-    // 输出内存池信息
-    put_str("    kernel_pool_bitmap_start:");
-    put_int((int)kernel_pool.pool_bitmap.bits);
-    put_str(" kernel_pool_phy_addr_start:");
-    put_int(kernel_pool.phy_addr_start);
-    put_str("\n");
-    put_str("    user_pool_bitmap_start:");
-    put_int((int)user_pool.pool_bitmap.bits);
-    put_str(" user_pool_phy_addr_start:");
-    put_int(user_pool.phy_addr_start);
-    put_str("\n");
+// cpu支持NX时置EFER的NXE位, 之后页表项中的PG_NX才有效, 否则它是保留位
+static void nx_init(void) {
+    uint32_t eax = 0x80000000, ebx, ecx, edx;
+    asm volatile ("cpuid" : "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx));
+    if(eax < 0x80000001) {
+        return;
+    }
+    // cpuid 0x80000001号功能, edx的第20位表示支持NX
+    eax = 0x80000001;
+    asm volatile ("cpuid" : "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx));
+    if(!(edx & (1 << 20))) {
+        return;
+    }
+    // EFER是0xc0000080号msr, 第11位是NXE
+    asm volatile ("rdmsr" : "=a" (eax), "=d" (edx) : "c" (0xc0000080));
+    eax |= 1 << 11;
+    asm volatile ("wrmsr" : : "a" (eax), "d" (edx), "c" (0xc0000080));
+    pg_nx = PG_NX;
+}
+#endif
+
+// 建立直接映射区: 用大页(非PAE下4MB, PAE下2MB)把物理内存从0起线性映射到KERNEL_BASE处,
+// 内核访问这些内存只需查一级页表, 整个内核也只占很少的tlb项
+// 大页的页目录项带PG_G: 内核的页目录项在每个进程中都一样, 即使经自映射被当作页表项也没有问题
+// PAE下还要建立内核的4个页目录并切换过去, loader建立的页目录从此不再使用
+// 返回直接映射区覆盖的物理内存上限
+static uint32_t direct_map_init(uint32_t mem_pfn) {
+    // cpuid 1号功能, edx的第3位表示支持PSE, 第6位表示支持PAE
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile ("cpuid" : "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx));
+    if(!(edx & (1 << 3))) {
+        PANIC("direct_map_init: PSE not supported");
+    }
+#ifdef CONFIG_PAE
+    if(!(edx & (1 << 6))) {
+        PANIC("direct_map_init: PAE not supported");
+    }
+#endif
+    uint32_t cr4;
+    asm volatile ("movl %%cr4, %0" : "=r" (cr4));
+    cr4 |= 0x10;    // PSE位
+    asm volatile ("movl %0, %%cr4" : : "r" (cr4) : "memory");
+
+    uint32_t pde_cnt = DIV_ROUND_UP(mem_pfn, PDE_SPAN / PG_SIZE);
+    if(pde_cnt > DIRECT_MAP_PDES) {
+        pde_cnt = DIRECT_MAP_PDES;
+    }
+    uint32_t cr3;
+#ifdef CONFIG_PAE
+    // loader的页目录中只映射了低端1MB, 先用4MB的大页把低端4MB映射到0和KERNEL_BASE处,
+    // 这样下面才能用P2V访问新的页目录, 切换时也能在恒等映射的地址上执行
+    uint32_t* boot_pd = (uint32_t*)0xfffff000;
+    boot_pd[0] = boot_pd[KERNEL_BASE >> 22] = PG_PS | PG_RW_W | PG_P_1;
+    asm volatile ("movl %%cr3, %0" : "=r" (cr3));
+    asm volatile ("movl %0, %%cr3" : : "r" (cr3) : "memory");
+
+    pte_t* pd = P2V(KERNEL_PD_PHYADDR);
+    memset(pd, 0, PGDIR_PAGES * PG_SIZE);
+    pd[0] = PG_PS | PG_RW_W | PG_P_1;   // 恒等映射低端2MB, 只在切换时使用
+    // 用户进程init的代码和数据都在内核映像里, 所以内核映射仍要带PG_US_U
+    uint32_t pde_idx = 0;
+    while(pde_idx < pde_cnt) {
+        pd[PDE_IDX(KERNEL_BASE) + pde_idx] = \
+            ((pte_t)pde_idx << PDE_SHIFT) | PG_PS | PG_G | PG_US_U | PG_RW_W | PG_P_1;
+        pde_idx++;
+    }
+    // 自映射只给内核用, 不带PG_US_U
+    pde_idx = 0;
+    while(pde_idx < PGDIR_PAGES) {
+        pd[PDE_IDX(PTE_BASE) + pde_idx] = (KERNEL_PD_PHYADDR + pde_idx * PG_SIZE) | PG_RW_W | PG_P_1;
+        // 页目录指针表项中只有P位, RW和US位是保留的
+        kernel_pdpt[pde_idx] = (KERNEL_PD_PHYADDR + pde_idx * PG_SIZE) | PG_P_1;
+        pde_idx++;
+    }
+    kernel_cr3 = V2P(kernel_pdpt);
+    pae_enable(kernel_cr3);
+    nx_init();
+#else
+    // 用户进程init的代码和数据都在内核映像里, 所以内核映射仍要带PG_US_U
+    pte_t* pde = pde_ptr(KERNEL_BASE);
+    uint32_t pde_idx = 0;
+    while(pde_idx < DIRECT_MAP_PDES) {
+        pde[pde_idx] = pde_idx < pde_cnt ? \
+            (pde_idx * PDE_SPAN) | PG_PS | PG_G | PG_US_U | PG_RW_W | PG_P_1 : 0;
+        pde_idx++;
+    }
+    kernel_cr3 = 0x100000;   // loader建立的页目录
+#endif
+    // 第0个页目录项是为开启分页(PAE下是切换分页模式)后还能执行低端代码建立的, 现在已经用不到了
+    // 此后不能再通过低端的恒等映射访问内存
+    *pde_ptr(0) = 0;
+    asm volatile ("movl %%cr3, %0" : "=r" (cr3));
+    asm volatile ("movl %0, %%cr3" : : "r" (cr3) : "memory");
+
+    // loader建立的第一个页表(原来第0和第768个页目录项共用)改作kmap的页表
+    memset(P2V(KMAP_PT_PHYADDR), 0, PG_SIZE);
+    *pde_ptr(KMAP_VADDR) = KMAP_PT_PHYADDR | PG_US_S | PG_RW_W | PG_P_1;
+    return pde_cnt * PDE_SPAN;
+}
+
+// 按e820内存布局整理出可用内存段, 低于low_pfn的部分(低端1MB和loader建立的页表)不要
+// 若loader没有取到ARDS(e801或0x88子功能), 就把mem_bytes_total以下都当作可用内存
+static void mem_ranges_init(uint32_t mem_bytes_total, uint32_t low_pfn) {
+    struct ards* ards = (struct ards*)P2V(ARDS_BUF_ADDR);
+    uint32_t ards_nr = *(uint16_t*)P2V(ARDS_NR_ADDR);
+    if(ards_nr > ARDS_MAX) {
+        ards_nr = ARDS_MAX;
+    }
+    mem_range_cnt = 0;
+    if(ards_nr == 0) {
+        mem_ranges[0].start_pfn = 0;
+        mem_ranges[0].end_pfn = mem_bytes_total / PG_SIZE;
+        mem_range_cnt = 1;
+    }
+
+    uint32_t idx = 0;
+    while(idx < ards_nr) {
+        struct ards* a = &ards[idx++];
+        uint64_t base = (uint64_t)a->base_high << 32 | a->base_low;
+        uint64_t end = base + ((uint64_t)a->length_high << 32 | a->length_low);
+        // 非PAE下只能使用4GB以内的物理内存
+        if(a->type != ARDS_TYPE_RAM || base >= MAX_PHYS_ADDR) {
+            continue;
+        }
+        if(end > MAX_PHYS_ADDR) {
+            end = MAX_PHYS_ADDR;
+        }
+        struct mem_range r;
+        // 只取整页, 起始地址向上取整, 结束地址向下取整
+        r.start_pfn = (uint32_t)((base + PG_SIZE - 1) >> 12);
+        r.end_pfn = (uint32_t)(end >> 12);
+        if(r.start_pfn >= r.end_pfn) {
+            continue;
+        }
+        // 插入排序, bios返回的ARDS不保证有序
+        uint32_t pos = mem_range_cnt;
+        while(pos > 0 && mem_ranges[pos - 1].start_pfn > r.start_pfn) {
+            mem_ranges[pos] = mem_ranges[pos - 1];
+            pos--;
+        }
+        mem_ranges[pos] = r;
+        mem_range_cnt++;
+    }
+
+    // 裁掉low_pfn以下的部分, 再合并重叠或相邻的内存段
+    uint32_t cnt = 0;
+    idx = 0;
+    while(idx < mem_range_cnt) {
+        struct mem_range r = mem_ranges[idx++];
+        if(r.start_pfn < low_pfn) {
+            r.start_pfn = low_pfn;
+        }
+        if(r.start_pfn >= r.end_pfn) {
+            continue;
+        }
+        if(cnt > 0 && r.start_pfn <= mem_ranges[cnt - 1].end_pfn) {
+            if(r.end_pfn > mem_ranges[cnt - 1].end_pfn) {
+                mem_ranges[cnt - 1].end_pfn = r.end_pfn;
+            }
+        } else {
+            mem_ranges[cnt++] = r;
+        }
+    }
+    mem_range_cnt = cnt;
+    if(mem_range_cnt == 0) {
+        PANIC("mem_ranges_init: no usable memory");
+    }
+}
+
+// 把内存池中的可用内存段交给它的伙伴系统, 空洞中的页框保持PAGE_RESERVED
+// 返回交出去的页框数
+static uint32_t pool_add_ranges(struct pool* m_pool) {
+    uint32_t pool_start = m_pool->phy_addr_start / PG_SIZE;
+    uint32_t pool_end = pool_start + (uint32_t)(m_pool->pool_size / PG_SIZE);
+    uint32_t added = 0;
+    uint32_t idx = 0;
+    while(idx < mem_range_cnt) {
+        uint32_t start = mem_ranges[idx].start_pfn;
+        uint32_t end = mem_ranges[idx].end_pfn;
+        idx++;
+        if(start < pool_start) {
+            start = pool_start;
+        }
+        if(end > pool_end) {
+            end = pool_end;
+        }
+        if(start < end) {
+            buddy_add_pages(&m_pool->zone, start - pool_start, end - start);
+            added += end - start;
+        }
+    }
+    return added;
+}
 
-    //将位图置零
-    bitmap_init(&kernel_pool.pool_bitmap);
-    bitmap_init(&user_pool.pool_bitmap);
+// 初始化内存池
+// 内核池和用户池各管理一段连续的物理地址, 中间的空洞由伙伴系统标记为PAGE_RESERVED, 不会被分配
+static void mem_pool_init(uint32_t mem_bytes_total) {
+    put_str("mem_pool_init_start\n");
+    // 低端1MB之上只保留页目录表和kmap的页表(PAE下还有内核的4个页目录), loader建立的其余页表已不再使用, 归内存池管理
+    uint32_t used_mem = BOOT_PT_END;
+    mem_ranges_init(mem_bytes_total, used_mem / PG_SIZE);
+
+    uint32_t first_pfn = mem_ranges[0].start_pfn;
+    uint32_t last_pfn = mem_ranges[mem_range_cnt - 1].end_pfn;
+    direct_map_end = direct_map_init(last_pfn);
+
+    uint32_t all_free_pages = 0;//所有空闲页的数量
+    uint32_t idx = 0;
+    while(idx < mem_range_cnt) {
+        all_free_pages += mem_ranges[idx].end_pfn - mem_ranges[idx].start_pfn;
+        idx++;
+    }
+
+    // 伙伴系统中每个物理页框对应一个page结构, 两个池的mem_map连在一起, 放在第一段可用内存的最前面
+    // 空洞中的页框也有page结构, 这样由物理地址找page结构只需一次减法
+    uint32_t map_pages = DIV_ROUND_UP((last_pfn - first_pfn) * sizeof(struct page), PG_SIZE);
+    uint32_t kp_start = first_pfn + map_pages;//内核内存池的起始页框号
+    if(kp_start >= mem_ranges[0].end_pfn || kp_start * PG_SIZE >= direct_map_end) {
+        PANIC("mem_pool_init: no room for mem_map");
+    }
+
+    // 内核池从kp_start起, 直到含有约定比例的可用页框, 但不能超出直接映射区
+    uint32_t kernel_want = all_free_pages / 100 * CONFIG_KERNEL_POOL_PERCENT + \
+        all_free_pages % 100 * CONFIG_KERNEL_POOL_PERCENT / 100;
+    uint32_t up_start = kp_start;//用户内存池的起始页框号
+    idx = 0;
+    while(idx < mem_range_cnt && kernel_want > 0) {
+        uint32_t start = mem_ranges[idx].start_pfn < kp_start ? kp_start : mem_ranges[idx].start_pfn;
+        uint32_t end = mem_ranges[idx].end_pfn;
+        if(start < end) {
+            up_start = end - start > kernel_want ? start + kernel_want : end;
+            kernel_want -= up_start - start;
+        }
+        idx++;
+    }
+    if(up_start * PG_SIZE > direct_map_end) {
+        up_start = direct_map_end / PG_SIZE;
+    }
+    if(up_start >= last_pfn) {
+        PANIC("mem_pool_init: no memory left for user pool");
+    }
+
+    kernel_pool.phy_addr_start = kp_start * PG_SIZE;
+    user_pool.phy_addr_start = up_start * PG_SIZE;
+
+    kernel_pool.pool_size = (up_start - kp_start) * PG_SIZE; //内核池（物理）大小  单位：字节, 包括其中的空洞
+    user_pool.pool_size = (phys_addr_t)(last_pfn - up_start) * PG_SIZE; //用户池（物理）大小
 
     //十一章新增: 锁的初始化
     lock_init(&kernel_pool.lock);
     lock_init(&user_pool.lock);
 
+    struct page* mem_map = P2V(first_pfn * PG_SIZE);
+    buddy_zone_init(&kernel_pool.zone, kernel_pool.phy_addr_start, up_start - kp_start, mem_map);
+    buddy_zone_init(&user_pool.zone, user_pool.phy_addr_start, last_pfn - up_start, \
+        mem_map + (up_start - kp_start));
+    uint32_t kernel_free_pages = pool_add_ranges(&kernel_pool);
+    uint32_t user_free_pages = pool_add_ranges(&user_pool);
 
-    //初始化内核虚拟地址的位图，按实际物理内存大小生成数组
-    // 要和内核内存池的大小一致
-    kernel_vaddr.vaddr_bitmap.btmp_bytes_len = kbm_length;
-   
-
-
-    //虚拟地址池的管理结构的位图的物理地址在上面两个位图之后
-    kernel_vaddr.vaddr_bitmap.bits = (void*) (MEM_BITMAP_BASE + kbm_length + ubm_length);
-    //虚拟地址的起始地址为0x100000,还没有将其与物理地址对应起来！！！
-    kernel_vaddr.vaddr_start = K_HEAP_START;
-    
-    bitmap_init(&kernel_vaddr.vaddr_bitmap);
+    // 输出内存池信息
+    put_str("    mem_ranges:");
+    put_int(mem_range_cnt);
+    put_str(" direct_map_end:");
+    put_int(direct_map_end);
+    put_str(" mem_map_start:");
+    put_int((int)mem_map);
+    put_str(" mem_map_pages:");
+    put_int(map_pages);
+    put_str("\n");
+    put_str("    kernel_pool_phy_addr_start:");
+    put_int(kernel_pool.phy_addr_start);
+    put_str(" pages:");
+    put_int(kernel_free_pages);
+    put_str(" user_pool_phy_addr_start:");
+    put_int(user_pool.phy_addr_start);
+    put_str(" pages:");
+    put_int(user_free_pages);
+    put_str("\n");
 
     put_str("    mem_pool_init done\n");
 }
@@ -597,21 +1625,56 @@ void block_desc_init(struct mem_block_desc* desc_array) {
    for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++) {
       desc_array[desc_idx].block_size = block_size;
 
-      /* 初始化arena中的内存块数量 */
-      desc_array[desc_idx].blocks_per_arena = (PG_SIZE - sizeof(struct arena)) / block_size;	  
+      /* 初始化arena中的内存块数量, 大于1024字节的块用多页arena, 元信息占掉一个块 */
+      if (block_size > 1024) {
+         desc_array[desc_idx].arena_pages = ARENA_SPAN / PG_SIZE;
+         desc_array[desc_idx].blocks_per_arena = ARENA_SPAN / block_size - 1;
+      } else {
+         desc_array[desc_idx].arena_pages = 1;
+         desc_array[desc_idx].blocks_per_arena = (PG_SIZE - sizeof(struct arena)) / block_size;	  
+      }
 
+      desc_array[desc_idx].arena_cnt = 0;
+      desc_array[desc_idx].free_cnt = 0;
       list_init(&desc_array[desc_idx].free_list);
 
       block_size *= 2;         //下标越低的内存块描述符，其表示的内存块容量越小
    }
 }
 
+// 分配共享零页, 它常驻内存, 不参与引用计数
+static void zero_page_init(void) {
+    void* vaddr = get_kernel_pages(1);
+    ASSERT(vaddr != NULL);
+    zero_page_phyaddr = addr_v2p((uint32_t)vaddr);
+    phy_addr2page(zero_page_phyaddr)->flags |= PAGE_RESERVED;
+}
+
+// 开启全局页: 内核的映射(直接映射区的大页和kmap的页表项)都带PG_G, 置cr4的PGE位后, 切换cr3时它们的tlb项不会被刷掉
+// 用户页目录项和第1023项不能带PG_G: 通过自映射, 页目录项会被当作0xffc00000起的页表项, 它们是进程私有的
+static void kernel_global_init(void) {
+    // cpuid 1号功能, edx的第13位表示支持PGE
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile ("cpuid" : "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx));
+    if(edx & (1 << 13)) {
+        uint32_t cr4;
+        asm volatile ("movl %%cr4, %0" : "=r" (cr4));
+        cr4 |= 0x80;    // PGE位
+        asm volatile ("movl %0, %%cr4" : : "r" (cr4) : "memory");
+    }
+}
+
 void mem_init() {
     put_str("mem_init start\n");
     //实际内存容量在LOADER.S中算出并存在了0xb00物理地址处，因为定义了dd，所以应该用32位指针去转换它，然后dereference给C语言的32位无符号整型。
+    // 现在只在没有e820内存布局时使用, 否则以0xb0a处的ARDS为准
     uint32_t mem_bytes_total = (*(uint32_t*)(0xb00));
     mem_pool_init(mem_bytes_total);
     block_desc_init(k_block_descs);// 初始化内核内存块描述符
+    kmem_cache_init();// 初始化slab对象缓存
+    vma_init();// 初始化用户进程的虚拟内存区域
+    zero_page_init();// 分配共享零页
+    kernel_global_init();// 开启全局页
     put_str("mem_bytes_total: 0x"); put_int(mem_bytes_total);put_str("\n");
     put_str("mem_init done\n");
 }
@@ -16,12 +16,43 @@ enum pool_flags {
 #define PG_RW_W 2 // RW属性值,读/写/执行
 #define PG_US_S 0    //US属性位，系统级
 #define PG_US_U 4   //US属性位置，用户级
+#define PG_PWT 0x8    //写直通, 与PG_PCD一起用于设备寄存器的映射
+#define PG_PCD 0x10   //禁止缓存该页
+#define PG_PS 0x80    //页目录项的PS位, 置1表示该项直接映射一个4MB的大页, 没有下一级页表
+#define PG_G 0x100    //全局页, cr3切换时tlb项不被刷新, 只用于所有进程都相同的内核映射
+#define PG_A 0x20     //访问位, 处理器访问该页时置1, 换出时据此挑选最近没用过的页
+#define PG_D 0x40     //脏位, 处理器写该页时置1
+#define PG_COW 0x200  //页表项中留给软件使用的第9位，表示该页是写时复制的只读共享页
+#define PG_SWAP 0x400 //不存在的页表项中留给软件使用的第10位, 表示该页已换出到交换分区, 第12位起是槽位号
 
-//虚拟地址池，用于虚拟地址管理
-struct virtual_addr {
-    struct bitmap vaddr_bitmap; //虚拟地址用到的位图结构
-    uint32_t vaddr_start; //虚拟地址起始地址
-};
+// 编译时加 DEFS=-DCONFIG_PAE 使用PAE分页: 页表项为64位, 物理地址可以超过4GB,
+// cr3指向有4项的页目录指针表, 每项指向一个512项的页目录, 每个页目录项管理2MB
+// 4个页目录在物理上连续, 下面把它们当成一个2048项的页目录, 用虚拟地址右移PDE_SHIFT位作下标
+#ifdef CONFIG_PAE
+typedef uint64_t pte_t;
+typedef uint64_t phys_addr_t;
+#define PT_ENTRIES 512    // 页表和每个页目录的项数
+#define PDE_SHIFT 21
+#define PGDIR_PAGES 4     // 页目录占的页数
+#define PTE_ADDR_MASK 0x000ffffffffff000ULL
+#define PG_NX (1ULL << 63)    //不可执行位, 只有PAE下才有, 且要先置EFER的NXE位
+#else
+typedef uint32_t pte_t;
+typedef uint32_t phys_addr_t;
+#define PT_ENTRIES 1024
+#define PDE_SHIFT 22
+#define PGDIR_PAGES 1
+#define PTE_ADDR_MASK 0xfffff000
+#endif
+#define PDE_SPAN (1UL << PDE_SHIFT)    // 一个页目录项管理的地址范围, 也是直接映射区大页的大小
+#define PTE_ADDR(entry) ((phys_addr_t)((entry) & PTE_ADDR_MASK))    // 页表项或页目录项中的物理地址
+#define PDE_IDX(addr) ((addr) >> PDE_SHIFT) // 取得高位，获取页目录表下标
+#define PTE_IDX(addr) (((addr) >> 12) & (PT_ENTRIES - 1)) // 取得中间的位，获取页表下标
+
+// 物理内存从0起用4MB大页线性映射到KERNEL_BASE起的直接映射区, 内核内存池的页都在这里
+#define KERNEL_BASE 0xc0000000
+#define P2V(pa) ((void*)((uint32_t)(pa) + KERNEL_BASE))
+#define V2P(va) ((uint32_t)(va) - KERNEL_BASE)
 
 // 内存块
 struct mem_block {
@@ -32,26 +63,160 @@ struct mem_block {
 struct mem_block_desc {
    uint32_t block_size;		 // 内存块大小
    uint32_t blocks_per_arena;	 // 这个类型的arena能够存放几个mem_block
+   uint32_t arena_pages;	 // arena占用的页数, 2KB和4KB的内存块从多页的arena中分配
+   uint32_t arena_cnt;		 // 这种规格现有的arena数
+   uint32_t free_cnt;		 // free_list中的内存块数, 弹匣中缓存的块不算
    struct list free_list;	 // 目前可用的mem_block链表，记录所有同类型的arena的空闲内存块
 };
 
-#define DESC_CNT 7  //内存块描述符的个数，有7中规格 16字节 32字节 64字节 128字节 256字节 512字节 1024字节;当要分配的内存块大于1024时，直接分配一个页框而不在arena中分配
+// 每个任务对每种规格的内存块都有一个弹匣, 缓存最近释放的块;
+// 分配和释放先找弹匣, 不用持有内存池的锁, 弹匣空了或满了才成批地与共享的free_list交换
+struct mem_magazine {
+   struct list_elem* top;   // 缓存的空闲块, 经free_elem.next串成单链表
+   uint32_t cnt;
+};
+
+#define DESC_CNT 9  //内存块描述符的个数，有9种规格 16字节 32字节 ... 1024字节 2048字节 4096字节;当要分配的内存块大于4096时，直接分配页框而不在arena中分配
+
+// 预清零页框的统计, 耗时的单位是时钟周期
+struct zeroed_page_stat {
+    uint32_t hits;          // 需要清零页时储备中有现成的
+    uint32_t misses;        // 储备为空, 只能当场清零
+    uint64_t sync_cycles;   // 分配时当场清零花费的时间
+    uint64_t idle_cycles;   // idle线程预先清零花费的时间
+};
+
+// sys_malloc/sys_free的统计, 用来观察内存池锁的争用
+struct malloc_stat {
+    uint32_t mag_hits;        // 直接从弹匣分配或释放到弹匣
+    uint32_t lock_acquires;   // 获取内存池锁的次数
+    uint32_t lock_contended;  // 获取时锁已被其他任务持有的次数
+};
+
+// 堆的碎片统计, 内核和用户各一份; 累计值用来看内部碎片, 当前值用来看arena中闲置的块
+struct heap_frag_stat {
+    uint64_t requested;     // 累计申请的字节数
+    uint64_t reserved;      // 累计实际分出去的字节数, 即内存块的大小或整页
+    uint32_t in_use;        // 当前分配出去的字节数, 按内存块的大小或整页计
+    uint32_t arena_pages;   // 当前arena和大块内存占用的页数
+};
+
+// 交换分区的统计, 由swap.c维护, meminfo也要报告所以定义在这里
+struct swap_stat {
+    uint32_t slots;        // 交换分区的槽位数, 每个槽位存一页
+    uint32_t slots_used;
+    uint32_t swap_ins;     // 缺页时从交换分区读回的页数
+    uint32_t swap_outs;    // 换出的页数
+    uint32_t aborts;       // 写盘期间页被访问或改动而放弃换出的次数
+};
+
+#define MEMINFO_PROCS 16   // meminfo最多报告的进程数
+#define MEMINFO_CACHES 16  // meminfo最多报告的对象缓存数
+
+// meminfo系统调用报告的一个物理内存池
+struct pool_info {
+    uint32_t total_pages;
+    uint32_t free_pages;      // 含预清零的储备
+    uint32_t largest_free;    // 伙伴系统中最大的空闲块的页数, 即一次最多能分配多少连续的页
+};
+
+// 一种规格的内存块的arena
+struct desc_info {
+    uint32_t block_size;
+    uint32_t blocks_per_arena;
+    uint32_t arenas;
+    uint32_t free_blocks;     // 空闲链表中的块, 其余的块已分配出去或缓存在弹匣中
+};
+
+// 一个用户进程的内存
+struct proc_mem_info {
+    uint32_t pid;
+    char name[16];
+    uint32_t vmas;            // 区域数
+    uint32_t resident_pages;  // 映射了页框的页, 含共享的页框
+    uint32_t swapped_pages;   // 已换出的页
+    uint32_t page_tables;     // 页表占用的页数
+    struct desc_info descs[DESC_CNT];   // 进程自己的u_block_desc
+};
+
+// 一个slab对象缓存(见slab.c)
+struct cache_info {
+    char name[16];
+    uint32_t obj_size;
+    uint32_t slabs;           // slab数, 每个slab一页
+    uint32_t total_objs;      // 所有slab中的对象数
+    uint32_t active_objs;     // 已分配出去的对象数
+    uint32_t allocs;          // 累计分配次数
+};
+
+// meminfo系统调用的结果, 各项是分别读取的, 彼此之间不保证一致
+struct meminfo {
+    struct pool_info kernel_pool;
+    struct pool_info user_pool;
+    struct desc_info kernel_descs[DESC_CNT];
+    uint32_t proc_cnt;        // 报告的进程数, 进程太多时只报告pid最小的MEMINFO_PROCS个
+    struct proc_mem_info procs[MEMINFO_PROCS];
+    uint32_t zeroed_pages;    // 预清零储备中的页框数
+    struct zeroed_page_stat zeroed_stat;
+    struct malloc_stat malloc_stat;
+    struct heap_frag_stat kernel_heap;
+    struct heap_frag_stat user_heap;
+    char swap_part[8];        // 交换分区名, 没有交换分区时为空串
+    struct swap_stat swap_stat;
+    uint32_t cache_cnt;       // 报告的对象缓存数, 按创建的顺序最多MEMINFO_CACHES个
+    struct cache_info caches[MEMINFO_CACHES];
+};
 
+struct task_struct;
 extern struct pool kernel_pool, user_pool;
+extern struct zeroed_page_stat zeroed_stat;
+extern struct malloc_stat malloc_stat;
+extern struct heap_frag_stat kernel_heap_stat, user_heap_stat;
+#ifdef CONFIG_BENCH
+extern bool mag_bypass;
+#endif
+extern uint32_t kernel_cr3;
+#ifdef CONFIG_PAE
+extern pte_t pg_nx;
+#endif
 void mem_init(void);
 void* get_kernel_pages(uint32_t pg_cnt);
+void free_kernel_pages(void* vaddr, uint32_t pg_cnt);
 void* malloc_page(enum pool_flags pf, uint32_t pg_cnt);
 void malloc_init(void);
-uint32_t* pte_ptr(uint32_t vaddr);
-uint32_t* pde_ptr(uint32_t vaddr);
-uint32_t addr_v2p(uint32_t vaddr);
+pte_t* pte_ptr(uint32_t vaddr);
+pte_t* pde_ptr(uint32_t vaddr);
+pte_t* task_pte_ptr(struct task_struct* pthread, uint32_t vaddr);
+pte_t* task_next_pte(struct task_struct* pthread, uint32_t* vaddr);
+phys_addr_t addr_v2p(uint32_t vaddr);
 void* get_a_page(enum pool_flags pf, uint32_t vaddr);
+bool map_user_pages(uint32_t vaddr, uint32_t pg_cnt, pte_t attr);
 void* get_user_pages(uint32_t pg_cnt);
 void block_desc_init(struct mem_block_desc* desc_array);
 void* sys_malloc(uint32_t size); //malloc系统调用子处理函数
 void mfree_page(enum pool_flags pf, void* _vaddr, uint32_t pg_cnt);
-void pfree(uint32_t pg_phy_addr);
+void pfree(phys_addr_t pg_phy_addr);
 void sys_free(void* ptr);
-void* get_a_page_without_opvaddrbitmap(enum pool_flags pf, uint32_t vaddr);
-void free_a_phy_page(uint32_t pg_phy_addr);
+uint32_t sys_brk(uint32_t new_brk);
+int32_t sys_meminfo(struct meminfo* info);
+void mem_magazine_drain(struct task_struct* pthread);
+phys_addr_t palloc_contig(enum pool_flags pf, uint32_t pg_cnt);
+void pfree_contig(phys_addr_t pg_phy_addr, uint32_t pg_cnt);
+void page_ref_get(phys_addr_t pg_phy_addr);
+uint32_t page_table_cnt(uint32_t pt_phy_addr);
+void page_table_set_cnt(uint32_t pt_phy_addr, uint32_t cnt);
+void pfree_batch(phys_addr_t* pg_phy_addrs, uint32_t cnt);
+uint32_t page_ref_cnt(phys_addr_t pg_phy_addr);
+bool page_mergeable(phys_addr_t pg_phy_addr);
+bool page_is_ksm(phys_addr_t pg_phy_addr);
+void page_set_ksm(phys_addr_t pg_phy_addr);
+void* kmap(phys_addr_t pg_phy_addr);
+void kunmap(void* vaddr);
+void* mmio_map(phys_addr_t paddr);
+void identity_map_low(bool enable);
+bool cow_page_fault(uint32_t vaddr);
+bool demand_page_fault(uint32_t vaddr, bool write);
+bool zeroed_page_refill(void);
+uint32_t zeroed_page_cnt(void);
+uint32_t user_pool_free_pages(void);
 #endif
\ No newline at end of file
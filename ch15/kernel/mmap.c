@@ -0,0 +1,149 @@
+#include "mmap.h"
+#include "stdint.h"
+#include "global.h"
+#include "debug.h"
+#include "interrupt.h"
+#include "memory.h"
+#include "thread.h"
+#include "process.h"
+#include "sync.h"
+#include "vma.h"
+#include "fs.h"
+#include "file.h"
+#include "inode.h"
+#include "ide.h"
+#include "pipe.h"
+#include "string.h"
+
+// 内存映射: mmap在进程的地址空间中划出一个VM_MMAP区域, 和malloc的大块内存一样只保留虚拟地址,
+// 页在第一次访问时才在缺页异常中分配(见demand_page_fault)
+//
+// 匿名映射的页是清零的; 文件映射的页按inode中的块地址直接从硬盘读入, 不经过文件的读写位置和sys_read的扇区缓冲区.
+// 文件映射只能是只读的私有映射, 页读入后就与文件无关, 之后对文件的写不会反映到已经读入的页上.
+// 区域持有inode的一次打开, 所以映射期间文件不能删除
+
+static struct lock mmap_lock;                    // 读文件页时持有, 保护下面两个缓冲区
+static uint8_t mmap_buf[PG_SIZE];                // 页框不一定在直接映射区中, 而kmap要关中断, 读盘时经这里中转
+static uint32_t indirect_buf[BLOCK_SIZE / 4];    // 文件的一级间接块表
+
+// 文件中第blk块的扇区地址, 间接块的地址要先读到indirect_buf中
+static uint32_t block_lba(struct inode* inode, uint32_t blk) {
+   return blk < 12 ? inode->i_sectors[blk] : indirect_buf[blk - 12];
+}
+
+// 把文件映射区域vma中vaddr所在的页从文件读到页框frame中, 文件末尾之后的部分清0
+// vaddr所在的页整个在文件末尾之后时返回false, 这样的页不能访问
+bool mmap_file_read(struct vm_area* vma, uint32_t vaddr, phys_addr_t frame) {
+   struct inode* inode = vma->vm_inode;
+   uint32_t offset = (vma->vm_pgoff + (vaddr - vma->vm_start) / PG_SIZE) * PG_SIZE;
+   if (offset >= inode->i_size) {
+      return false;
+   }
+   uint32_t size = inode->i_size - offset < PG_SIZE ? inode->i_size - offset : PG_SIZE;
+   uint32_t blk = offset / BLOCK_SIZE;
+   uint32_t blk_end = DIV_ROUND_UP(offset + size, BLOCK_SIZE);
+
+   lock_acquire(&mmap_lock);
+   if (blk_end > 12) {
+      ide_read(cur_part->my_disk, inode->i_sectors[12], indirect_buf, 1);
+   }
+   // 扇区地址连续的块一次读入
+   uint8_t* buf = mmap_buf;
+   while (blk < blk_end) {
+      uint32_t lba = block_lba(inode, blk);
+      uint32_t cnt = 1;
+      while (blk + cnt < blk_end && block_lba(inode, blk + cnt) == lba + cnt) {
+         cnt++;
+      }
+      ide_read(cur_part->my_disk, lba, buf, cnt);
+      buf += cnt * BLOCK_SIZE;
+      blk += cnt;
+   }
+   memset(mmap_buf + size, 0, PG_SIZE - size);
+
+   enum intr_status old_status = intr_disable();
+   void* dst = kmap(frame);
+   memcpy(dst, mmap_buf, PG_SIZE);
+   kunmap(dst);
+   intr_set_status(old_status);
+   lock_release(&mmap_lock);
+   return true;
+}
+
+// 返回以可读方式打开的普通文件描述符fd对应的inode, fd不合法时返回NULL
+static struct inode* fd2inode(int32_t fd) {
+   struct task_struct* cur = running_thread();
+   if (fd <= stderr_no || fd >= MAX_FILES_OPEN_PER_PROC || cur->fd_table[fd] == -1 || is_pipe(fd)) {
+      return NULL;
+   }
+   struct file* pf = &file_table[fd_local2global(fd)];
+   return pf->fd_flag & O_WRONLY ? NULL : pf->fd_inode;
+}
+
+// 建立映射, 成功返回映射的起始地址, 失败返回MAP_FAILED
+void* sys_mmap(struct mmap_args* args) {
+   struct task_struct* cur = running_thread();
+   uint32_t len = DIV_ROUND_UP(args->len, PG_SIZE) * PG_SIZE;
+   if (cur->pgdir == NULL || len == 0 || len > KERNEL_BASE - USER_VADDR_START || \
+       !(args->flags & MAP_PRIVATE) || (args->prot & ~(PROT_READ | PROT_WRITE))) {
+      return MAP_FAILED;
+   }
+   struct inode* inode = NULL;
+   if (!(args->flags & MAP_ANONYMOUS)) {
+      inode = fd2inode(args->fd);
+      if (inode == NULL || (args->prot & PROT_WRITE) || args->offset % PG_SIZE != 0) {
+         return MAP_FAILED;
+      }
+   }
+
+   // addr只是建议, 没对齐或者与已有区域重叠时另找一段
+   uint32_t start = (uint32_t)args->addr;
+   if (start == 0 || start % PG_SIZE != 0 || start < USER_VADDR_START || start > KERNEL_BASE - len || \
+       vma_overlap(&cur->vma_list, start, start + len)) {
+      start = vma_get_unmapped(&cur->vma_list, len, PG_SIZE);
+      if (start == 0) {
+         return MAP_FAILED;
+      }
+   }
+   uint32_t vm_flags = VM_MMAP | (args->prot & PROT_WRITE ? 0 : VM_RDONLY);
+   if (!vma_add(&cur->vma_list, start, start + len, vm_flags)) {
+      return MAP_FAILED;
+   }
+   if (inode != NULL) {
+      // VM_MMAP区域不合并, 刚加入的区域正好是[start, start + len)
+      struct vm_area* vma = vma_find(&cur->vma_list, start);
+      enum intr_status old_status = intr_disable();
+      inode->i_open_cnts++;
+      intr_set_status(old_status);
+      vma->vm_inode = inode;
+      vma->vm_pgoff = args->offset / PG_SIZE;
+   }
+   return (void*)start;
+}
+
+// 解除[addr, addr + len)的映射, 范围内的页都要是mmap建立的, 可以只解除一个映射的一部分
+// 成功返回0, 失败返回-1
+int32_t sys_munmap(void* addr, uint32_t len) {
+   struct task_struct* cur = running_thread();
+   uint32_t start = (uint32_t)addr;
+   uint32_t pg_cnt = DIV_ROUND_UP(len, PG_SIZE);
+   if (cur->pgdir == NULL || start % PG_SIZE != 0 || start < USER_VADDR_START || start >= KERNEL_BASE || \
+       pg_cnt == 0 || pg_cnt > (KERNEL_BASE - start) / PG_SIZE) {
+      return -1;
+   }
+   uint32_t end = start + pg_cnt * PG_SIZE;
+   uint32_t vaddr = start;
+   while (vaddr < end) {
+      struct vm_area* vma = vma_find(&cur->vma_list, vaddr);
+      if (vma == NULL || !(vma->vm_flags & VM_MMAP)) {
+         return -1;
+      }
+      vaddr = vma->vm_end;
+   }
+   mfree_page(PF_USER, addr, pg_cnt);
+   return 0;
+}
+
+void mmap_init(void) {
+   lock_init(&mmap_lock);
+}
@@ -0,0 +1,31 @@
+#ifndef __KERNEL_MMAP_H
+#define __KERNEL_MMAP_H
+#include "stdint.h"
+#include "memory.h"
+#include "vma.h"
+
+// mmap的prot, 页总是可读的
+#define PROT_READ  1
+#define PROT_WRITE 2
+
+// mmap的flags, 只支持私有映射
+#define MAP_PRIVATE   2
+#define MAP_ANONYMOUS 0x20   // 不映射文件, 页的内容都是0, 忽略fd和offset
+
+#define MAP_FAILED ((void*)-1)
+
+// 系统调用最多传3个参数, mmap的参数打包在这里传入
+struct mmap_args {
+   void* addr;         // 建议的起始地址, 为NULL或者不可用时由内核挑选
+   uint32_t len;       // 映射的字节数, 向上取整到页
+   uint32_t prot;
+   uint32_t flags;
+   int32_t fd;         // 被映射的文件, 要以可读方式打开, 映射只能是只读的
+   uint32_t offset;    // 从文件中的这个偏移开始映射, 要按页对齐
+};
+
+void mmap_init(void);
+void* sys_mmap(struct mmap_args* args);
+int32_t sys_munmap(void* addr, uint32_t len);
+bool mmap_file_read(struct vm_area* vma, uint32_t vaddr, phys_addr_t frame);
+#endif
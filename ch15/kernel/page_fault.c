@@ -0,0 +1,58 @@
+#include "page_fault.h"
+#include "stdint.h"
+#include "global.h"
+#include "interrupt.h"
+#include "memory.h"
+#include "thread.h"
+#include "debug.h"
+#include "stdio-kernel.h"
+#include "wait_exit.h"
+
+// 缺页异常(0x0e)压入的错误码
+#define PF_ERR_P 1   // 0表示页不存在, 1表示违反了页级保护
+#define PF_ERR_W 2   // 1表示写操作引起
+#define PF_ERR_U 4   // 1表示在用户态(3特权级)引起
+
+// 缺页异常处理函数
+// vec_nr是kernel.S中VECTOR宏最后压入的中断号, 它就是intr_stack的第一个成员,
+// 所以取它的地址就得到了整个中断栈, 从中可以拿到cpu压入的错误码和eip
+static void page_fault_handler(uint32_t vec_nr) {
+   struct intr_stack* frame = (struct intr_stack*)&vec_nr;
+   uint32_t err_code = frame->err_code;
+   uint32_t vaddr;
+   // cr2 存放造成 page_fault 的地址
+   asm ("movl %%cr2, %0" : "=r" (vaddr));
+
+   struct task_struct* cur = running_thread();
+   if (cur->pgdir != NULL && vaddr < 0xc0000000) {
+      if (!(err_code & PF_ERR_P)) {
+         // 访问已保留但还未分配物理页的用户地址
+         if (demand_page_fault(vaddr, err_code & PF_ERR_W)) {
+            return;
+         }
+      } else if (err_code & PF_ERR_W) {
+         // 写共享页, 内核写用户缓冲区时也一样, 前提是cr0的WP位已置1
+         if (cow_page_fault(vaddr)) {
+            return;
+         }
+      }
+   }
+
+   printk("page fault: %s pid %d addr 0x%x eip 0x%x err %d\n", \
+          cur->name, cur->pid, vaddr, (uint32_t)frame->eip, err_code);
+   // 用户进程的非法访问只结束该进程, 内核中的缺页说明内核有bug
+   if (err_code & PF_ERR_U) {
+      sys_exit(-1);
+   }
+   PANIC("page fault in kernel");
+}
+
+// 注册缺页异常处理函数
+void page_fault_init(void) {
+   // 置cr0的WP位(第16位), 使内核对只读页的写操作也引起缺页, 这样写时复制对内核同样有效
+   uint32_t cr0;
+   asm volatile ("movl %%cr0, %0" : "=r" (cr0));
+   cr0 |= 0x00010000;
+   asm volatile ("movl %0, %%cr0" : : "r" (cr0) : "memory");
+   register_handler(0x0e, page_fault_handler);
+}
@@ -0,0 +1,4 @@
+#ifndef __KERNEL_PAGE_FAULT_H
+#define __KERNEL_PAGE_FAULT_H
+void page_fault_init(void);
+#endif
@@ -0,0 +1,205 @@
+#include "slab.h"
+#include "stdint.h"
+#include "global.h"
+#include "list.h"
+#include "sync.h"
+#include "memory.h"
+#include "string.h"
+#include "debug.h"
+#include "interrupt.h"
+
+#define BUFCTL_END 0xffff   // 空闲对象链表的结束标记
+
+// slab的元信息, 位于slab页的开头
+// 紧跟其后的是bufctl数组, bufctl[i]是空闲链表中第i个对象的下一个空闲对象的下标
+// 空闲链表不占用对象本身的空间, 所以对象释放后仍保持构造函数初始化过的状态
+struct slab {
+   struct kmem_cache* cache;   // 所属的缓存
+   struct list_elem slab_tag;  // 挂在cache的partial或full链表中
+   uint32_t inuse;             // 已分配出去的对象数
+   uint32_t free;              // 第一个空闲对象的下标
+};
+
+// 存放kmem_cache结构自身的缓存
+static struct kmem_cache cache_cache;
+// 所有缓存, 用于统计
+static struct list cache_list;
+
+static uint16_t* slab_bufctl(struct slab* slab) {
+   return (uint16_t*)(slab + 1);
+}
+
+static void* slab_obj(struct kmem_cache* cache, struct slab* slab, uint32_t idx) {
+   return (void*)((uint32_t)slab + cache->obj_offset + idx * cache->obj_size);
+}
+
+// 对象所在的slab就是对象所在的页
+static struct slab* obj2slab(void* obj) {
+   return (struct slab*)((uint32_t)obj & 0xfffff000);
+}
+
+// 初始化缓存cache, 计算一页能放下多少对象
+static void cache_setup(struct kmem_cache* cache, const char* name, uint32_t size, void (*ctor)(void*)) {
+   uint32_t name_len = strlen(name);
+   if (name_len >= CACHE_NAME_LEN) {
+      name_len = CACHE_NAME_LEN - 1;
+   }
+   memset(cache, 0, sizeof(struct kmem_cache));
+   memcpy(cache->name, name, name_len);
+
+   cache->obj_size = (size + 3) & ~3;
+   // 每个对象除自身外还需要2字节的bufctl
+   uint32_t cnt = (PG_SIZE - sizeof(struct slab)) / (cache->obj_size + sizeof(uint16_t));
+   uint32_t offset = (sizeof(struct slab) + cnt * sizeof(uint16_t) + 3) & ~3;
+   while (offset + cnt * cache->obj_size > PG_SIZE) {
+      cnt--;
+      offset = (sizeof(struct slab) + cnt * sizeof(uint16_t) + 3) & ~3;
+   }
+   ASSERT(cnt > 0);
+   cache->objs_per_slab = cnt;
+   cache->obj_offset = offset;
+   cache->ctor = ctor;
+
+   list_init(&cache->partial);
+   list_init(&cache->full);
+   lock_init(&cache->lock);
+   list_append(&cache_list, &cache->cache_tag);
+}
+
+// 为cache新建一个slab, 所有对象串成空闲链表
+static struct slab* slab_create(struct kmem_cache* cache) {
+   struct slab* slab = get_kernel_pages(1);
+   if (slab == NULL) {
+      return NULL;
+   }
+   slab->cache = cache;
+   slab->inuse = 0;
+   slab->free = 0;
+
+   uint16_t* bufctl = slab_bufctl(slab);
+   uint32_t idx;
+   for (idx = 0; idx < cache->objs_per_slab; idx++) {
+      bufctl[idx] = idx + 1;
+      if (cache->ctor != NULL) {
+         cache->ctor(slab_obj(cache, slab, idx));
+      }
+   }
+   bufctl[cache->objs_per_slab - 1] = BUFCTL_END;
+
+   cache->slab_cnt++;
+   cache->total_objs += cache->objs_per_slab;
+   return slab;
+}
+
+// 归还一个已全部空闲的slab
+static void slab_destroy(struct kmem_cache* cache, struct slab* slab) {
+   ASSERT(slab->inuse == 0);
+   cache->slab_cnt--;
+   cache->total_objs -= cache->objs_per_slab;
+   free_kernel_pages(slab, 1);
+}
+
+// 创建名为name, 对象大小为size的缓存, ctor为可选的构造函数
+struct kmem_cache* kmem_cache_create(const char* name, uint32_t size, void (*ctor)(void*)) {
+   ASSERT(size > 0 && size <= PG_SIZE / 2);
+   struct kmem_cache* cache = kmem_cache_alloc(&cache_cache);
+   if (cache == NULL) {
+      return NULL;
+   }
+   enum intr_status old_status = intr_disable();
+   cache_setup(cache, name, size, ctor);
+   intr_set_status(old_status);
+   return cache;
+}
+
+// 从cache中分配一个对象, 失败返回NULL
+// 对象的内容是构造函数初始化后的状态或上次释放时的状态, 不会被清0
+void* kmem_cache_alloc(struct kmem_cache* cache) {
+   lock_acquire(&cache->lock);
+   struct slab* slab;
+   if (list_empty(&cache->partial)) {
+      slab = slab_create(cache);
+      if (slab == NULL) {
+         lock_release(&cache->lock);
+         return NULL;
+      }
+      list_push(&cache->partial, &slab->slab_tag);
+   } else {
+      slab = elem2entry(struct slab, slab_tag, cache->partial.head.next);
+   }
+
+   uint16_t* bufctl = slab_bufctl(slab);
+   uint32_t idx = slab->free;
+   ASSERT(idx != BUFCTL_END);
+   slab->free = bufctl[idx];
+   // 最后一个空闲对象也分出去了, 转到full链表
+   if (++slab->inuse == cache->objs_per_slab) {
+      list_remove(&slab->slab_tag);
+      list_push(&cache->full, &slab->slab_tag);
+   }
+   cache->active_objs++;
+   cache->alloc_cnt++;
+   lock_release(&cache->lock);
+   return slab_obj(cache, slab, idx);
+}
+
+// 分配一个对象并清0, 用于替换原先依赖sys_malloc清0语义的地方
+void* kmem_cache_zalloc(struct kmem_cache* cache) {
+   void* obj = kmem_cache_alloc(cache);
+   if (obj != NULL) {
+      memset(obj, 0, cache->obj_size);
+   }
+   return obj;
+}
+
+// 将obj归还给cache
+void kmem_cache_free(struct kmem_cache* cache, void* obj) {
+   ASSERT(obj != NULL);
+   struct slab* slab = obj2slab(obj);
+   ASSERT(slab->cache == cache);
+   uint32_t idx = ((uint32_t)obj - (uint32_t)slab - cache->obj_offset) / cache->obj_size;
+   ASSERT(idx < cache->objs_per_slab && slab->inuse > 0);
+
+   lock_acquire(&cache->lock);
+   uint16_t* bufctl = slab_bufctl(slab);
+   bufctl[idx] = slab->free;
+   slab->free = idx;
+   if (slab->inuse-- == cache->objs_per_slab) {
+      // 原先是满的, 现在有了空闲对象
+      list_remove(&slab->slab_tag);
+      list_push(&cache->partial, &slab->slab_tag);
+   } else if (slab->inuse == 0 && cache->slab_cnt > 1) {
+      // 整个slab都空闲了, 若不是唯一的slab就还给内核内存池
+      list_remove(&slab->slab_tag);
+      slab_destroy(cache, slab);
+   }
+   cache->active_objs--;
+   lock_release(&cache->lock);
+}
+
+// 把cache_list中前max个缓存的使用情况填入infos, 返回填了几个, 供meminfo使用
+// 各缓存的计数在各自的锁下更新, 这里只关中断读一遍, 不保证彼此一致
+uint32_t kmem_cache_info(struct cache_info* infos, uint32_t max) {
+   uint32_t cnt = 0;
+   enum intr_status old_status = intr_disable();
+   struct list_elem* pelem = cache_list.head.next;
+   while (pelem != &cache_list.tail && cnt < max) {
+      struct kmem_cache* cache = elem2entry(struct kmem_cache, cache_tag, pelem);
+      struct cache_info* info = &infos[cnt++];
+      memcpy(info->name, cache->name, sizeof(info->name));
+      info->obj_size = cache->obj_size;
+      info->slabs = cache->slab_cnt;
+      info->total_objs = cache->total_objs;
+      info->active_objs = cache->active_objs;
+      info->allocs = cache->alloc_cnt;
+      pelem = pelem->next;
+   }
+   intr_set_status(old_status);
+   return cnt;
+}
+
+// 初始化slab分配器, 在mem_init中调用
+void kmem_cache_init(void) {
+   list_init(&cache_list);
+   cache_setup(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), NULL);
+}
@@ -0,0 +1,38 @@
+#ifndef __KERNEL_SLAB_H
+#define __KERNEL_SLAB_H
+#include "stdint.h"
+#include "list.h"
+#include "sync.h"
+
+#define CACHE_NAME_LEN 16
+
+// 对象缓存: 同一种固定大小的内核对象从这里分配, 每个slab占一页, 由若干个对象组成
+// 与sys_malloc相比, 不必遍历内存块描述符, 也不必抢内核内存池的全局锁
+struct kmem_cache {
+   char name[CACHE_NAME_LEN];
+   uint32_t obj_size;         // 对象大小, 已按4字节对齐
+   uint32_t objs_per_slab;    // 每个slab能容纳的对象数
+   uint32_t obj_offset;       // 第一个对象在slab页内的偏移
+   void (*ctor)(void*);       // 构造函数, 新建slab时对每个对象调用一次, 可以为NULL
+
+   struct list partial;       // 还有空闲对象的slab
+   struct list full;          // 对象都已分配出去的slab
+   struct lock lock;
+
+   // 使用情况统计
+   uint32_t slab_cnt;         // slab(页)数
+   uint32_t total_objs;       // 所有slab中的对象总数
+   uint32_t active_objs;      // 已分配出去的对象数
+   uint32_t alloc_cnt;        // 累计分配次数
+
+   struct list_elem cache_tag;   // 挂在全部缓存的链表cache_list中
+};
+
+void kmem_cache_init(void);
+struct kmem_cache* kmem_cache_create(const char* name, uint32_t size, void (*ctor)(void*));
+void* kmem_cache_alloc(struct kmem_cache* cache);
+void* kmem_cache_zalloc(struct kmem_cache* cache);
+void kmem_cache_free(struct kmem_cache* cache, void* obj);
+struct cache_info;
+uint32_t kmem_cache_info(struct cache_info* infos, uint32_t max);
+#endif
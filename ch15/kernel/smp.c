@@ -0,0 +1,605 @@
+#include "smp.h"
+#include "stdint.h"
+#include "global.h"
+#include "debug.h"
+#include "io.h"
+#include "interrupt.h"
+#include "memory.h"
+#include "thread.h"
+#include "sync.h"
+#include "tss.h"
+#include "apic.h"
+#include "clock.h"
+#include "timer.h"
+#include "string.h"
+#include "print.h"
+#include "stdio-kernel.h"
+
+// 多处理器: 从BIOS的MP表(没有时从ACPI的MADT)中找出各处理器的本地APIC ID和IOAPIC, 启用APIC后用INIT-SIPI唤醒各AP,
+// 每个AP有自己的gdt中的tss, idle线程和就绪队列(见thread.c), 以及本地APIC时钟.
+//
+// 内核中的互斥原来都靠关中断, 多个处理器同时进内核时关中断挡不住别的处理器, 所以加一把大内核锁:
+// 进内核(中断, 异常, 系统调用的入口)时拿锁, 回到用户态时放锁, 同一时刻只有一个处理器在内核中执行,
+// 原有的关中断, 信号量和锁都照旧有效. 用户态的计算可以在各处理器上同时进行.
+// 任务切换时锁由换下的任务交给换上的任务; idle在hlt前放锁, 被中断唤醒时在入口处重新拿锁.
+// 嵌套进内核时只计数, 层数记在任务的lock_depth中
+//
+// 信号量(锁也是用它实现的)各有一把自旋锁保护自己的value和等待队列, 不再只靠关中断, 拆细大内核锁时锁本身不用再改;
+// 但阻塞和唤醒要动就绪队列, 调度器还没有自己的锁, 所以现在一切仍在大内核锁之下, 用户态之外还不能并行
+//
+// 有些全局状态只靠关中断互斥, 在多处理器上正确全靠这把锁: kmap唯一的槽位, 预清零, malloc和堆的统计,
+// ksmd和kswapd的扫描位置和统计, 交换槽位的引用计数. 它们在定义处都注明了, 以后把大内核锁拆细时要逐个加上自旋锁
+//
+// 大内核锁管不到用户态: 别的处理器可能正在用户态运行某个进程, tlb中缓存着它的页表项.
+// ksmd和kswapd改别的进程的页表项后要释放或共享原来的页框, 没有tlb shootdown, 所以跳过正在别的处理器上运行的进程
+// (见memory.c中的task_on_other_cpu). 以后要改正在运行的进程的页表项, 得先加上shootdown
+
+#define MP_FPS_SIG   0x5f504d5f   // "_MP_"
+#define MP_CONF_SIG  0x504d4350   // "PCMP"
+#define BIOS_EBDA_SEG 0x40e       // BIOS数据区中扩展BIOS数据区(EBDA)的段地址
+#define BIOS_BASE_KB  0x413       // BIOS数据区中常规内存的KB数
+
+#define MP_PROCESSOR 0
+#define MP_BUS       1
+#define MP_IOAPIC    2
+#define MP_INTSRC    3
+#define MP_CPU_EN    0x01         // 处理器项的标志: 可用
+#define MP_CPU_BSP   0x02         // 处理器项的标志: 启动处理器
+#define MP_INT       0            // 中断源项的类型: 向量中断
+#define MP_IMCRP     0x80         // MP浮动指针的特性字节2: 有IMCR, 8259A在PIC模式下直连处理器
+
+#define ACPI_RSDP_SIG0 0x20445352 // "RSD "
+#define ACPI_RSDP_SIG1 0x20525450 // "PTR "
+#define ACPI_MADT_SIG  0x43495041 // "APIC"
+#define ACPI_RSDT_SIG  0x54445352 // "RSDT"
+#define MADT_LAPIC     0          // MADT表项的类型: 处理器的本地APIC
+#define MADT_IOAPIC    1
+#define MADT_INTSRC    2          // 中断源重定向, ISA中断不接在同号引脚上时才有
+#define MADT_LAPIC_EN  0x01       // 本地APIC项的标志: 可用
+
+#define IMCR_ADDR    0x22
+#define IMCR_DATA    0x23
+
+#define ISA_IRQ_CNT  16
+#define AP_BOOT_ADDR 0x70000      // 与ap_boot.S一致
+
+// MP浮动指针, 在BIOS的内存中按16字节对齐存放
+struct mp_fps {
+   uint32_t signature;
+   uint32_t config;               // MP配置表的物理地址, 为0表示使用默认配置
+   uint8_t length;                // 以16字节为单位
+   uint8_t spec_rev;
+   uint8_t checksum;
+   uint8_t feature1;
+   uint8_t feature2;
+   uint8_t feature_reserved[3];
+} __attribute__((packed));
+
+// MP配置表的表头, 后面紧跟entry_cnt个长度不等的表项
+struct mp_config {
+   uint32_t signature;
+   uint16_t length;
+   uint8_t spec_rev;
+   uint8_t checksum;
+   char oem[8];
+   char product[12];
+   uint32_t oem_table;
+   uint16_t oem_size;
+   uint16_t entry_cnt;
+   uint32_t lapic_addr;           // 本地APIC寄存器的物理地址
+   uint16_t ext_length;
+   uint8_t ext_checksum;
+   uint8_t reserved;
+} __attribute__((packed));
+
+struct mp_processor {
+   uint8_t type;
+   uint8_t apic_id;
+   uint8_t apic_ver;
+   uint8_t flags;
+   uint32_t signature;
+   uint32_t features;
+   uint32_t reserved[2];
+} __attribute__((packed));
+
+struct mp_bus {
+   uint8_t type;
+   uint8_t bus_id;
+   char bus_type[6];
+} __attribute__((packed));
+
+struct mp_ioapic {
+   uint8_t type;
+   uint8_t apic_id;
+   uint8_t apic_ver;
+   uint8_t flags;
+   uint32_t addr;
+} __attribute__((packed));
+
+struct mp_intsrc {
+   uint8_t type;
+   uint8_t irq_type;
+   uint16_t flags;                // 第0~1位是极性, 3表示低电平有效; 第2~3位是触发方式, 3表示电平触发
+   uint8_t src_bus;
+   uint8_t src_irq;
+   uint8_t dst_apic;
+   uint8_t dst_pin;
+} __attribute__((packed));
+
+// ACPI的根系统描述指针, 和MP浮动指针一样在BIOS的内存中按16字节对齐存放, 只用ACPI 1.0的部分
+struct acpi_rsdp {
+   uint32_t signature[2];
+   uint8_t checksum;              // 前20字节之和为0
+   char oem[6];
+   uint8_t revision;
+   uint32_t rsdt;                 // RSDT的物理地址
+} __attribute__((packed));
+
+// ACPI各个系统描述表共同的表头, RSDT的表头后是各表的32位物理地址
+struct acpi_header {
+   uint32_t signature;
+   uint32_t length;               // 含表头的整个表的字节数, 全部字节之和为0
+   uint8_t revision;
+   uint8_t checksum;
+   char oem[6];
+   char oem_table[8];
+   uint32_t oem_revision;
+   uint32_t creator;
+   uint32_t creator_revision;
+} __attribute__((packed));
+
+// 多APIC描述表(MADT), 后面是长度不等的表项, 每项的头两个字节是类型和长度
+struct acpi_madt {
+   struct acpi_header header;
+   uint32_t lapic_addr;
+   uint32_t flags;
+} __attribute__((packed));
+
+struct madt_lapic {
+   uint8_t type;
+   uint8_t length;
+   uint8_t acpi_id;
+   uint8_t apic_id;
+   uint32_t flags;
+} __attribute__((packed));
+
+struct madt_ioapic {
+   uint8_t type;
+   uint8_t length;
+   uint8_t apic_id;
+   uint8_t reserved;
+   uint32_t addr;
+   uint32_t gsi_base;             // 第0个引脚对应的全局中断号
+} __attribute__((packed));
+
+struct madt_intsrc {
+   uint8_t type;
+   uint8_t length;
+   uint8_t bus;                   // 总是0, 即ISA
+   uint8_t src_irq;
+   uint32_t gsi;
+   uint16_t flags;                // 与MP表的中断源项相同: 第0~1位是极性, 第2~3位是触发方式
+} __attribute__((packed));
+
+// ISA中断号接在IOAPIC的哪个引脚上, MP表中没有说明的就是同号引脚
+struct isa_irq {
+   uint8_t pin;
+   bool active_low;
+   bool level;
+};
+
+// 与ap_boot.S中的ap_boot_args一致
+struct ap_boot_args {
+   uint32_t cr0;
+   uint32_t cr3;
+   uint32_t cr4;
+   uint32_t nx;
+   uint32_t stack;
+   void (*entry)(void);
+};
+
+extern uint8_t ap_boot_start[], ap_boot_end[], ap_boot_args[];
+
+struct cpu cpus[NR_CPUS];
+uint32_t cpu_cnt;                 // 已经在运行的处理器数, 它们是cpus[0]到cpus[cpu_cnt - 1]
+
+// 大内核锁, BSP从启动起就在内核中, 所以一开始就是锁上的
+static struct spinlock kernel_lock = {1};
+
+static uint8_t cpu_apic_ids[NR_CPUS];   // MP表中可用处理器的本地APIC ID, BSP在第0个; 用MADT时第0个不用
+static uint32_t cpu_found;
+static phys_addr_t lapic_addr;
+static phys_addr_t ioapic_addr;         // 只用第一个IOAPIC, 为0表示没有找到
+static uint8_t ioapic_id;
+static bool imcr_present;
+static struct isa_irq isa_irqs[ISA_IRQ_CNT];
+static uint8_t acpi_buf[PG_SIZE];      // ACPI表可能在直接映射区外, 复制到这里再解析
+
+// 当前处理器
+struct cpu* this_cpu(void) {
+   return &cpus[running_thread()->cpu];
+}
+
+// 所有处理器都在运行idle且没有就绪的任务
+bool cpus_idle(void) {
+   uint32_t cpu_idx;
+   for (cpu_idx = 0; cpu_idx < cpu_cnt; cpu_idx++) {
+      if (cpus[cpu_idx].curr != cpus[cpu_idx].idle || cpus[cpu_idx].nr_ready != 0) {
+         return false;
+      }
+   }
+   return true;
+}
+
+// 通知处理器c重新调度, 须关中断调用
+void smp_send_resched(struct cpu* c) {
+   if (apic_enabled() && c->online) {
+      lapic_send_ipi(c->apic_id, RESCHED_VECTOR);
+   }
+}
+
+// 重新调度的处理器间中断, 发送方已经置了need_resched, 这里可能已经在别的中断中调度过了
+static void intr_resched_handler(void) {
+   if (this_cpu()->need_resched) {
+      schedule();
+   }
+}
+
+// 进入内核, 由kernel.S中各中断入口在保存上下文后调用, 最外层时拿大内核锁
+// idle在hlt期间放开了锁, 唤醒它的中断拿到锁后先恢复停掉的时钟
+void kernel_lock_enter(void) {
+   struct task_struct* cur = running_thread();
+   if (cur->lock_depth++ == 0) {
+      spin_lock(&kernel_lock);
+      if (cur == cpus[cur->cpu].idle) {
+         tick_resume();
+      }
+   }
+}
+
+// 当前任务是否在内核中持有大内核锁, 只有idle在hlt前后的一小段不持有
+bool kernel_lock_held(void) {
+   return running_thread()->lock_depth > 0;
+}
+
+// 离开内核, 由intr_exit在恢复上下文前调用, 回到最外层时放开大内核锁
+void kernel_lock_exit(void) {
+   struct task_struct* cur = running_thread();
+   ASSERT(cur->lock_depth > 0);
+   if (--cur->lock_depth == 0) {
+      spin_unlock(&kernel_lock);
+   }
+}
+
+static uint8_t mp_checksum(void* addr, uint32_t len) {
+   uint8_t* p = addr;
+   uint8_t sum = 0;
+   while (len-- > 0) {
+      sum += *p++;
+   }
+   return sum;
+}
+
+// 在物理地址[start, start + len)中找MP浮动指针
+static struct mp_fps* mp_scan(uint32_t start, uint32_t len) {
+   uint32_t addr;
+   for (addr = start; addr + sizeof(struct mp_fps) <= start + len; addr += 16) {
+      struct mp_fps* fps = P2V(addr);
+      if (fps->signature == MP_FPS_SIG && fps->length == 1 && mp_checksum(fps, sizeof(struct mp_fps)) == 0) {
+         return fps;
+      }
+   }
+   return NULL;
+}
+
+// 按MP规范的顺序找MP浮动指针: EBDA的第一个KB, 常规内存的最后一个KB, 0xf0000起的BIOS ROM
+static struct mp_fps* mp_find(void) {
+   struct mp_fps* fps = NULL;
+   uint32_t ebda = (uint32_t)*(uint16_t*)P2V(BIOS_EBDA_SEG) << 4;
+   if (ebda != 0) {
+      fps = mp_scan(ebda, 1024);
+   }
+   if (fps == NULL) {
+      fps = mp_scan(((uint32_t)*(uint16_t*)P2V(BIOS_BASE_KB) - 1) * 1024, 1024);
+   }
+   if (fps == NULL) {
+      fps = mp_scan(0xf0000, 0x10000);
+   }
+   return fps;
+}
+
+// ISA中断先都按接在IOAPIC同号引脚上, 高电平有效, 边沿触发, 再按MP表或MADT修正
+static void isa_irq_defaults(void) {
+   uint8_t irq;
+   for (irq = 0; irq < ISA_IRQ_CNT; irq++) {
+      isa_irqs[irq].pin = irq;
+      isa_irqs[irq].active_low = isa_irqs[irq].level = false;
+   }
+}
+
+// 按中断源项的标志设置ISA中断irq的极性和触发方式, MP表和MADT的标志格式相同
+static void isa_irq_set(uint8_t irq, uint8_t pin, uint16_t flags) {
+   isa_irqs[irq].pin = pin;
+   isa_irqs[irq].active_low = (flags & 0x3) == 0x3;
+   isa_irqs[irq].level = ((flags >> 2) & 0x3) == 0x3;
+}
+
+// 解析MP配置表, 记下可用的处理器, 第一个IOAPIC和ISA中断的接线, 有本地APIC和IOAPIC时返回true
+// 没有配置表(默认配置)的老机器不支持, 仍按单处理器用8259A
+static bool mp_parse(void) {
+   struct mp_fps* fps = mp_find();
+   if (fps == NULL || fps->config == 0 || fps->config >= 0x100000) {
+      return false;
+   }
+   struct mp_config* conf = P2V(fps->config);
+   if (conf->signature != MP_CONF_SIG || mp_checksum(conf, conf->length) != 0) {
+      return false;
+   }
+   imcr_present = fps->feature2 & MP_IMCRP;
+   lapic_addr = conf->lapic_addr;
+
+   isa_irq_defaults();
+   uint8_t isa_bus = 0xff;
+   uint8_t* entry = (uint8_t*)(conf + 1);
+   uint32_t entry_idx;
+   cpu_found = 1;      // 第0个留给BSP
+   for (entry_idx = 0; entry_idx < conf->entry_cnt; entry_idx++) {
+      switch (*entry) {
+         case MP_PROCESSOR: {
+            struct mp_processor* proc = (struct mp_processor*)entry;
+            if (proc->flags & MP_CPU_BSP) {
+               cpu_apic_ids[0] = proc->apic_id;
+            } else if ((proc->flags & MP_CPU_EN) && cpu_found < NR_CPUS) {
+               cpu_apic_ids[cpu_found++] = proc->apic_id;
+            }
+            entry += sizeof(struct mp_processor);
+            break;
+         }
+         case MP_BUS: {
+            struct mp_bus* bus = (struct mp_bus*)entry;
+            if (!memcmp(bus->bus_type, "ISA", 3)) {
+               isa_bus = bus->bus_id;
+            }
+            entry += sizeof(struct mp_bus);
+            break;
+         }
+         case MP_IOAPIC: {
+            struct mp_ioapic* io = (struct mp_ioapic*)entry;
+            if ((io->flags & MP_CPU_EN) && ioapic_addr == 0) {
+               ioapic_addr = io->addr;
+               ioapic_id = io->apic_id;
+            }
+            entry += sizeof(struct mp_ioapic);
+            break;
+         }
+         case MP_INTSRC: {
+            // 总线项在中断源项之前, 这时已经知道ISA总线的编号
+            struct mp_intsrc* src = (struct mp_intsrc*)entry;
+            if (src->irq_type == MP_INT && src->src_bus == isa_bus && src->src_irq < ISA_IRQ_CNT && \
+                (src->dst_apic == ioapic_id || src->dst_apic == 0xff)) {
+               isa_irq_set(src->src_irq, src->dst_pin, src->flags);
+            }
+            entry += sizeof(struct mp_intsrc);
+            break;
+         }
+         default:      // 本地中断项等, 都是8字节
+            entry += 8;
+      }
+   }
+   return lapic_addr != 0 && ioapic_addr != 0;
+}
+
+// 把物理地址paddr起的len字节复制到buf. ACPI表一般在内存的顶端, 可能在直接映射区外, 也可能跨页, 所以逐页kmap
+// 启动AP之前关中断调用
+static void acpi_copy(void* buf, phys_addr_t paddr, uint32_t len) {
+   uint8_t* dst = buf;
+   while (len > 0) {
+      uint32_t offset = (uint32_t)paddr & (PG_SIZE - 1);
+      uint32_t size = PG_SIZE - offset < len ? PG_SIZE - offset : len;
+      uint8_t* src = kmap(paddr - offset);
+      memcpy(dst, src + offset, size);
+      kunmap(src);
+      dst += size;
+      paddr += size;
+      len -= size;
+   }
+}
+
+// 把物理地址paddr处签名为signature的ACPI表读到acpi_buf中, 成功返回true
+static bool acpi_load(phys_addr_t paddr, uint32_t signature) {
+   struct acpi_header* header = (struct acpi_header*)acpi_buf;
+   acpi_copy(acpi_buf, paddr, sizeof(struct acpi_header));
+   if (header->signature != signature || header->length < sizeof(struct acpi_header) || \
+       header->length > sizeof(acpi_buf)) {
+      return false;
+   }
+   acpi_copy(acpi_buf, paddr, header->length);
+   return mp_checksum(acpi_buf, header->length) == 0;
+}
+
+// 在物理地址[start, start + len)中找ACPI的根系统描述指针
+static struct acpi_rsdp* acpi_scan(uint32_t start, uint32_t len) {
+   uint32_t addr;
+   for (addr = start; addr + sizeof(struct acpi_rsdp) <= start + len; addr += 16) {
+      struct acpi_rsdp* rsdp = P2V(addr);
+      if (rsdp->signature[0] == ACPI_RSDP_SIG0 && rsdp->signature[1] == ACPI_RSDP_SIG1 && \
+          mp_checksum(rsdp, sizeof(struct acpi_rsdp)) == 0) {
+         return rsdp;
+      }
+   }
+   return NULL;
+}
+
+// 解析ACPI的MADT, 记下的内容和mp_parse一样, 供没有MP表的机器使用
+// MADT不标明哪个是BSP, 所有可用的处理器都记下, smp_init按本地APIC ID跳过BSP.
+// MADT不说明有没有IMCR, 有IMCR的老机器总会有MP表, 所以这里不管它
+static bool acpi_parse(void) {
+   uint32_t ebda = (uint32_t)*(uint16_t*)P2V(BIOS_EBDA_SEG) << 4;
+   struct acpi_rsdp* rsdp = ebda != 0 ? acpi_scan(ebda, 1024) : NULL;
+   if (rsdp == NULL) {
+      rsdp = acpi_scan(0xe0000, 0x20000);
+   }
+   if (rsdp == NULL || !acpi_load(rsdp->rsdt, ACPI_RSDT_SIG)) {
+      return false;
+   }
+
+   // 先从RSDT中找出MADT的地址, 再把MADT读到同一个缓冲区中
+   struct acpi_header* rsdt = (struct acpi_header*)acpi_buf;
+   uint32_t* tables = (uint32_t*)(rsdt + 1);
+   uint32_t table_cnt = (rsdt->length - sizeof(struct acpi_header)) / 4;
+   phys_addr_t madt_addr = 0;
+   uint32_t table_idx;
+   for (table_idx = 0; table_idx < table_cnt && madt_addr == 0; table_idx++) {
+      struct acpi_header header;
+      acpi_copy(&header, tables[table_idx], sizeof(header));
+      if (header.signature == ACPI_MADT_SIG) {
+         madt_addr = tables[table_idx];
+      }
+   }
+   if (madt_addr == 0 || !acpi_load(madt_addr, ACPI_MADT_SIG)) {
+      return false;
+   }
+
+   struct acpi_madt* madt = (struct acpi_madt*)acpi_buf;
+   imcr_present = false;
+   lapic_addr = madt->lapic_addr;
+   ioapic_addr = 0;
+   isa_irq_defaults();
+   uint32_t gsi_base = 0;
+   uint8_t* entry = (uint8_t*)(madt + 1);
+   uint8_t* end = acpi_buf + madt->header.length;
+   cpu_found = 1;      // 第0个不用
+   while (entry + 2 <= end && entry[1] >= 2 && entry + entry[1] <= end) {
+      switch (entry[0]) {
+         case MADT_LAPIC: {
+            struct madt_lapic* proc = (struct madt_lapic*)entry;
+            if ((proc->flags & MADT_LAPIC_EN) && cpu_found < NR_CPUS) {
+               cpu_apic_ids[cpu_found++] = proc->apic_id;
+            }
+            break;
+         }
+         case MADT_IOAPIC: {
+            struct madt_ioapic* io = (struct madt_ioapic*)entry;
+            if (ioapic_addr == 0) {
+               ioapic_addr = io->addr;
+               ioapic_id = io->apic_id;
+               gsi_base = io->gsi_base;
+            }
+            break;
+         }
+         case MADT_INTSRC: {
+            // 全局中断号减去IOAPIC的起始中断号就是引脚号, IOAPIC项在中断源项之前
+            struct madt_intsrc* src = (struct madt_intsrc*)entry;
+            if (src->bus == 0 && src->src_irq < ISA_IRQ_CNT && ioapic_addr != 0 && src->gsi >= gsi_base) {
+               isa_irq_set(src->src_irq, src->gsi - gsi_base, src->flags);
+            }
+            break;
+         }
+      }
+      entry += entry[1];
+   }
+   return lapic_addr != 0 && ioapic_addr != 0;
+}
+
+// 把ISA中断irq经IOAPIC送到BSP, 向量号与8259A时一样
+static void isa_irq_route(uint8_t irq) {
+   struct isa_irq* isa = &isa_irqs[irq];
+   ioapic_route(isa->pin, 0x20 + irq, cpus[0].apic_id, isa->active_low, isa->level);
+}
+
+// AP在ap_boot.S中开启分页后跳到这里, 运行在为它准备的idle线程的栈上
+static void ap_main(void) {
+   struct cpu* c = this_cpu();
+   tss_ap_init(c->id);
+   idt_load();
+   lapic_init(false);
+   lapic_timer_start();
+   // 先报告启动成功再等锁, BSP在smp_init中等着这个标志, 那时它持有大内核锁
+   c->online = true;
+   spin_lock(&kernel_lock);
+   cpu_idle();
+}
+
+// 启动处理器c, 成功返回true
+// 按MP规范: 发INIT, 等10毫秒, 发SIPI, 没有反应就再发一次, 最多等100毫秒
+static bool ap_start(struct cpu* c, struct ap_boot_args* args) {
+   struct task_struct* idle = idle_thread_create(c->id);
+   idle->status = TASK_RUNNING;
+   c->curr = idle;
+   args->stack = (uint32_t)idle + PG_SIZE;
+   args->entry = ap_main;
+
+   lapic_send_init(c->apic_id);
+   udelay(10000);
+   uint32_t try;
+   for (try = 0; try < 2 && !c->online; try++) {
+      lapic_send_startup(c->apic_id, AP_BOOT_ADDR);
+      udelay(200);
+   }
+   uint32_t wait_ms;
+   for (wait_ms = 0; wait_ms < 100 && !c->online; wait_ms++) {
+      udelay(1000);
+   }
+   if (!c->online) {
+      // 再发一次INIT让它停下来, 以免它晚些时候用上已经回收的栈
+      lapic_send_init(c->apic_id);
+      c->idle = c->curr = NULL;
+      thread_exit(idle, false);
+      return false;
+   }
+   return true;
+}
+
+// 启用APIC, 启动所有AP, 要在tss_init和clock_init之后, 开中断之前调用
+void smp_init(void) {
+   put_str("smp_init start\n");
+   cpus[0].online = true;
+   if (!mp_parse() && !acpi_parse()) {
+      put_str("   no MP table or ACPI MADT, single processor with 8259A\n");
+      return;
+   }
+
+   // 外部中断从8259A改走IOAPIC: PIC模式下还要经IMCR把8259A从处理器的INTR引脚上断开
+   if (imcr_present) {
+      outb(IMCR_ADDR, 0x70);
+      outb(IMCR_DATA, inb(IMCR_DATA) | 0x01);
+   }
+   pic_disable();
+   lapic_setup(lapic_addr);
+   cpus[0].apic_id = lapic_id();
+   ioapic_setup(ioapic_addr);
+   isa_irq_route(0);    // 时钟
+   isa_irq_route(1);    // 键盘
+   isa_irq_route(14);   // 硬盘
+   lapic_timer_calibrate();
+   register_handler(RESCHED_VECTOR, intr_resched_handler);
+
+   // 启动代码复制到低端, AP开启分页时还在那里执行, 要临时恢复低端的恒等映射
+   memcpy(P2V(AP_BOOT_ADDR), ap_boot_start, ap_boot_end - ap_boot_start);
+   struct ap_boot_args* args = P2V(AP_BOOT_ADDR + (ap_boot_args - ap_boot_start));
+   asm volatile ("movl %%cr0, %0" : "=r" (args->cr0));
+   asm volatile ("movl %%cr4, %0" : "=r" (args->cr4));
+   args->cr3 = kernel_cr3;
+#ifdef CONFIG_PAE
+   args->nx = pg_nx != 0;
+#else
+   args->nx = 0;
+#endif
+   identity_map_low(true);
+   uint32_t found_idx;
+   for (found_idx = 1; found_idx < cpu_found; found_idx++) {
+      struct cpu* c = &cpus[cpu_cnt];
+      c->apic_id = cpu_apic_ids[found_idx];
+      if (c->apic_id == cpus[0].apic_id) {
+         continue;
+      }
+      if (ap_start(c, args)) {
+         cpu_cnt++;
+      } else {
+         printk("   cpu with apic id %d failed to start\n", c->apic_id);
+      }
+   }
+   identity_map_low(false);
+   printk("   %d cpus online\n", cpu_cnt);
+   put_str("smp_init done\n");
+}
@@ -0,0 +1,33 @@
+#ifndef __KERNEL_SMP_H
+#define __KERNEL_SMP_H
+#include "stdint.h"
+#include "global.h"
+#include "list.h"
+#include "thread.h"
+
+#define NR_CPUS 8      // 最多支持的处理器数
+
+// 每个处理器的调度状态, cpus[0]是启动处理器(BSP), 其余是应用处理器(AP)
+struct cpu {
+   uint8_t id;                           // 在cpus中的下标, 任务的cpu字段就是它
+   uint8_t apic_id;                      // 本地APIC的ID, 发处理器间中断时用
+   volatile bool online;                 // AP启动后自己置位
+   struct task_struct* idle;             // 本处理器的idle线程, 不进就绪队列
+   struct task_struct* curr;             // 正在本处理器上运行的任务
+   struct list ready_queue[MLFQ_LEVELS]; // 本处理器的多级反馈队列
+   uint32_t ready_bitmap;                // 第i位表示第i级队列非空
+   uint32_t nr_ready;                    // 就绪任务数, 负载均衡时比较
+   bool need_resched;                    // 唤醒了级别更高的任务, 下一个时钟中断或处理器间中断时切换
+   bool tick_stopped;                    // AP空闲时停掉了本地APIC时钟(见tick_stop)
+};
+
+extern struct cpu cpus[NR_CPUS];
+extern uint32_t cpu_cnt;
+struct cpu* this_cpu(void);
+bool cpus_idle(void);
+void smp_send_resched(struct cpu* c);
+void kernel_lock_enter(void);
+bool kernel_lock_held(void);
+void kernel_lock_exit(void);
+void smp_init(void);
+#endif
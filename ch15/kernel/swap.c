@@ -0,0 +1,216 @@
+#include "swap.h"
+#include "stdint.h"
+#include "global.h"
+#include "debug.h"
+#include "interrupt.h"
+#include "memory.h"
+#include "thread.h"
+#include "sync.h"
+#include "ide.h"
+#include "string.h"
+#include "stdio-kernel.h"
+
+// 交换: 用户内存池的页框不够用时, 把最近没有访问过的用户页写到交换分区, 页表项中记下槽位号,
+// 进程再访问时在缺页异常中读回来(见demand_page_fault)
+//
+// 交换分区在启动时选定: 编译时加 DEFS='-DCONFIG_SWAP_PART=\"sdb9\"' 按名字指定,
+// 否则用分区表中类型为0x82的第一个分区, 都没有就不启用交换. 文件系统不会格式化交换分区
+//
+// 换出由kswapd在后台完成, 空闲页框少于SWAP_LOW_PAGES时被唤醒; 已经一页都分不到时分配者当场换出
+// 挑选换出的页用时钟算法: 指针按pid顺序扫过所有进程存在的页, 处理器访问页时会置页表项的访问位,
+// 指针经过时访问位为1就清0, 给它第二次机会, 访问位为0说明指针转一圈的时间里都没有用过, 换出它
+//
+// 只换出只有一个页表项在用的普通页框, 写时复制或ksmd共享的页框要改所有映射它的页表项, 不换出
+
+#define SWAP_SECS_PER_SLOT (PG_SIZE / 512)
+
+struct partition* swap_part;
+struct swap_stat swap_stat;
+static uint8_t* slot_refs;     // 每个槽位被多少个页表项引用, fork时共享, 为0表示空闲
+static uint32_t slot_hint;     // 下一次从这里开始找空闲槽位
+static struct lock swap_lock;  // 读写交换分区时持有, 保护swap_buf
+static uint8_t swap_buf[PG_SIZE];   // 页框不一定在直接映射区中, 而kmap要关中断, 读写硬盘时经这里中转
+static struct task_struct* kswapd_thread;
+
+// 统计, 槽位的引用计数和下面的时钟指针都只靠关中断互斥, 多处理器上还依赖大内核锁(见smp.c)
+static pid_t hand_pid;         // 时钟指针所在的进程, 为0表示新的一圈还没开始
+static uint32_t hand_vaddr;    // 时钟指针在该进程中的用户虚拟地址
+
+// 分配一个空闲槽位, 没有时返回-1, 须关中断调用
+static int32_t slot_alloc(void) {
+   uint32_t cnt = 0;
+   while (cnt++ < swap_stat.slots) {
+      uint32_t slot = slot_hint;
+      slot_hint = (slot_hint + 1) % swap_stat.slots;
+      if (slot_refs[slot] == 0) {
+         slot_refs[slot] = 1;
+         swap_stat.slots_used++;
+         return slot;
+      }
+   }
+   return -1;
+}
+
+// 页表项被复制(fork)时增加槽位的引用
+void swap_dup(uint32_t slot) {
+   enum intr_status old_status = intr_disable();
+   ASSERT(slot_refs[slot] > 0 && slot_refs[slot] < 255);
+   slot_refs[slot]++;
+   intr_set_status(old_status);
+}
+
+// 释放页表项对槽位的引用, 减到0时槽位空闲
+void swap_free(uint32_t slot) {
+   enum intr_status old_status = intr_disable();
+   ASSERT(slot_refs[slot] > 0);
+   if (--slot_refs[slot] == 0) {
+      swap_stat.slots_used--;
+   }
+   intr_set_status(old_status);
+}
+
+// 转动时钟指针找一个可以换出的页, 最多转两圈, 找到时指针停在这一页上, 返回它的页表项
+// 须关中断调用. 直接换出时当前进程的页表项可能在本处理器的tlb中, 所以改了访问位要刷新;
+// 正在别的处理器上运行的进程那边的tlb项刷不掉, task_next_pte跳过这样的进程
+static pte_t* clock_pick(void) {
+   uint32_t laps = 0;
+   while (laps < 2) {
+      struct task_struct* proc = hand_pid == 0 ? NULL : pid2thread(hand_pid);
+      pte_t* pte = (proc != NULL && proc->pgdir != NULL) ? task_next_pte(proc, &hand_vaddr) : NULL;
+      if (pte == NULL) {   // 这个进程转完了或者已经退出, 换下一个
+         proc = next_process(hand_pid);
+         if (proc == NULL) {
+            laps++;
+         }
+         hand_pid = proc != NULL ? proc->pid : 0;
+         hand_vaddr = 0;
+         continue;
+      }
+      if (page_mergeable(PTE_ADDR(*pte))) {
+         if (!(*pte & PG_A)) {
+            return pte;
+         }
+         *pte &= ~PG_A;
+         asm volatile ("invlpg %0"::"m" (*(char*)hand_vaddr):"memory");
+      }
+      hand_vaddr += PG_SIZE;
+   }
+   return NULL;
+}
+
+// 换出一页, 成功返回true; 没有交换分区, 槽位用完或者找不到可以换出的页时返回false
+// 先清掉页表项的脏位, 复制页框后开中断写盘, 写完确认页表项没有变过(没被访问, 没被改写)才真正换出.
+// 写盘期间进程可能被调度到别的处理器上, 这时task_pte_ptr返回NULL, 放弃这次换出
+bool swap_out_page(void) {
+   if (swap_part == NULL) {
+      return false;
+   }
+   lock_acquire(&swap_lock);
+   enum intr_status old_status = intr_disable();
+   int32_t slot = slot_alloc();
+   pte_t* pte = slot == -1 ? NULL : clock_pick();
+   if (pte == NULL) {
+      if (slot != -1) {
+         swap_free(slot);
+      }
+      intr_set_status(old_status);
+      lock_release(&swap_lock);
+      return false;
+   }
+   pid_t pid = hand_pid;
+   uint32_t vaddr = hand_vaddr;
+   hand_vaddr += PG_SIZE;
+   *pte &= ~PG_D;
+   asm volatile ("invlpg %0"::"m" (*(char*)vaddr):"memory");
+   pte_t old_pte = *pte;
+   phys_addr_t frame = PTE_ADDR(old_pte);
+   void* src = kmap(frame);
+   memcpy(swap_buf, src, PG_SIZE);
+   kunmap(src);
+   intr_set_status(old_status);
+
+   ide_write(swap_part->my_disk, swap_part->start_lba + slot * SWAP_SECS_PER_SLOT, swap_buf, SWAP_SECS_PER_SLOT);
+
+   old_status = intr_disable();
+   struct task_struct* proc = pid2thread(pid);
+   pte = (proc != NULL && proc->pgdir != NULL) ? task_pte_ptr(proc, vaddr) : NULL;
+   bool done = pte != NULL && *pte == old_pte && page_mergeable(frame);
+   if (done) {
+      *pte = SWAP_ENTRY(slot) | (old_pte & ~PTE_ADDR_MASK & ~(PG_P_1 | PG_A | PG_D));
+      asm volatile ("invlpg %0"::"m" (*(char*)vaddr):"memory");
+      pfree(frame);
+      swap_stat.swap_outs++;
+   } else {
+      swap_free(slot);
+      swap_stat.aborts++;
+   }
+   intr_set_status(old_status);
+   lock_release(&swap_lock);
+   return done;
+}
+
+// 把槽位slot中的页读到页框frame中, 槽位的引用由调用者在改好页表项后释放
+void swap_read(uint32_t slot, phys_addr_t frame) {
+   lock_acquire(&swap_lock);
+   ide_read(swap_part->my_disk, swap_part->start_lba + slot * SWAP_SECS_PER_SLOT, swap_buf, SWAP_SECS_PER_SLOT);
+   enum intr_status old_status = intr_disable();
+   void* dst = kmap(frame);
+   memcpy(dst, swap_buf, PG_SIZE);
+   kunmap(dst);
+   swap_stat.swap_ins++;
+   intr_set_status(old_status);
+   lock_release(&swap_lock);
+}
+
+// kswapd线程: 被唤醒后换出到空闲页框不少于SWAP_HIGH_PAGES, 或者再也换不出为止, 然后阻塞
+static void kswapd(void* arg UNUSED) {
+   while (1) {
+      while (user_pool_free_pages() < SWAP_HIGH_PAGES && swap_out_page());
+      enum intr_status old_status = intr_disable();
+      thread_block(TASK_BLOCKED);
+      intr_set_status(old_status);
+   }
+}
+
+// 空闲页框不多了, 唤醒kswapd, 可以在关中断时调用
+void kswapd_wakeup(void) {
+   if (kswapd_thread == NULL) {
+      return;
+   }
+   enum intr_status old_status = intr_disable();
+   if (kswapd_thread->status == TASK_BLOCKED) {
+      thread_unblock(kswapd_thread);
+   }
+   intr_set_status(old_status);
+}
+
+// 判断分区是不是选定的交换分区
+static bool swap_part_match(struct list_elem* pelem, int arg UNUSED) {
+   struct partition* part = elem2entry(struct partition, part_tag, pelem);
+#ifdef CONFIG_SWAP_PART
+   return !strcmp(part->name, CONFIG_SWAP_PART);
+#else
+   return part->fs_type == PART_TYPE_SWAP;
+#endif
+}
+
+// 选定交换分区并启动kswapd, 要在ide_init之后, filesys_init之前调用
+void swap_init(void) {
+   printk("swap_init start\n");
+   lock_init(&swap_lock);
+   struct list_elem* pelem = list_traversal(&partition_list, swap_part_match, 0);
+   if (pelem == NULL) {
+      printk("   no swap partition, swapping disabled\n");
+      return;
+   }
+   swap_part = elem2entry(struct partition, part_tag, pelem);
+   swap_stat.slots = swap_part->sec_cnt / SWAP_SECS_PER_SLOT;
+   slot_refs = sys_malloc(swap_stat.slots);
+   if (slot_refs == NULL) {
+      PANIC("swap_init: alloc memory failed!");
+   }
+   memset(slot_refs, 0, swap_stat.slots);
+   kswapd_thread = thread_start("kswapd", 16, kswapd, NULL);
+   printk("   swap on %s, %d pages\n", swap_part->name, swap_stat.slots);
+   printk("swap_init done\n");
+}
@@ -0,0 +1,24 @@
+#ifndef __KERNEL_SWAP_H
+#define __KERNEL_SWAP_H
+#include "stdint.h"
+#include "memory.h"
+
+#define PART_TYPE_SWAP 0x82   // 分区表中交换分区的类型, 与Linux相同
+
+// 用户内存池的空闲页框(含预清零的储备)少于SWAP_LOW_PAGES时唤醒kswapd, 换出到SWAP_HIGH_PAGES为止
+#define SWAP_LOW_PAGES 64
+#define SWAP_HIGH_PAGES 128
+
+// 换出的页的页表项: P位为0, 置PG_SWAP, 第12位起是槽位号, 其余属性位(RW, US, COW, NX)保持不变
+#define SWAP_SLOT(entry) ((uint32_t)(PTE_ADDR(entry) >> 12))
+#define SWAP_ENTRY(slot) (((pte_t)(slot) << 12) | PG_SWAP)
+
+extern struct partition* swap_part;
+extern struct swap_stat swap_stat;
+void swap_init(void);
+void kswapd_wakeup(void);
+bool swap_out_page(void);
+void swap_read(uint32_t slot, phys_addr_t frame);
+void swap_dup(uint32_t slot);
+void swap_free(uint32_t slot);
+#endif
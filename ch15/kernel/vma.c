@@ -0,0 +1,216 @@
+#include "vma.h"
+#include "stdint.h"
+#include "global.h"
+#include "list.h"
+#include "debug.h"
+#include "slab.h"
+#include "process.h"
+#include "interrupt.h"
+
+// 用户进程的虚拟地址空间由若干个区域描述, 而不是覆盖整个3GB空间的位图
+// 一个进程通常只有十几个区域, 查找, 分配, fork时复制和退出时释放都只与区域数有关
+
+static struct kmem_cache* vma_cache;
+
+// 创建vm_area的对象缓存
+void vma_init(void) {
+   vma_cache = kmem_cache_create("vm_area", sizeof(struct vm_area), NULL);
+   if (vma_cache == NULL) {
+      PANIC("vma_init: create cache failed!");
+   }
+}
+
+static struct vm_area* vma_new(uint32_t start, uint32_t end, uint32_t flags) {
+   struct vm_area* vma = kmem_cache_alloc(vma_cache);
+   if (vma != NULL) {
+      vma->vm_start = start;
+      vma->vm_end = end;
+      vma->vm_flags = flags;
+      vma->vm_inode = NULL;
+      vma->vm_pgoff = 0;
+   }
+   return vma;
+}
+
+// 新区域与vma映射同一个文件, 从vma起第pg_skip页开始
+static void vma_file_copy(struct vm_area* dst, struct vm_area* vma, uint32_t pg_skip) {
+   if (vma->vm_inode != NULL) {
+      enum intr_status old_status = intr_disable();
+      vma->vm_inode->i_open_cnts++;
+      intr_set_status(old_status);
+      dst->vm_inode = vma->vm_inode;
+      dst->vm_pgoff = vma->vm_pgoff + pg_skip;
+   }
+}
+
+// 释放区域, 文件映射的区域同时关闭inode
+static void vma_free(struct vm_area* vma) {
+   if (vma->vm_inode != NULL) {
+      inode_close(vma->vm_inode);
+   }
+   kmem_cache_free(vma_cache, vma);
+}
+
+// 返回包含vaddr的区域, 不存在则返回NULL
+struct vm_area* vma_find(struct list* vma_list, uint32_t vaddr) {
+   struct list_elem* elem = vma_list->head.next;
+   while (elem != &vma_list->tail) {
+      struct vm_area* vma = elem2entry(struct vm_area, vma_tag, elem);
+      if (vaddr < vma->vm_start) {
+         break;   // 后面的区域起始地址更大
+      }
+      if (vaddr < vma->vm_end) {
+         return vma;
+      }
+      elem = elem->next;
+   }
+   return NULL;
+}
+
+// 在空闲的[low, end)中靠上放一段长度为len, 起始地址按align对齐的区域, 放不下返回0
+static uint32_t gap_fit(uint32_t low, uint32_t end, uint32_t len, uint32_t align) {
+   if (end <= low || end - low < len) {
+      return 0;
+   }
+   uint32_t addr = (end - len) & ~(align - 1);
+   return addr >= low ? addr : 0;
+}
+
+// 在用户空间中找一段长度为len的空闲虚拟地址, 起始地址按align(2的幂)对齐, 成功返回起始地址, 失败返回0
+// 从用户栈往低地址找, 离程序段之后的brk堆尽量远, 给堆的增长留出空间
+uint32_t vma_get_unmapped(struct list* vma_list, uint32_t len, uint32_t align) {
+   uint32_t end = 0xc0000000;
+   struct list_elem* elem = vma_list->tail.prev;
+   while (elem != &vma_list->head) {
+      struct vm_area* vma = elem2entry(struct vm_area, vma_tag, elem);
+      uint32_t addr = gap_fit(vma->vm_end, end, len, align);
+      if (addr != 0) {
+         return addr;
+      }
+      if (vma->vm_start < end) {
+         end = vma->vm_start;
+      }
+      elem = elem->prev;
+   }
+   return gap_fit(USER_VADDR_START, end, len, align);
+}
+
+// [start, end)与已有的某个区域相交时返回true
+bool vma_overlap(struct list* vma_list, uint32_t start, uint32_t end) {
+   struct list_elem* elem = vma_list->head.next;
+   while (elem != &vma_list->tail) {
+      struct vm_area* vma = elem2entry(struct vm_area, vma_tag, elem);
+      if (vma->vm_start >= end) {
+         break;
+      }
+      if (vma->vm_end > start) {
+         return true;
+      }
+      elem = elem->next;
+   }
+   return false;
+}
+
+// 添加区域[start, end), 已被某个区域完全包含时什么也不做
+// 新区域不能与已有区域部分重叠, 成功返回true
+bool vma_add(struct list* vma_list, uint32_t start, uint32_t end, uint32_t flags) {
+   ASSERT(start < end && start % PG_SIZE == 0 && end % PG_SIZE == 0);
+   struct vm_area* prev = NULL;
+   struct list_elem* elem = vma_list->head.next;
+   while (elem != &vma_list->tail) {
+      struct vm_area* vma = elem2entry(struct vm_area, vma_tag, elem);
+      if (vma->vm_start >= end) {
+         break;   // 新区域应插在vma之前
+      }
+      if (start >= vma->vm_start && end <= vma->vm_end) {
+         return true;
+      }
+      ASSERT(vma->vm_end <= start);
+      prev = vma;
+      elem = elem->next;
+   }
+   struct vm_area* next = elem == &vma_list->tail ? NULL : elem2entry(struct vm_area, vma_tag, elem);
+
+   // VM_HEAP区域要能按分配时的大小整体释放, VM_MMAP区域可能映射着文件, 都不合并
+   bool mergeable = !(flags & (VM_HEAP | VM_MMAP));
+   bool merge_prev = mergeable && prev != NULL && prev->vm_end == start && prev->vm_flags == flags;
+   bool merge_next = mergeable && next != NULL && next->vm_start == end && next->vm_flags == flags;
+   if (merge_prev && merge_next) {
+      prev->vm_end = next->vm_end;
+      list_remove(&next->vma_tag);
+      kmem_cache_free(vma_cache, next);
+   } else if (merge_prev) {
+      prev->vm_end = end;
+   } else if (merge_next) {
+      next->vm_start = start;
+   } else {
+      struct vm_area* vma = vma_new(start, end, flags);
+      if (vma == NULL) {
+         return false;
+      }
+      list_insert_before(elem, &vma->vma_tag);
+   }
+   return true;
+}
+
+// 删除[start, end)范围内的地址, 与之相交的区域被删除, 截短或一分为二
+// 只有拆分区域时分配vm_area失败才会返回false
+bool vma_remove(struct list* vma_list, uint32_t start, uint32_t end) {
+   ASSERT(start < end);
+   struct list_elem* elem = vma_list->head.next;
+   while (elem != &vma_list->tail) {
+      struct vm_area* vma = elem2entry(struct vm_area, vma_tag, elem);
+      elem = elem->next;   // vma可能被删除, 先取得下一个结点
+      if (vma->vm_start >= end) {
+         break;
+      }
+      if (vma->vm_end <= start) {
+         continue;
+      }
+      if (start <= vma->vm_start && end >= vma->vm_end) {
+         list_remove(&vma->vma_tag);
+         vma_free(vma);
+      } else if (start > vma->vm_start && end < vma->vm_end) {
+         struct vm_area* tail = vma_new(end, vma->vm_end, vma->vm_flags);
+         if (tail == NULL) {
+            return false;
+         }
+         vma_file_copy(tail, vma, (end - vma->vm_start) / PG_SIZE);
+         vma->vm_end = start;
+         list_insert_before(elem, &tail->vma_tag);
+         break;
+      } else if (start > vma->vm_start) {
+         vma->vm_end = start;
+      } else {
+         vma->vm_pgoff += (end - vma->vm_start) / PG_SIZE;
+         vma->vm_start = end;
+      }
+   }
+   return true;
+}
+
+// fork时复制区域链表, dst中原有的内容被忽略, 成功返回0, 失败返回-1
+int32_t vma_list_copy(struct list* dst, struct list* src) {
+   list_init(dst);
+   struct list_elem* elem = src->head.next;
+   while (elem != &src->tail) {
+      struct vm_area* vma = elem2entry(struct vm_area, vma_tag, elem);
+      struct vm_area* copy = vma_new(vma->vm_start, vma->vm_end, vma->vm_flags);
+      if (copy == NULL) {
+         vma_list_destroy(dst);
+         return -1;
+      }
+      vma_file_copy(copy, vma, 0);
+      list_append(dst, &copy->vma_tag);
+      elem = elem->next;
+   }
+   return 0;
+}
+
+// 进程退出时释放全部区域
+void vma_list_destroy(struct list* vma_list) {
+   while (!list_empty(vma_list)) {
+      struct vm_area* vma = elem2entry(struct vm_area, vma_tag, list_pop(vma_list));
+      vma_free(vma);
+   }
+}
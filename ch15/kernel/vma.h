@@ -0,0 +1,35 @@
+#ifndef __KERNEL_VMA_H
+#define __KERNEL_VMA_H
+#include "stdint.h"
+#include "list.h"
+#include "inode.h"
+
+#define VM_HEAP  1   // vaddr_get分配的内存, 每次分配单独成为一个区域, 释放时整体删除
+#define VM_FIXED 2   // get_a_page按指定地址添加的页(用户栈, 程序段), 与相邻的同类区域合并
+#define VM_BRK   4   // brk系统调用扩展的进程堆, 紧接在程序段之后, 只在末尾增长或缩小
+#define VM_MMAP  8   // mmap建立的映射, 不与其它区域合并, 只能用munmap删除
+#define VM_RDONLY 16 // 只读区域, 写访问是非法的
+
+// 被vma链表取代的用户虚拟地址位图原本占用的页数, 用于统计节省的内核内存
+#define VMA_BITMAP_PAGES DIV_ROUND_UP((0xc0000000 - USER_VADDR_START) / PG_SIZE / 8, PG_SIZE)
+
+// 用户进程的一段虚拟内存区域[vm_start, vm_end), 都按页对齐
+// 每个进程的区域挂在task_struct的vma_list上, 按起始地址升序排列且互不重叠
+struct vm_area {
+   struct list_elem vma_tag;
+   uint32_t vm_start;
+   uint32_t vm_end;
+   uint32_t vm_flags;
+   struct inode* vm_inode;   // 文件映射的区域持有文件inode的一次打开, 其它区域为NULL
+   uint32_t vm_pgoff;        // vm_start对应文件中的第几页
+};
+
+void vma_init(void);
+struct vm_area* vma_find(struct list* vma_list, uint32_t vaddr);
+uint32_t vma_get_unmapped(struct list* vma_list, uint32_t len, uint32_t align);
+bool vma_overlap(struct list* vma_list, uint32_t start, uint32_t end);
+bool vma_add(struct list* vma_list, uint32_t start, uint32_t end, uint32_t flags);
+bool vma_remove(struct list* vma_list, uint32_t start, uint32_t end);
+int32_t vma_list_copy(struct list* dst, struct list* src);
+void vma_list_destroy(struct list* vma_list);
+#endif
@@ -10,6 +10,7 @@ void bitmap_init(struct bitmap* btmp) {
    //memset定义在string.c中；
    //memset(void* dst_, uint8_t value, uint32_t size)
     memset(btmp->bits, 0 , btmp->btmp_bytes_len);
+    btmp->hint = 0;
 }
 
 /* 判断bit_idx位是否为1,若为1则返回true，否则返回false */
@@ -19,51 +20,78 @@ bool bitmap_scan_test(struct bitmap* btmp, uint32_t bit_idx) {
    return (btmp->bits[byte_idx] & (BITMAP_MASK << bit_odd));
 }
 
-/* 在位图中申请连续cnt个位,成功则返回其起始位下标，失败返回-1 */
-int bitmap_scan(struct bitmap* btmp, uint32_t cnt) {
-   uint32_t idx_byte = 0;	 // 用于记录空闲位所在的字节
-/* 先逐字节比较,蛮力法 */
-   while (( 0xff == btmp->bits[idx_byte]) && (idx_byte < btmp->btmp_bytes_len)) {
-/* 1表示该位已分配,所以若为0xff,则表示该字节内已无空闲位,向下一字节继续找 */
-      idx_byte++;
+/* 取出从bit_idx开始的至多32位, 低位对应bit_idx, *valid为其中有效的位数 */
+static uint32_t bitmap_word(struct bitmap* btmp, uint32_t bit_idx, uint32_t* valid) {
+   uint32_t byte_idx = bit_idx / 8;
+   uint32_t bit_odd  = bit_idx % 8;
+   uint32_t word;
+   if (byte_idx + 4 <= btmp->btmp_bytes_len) {
+/* x86允许非对齐访问, 直接按32位读出 */
+      word = *(uint32_t*)(btmp->bits + byte_idx);
+      *valid = 32 - bit_odd;
+   } else {		      // 位图末尾不足4字节, 逐字节拼起来
+      uint32_t byte_cnt = btmp->btmp_bytes_len - byte_idx;
+      uint32_t i;
+      word = 0;
+      for (i = 0; i < byte_cnt; i++) {
+	 word |= (uint32_t)btmp->bits[byte_idx + i] << (i * 8);
+      }
+      *valid = byte_cnt * 8 - bit_odd;
    }
+   return word >> bit_odd;
+}
 
-   ASSERT(idx_byte < btmp->btmp_bytes_len);
-   if (idx_byte == btmp->btmp_bytes_len) {  // 若该内存池找不到可用空间		
-      return -1;
-   }
+/* 返回word中最低的1所在的位, word不能为0 */
+static inline uint32_t bit_scan_forward(uint32_t word) {
+   uint32_t idx;
+   asm ("bsf %1, %0" : "=r" (idx) : "rm" (word));
+   return idx;
+}
 
- /* 若在位图数组范围内的某字节内找到了空闲位，
-  * 在该字节内逐位比对,返回空闲位的索引。*/
-   int idx_bit = 0;
- /* 和btmp->bits[idx_byte]这个字节逐位对比 */
-   while ((uint8_t)(BITMAP_MASK << idx_bit) & btmp->bits[idx_byte]) { 
-	 idx_bit++;
-   }
-	 
-   int bit_idx_start = idx_byte * 8 + idx_bit;    // 空闲位在位图内的下标
-   if (cnt == 1) {
-      return bit_idx_start;
+/* 从bit_idx开始找第一个值为value的位, 找不到则返回位图的总位数 */
+static uint32_t bitmap_find(struct bitmap* btmp, uint32_t bit_idx, int8_t value) {
+   uint32_t bit_len = btmp->btmp_bytes_len * 8;
+   while (bit_idx < bit_len) {
+      uint32_t valid;
+      uint32_t word = bitmap_word(btmp, bit_idx, &valid);
+      if (!value) {
+	 word = ~word;
+      }
+      if (valid < 32) {
+	 word &= (1UL << valid) - 1;
+      }
+/* 一次比较32位, 有目标位就用bsf直接定位 */
+      if (word) {
+	 return bit_idx + bit_scan_forward(word);
+      }
+      bit_idx += valid;
    }
+   return bit_len;
+}
 
-   uint32_t bit_left = (btmp->btmp_bytes_len * 8 - bit_idx_start);   // 记录还有多少位可以判断
-   uint32_t next_bit = bit_idx_start + 1;
-   uint32_t count = 1;	      // 用于记录找到的空闲位的个数
+/* 在位图中申请连续cnt个位,成功则返回其起始位下标，失败返回-1 */
+int bitmap_scan(struct bitmap* btmp, uint32_t cnt) {
+   uint32_t bit_len = btmp->btmp_bytes_len * 8;
+   if (btmp->hint > bit_len) {
+      btmp->hint = 0;
+   }
+/* hint之前全是1, 从hint找第一个空闲位, 找到后hint前移到这里 */
+   uint32_t bit_idx_start = bitmap_find(btmp, btmp->hint, 0);
+   btmp->hint = bit_idx_start;
 
-   bit_idx_start = -1;	      // 先将其置为-1,若找不到连续的位就直接返回
-   while (bit_left-- > 0) {
-      if (!(bitmap_scan_test(btmp, next_bit))) {	 // 若next_bit为0
-	 count++;
-      } else {
-	 count = 0;//若连续空间不满足要求，则将count置为0，重新开始找
+/* 找连续cnt个空闲位: 空闲段的结束处就是下一个1,
+ * 若空闲段不够长, 就从这个1之后的第一个0重新开始 */
+   while (bit_idx_start < bit_len) {
+      if (cnt == 1) {
+	 return bit_idx_start;
       }
-      if (count == cnt) {	    // 若找到连续的cnt个空位
-	 bit_idx_start = next_bit - cnt + 1;
-	 break;
+      uint32_t bit_idx_end = bitmap_find(btmp, bit_idx_start, 1);
+      if (bit_idx_end - bit_idx_start >= cnt) {
+	 return bit_idx_start;
       }
-      next_bit++;          
+      bit_idx_start = bitmap_find(btmp, bit_idx_end, 0);
    }
-   return bit_idx_start;
+   return -1;
 }
 
 /* 将位图btmp的bit_idx位设置为value */
@@ -78,5 +106,38 @@ void bitmap_set(struct bitmap* btmp, uint32_t bit_idx, int8_t value) {
       btmp->bits[byte_idx] |= (BITMAP_MASK << bit_odd);
    } else {		      // 若为0
       btmp->bits[byte_idx] &= ~(BITMAP_MASK << bit_odd);
+      if (bit_idx < btmp->hint) {
+	 btmp->hint = bit_idx;
+      }
+   }
+}
+
+/* 将从bit_idx开始的cnt个位都设置为value, 两端不足一字的部分按位处理, 中间按32位整字写入 */
+static void bitmap_fill(struct bitmap* btmp, uint32_t bit_idx, uint32_t cnt, int8_t value) {
+   uint32_t bit_end = bit_idx + cnt;
+   ASSERT(bit_end <= btmp->btmp_bytes_len * 8);
+   while (bit_idx < bit_end && (bit_idx % 32)) {
+      bitmap_set(btmp, bit_idx++, value);
+   }
+   uint32_t word = value ? 0xffffffff : 0;
+   while (bit_idx + 32 <= bit_end) {
+      *(uint32_t*)(btmp->bits + bit_idx / 8) = word;
+      bit_idx += 32;
+   }
+   while (bit_idx < bit_end) {
+      bitmap_set(btmp, bit_idx++, value);
+   }
+}
+
+/* 将从bit_idx开始的连续cnt个位置1 */
+void bitmap_set_range(struct bitmap* btmp, uint32_t bit_idx, uint32_t cnt) {
+   bitmap_fill(btmp, bit_idx, cnt, 1);
+}
+
+/* 将从bit_idx开始的连续cnt个位清0 */
+void bitmap_clear_range(struct bitmap* btmp, uint32_t bit_idx, uint32_t cnt) {
+   bitmap_fill(btmp, bit_idx, cnt, 0);
+   if (bit_idx < btmp->hint) {
+      btmp->hint = bit_idx;
    }
 }
@@ -7,10 +7,14 @@ struct bitmap {
    uint32_t btmp_bytes_len;
 /* 在遍历位图时,整体上以字节为单位,细节上是以位为单位,所以此处位图的指针必须是单字节 */
    uint8_t* bits;
+/* 扫描的起点: 此位之前的位都已置1, bitmap_scan从这里开始找, 不必每次从0开始 */
+   uint32_t hint;
 };
 
 void bitmap_init(struct bitmap* btmp);
 bool bitmap_scan_test(struct bitmap* btmp, uint32_t bit_idx);
 int bitmap_scan(struct bitmap* btmp, uint32_t cnt);
 void bitmap_set(struct bitmap* btmp, uint32_t bit_idx, int8_t value);
+void bitmap_set_range(struct bitmap* btmp, uint32_t bit_idx, uint32_t cnt);
+void bitmap_clear_range(struct bitmap* btmp, uint32_t bit_idx, uint32_t cnt);
 #endif
\ No newline at end of file
@@ -30,4 +30,11 @@ static inline uint8_t inb(uint16_t port) {
     asm volatile ("inb %w1, %b0" : "=a" (data) : "Nd" (port));
    return data;
 }
+
+// 读取时间戳计数器, 用来测量一段代码花费的时钟周期数
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+}
 #endif
\ No newline at end of file
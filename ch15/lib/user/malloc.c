@@ -0,0 +1,217 @@
+#include "malloc.h"
+#include "syscall.h"
+#include "string.h"
+#include "global.h"
+#include "stdint.h"
+
+// 用户态的内存分配器, 和内核的sys_malloc一样按arena管理:
+// 堆由brk扩展并按页切分, 不超过1024字节的申请从对应规格的arena中分配内存块,
+// 更大的申请直接分配连续的页. 释放的块和页留在进程中复用,
+// 只有堆要增长, 或者堆顶攒够了HEAP_TRIM_PAGES个空闲页要归还时才进入内核
+
+#define BLOCK_DESC_CNT 7       // 内存块的规格数, 16字节 32字节 ... 1024字节
+#define MAX_BLOCK_SIZE 1024
+#define HEAP_GROW_PAGES 8      // 堆不够用时至少扩展的页数, 减少brk的次数
+#define HEAP_TRIM_PAGES 16     // 堆顶连续的空闲页达到这么多时才缩小堆
+
+// 空闲内存块, 同一规格的串成双向链表, 释放整个arena时要从链表中间摘除
+struct heap_block {
+   struct heap_block* prev;
+   struct heap_block* next;
+};
+
+// 每个arena页开头的元信息
+struct heap_arena {
+   uint32_t block_size;   // 内存块大小, 为0表示这是直接按页分配的大块
+   uint32_t cnt;          // 小块arena中空闲的内存块数, 大块中为页数
+};
+
+// 一段空闲的连续页, 元信息放在第一页中, 按地址升序串成单链表, 相邻的会合并
+struct heap_run {
+   struct heap_run* next;
+   uint32_t pg_cnt;
+};
+
+static struct heap_block* free_blocks[BLOCK_DESC_CNT];   // 各规格的空闲内存块
+static struct heap_run* free_runs;                       // 堆中空闲的页
+
+// 把[run, run + pg_cnt页)放回free_runs, 与前后相邻的空闲页合并
+static void run_insert(struct heap_run* run, uint32_t pg_cnt) {
+   struct heap_run* prev = NULL;
+   struct heap_run* next = free_runs;
+   while (next != NULL && next < run) {
+      prev = next;
+      next = next->next;
+   }
+   run->pg_cnt = pg_cnt;
+   run->next = next;
+   if (next != NULL && (uint32_t)run + pg_cnt * PG_SIZE == (uint32_t)next) {
+      run->pg_cnt += next->pg_cnt;
+      run->next = next->next;
+   }
+   if (prev != NULL && (uint32_t)prev + prev->pg_cnt * PG_SIZE == (uint32_t)run) {
+      prev->pg_cnt += run->pg_cnt;
+      prev->next = run->next;
+   } else if (prev != NULL) {
+      prev->next = run;
+   } else {
+      free_runs = run;
+   }
+}
+
+// 用brk扩展堆, 至少HEAP_GROW_PAGES页, 多出来的页放进free_runs, 返回pg_cnt页的起始地址
+static void* heap_grow(uint32_t pg_cnt) {
+   uint32_t grow_cnt = pg_cnt > HEAP_GROW_PAGES ? pg_cnt : HEAP_GROW_PAGES;
+   uint32_t old_brk = (uint32_t)sbrk(0);
+   uint32_t pad = (PG_SIZE - old_brk % PG_SIZE) % PG_SIZE;   // 用户程序自己调用过sbrk时堆的末尾不一定页对齐
+   if (sbrk(pad + grow_cnt * PG_SIZE) == (void*)-1) {
+      return NULL;
+   }
+   uint32_t start = old_brk + pad;
+   if (grow_cnt > pg_cnt) {
+      run_insert((struct heap_run*)(start + pg_cnt * PG_SIZE), grow_cnt - pg_cnt);
+   }
+   return (void*)start;
+}
+
+// 分配pg_cnt个连续页, 内容都已清0: 新扩展的页由内核按需分配, 本来就是0, 复用的页要自己清0
+static void* pages_alloc(uint32_t pg_cnt) {
+   struct heap_run* prev = NULL;
+   struct heap_run* run = free_runs;
+   while (run != NULL && run->pg_cnt < pg_cnt) {
+      prev = run;
+      run = run->next;
+   }
+   if (run == NULL) {
+      return heap_grow(pg_cnt);
+   }
+   void* pages;
+   if (run->pg_cnt == pg_cnt) {
+      if (prev != NULL) {
+         prev->next = run->next;
+      } else {
+         free_runs = run->next;
+      }
+      pages = run;
+   } else {   // 从这段空闲页的末尾切下来, 元信息不用挪动
+      run->pg_cnt -= pg_cnt;
+      pages = (void*)((uint32_t)run + run->pg_cnt * PG_SIZE);
+   }
+   memset(pages, 0, pg_cnt * PG_SIZE);
+   return pages;
+}
+
+// 释放连续的页, 堆顶的空闲页攒够了就还给内核, 但留下HEAP_GROW_PAGES页, 免得堆反复伸缩
+static void pages_free(void* pages, uint32_t pg_cnt) {
+   run_insert(pages, pg_cnt);
+
+   struct heap_run* last = free_runs;
+   while (last->next != NULL) {
+      last = last->next;
+   }
+   if (last->pg_cnt < HEAP_TRIM_PAGES || \
+       (uint32_t)sbrk(0) != (uint32_t)last + last->pg_cnt * PG_SIZE) {
+      return;
+   }
+   if (brk((void*)((uint32_t)last + HEAP_GROW_PAGES * PG_SIZE)) == 0) {
+      last->pg_cnt = HEAP_GROW_PAGES;
+   }
+}
+
+// 返回内存块b所在的arena
+static struct heap_arena* block2arena(void* b) {
+   return (struct heap_arena*)((uint32_t)b & 0xfffff000);
+}
+
+static void block_push(uint32_t desc_idx, struct heap_block* b) {
+   b->prev = NULL;
+   b->next = free_blocks[desc_idx];
+   if (b->next != NULL) {
+      b->next->prev = b;
+   }
+   free_blocks[desc_idx] = b;
+}
+
+static void block_remove(uint32_t desc_idx, struct heap_block* b) {
+   if (b->prev != NULL) {
+      b->prev->next = b->next;
+   } else {
+      free_blocks[desc_idx] = b->next;
+   }
+   if (b->next != NULL) {
+      b->next->prev = b->prev;
+   }
+}
+
+// 新建一个desc_idx规格的arena, 把它的内存块都放进空闲链表
+static bool arena_new(uint32_t desc_idx) {
+   struct heap_arena* a = pages_alloc(1);
+   if (a == NULL) {
+      return false;
+   }
+   a->block_size = 16 << desc_idx;
+   a->cnt = (PG_SIZE - sizeof(struct heap_arena)) / a->block_size;
+   uint32_t block_idx;
+   for (block_idx = 0; block_idx < a->cnt; block_idx++) {
+      block_push(desc_idx, (struct heap_block*)((uint32_t)(a + 1) + block_idx * a->block_size));
+   }
+   return true;
+}
+
+// 申请size字节内存, 内容已清0, 失败返回NULL
+void* malloc(uint32_t size) {
+   if (size == 0) {
+      return NULL;
+   }
+   /* 超过最大内存块, 就直接分配页 */
+   if (size > MAX_BLOCK_SIZE) {
+      uint32_t pg_cnt = DIV_ROUND_UP(size + sizeof(struct heap_arena), PG_SIZE);
+      struct heap_arena* a = pages_alloc(pg_cnt);
+      if (a == NULL) {
+         return NULL;
+      }
+      a->block_size = 0;
+      a->cnt = pg_cnt;
+      return a + 1;
+   }
+
+   uint32_t desc_idx = 0;
+   while ((16U << desc_idx) < size) {
+      desc_idx++;
+   }
+   if (free_blocks[desc_idx] == NULL && !arena_new(desc_idx)) {
+      return NULL;
+   }
+   struct heap_block* b = free_blocks[desc_idx];
+   block_remove(desc_idx, b);
+   block2arena(b)->cnt--;
+   memset(b, 0, 16 << desc_idx);
+   return b;
+}
+
+// 释放malloc得到的内存
+void free(void* ptr) {
+   if (ptr == NULL) {
+      return;
+   }
+   struct heap_arena* a = block2arena(ptr);
+   if (a->block_size == 0) {
+      pages_free(a, a->cnt);
+      return;
+   }
+
+   uint32_t desc_idx = 0;
+   while ((16U << desc_idx) < a->block_size) {
+      desc_idx++;
+   }
+   block_push(desc_idx, ptr);
+   /* arena中的内存块都空闲了, 就从空闲链表中摘掉它们, 归还整页 */
+   uint32_t blocks_per_arena = (PG_SIZE - sizeof(struct heap_arena)) / a->block_size;
+   if (++a->cnt == blocks_per_arena) {
+      uint32_t block_idx;
+      for (block_idx = 0; block_idx < blocks_per_arena; block_idx++) {
+         block_remove(desc_idx, (struct heap_block*)((uint32_t)(a + 1) + block_idx * a->block_size));
+      }
+      pages_free(a, 1);
+   }
+}
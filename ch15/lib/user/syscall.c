@@ -59,16 +59,32 @@ uint32_t write(int32_t fd, const void* buf, uint32_t count) {
    return _syscall3(SYS_WRITE, fd, buf, count);
 }
 
-/* 申请size字节大小的内存,并返回结果 */
-void* malloc(uint32_t size) {
+/* 由内核的sys_malloc申请size字节大小的内存,并返回结果; 用户程序一般用malloc.h中的malloc */
+void* syscall_malloc(uint32_t size) {
    return (void*)_syscall1(SYS_MALLOC, size);
 }
 
-/* 释放ptr指向的内存 */
-void free(void* ptr) {
+/* 释放syscall_malloc得到的ptr指向的内存 */
+void syscall_free(void* ptr) {
    _syscall1(SYS_FREE, ptr);
 }
 
+/* 将进程堆的末尾设为addr, 成功返回0, 失败返回-1 */
+int32_t brk(void* addr) {
+   return _syscall1(SYS_BRK, addr) == (int32_t)addr ? 0 : -1;
+}
+
+/* 将进程堆的末尾移动increment字节, 成功返回原来的末尾, 失败返回(void*)-1
+ * 不在本地缓存堆的末尾: 内核中的init和shell也链接这个文件, 它们的数据是所有进程共享的 */
+void* sbrk(int32_t increment) {
+   uint32_t old_brk = _syscall1(SYS_BRK, 0);
+   if (increment == 0) {
+      return (void*)old_brk;
+   }
+   uint32_t new_brk = old_brk + increment;
+   return (uint32_t)_syscall1(SYS_BRK, new_brk) == new_brk ? (void*)old_brk : (void*)-1;
+}
+
 /* 派生子进程,返回子进程pid */
 pid_t fork(void){
    return _syscall0(SYS_FORK);
@@ -182,3 +198,34 @@ int32_t pipe(int32_t pipefd[2]) {
 void fd_redirect(uint32_t old_local_fd, uint32_t new_local_fd) {
    _syscall2(SYS_FD_REDIRECT, old_local_fd, new_local_fd);
 }
+
+/* 设置或查询同页合并线程ksmd, cmd见ksm.h, 成功返回0 */
+int32_t ksm_ctl(uint32_t cmd, uint32_t arg) {
+   return _syscall2(SYS_KSM_CTL, cmd, arg);
+}
+
+/* 把文件fd从offset起映射到内存, 或者flags带MAP_ANONYMOUS时分配清零的内存, 成功返回起始地址, 失败返回MAP_FAILED */
+void* mmap(void* addr, uint32_t len, uint32_t prot, uint32_t flags, int32_t fd, uint32_t offset) {
+   struct mmap_args args = {addr, len, prot, flags, fd, offset};
+   return (void*)_syscall1(SYS_MMAP, &args);
+}
+
+/* 解除mmap建立的映射, 成功返回0 */
+int32_t munmap(void* addr, uint32_t len) {
+   return _syscall2(SYS_MUNMAP, addr, len);
+}
+
+/* 取得内存池, 堆和各进程的内存统计, 成功返回0 */
+int32_t meminfo(struct meminfo* info) {
+   return _syscall1(SYS_MEMINFO, info);
+}
+
+/* 睡眠m_seconds毫秒, 期间不占用处理器 */
+void sleep(uint32_t m_seconds) {
+   _syscall1(SYS_SLEEP, m_seconds);
+}
+
+/* 取CLOCK_REALTIME或CLOCK_MONOTONIC时钟的当前时间, 纳秒精度, 成功返回0 */
+int32_t clock_gettime(uint32_t clock_id, struct timespec* tp) {
+   return _syscall2(SYS_CLOCK_GETTIME, clock_id, tp);
+}
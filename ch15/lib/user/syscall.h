@@ -3,6 +3,9 @@
 #include "stdint.h"
 #include "fs.h"
 #include "thread.h"
+#include "ksm.h"
+#include "mmap.h"
+#include "clock.h"
 enum SYSCALL_NR {
    SYS_GETPID,
    SYS_WRITE,
@@ -31,11 +34,18 @@ enum SYSCALL_NR {
    SYS_WAIT,
    SYS_PIPE,
    SYS_FD_REDIRECT,
+   SYS_BRK,
+   SYS_KSM_CTL,
+   SYS_MMAP,
+   SYS_MUNMAP,
+   SYS_MEMINFO,
+   SYS_SLEEP,
+   SYS_CLOCK_GETTIME,
 };
 uint32_t getpid(void);
 uint32_t write(int32_t fd, const void* buf, uint32_t count);
-void* malloc(uint32_t size);
-void free(void* ptr);
+void* syscall_malloc(uint32_t size);
+void syscall_free(void* ptr);
 int16_t fork(void);
 int32_t read(int32_t fd, void* buf, uint32_t count);
 void putchar(char char_asci);
@@ -59,5 +69,13 @@ void exit(int32_t status);
 pid_t wait(int32_t* status);
 int32_t pipe(int32_t pipefd[2]);
 void fd_redirect(uint32_t old_local_fd, uint32_t new_local_fd);
+int32_t brk(void* addr);
+void* sbrk(int32_t increment);
+int32_t ksm_ctl(uint32_t cmd, uint32_t arg);
+void* mmap(void* addr, uint32_t len, uint32_t prot, uint32_t flags, int32_t fd, uint32_t offset);
+int32_t munmap(void* addr, uint32_t len);
+int32_t meminfo(struct meminfo* info);
+void sleep(uint32_t m_seconds);
+int32_t clock_gettime(uint32_t clock_id, struct timespec* tp);
 #endif
 
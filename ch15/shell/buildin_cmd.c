@@ -205,10 +205,39 @@ void buildin_ls(uint32_t argc, char** argv) {
    }
 }
 
-/* ps命令内建函数 */
-void buildin_ps(uint32_t argc, char** argv UNUSED) {
+/* 打印各用户进程的内存: 页数, 以及堆中每种规格的arena里分配出去的块(含弹匣中缓存的) */
+static void ps_mem(void) {
+   struct meminfo* info = syscall_malloc(sizeof(struct meminfo));
+   if (info == NULL) {
+      printf("ps: malloc memory failed\n");
+      return;
+   }
+   meminfo(info);
+   uint32_t proc_idx;
+   for (proc_idx = 0; proc_idx < info->proc_cnt; proc_idx++) {
+      struct proc_mem_info* proc = &info->procs[proc_idx];
+      printf("%d %s: resident %d swapped %d page tables %d vmas %d\n", proc->pid, proc->name, \
+             proc->resident_pages, proc->swapped_pages, proc->page_tables, proc->vmas);
+      uint32_t desc_idx;
+      for (desc_idx = 0; desc_idx < DESC_CNT; desc_idx++) {
+         struct desc_info* desc = &proc->descs[desc_idx];
+         if (desc->arenas > 0) {
+            printf("   %d bytes: %d arenas, %d of %d blocks in use\n", desc->block_size, desc->arenas, \
+                   desc->arenas * desc->blocks_per_arena - desc->free_blocks, desc->arenas * desc->blocks_per_arena);
+         }
+      }
+   }
+   syscall_free(info);
+}
+
+/* ps命令内建函数, "ps -m"显示各进程的内存 */
+void buildin_ps(uint32_t argc, char** argv) {
+   if (argc == 2 && !strcmp("-m", argv[1])) {
+      ps_mem();
+      return;
+   }
    if (argc != 1) {
-      printf("ps: no argument support!\n");
+      printf("usage: ps [-m]\n");
       return;
    }
    ps();
@@ -283,4 +312,53 @@ int32_t buildin_rm(uint32_t argc, char** argv) {
       }
    }
    return ret;
-}
\ No newline at end of file
+}
+/* 把十进制数字串str转换为整数存入num, str不全是数字时返回false */
+static bool str2num(const char* str, uint32_t* num) {
+   if (*str == 0) {
+      return false;
+   }
+   *num = 0;
+   while (*str != 0) {
+      if (*str < '0' || *str > '9') {
+	 return false;
+      }
+      *num = *num * 10 + (*str++ - '0');
+   }
+   return true;
+}
+
+/* ksm命令内建函数
+   不带参数时显示ksmd的设置和统计, "ksm run 0|1"停止或开始扫描,
+   "ksm scan 页数"设置每批扫描的页数, "ksm sleep 毫秒"设置两批之间休眠的时间
+*/
+int32_t buildin_ksm(uint32_t argc, char** argv) {
+   if (argc == 1) {
+      struct ksm_info info;
+      ksm_ctl(KSM_INFO, (uint32_t)&info);
+      printf("run %d, %d pages every %d ms\n", info.run, info.pages_to_scan, info.sleep_ms);
+      printf("pages shared %d saved %d, scanned %d in %d rounds, %dK cycles\n", \
+	     info.pages_shared, info.pages_saved, info.pages_scanned, info.full_scans, info.scan_kcycles);
+      return 0;
+   }
+   uint32_t cmd, value;
+   if (argc != 3 || !str2num(argv[2], &value)) {
+      printf("usage: ksm [run 0|1 | scan pages | sleep ms]\n");
+      return -1;
+   }
+   if (!strcmp("run", argv[1])) {
+      cmd = KSM_RUN;
+   } else if (!strcmp("scan", argv[1])) {
+      cmd = KSM_PAGES_TO_SCAN;
+   } else if (!strcmp("sleep", argv[1])) {
+      cmd = KSM_SLEEP_MS;
+   } else {
+      printf("ksm: unknown setting %s\n", argv[1]);
+      return -1;
+   }
+   if (ksm_ctl(cmd, value) == -1) {
+      printf("ksm: invalid value %s\n", argv[2]);
+      return -1;
+   }
+   return 0;
+}
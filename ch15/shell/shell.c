@@ -139,6 +139,8 @@ static void cmd_execute(uint32_t argc, char** argv) {
       buildin_rmdir(argc, argv);
    } else if (!strcmp("rm", argv[0])) {
       buildin_rm(argc, argv);
+   } else if (!strcmp("ksm", argv[0])) {
+      buildin_ksm(argc, argv);
    } else if (!strcmp("help", argv[0])) {
       // buildin_help(argc, argv);
    } else {      // 如果是外部命令,需要从磁盘上加载
@@ -8,6 +8,7 @@
 void sema_init(struct semaphore* psema, uint8_t value) {
     psema->value = value;
     list_init(&psema->waiters);
+    spin_lock_init(&psema->guard);
 }
 
 // 初始化锁 plock
@@ -19,8 +20,9 @@ void lock_init(struct lock* plock) {
 
 // 信号量 down 操作
 void sema_down(struct semaphore* psema) {
-    // 关中断来保证原子操作
+    // 关中断挡住本处理器上的中断, 自旋锁挡住别的处理器
     enum intr_status old_status = intr_disable();
+    spin_lock(&psema->guard);
     while(psema->value == 0) { // value 为0, 表示已经被别人持有
         ASSERT(!elem_find(&psema->waiters, &running_thread()->general_tag));
         if(elem_find(&psema->waiters, &running_thread()->general_tag)) {
@@ -28,28 +30,48 @@ void sema_down(struct semaphore* psema) {
         }
         // 若信号量等于 0, 则当前线程把自己加入该锁的等待队列, 然后阻塞自己
         list_append(&psema->waiters, &running_thread()->general_tag);
+        // 持有自旋锁时不能调度, 阻塞前放开. 从放锁到换下处理器的这一段, 别的处理器上的sema_up
+        // 要是把本线程取出来唤醒就会出错, 现在靠大内核锁排除, 拆大内核锁时调度器要先有自己的锁
+        spin_unlock(&psema->guard);
         thread_block(TASK_BLOCKED); // 阻塞线程, 直到被唤醒
+        spin_lock(&psema->guard);
     }
     // 若 value 为 1 或被唤醒后, 会执行下面的代码, 也就是获得了锁
     psema->value--;
     ASSERT(psema->value == 0);
+    spin_unlock(&psema->guard);
     intr_set_status(old_status);
 }
 
-// 信号量 up 操作
-void sema_up(struct semaphore* psema) {
-    // 关中断保证原子操作
+// 信号量 up 操作, io为true时等待者在等输入输出, 按thread_unblock_io唤醒
+static void sema_post(struct semaphore* psema, bool io) {
+    // 关中断挡住本处理器上的中断, 自旋锁挡住别的处理器
     enum intr_status old_status = intr_disable();
+    spin_lock(&psema->guard);
     ASSERT(psema->value == 0);
     if(!list_empty(&psema->waiters)) {
         struct task_struct* thread_blocked = elem2entry(struct task_struct, general_tag, list_pop(&psema->waiters));
-        thread_unblock(thread_blocked);
+        if(io) {
+            thread_unblock_io(thread_blocked);
+        } else {
+            thread_unblock(thread_blocked);
+        }
     }
     psema->value++;
     ASSERT(psema->value == 1);
+    spin_unlock(&psema->guard);
     intr_set_status(old_status);
 }
 
+void sema_up(struct semaphore* psema) {
+    sema_post(psema, false);
+}
+
+// 设备中断处理函数通知输入输出完成时用
+void sema_up_io(struct semaphore* psema) {
+    sema_post(psema, true);
+}
+
 // 获取锁 plock
 void lock_acquire(struct lock* plock) {
     // 排除曾经自己已经持有锁但还未将其释放的情况
@@ -74,4 +96,30 @@ void lock_release(struct lock* plock) {
     plock->holder = NULL;
     plock->holder_repeat_nr = 0;
     sema_up(&plock->semaphore);
-}
\ No newline at end of file
+}
+// 初始化自旋锁 plock
+void spin_lock_init(struct spinlock* plock) {
+    plock->locked = 0;
+}
+
+// 获取自旋锁 plock
+// xchg 隐含 lock 前缀, 读出旧值和写入 1 是一个原子操作, 旧值为 0 就拿到了锁;
+// 没拿到时只读不写地等, 以免各处理器反复争抢同一缓存行, pause 提示处理器这是自旋等待
+void spin_lock(struct spinlock* plock) {
+    while(1) {
+        uint32_t locked = 1;
+        asm volatile ("xchgl %0, %1" : "+r" (locked), "+m" (plock->locked) : : "memory");
+        if(locked == 0) {
+            return;
+        }
+        while(plock->locked) {
+            asm volatile ("pause");
+        }
+    }
+}
+
+// 释放自旋锁 plock, x86 的写操作不会越过之前的读写, 只要挡住编译器的重排
+void spin_unlock(struct spinlock* plock) {
+    asm volatile ("" : : : "memory");
+    plock->locked = 0;
+}
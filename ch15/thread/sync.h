@@ -4,10 +4,16 @@
 #include "stdint.h"
 #include "thread.h"
 
+// 自旋锁, 用于处理器之间的互斥, 拿不到时原地空转而不是阻塞, 持有期间不能调度
+struct spinlock {
+    volatile uint32_t locked;   // 为1表示已被某个处理器持有
+};
+
 // 信号量结构
 struct semaphore {
     uint8_t value;
     struct list waiters;
+    struct spinlock guard;      // 保护value和waiters, 关中断只挡得住本处理器
 };
 
 // 锁结构
@@ -20,7 +26,11 @@ struct lock {
 void sema_init(struct semaphore* psema, uint8_t value); 
 void sema_down(struct semaphore* psema);
 void sema_up(struct semaphore* psema);
+void sema_up_io(struct semaphore* psema);
 void lock_init(struct lock* plock);
 void lock_acquire(struct lock* plock);
 void lock_release(struct lock* plock);
+void spin_lock_init(struct spinlock* plock);
+void spin_lock(struct spinlock* plock);
+void spin_unlock(struct spinlock* plock);
 #endif
\ No newline at end of file
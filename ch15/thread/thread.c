@@ -10,6 +10,10 @@
 #include "sync.h"
 #include "file.h"
 #include "fs.h"
+#include "vma.h"
+#include "stdio.h"
+#include "timer.h"
+#include "smp.h"
 
 #define PG_SIZE 4096
 // pid 的位图, 最大支持 1024 个 pid
@@ -22,10 +26,18 @@ struct pid_pool {
 }pid_pool;
 
 struct task_struct* main_thread; // 主线程PCB
-struct task_struct* idle_thread;    // idle线程
-struct list thread_ready_list; // 就绪队列
 struct list thread_all_list; // 所有任务队列
 static struct list_elem* thread_tag;
+
+// 就绪队列是多级反馈队列: 就绪的任务按级别挂在不同的队列上, 调度时取最高的非空队列的队首,
+// ready_bitmap的第i位表示第i级队列非空, 用bsf指令一次找到, 与就绪任务的多少无关.
+// 用完整个时间片的任务在做计算, 降一级, 时间片加倍; 等输入输出(等键盘, 等硬盘)的任务被唤醒时回到最高级别(见thread_unblock_io),
+// 所以交互的任务总是先于计算的任务运行. 等锁, 睡眠等别的原因阻塞的任务醒来时保留级别和剩下的时间片,
+// 否则计算任务在时间片用完前睡一下就永远不会降级, 降了级的由mlfq_boost定期提回去.
+// 唤醒的任务级别比当前任务高时置need_resched, 下一个时钟中断就切换
+//
+// 每个处理器有自己的一套队列(struct cpu). 任务就绪时优先回到上次运行的处理器, 那里的缓存和tlb可能还是热的,
+// 它比别处忙时才放到最闲的处理器上; 处理器没有任务可运行时从最忙的处理器偷一个, 时钟中断中还定期做一次负载均衡
 // struct lock pid_lock;//分配pid的锁
 
 
@@ -37,13 +49,175 @@ extern void init(void);
 static void idle(void* arg UNUSED) {
    while(1) {
       thread_block(TASK_BLOCKED);     
+      // 先利用空闲时间补充预清零的页框, 每次只清零一小批, 然后重新阻塞,
+      // 让调度器看看是否有别的任务就绪; 储备补满了才hlt
+      if (zeroed_page_refill()) {
+         continue;
+      }
       //执行hlt时必须要保证目前处在开中断的情况下
       //hlt指令的功能让处理器停止指令执行
         // hlt执行后，cpu内部不会产生内部异常，唯一能够唤醒cpu的就是外部中断
+      // 动态时钟打开时, 没有任务就绪就停掉周期性的时钟中断, 醒来后恢复(见tick_stop)
+      // 睡眠期间放开大内核锁, 别的处理器才能进内核; 唤醒它的中断在入口处重新拿锁并恢复时钟(见kernel_lock_enter)
+      // 放锁后别的处理器给这里派了任务, 发来的处理器间中断要等sti后才响应, 正好把hlt唤醒
+      enum intr_status old_status = intr_disable();
+      if (this_cpu()->ready_bitmap == 0) {
+         tick_stop();
+      }
+      kernel_lock_exit();
       asm volatile ("sti; hlt" : : : "memory");
+      intr_disable();
+      kernel_lock_enter();
+      intr_set_status(old_status);
    }
 }
 
+// AP启动后在自己的idle线程中进入空闲循环
+void cpu_idle(void) {
+   idle(NULL);
+}
+
+// 优先级为prio的任务的最高级别, 优先级每低6级, 最高级别就低一级
+static uint8_t prio_top_level(uint8_t prio) {
+    uint32_t level = prio >= 31 ? 0 : (31 - prio) / 6;
+    return level < MLFQ_LEVELS ? level : MLFQ_LEVELS - 1;
+}
+
+static bool is_idle(struct task_struct* pthread) {
+    return pthread == cpus[pthread->cpu].idle;
+}
+
+// 处理器的负载: 就绪任务数, 加上正在运行的非idle任务
+static uint32_t cpu_load(struct cpu* c) {
+    return c->nr_ready + (c->curr != c->idle);
+}
+
+// 把pthread放到处理器c上它所在级别的就绪队列末尾, 须关中断调用
+static void cpu_enqueue(struct cpu* c, struct task_struct* pthread) {
+    ASSERT(!elem_find(&c->ready_queue[pthread->level], &pthread->general_tag));
+    list_append(&c->ready_queue[pthread->level], &pthread->general_tag);
+    c->ready_bitmap |= 1 << pthread->level;
+    c->nr_ready++;
+    pthread->cpu = c->id;
+}
+
+// 把就绪的pthread从它所在处理器的就绪队列中删除, 须关中断调用
+static void ready_remove(struct task_struct* pthread) {
+    struct cpu* c = &cpus[pthread->cpu];
+    list_remove(&pthread->general_tag);
+    if (list_empty(&c->ready_queue[pthread->level])) {
+        c->ready_bitmap &= ~(1 << pthread->level);
+    }
+    c->nr_ready--;
+}
+
+// 取出处理器c上级别最高的就绪任务, 须关中断调用且c的就绪队列非空
+static struct task_struct* ready_dequeue(struct cpu* c) {
+    uint32_t level;
+    asm ("bsfl %1, %0" : "=r" (level) : "rm" (c->ready_bitmap));
+    thread_tag = list_pop(&c->ready_queue[level]);
+    if (list_empty(&c->ready_queue[level])) {
+        c->ready_bitmap &= ~(1 << level);
+    }
+    c->nr_ready--;
+    return elem2entry(struct task_struct, general_tag, thread_tag);
+}
+
+// 给就绪的pthread挑一个处理器: 上次运行的处理器不比别处忙就留在那里, 否则去负载最小的处理器
+static struct cpu* select_cpu(struct task_struct* pthread) {
+    struct cpu* best = &cpus[pthread->cpu];
+    uint32_t best_load = cpu_load(best);
+    uint32_t cpu_idx;
+    for (cpu_idx = 0; cpu_idx < cpu_cnt && best_load > 0; cpu_idx++) {
+        uint32_t load = cpu_load(&cpus[cpu_idx]);
+        if (load < best_load) {
+            best = &cpus[cpu_idx];
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+// 让就绪的pthread进入某个处理器的就绪队列, 须关中断调用
+// 它比那个处理器上正在运行的任务级别高(或那里在运行idle)就抢占, 别的处理器要发处理器间中断通知
+void ready_enqueue(struct task_struct* pthread) {
+    ASSERT(!elem_find(&cpus[pthread->cpu].ready_queue[pthread->level], &pthread->general_tag));
+    struct cpu* c = select_cpu(pthread);
+    cpu_enqueue(c, pthread);
+    if (c->curr == c->idle || pthread->level < c->curr->level) {
+        c->need_resched = true;
+        if (c != this_cpu()) {
+            smp_send_resched(c);
+        }
+    }
+}
+
+// 把所有任务提回最高级别, 在时钟中断中调用
+void mlfq_boost(void) {
+    struct list_elem* pelem = thread_all_list.head.next;
+    while (pelem != &thread_all_list.tail) {
+        struct task_struct* pthread = elem2entry(struct task_struct, all_list_tag, pelem);
+        uint8_t top = prio_top_level(pthread->priority);
+        if (pthread->level != top && !is_idle(pthread)) {
+            if (pthread->status == TASK_READY) {
+                struct cpu* c = &cpus[pthread->cpu];
+                ready_remove(pthread);
+                pthread->level = top;
+                cpu_enqueue(c, pthread);
+            } else {
+                pthread->level = top;
+            }
+        }
+        pelem = pelem->next;
+    }
+}
+
+// 从最忙的处理器(负载至少为min_load)的就绪队列中取一个任务, 没有时返回NULL, 须关中断调用
+// 取级别最低的队列的队尾: 它是计算任务, 最久不会在原处运行, 迁移的损失最小
+static struct task_struct* steal_task(struct cpu* thief, uint32_t min_load) {
+    struct cpu* busiest = NULL;
+    uint32_t max_load = min_load - 1;
+    uint32_t cpu_idx;
+    for (cpu_idx = 0; cpu_idx < cpu_cnt; cpu_idx++) {
+        struct cpu* c = &cpus[cpu_idx];
+        uint32_t load = cpu_load(c);
+        if (c != thief && c->nr_ready > 0 && load > max_load) {
+            busiest = c;
+            max_load = load;
+        }
+    }
+    if (busiest == NULL) {
+        return NULL;
+    }
+    uint32_t level;
+    asm ("bsrl %1, %0" : "=r" (level) : "rm" (busiest->ready_bitmap));
+    struct task_struct* pthread = elem2entry(struct task_struct, general_tag, busiest->ready_queue[level].tail.prev);
+    ready_remove(pthread);
+    return pthread;
+}
+
+// 负载均衡, 在时钟中断中定期调用: 最忙的处理器比最闲的多出两个以上任务时, 移一个就绪任务过去
+void load_balance(void) {
+    struct cpu* idlest = &cpus[0];
+    uint32_t cpu_idx;
+    for (cpu_idx = 1; cpu_idx < cpu_cnt; cpu_idx++) {
+        if (cpu_load(&cpus[cpu_idx]) < cpu_load(idlest)) {
+            idlest = &cpus[cpu_idx];
+        }
+    }
+    struct task_struct* pthread = steal_task(idlest, cpu_load(idlest) + 2);
+    if (pthread == NULL) {
+        return;
+    }
+    cpu_enqueue(idlest, pthread);
+    if (idlest->curr == idlest->idle) {
+        idlest->need_resched = true;
+        if (idlest != this_cpu()) {
+            smp_send_resched(idlest);
+        }
+    }
+}
+
 // 初始化 pid 池
 static void pid_pool_init(void) {
     pid_pool.pid_start = 1;
@@ -131,9 +305,11 @@ void init_thread(struct task_struct* pthread, char* name, int prio) {
 
     // 初始化线程调度相关的参数
     pthread->priority = prio;
-    //注意优先级越高，ticks越高，也就是说它运行的时间会越长，调度器只是从就绪队列中取出下一个线程来执行
-    pthread->ticks = prio;
+    //优先级决定任务从哪一级开始, 级别越高越先运行, 时间片越短
+    pthread->level = prio_top_level(prio);
+    pthread->ticks = MLFQ_QUANTUM(pthread->level);
     pthread->elapsed_ticks = 0; //累计时间初始化为0
+    pthread->lock_depth = 1; //新任务第一次被调度时在内核中, 大内核锁由换下的任务带过来
     pthread->pgdir = NULL; //线程没有自己的虚拟地址空间
 
     //14章新增，文件描述符初始化工作，处理三个标准文件描述符，其他描述符都初始化为-1
@@ -162,13 +338,13 @@ struct task_struct* thread_start(char* name, int prio, thread_func function, voi
     init_thread(thread,name,prio);
     thread_create(thread, function, func_arg);
 
-    // 在线程创建之前，就绪队列中不应该有这个线程的general_tag
-    ASSERT(!elem_find(&thread_ready_list, &thread->general_tag));
-    list_append(&thread_ready_list, &thread->general_tag);
+    enum intr_status old_status = intr_disable();
+    ready_enqueue(thread);
 
     // 在线程创建之前，一般队列中不应该有这个线程的all-tag-list
     ASSERT(!elem_find(&thread_all_list , &thread->all_list_tag));
     list_append(&thread_all_list, &thread->all_list_tag);
+    intr_set_status(old_status);
 
 
     // //关键 ： movl %0, %%esp 会将thread->self_kstack赋值给esp
@@ -187,40 +363,72 @@ static void make_main_thread(void) {
     list_append(&thread_all_list, &main_thread->all_list_tag);
 }
 
+// 为处理器cpu_id创建idle线程, 它不进就绪队列, 处理器没有别的任务可运行时由schedule直接选中
+// BSP的idle第一次被调度时从kernel_thread开始运行; AP启动时直接在idle的栈上运行(见smp.c), 用不到线程栈
+struct task_struct* idle_thread_create(uint8_t cpu_id) {
+    struct task_struct* thread = get_kernel_pages(1);
+    char name[TASK_NAME_LEN];
+    if (cpu_id == 0) {
+        strcpy(name, "idle");
+    } else {
+        sprintf(name, "idle%d", cpu_id);
+    }
+    init_thread(thread, name, 10);
+    thread_create(thread, idle, NULL);
+    thread->cpu = cpu_id;
+    thread->status = TASK_BLOCKED;
+    cpus[cpu_id].idle = thread;
+
+    enum intr_status old_status = intr_disable();
+    list_append(&thread_all_list, &thread->all_list_tag);
+    intr_set_status(old_status);
+    return thread;
+}
+
 // 实现线程调度schedule
 void schedule(void) {
     //在进行schedule时确保已经关中断了，保证调度程序不被打断
     ASSERT(intr_get_status() == INTR_OFF);
 
     struct task_struct* cur = running_thread();//获取当前线程的PCB
-
-    if(cur->status == TASK_RUNNING) {
-        //本线程的状态是running的，说明它是因为时间片用完了才被调用shedule的，
-        // 将它加入就绪队列中，并将ticks重置为 当前线程的priority
-
-        //此线程之前是RUnning的，所以不会在就绪队列中
-        ASSERT(!elem_find(&thread_ready_list, &cur->general_tag));
-        // 将本线程的一般标签加入就绪队列中，以便下次调用
-        list_append(&thread_ready_list, &cur->general_tag);
-        cur->ticks = cur->priority;
+    struct cpu* c = this_cpu();
+
+    if(cur == c->idle && cur->status == TASK_RUNNING) {
+        // idle只在没有别的任务可运行时才运行, 不进就绪队列, 否则会排在降了级的计算任务前面
+        cur->status = TASK_BLOCKED;
+    } else if(cur->status == TASK_RUNNING) {
+        //本线程的状态是running的，说明它是因为时间片用完了或被唤醒的高级别任务抢占才被调用shedule的
+        // 时间片用完的降一级, 时间片按新的级别充满; 被抢占的保留级别和剩下的时间片
+        if (cur->ticks == 0) {
+            if (cur->level < MLFQ_LEVELS - 1) {
+                cur->level++;
+            }
+            cur->ticks = MLFQ_QUANTUM(cur->level);
+        }
+        // 将本线程的一般标签加入本处理器的就绪队列中，以便下次调用
+        cpu_enqueue(c, cur);
         cur->status = TASK_READY;
     }else {
         // 当前线程不是因为时间片用完才被调度的，那么肯定是由于某种原因被阻塞了（比如对0值信号量进行P操作就会让线程阻塞）
         //不重置该线程的ticks,也不要把当前线程放在可执行队列中
     }
 
-    /* 如果就绪队列中没有可运行的任务,就唤醒idle */
-   if (list_empty(&thread_ready_list)) {
-      thread_unblock(idle_thread);
-   }
-
-    ASSERT(!list_empty(&thread_ready_list));
     thread_tag =  NULL; // 清空全局变量thread_tag 的值
-    thread_tag = list_pop(&thread_ready_list);// 弹出队列中的第一个线程的thread_tag的指针，准备将其调度上CPU
-
-    //将thread_tag指针转换成PCB的虚拟地址
-    struct task_struct* next = elem2entry(struct task_struct, general_tag, thread_tag);//此宏在list.h中定义
+    struct task_struct* next;
+    if (c->ready_bitmap != 0) {
+        // 弹出级别最高的就绪任务，准备将其调度上CPU
+        next = ready_dequeue(c);
+    } else {
+        /* 本处理器没有就绪的任务, 先到别的处理器上偷一个, 也没有就运行idle */
+        next = steal_task(c, 1);
+        if (next == NULL) {
+            next = c->idle;
+        }
+    }
     next->status = TASK_RUNNING;
+    next->cpu = c->id;
+    c->curr = next;
+    c->need_resched = false;
 
     // 激活进程页表等,如果当前线程是进程的话，将3特权级占保存到tss中，并切换页目录表的物理地址
     // 如果是线程的话,只需要切换页目录表的物理地址即可
@@ -235,8 +443,8 @@ void schedule(void) {
 void thread_yield(void) {
    struct task_struct* cur = running_thread();   
    enum intr_status old_status = intr_disable();
-   ASSERT(!elem_find(&thread_ready_list, &cur->general_tag));
-   list_append(&thread_ready_list, &cur->general_tag);
+   // 主动让出的任务留在原来的级别, 排到本处理器的队尾
+   cpu_enqueue(this_cpu(), cur);
    cur->status = TASK_READY;
    schedule();
    intr_set_status(old_status);
@@ -244,16 +452,20 @@ void thread_yield(void) {
 
 // 回收 thread_over 的 pcb 和页表, 并将其从调度队列中去除
 void thread_exit(struct task_struct* thread_over, bool need_schedule) {
+    // 内核线程弹匣中缓存的内存块在pcb里记着, pcb释放前先还给内核的free_list, 这里可能要等锁
+    if (thread_over->pgdir == NULL) {
+        mem_magazine_drain(thread_over);
+    }
     // 要保证 schedule 在关中断情况下调用
     intr_disable();
     thread_over->status = TASK_DIED;
 
     // 如果 thread_over 不是当前线程, 就有可能还在就绪队列中, 将其从中删除
-    if (elem_find(&thread_ready_list, &thread_over->general_tag)) {
-        list_remove(&thread_over->general_tag);
+    if (elem_find(&cpus[thread_over->cpu].ready_queue[thread_over->level], &thread_over->general_tag)) {
+        ready_remove(thread_over);
     }
     if (thread_over->pgdir) { // 如果是进程, 回收进程的页表
-        mfree_page(PF_KERNEL, thread_over->pgdir, 1);
+        mfree_page(PF_KERNEL, thread_over->pgdir, PGDIR_PAGES);
     }
 
     // 从 all_thread_list 中去掉此任务
@@ -290,11 +502,33 @@ struct task_struct* pid2thread(int32_t pid) {
     return thread;
 }
 
+// 返回pid比pid大的用户进程中pid最小的一个, 没有时返回NULL, 须关中断调用
+// ksmd和kswapd据此按pid的顺序遍历进程, 进程的创建和退出不影响遍历到的位置
+struct task_struct* next_process(pid_t pid) {
+    struct task_struct* next = NULL;
+    struct list_elem* pelem = thread_all_list.head.next;
+    while (pelem != &thread_all_list.tail) {
+        struct task_struct* pthread = elem2entry(struct task_struct, all_list_tag, pelem);
+        if (pthread->pgdir != NULL && pthread->pid > pid && (next == NULL || pthread->pid < next->pid)) {
+            next = pthread;
+        }
+        pelem = pelem->next;
+    }
+    return next;
+}
+
 
 void thread_init(void) {
     put_str("thread_init start\n");
-    //初始化两个链表
-    list_init(&thread_ready_list);
+    //初始化各处理器的各级就绪队列和全部任务队列, 在smp_init之前只有BSP一个处理器
+    uint32_t cpu_idx, level;
+    for (cpu_idx = 0; cpu_idx < NR_CPUS; cpu_idx++) {
+        cpus[cpu_idx].id = cpu_idx;
+        for (level = 0; level < MLFQ_LEVELS; level++) {
+            list_init(&cpus[cpu_idx].ready_queue[level]);
+        }
+    }
+    cpu_cnt = 1;
     list_init(&thread_all_list);
     pid_pool_init(); //害人不浅啊！！
 
@@ -303,9 +537,9 @@ void thread_init(void) {
     
     // 将当前 main 函数创建为线程
     make_main_thread();
-    /* 创建idle线程 */
-    //优先级为10
-    idle_thread = thread_start("idle", 10, idle, NULL);
+    cpus[0].curr = main_thread;
+    /* 创建BSP的idle线程 */
+    idle_thread_create(0);
     put_str("thread_init donw\n");
 }
 
@@ -330,19 +564,27 @@ void thread_unblock(struct task_struct* pthread) {
     ASSERT((pthread->status == TASK_BLOCKED) || (pthread->status == TASK_WAITING) || (pthread->status == TASK_HANGING));
 
     if(pthread->status != TASK_RUNNING) {
-        ASSERT(!elem_find(&thread_ready_list, &pthread->general_tag));
-        if(elem_find(&thread_ready_list, &pthread->general_tag)) {
+        // 级别和时间片保持阻塞前的, 等输入输出的由thread_unblock_io先提到最高级别
+        if(elem_find(&cpus[pthread->cpu].ready_queue[pthread->level], &pthread->general_tag)) {
             PANIC("thread_unblock: blocked thread in ready_list\n");
         }
-        //将pthread放在等待队列中，而且放在了最前端使得这个线程能够尽快被调用
-        list_push(&thread_ready_list, &pthread->general_tag);
-
-        pthread->status = TASK_RUNNING;
+        // 比所去处理器上的任务级别高就抢占它, 那里在运行idle时也不用等它的时间片用完
+        ready_enqueue(pthread);
+        pthread->status = TASK_READY;
     }
 
     intr_set_status(old_status);
 }
 
+// 将等输入输出(键盘, 硬盘)的线程pthread解除阻塞, 它回到最高级别, 时间片重新充满
+void thread_unblock_io(struct task_struct* pthread) {
+    enum intr_status old_status = intr_disable();
+    pthread->level = prio_top_level(pthread->priority);
+    pthread->ticks = MLFQ_QUANTUM(pthread->level);
+    thread_unblock(pthread);
+    intr_set_status(old_status);
+}
+
 /* 以填充空格的方式输出buf */
 static void pad_print(char* buf, int32_t buf_len, void* ptr, char format) {
    memset(buf, 0, buf_len);
@@ -353,6 +595,10 @@ static void pad_print(char* buf, int32_t buf_len, void* ptr, char format) {
 	 break;
       case 'd':
 	 out_pad_0idx = sprintf(buf, "%d", *((int16_t*)ptr));
+	 break;
+      case 'u':
+	 out_pad_0idx = sprintf(buf, "%d", *((uint32_t*)ptr));
+	 break;
       case 'x':
 	 out_pad_0idx = sprintf(buf, "%x", *((uint32_t*)ptr));
    }
@@ -397,6 +643,17 @@ static bool elem2thread_info(struct list_elem* pelem, int arg UNUSED) {
    }
    pad_print(out_pad, 16, &pthread->elapsed_ticks, 'x');
 
+   /* 用户进程的区域数, 以及区域链表相比原来的虚拟地址位图节省的内核内存(字节) */
+   if (pthread->pgdir != NULL) {
+      uint32_t vma_cnt = list_len(&pthread->vma_list);
+      uint32_t saved = VMA_BITMAP_PAGES * PG_SIZE - vma_cnt * sizeof(struct vm_area);
+      pad_print(out_pad, 16, &vma_cnt, 'u');
+      pad_print(out_pad, 16, &saved, 'u');
+   } else {
+      pad_print(out_pad, 16, "-", 's');
+      pad_print(out_pad, 16, "-", 's');
+   }
+
    memset(out_pad, 0, 16);
    ASSERT(strlen(pthread->name) < 17);
    memcpy(out_pad, pthread->name, strlen(pthread->name));
@@ -407,7 +664,7 @@ static bool elem2thread_info(struct list_elem* pelem, int arg UNUSED) {
 
 /* 打印任务列表 */
 void sys_ps(void) {
-   char* ps_title = "PID            PPID           STAT           TICKS          COMMAND\n";
+   char* ps_title = "PID            PPID           STAT           TICKS          VMAS           SAVED          COMMAND\n";
    sys_write(stdout_no, ps_title, strlen(ps_title));
    list_traversal(&thread_all_list, elem2thread_info, 0);
 }
\ No newline at end of file
@@ -8,6 +8,14 @@
 
 #define TASK_NAME_LEN 16
 #define MAX_FILES_OPEN_PER_PROC 8
+#define USER_PDE_CNT (KERNEL_BASE >> PDE_SHIFT)   // 用户空间(0xc0000000以下)的页目录项数
+
+// 多级反馈队列的级数, 0级最高; 第level级的时间片是MLFQ_QUANTUM(level)个嘀嗒, 级别越低时间片越长
+#define MLFQ_LEVELS 6
+#define MLFQ_BASE_TICKS 2
+#define MLFQ_QUANTUM(level) (MLFQ_BASE_TICKS << (level))
+#define MLFQ_BOOST_TICKS 100   // 每隔这么多嘀嗒把所有任务提回最高级别, 防止低级别的任务饿死
+#define LOAD_BALANCE_TICKS 10  // 每隔这么多嘀嗒在处理器之间平衡一次就绪任务
 // 自定义通用函数类型, 在线程函数中作为形参类型
 typedef void thread_func(void*);
 typedef int16_t pid_t;
@@ -77,6 +85,9 @@ struct task_struct {
     char name[16];
     uint8_t priority; // 线程优先级
     uint8_t ticks; // 每次在处理器上执行的时间嘀嗒数
+    uint8_t level; // 在多级反馈队列中所在的级别, 最高级别由优先级决定
+    uint8_t cpu; // 正在运行或就绪时所在的处理器, 阻塞时是上次运行的处理器
+    uint32_t lock_depth; // 嵌套进入内核的层数, 从0变1时拿大内核锁, 回到0时放开(见smp.c)
 
     uint32_t elapsed_ticks; // 此任务上 cpu 运行后至今占用了多少嘀嗒数
 
@@ -85,16 +96,22 @@ struct task_struct {
     struct list_elem general_tag; // 用于线程在一般队列中的结点
     struct list_elem all_list_tag; // 用于线程在 thread_all_list 中的结点
 
-    uint32_t* pgdir; // 进程自己页表的虚拟地址
-    struct virtual_addr userprog_vaddr; // 用户进程的虚拟地址
+    pte_t* pgdir; // 进程自己页表的虚拟地址
+    struct list vma_list; // 用户进程的虚拟内存区域, 按起始地址升序排列
+    uint32_t start_brk; // 进程堆的起始地址, 紧接在程序段之后, 页对齐
+    uint32_t brk; // 进程堆的末尾(program break), 由brk系统调用移动
+    uint32_t pde_bitmap[USER_PDE_CNT / 32]; // 存在的用户页表, 每位对应一个用户页目录项
     struct mem_block_desc u_block_desc[DESC_CNT]; // 用户进程内存块描述符
+    struct mem_magazine mag[DESC_CNT]; // 各规格内存块的弹匣, 内核线程缓存内核内存块, 进程缓存自己堆中的
     uint32_t cwd_inode_nr; // 进程所在的工作目录的 inode 编号
     int16_t parent_pid; // 父进程 pid
     int8_t exit_status; // 进程结束时自己调用 exit 传入的参数
+#ifdef CONFIG_PAE
+    uint64_t pdpt[4] __attribute__((aligned(32))); // 页目录指针表, 进程的cr3指向这里, 要32字节对齐
+#endif
     uint32_t stack_magic; // 栈的边界标记, 用于检测栈的溢出
 };
 
-extern struct list thread_ready_list;
 extern struct list thread_all_list;
 
 void thread_create(struct task_struct* pthread, thread_func function, void* func_arg);
@@ -105,10 +122,17 @@ void schedule(void);
 void thread_init(void);
 void thread_block(enum task_status stat);
 void thread_unblock(struct task_struct* pthread);
+void thread_unblock_io(struct task_struct* pthread);
 void thread_yield(void);
+void ready_enqueue(struct task_struct* pthread);
+void mlfq_boost(void);
+void load_balance(void);
+struct task_struct* idle_thread_create(uint8_t cpu_id);
+void cpu_idle(void);
 pid_t fork_pid(void);
 void sys_ps(void);
 void thread_exit(struct task_struct* thread_over, bool need_schedule);
 struct task_struct* pid2thread(int32_t pid);
+struct task_struct* next_process(pid_t pid);
 void release_pid(pid_t pid);
 #endif
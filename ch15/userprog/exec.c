@@ -58,40 +58,60 @@ enum segment_type {
    PT_PHDR             // 程序头表
 };
 
-/* 将文件描述符fd指向的文件中,偏移为offset,大小为filesz的段加载到虚拟地址为vaddr的内存 */
-static bool segment_load(int32_t fd, uint32_t offset, uint32_t filesz, uint32_t vaddr) {
+/* 段权限, 即程序头中的p_flags */
+enum segment_flags {
+   PF_X = 1,           // 可执行
+   PF_W = 2,           // 可写
+   PF_R = 4            // 可读
+};
+
+/* 将文件描述符fd指向的文件中,偏移为offset,大小为filesz的段加载到虚拟地址为vaddr的内存
+ * 段在内存中占memsz字节, 超出filesz的部分(.bss)清0
+ * PAE下不可执行的段所在的页带上NX位, 与可执行段共用的页仍然可执行 */
+static bool segment_load(int32_t fd, uint32_t offset, uint32_t filesz, uint32_t memsz, uint32_t vaddr, uint32_t flags) {
    uint32_t vaddr_first_page = vaddr & 0xfffff000;    // vaddr地址所在的页框
-   uint32_t size_in_first_page = PG_SIZE - (vaddr & 0x00000fff);     // 加载到内存后,文件在第一个页框中占用的字节大小
+   uint32_t size_in_first_page = PG_SIZE - (vaddr & 0x00000fff);     // 加载到内存后,段在第一个页框中占用的字节大小
    uint32_t occupy_pages = 0;
    /* 若一个页框容不下该段 */
-   if (filesz > size_in_first_page) {
-      uint32_t left_size = filesz - size_in_first_page;
+   if (memsz > size_in_first_page) {
+      uint32_t left_size = memsz - size_in_first_page;
       occupy_pages = DIV_ROUND_UP(left_size, PG_SIZE) + 1;	     // 1是指vaddr_first_page
    } else {
       occupy_pages = 1;
    }
 
-   /* 为进程分配内存 */
-   uint32_t page_idx = 0;
-   uint32_t vaddr_page = vaddr_first_page;
-   while (page_idx < occupy_pages) {
-      uint32_t* pde = pde_ptr(vaddr_page);
-      uint32_t* pte = pte_ptr(vaddr_page);
-
-      /* 如果pde不存在,或者pte不存在就分配内存.
-       * pde的判断要在pte之前,否则pde若不存在会导致
-       * 判断pte时缺页异常 */
-      if (!(*pde & 0x00000001) || !(*pte & 0x00000001)) {
-        if (get_a_page(PF_USER, vaddr_page) == NULL) {
-            return false;
-        }
-      } // 如果原进程的页表已经分配了,利用现有的物理页,直接覆盖进程体
-      vaddr_page += PG_SIZE;
-      page_idx++;
+   /* 为进程分配内存, 页框不够时一页也不分配
+    * 如果原进程的页表已经分配了,利用现有的物理页,直接覆盖进程体 */
+   pte_t attr = PG_US_U | PG_RW_W;
+#ifdef CONFIG_PAE
+   attr |= pg_nx;    // 新页还没有tlb项, 不用刷新
+#endif
+   if (!map_user_pages(vaddr_first_page, occupy_pages, attr)) {
+      return false;
+   }
+#ifdef CONFIG_PAE
+   if (flags & PF_X) {
+      uint32_t page_idx = 0;
+      uint32_t vaddr_page = vaddr_first_page;
+      while (page_idx < occupy_pages) {
+         pte_t* pte = pte_ptr(vaddr_page);
+         if (*pte & PG_NX) {
+            *pte &= ~PG_NX;
+            asm volatile ("invlpg %0"::"m" (*(char*)vaddr_page):"memory");
+         }
+         vaddr_page += PG_SIZE;
+         page_idx++;
+      }
    }
+#else
+   (void)flags;
+#endif
    sys_lseek(fd, offset, SEEK_SET);
    //从文件中读入内存
    sys_read(fd, (void*)vaddr, filesz);
+   if (memsz > filesz) {
+      memset((void*)(vaddr + filesz), 0, memsz - filesz);
+   }
    return true;
 }
 
@@ -126,6 +146,11 @@ static int32_t load(const char* pathname) {
    Elf32_Off prog_header_offset = elf_header.e_phoff; 
    Elf32_Half prog_header_size = elf_header.e_phentsize;
 
+   /* 新程序的段可能落在旧程序的堆中, 先把旧的堆整个释放掉 */
+   struct task_struct* cur = running_thread();
+   sys_brk(cur->start_brk);
+   uint32_t image_end = 0;     // 各可加载段在内存中的最高地址, 新的堆从这里之后开始
+
    /* 遍历所有程序头 */
    uint32_t prog_idx = 0;
    while (prog_idx < elf_header.e_phnum) {
@@ -142,16 +167,22 @@ static int32_t load(const char* pathname) {
 
       /* 如果是可加载段就调用segment_load加载到内存 */
       if (PT_LOAD == prog_header.p_type) {
-        if (!segment_load(fd, prog_header.p_offset, prog_header.p_filesz, prog_header.p_vaddr)) {
+        if (prog_header.p_memsz < prog_header.p_filesz || \
+            !segment_load(fd, prog_header.p_offset, prog_header.p_filesz, prog_header.p_memsz, \
+                          prog_header.p_vaddr, prog_header.p_flags)) {
             ret = -1;
             goto done;
         }
+        if (prog_header.p_vaddr + prog_header.p_memsz > image_end) {
+            image_end = prog_header.p_vaddr + prog_header.p_memsz;
+        }
       }
 
       /* 更新下一个程序头的偏移 */
       prog_header_offset += elf_header.e_phentsize;
       prog_idx++;
    }
+   cur->start_brk = cur->brk = DIV_ROUND_UP(image_end, PG_SIZE) * PG_SIZE;
    ret = elf_header.e_entry;
 done:
    sys_close(fd);
@@ -6,81 +6,108 @@
 #include "thread.h"    
 #include "string.h"
 #include "file.h"
+#include "vma.h"
+#include "swap.h"
 #include <stdint.h>
 
 extern void intr_exit(void);
 
 
-/* 将父进程的pcb、虚拟地址位图拷贝给子进程 
-    其中pcb中单独修改，pid elapsed_ticks status ticks parent_pid 等这几个属性， 并且初始化子进程的内存块描述符
+/* 将父进程的pcb、虚拟内存区域链表拷贝给子进程 
+    其中pcb中单独修改，pid elapsed_ticks status ticks parent_pid 等这几个属性
 */
-static int32_t copy_pcb_vaddrbitmap_stack0(struct task_struct* child_thread, struct task_struct* parent_thread) {
+static int32_t copy_pcb_vma_stack0(struct task_struct* child_thread, struct task_struct* parent_thread) {
     /* 复制pcb所在的整个页，然后单独修改部分 */
     memcpy(child_thread, parent_thread, PG_SIZE);
     child_thread->pid = fork_pid();
     child_thread->elapsed_ticks = 0;
     child_thread->status = TASK_READY;
-    child_thread->ticks = child_thread->priority;   // 为新进程把时间片充满
+    child_thread->ticks = MLFQ_QUANTUM(child_thread->level);   // 子进程留在父进程的级别, 把时间片充满
+    child_thread->lock_depth = 1;   // 子进程从intr_exit返回用户态, 在那里放开大内核锁
     child_thread->parent_pid = parent_thread->pid;
     child_thread->general_tag.prev = child_thread->general_tag.next = NULL;
     child_thread->all_list_tag.prev = child_thread->all_list_tag.next = NULL;
-    block_desc_init(child_thread->u_block_desc);//初始化内存块描述结构
-    /* b 复制父进程的虚拟地址池的位图 */
-    uint32_t bitmap_pg_cnt = DIV_ROUND_UP((0xc0000000 - USER_VADDR_START) / PG_SIZE / 8 , PG_SIZE);
-    void* vaddr_btmp = get_kernel_pages(bitmap_pg_cnt);
-    if (vaddr_btmp == NULL) return -1;
-    /* 此时child_thread->userprog_vaddr.vaddr_bitmap.bits还是指向父进程虚拟地址的位图地址
-        * 下面将child_thread->userprog_vaddr.vaddr_bitmap.bits指向自己的位图vaddr_btmp */
-    memcpy(vaddr_btmp, child_thread->userprog_vaddr.vaddr_bitmap.bits, bitmap_pg_cnt * PG_SIZE);
-    child_thread->userprog_vaddr.vaddr_bitmap.bits = vaddr_btmp;
+    // 内存块描述符和弹匣随pcb复制过来, 子进程接着管理复制来的堆, free_list两端在子进程中第一次用时再接好(见heap_descs)
+    /* b 复制父进程的虚拟内存区域
+        * 此时child_thread->vma_list的头尾结点还指向父进程的区域, 下面为子进程建立自己的链表 */
+    if (vma_list_copy(&child_thread->vma_list, &parent_thread->vma_list) == -1) {
+        release_pid(child_thread->pid);
+        return -1;
+    }
     /* 调试用 */
     ASSERT(strlen(child_thread->name) < 11);	// pcb.name的长度是16,为避免下面strcat越界
     strcat(child_thread->name,"_fork");
     return 0;
 }
 
-/* 复制子进程的进程体(代码和数据)及用户栈 
-    需要用内核页作为父子进程之间拷贝数据的中转站
+/* 释放子进程页目录中[0, pde_end)范围内已经分配的页表, 复制页表失败时回退用 */
+static void free_child_page_tables(struct task_struct* child_thread, uint32_t pde_end) {
+   uint32_t pde_idx = 0;
+   while (pde_idx < pde_end) {
+      if (child_thread->pgdir[pde_idx] & PG_P_1) {
+         pfree(PTE_ADDR(child_thread->pgdir[pde_idx]));
+         child_thread->pgdir[pde_idx] = 0;
+      }
+      pde_idx++;
+   }
+}
+
+/* 以写时复制的方式共享父进程的进程体(代码和数据)及用户栈
+    只为子进程复制页表: 父子进程的页表项指向同一物理页框, 可写的页在双方都改为只读并打上PG_COW,
+    页框的引用计数加1, 等到某一方写这个页时才在缺页异常中真正复制(见cow_page_fault)
+    先为子进程分配好所有的页表再改父进程的页表项, 分配失败时父进程还原封未动, 只需释放已分配的页表
 */
-static void copy_body_stack3(struct task_struct* child_thread, struct task_struct* parent_thread, void* buf_page) {
-   uint8_t* vaddr_btmp = parent_thread->userprog_vaddr.vaddr_bitmap.bits;
-   uint32_t btmp_bytes_len = parent_thread->userprog_vaddr.vaddr_bitmap.btmp_bytes_len;
-   uint32_t vaddr_start = parent_thread->userprog_vaddr.vaddr_start;
-   uint32_t idx_byte = 0;
-   uint32_t idx_bit = 0;
-   uint32_t prog_vaddr = 0;
-
-   /* 在父进程的用户空间中查找已有数据的页 */
-   while (idx_byte < btmp_bytes_len) {
-      if (vaddr_btmp[idx_byte]) {//位图的某个字节不为0，说明该字节的位不全为0，下面依次检查该字节的每个位
-         idx_bit = 0;
-         while (idx_bit < 8) {
-            //BITMAP_MASK = 1
-            if ((BITMAP_MASK << idx_bit) & vaddr_btmp[idx_byte]) {//逐位查看该字节
-               prog_vaddr = (idx_byte * 8 + idx_bit) * PG_SIZE + vaddr_start;
-         /* 下面的操作是将父进程用户空间中的数据通过内核空间做中转,最终复制到子进程的用户空间 */
-
-               /* a 将父进程在用户空间中的数据复制到内核缓冲区buf_page,
-               目的是下面切换到子进程的页表后,还能访问到父进程的数据*/
-               memcpy(buf_page, (void*)prog_vaddr, PG_SIZE);
-
-               /* b 将页表切换到子进程,目的是避免下面申请内存的函数将pte及pde安装在父进程的页表中 */
-               page_dir_activate(child_thread);
-               /* c 申请虚拟地址prog_vaddr ，不用申请虚拟空间位图，是因为copy_pcb_vaddrbitmap_stack0已经将位图拷贝好了*/
-               //使用与父进程相同的prog_vaddr为子进程申请物理空间，所以父子进程往往有相同的虚拟地址
-               get_a_page_without_opvaddrbitmap(PF_USER, prog_vaddr);
-
-               /* d 从内核缓冲区中将父进程数据复制到子进程的用户空间 */
-               memcpy((void*)prog_vaddr, buf_page, PG_SIZE);
-
-               /* e 恢复父进程页表 */
-               page_dir_activate(parent_thread);
+static int32_t copy_page_table_cow(struct task_struct* child_thread) {
+   uint32_t pde_idx = 0;
+   while (pde_idx < USER_PDE_CNT) {    // 只处理用户空间, 内核部分在create_page_dir中已共享
+      pte_t* pde = pde_ptr(pde_idx << PDE_SHIFT);
+      if (*pde & PG_P_1) {
+         uint32_t pt_phyaddr = palloc_contig(PF_KERNEL, 1);
+         if (pt_phyaddr == 0) {
+            free_child_page_tables(child_thread, pde_idx);
+            return -1;
+         }
+         child_thread->pgdir[pde_idx] = pt_phyaddr | (*pde & ~PTE_ADDR_MASK);
+      }
+      pde_idx++;
+   }
+
+   pde_idx = 0;
+   while (pde_idx < USER_PDE_CNT) {
+      if (child_thread->pgdir[pde_idx] & PG_P_1) {
+         uint32_t pt_phyaddr = PTE_ADDR(child_thread->pgdir[pde_idx]);
+         /* 父进程的页表通过自映射访问, 子进程的页表不在当前页目录中, 用kmap取得它的内核地址 */
+         pte_t* parent_pt = pte_ptr(pde_idx << PDE_SHIFT);
+         pte_t* child_pt = kmap(pt_phyaddr);
+         uint32_t pte_idx = 0, pte_cnt = 0;
+         while (pte_idx < PT_ENTRIES) {
+            pte_t pte = parent_pt[pte_idx];
+            if (pte & PG_P_1) {
+               if (pte & PG_RW_W) {
+                  pte = (pte & ~PG_RW_W) | PG_COW;
+                  parent_pt[pte_idx] = pte;
+               }
+               page_ref_get(PTE_ADDR(pte));
+               pte_cnt++;
+            } else if (pte & PG_SWAP) {
+               // 换出的页由父子进程共享交换分区中的槽位, 各自访问时分别读回
+               swap_dup(SWAP_SLOT(pte));
+               pte_cnt++;
             }
-            idx_bit++;
+            child_pt[pte_idx] = pte;
+            pte_idx++;
          }
+         kunmap(child_pt);
+         page_table_set_cnt(pt_phyaddr, pte_cnt);   // 子进程的pde_bitmap已随pcb复制过去
       }
-      idx_byte++;
+      pde_idx++;
    }
+   /* 父进程的页表项被改为只读, 重新加载cr3刷新tlb中的用户页
+      父进程就是当前进程, page_dir_activate会因cr3没变而跳过加载, 所以这里直接重载 */
+   uint32_t cr3;
+   asm volatile ("movl %%cr3, %0" : "=r" (cr3));
+   asm volatile ("movl %0, %%cr3" : : "r" (cr3) : "memory");
+   return 0;
 }
 
 /* 为子进程构建thread_stack,将PCB的self_stack指向它
@@ -140,35 +167,35 @@ static void update_inode_open_cnts(struct task_struct* thread) {
 }
 
 /* 拷贝父进程本身所占资源给子进程： 该函数上面几个函数的封装
+   失败时已经为子进程分配的pid, 区域链表和页目录都释放掉, pcb由调用者释放
  */
 static int32_t copy_process(struct task_struct* child_thread, struct task_struct* parent_thread) {
-   /* 内核缓冲区,作为父进程用户空间的数据复制到子进程用户空间的中转 */
-   void* buf_page = get_kernel_pages(1);
-   if (buf_page == NULL) {
-      return -1;
-   }
-
-   /* a 复制父进程的pcb、虚拟地址位图、内核栈到子进程 */
-   if (copy_pcb_vaddrbitmap_stack0(child_thread, parent_thread) == -1) {
+   /* a 复制父进程的pcb、虚拟内存区域、内核栈到子进程 */
+   if (copy_pcb_vma_stack0(child_thread, parent_thread) == -1) {
       return -1;
    }
 
    /* b 为子进程创建页表,此页表仅包括内核空间 */
    child_thread->pgdir = create_page_dir();
    if(child_thread->pgdir == NULL) {
+      vma_list_destroy(&child_thread->vma_list);
+      release_pid(child_thread->pid);
       return -1;
    }
 
-   /* c 复制父进程进程体及用户栈给子进程 */
-   copy_body_stack3(child_thread, parent_thread, buf_page);
+   /* c 以写时复制的方式共享父进程进程体及用户栈 */
+   if (copy_page_table_cow(child_thread) == -1) {
+      mfree_page(PF_KERNEL, child_thread->pgdir, PGDIR_PAGES);
+      vma_list_destroy(&child_thread->vma_list);
+      release_pid(child_thread->pid);
+      return -1;
+   }
 
    /* d 构建子进程thread_stack和修改返回值pid */
    build_child_stack(child_thread);
 
    /* e 更新子进程文件inode的打开数 */
    update_inode_open_cnts(child_thread);
-
-   mfree_page(PF_KERNEL, buf_page, 1);
    return 0;
 }
 
@@ -183,12 +210,12 @@ pid_t sys_fork(void) {
 
     // 调用copy_process 复制进程体
    if (copy_process(child_thread, parent_thread) == -1) {
+      mfree_page(PF_KERNEL, child_thread, 1);
       return -1;
    }
 
    /* 添加到就绪线程队列和所有线程队列,子进程由调试器安排运行 */
-   ASSERT(!elem_find(&thread_ready_list, &child_thread->general_tag));
-   list_append(&thread_ready_list, &child_thread->general_tag);
+   ready_enqueue(child_thread);
    ASSERT(!elem_find(&thread_all_list, &child_thread->all_list_tag));
    list_append(&thread_all_list, &child_thread->all_list_tag);
    
@@ -37,15 +37,32 @@ void start_process(void* filename_) {
 }
 
 // 激活页表
+// 页目录没变时(如内核线程之间切换)不重新加载cr3, 以免无谓地刷新tlb
 void page_dir_activate(struct task_struct* p_thread) {
     // 默认为内核所用的 页目录项表的物理地址
-    uint32_t pagedir_phy_addr = 0x100000;
+    uint32_t pagedir_phy_addr = kernel_cr3;
     if(p_thread->pgdir != NULL) {
         // 如果是进程而不是内核线程，就将页目录表的物理地址重置
+#ifdef CONFIG_PAE
+        // PAE下cr3指向pcb中的页目录指针表, 它的4项依次指向pgdir起的4个页目录
+        // fork时pcb是整页复制的, 所以每次都重新填写, 内容不变时重复写入也没有影响
+        uint32_t pgdir_phy_addr = addr_v2p((uint32_t)p_thread->pgdir);
+        uint32_t pd_idx = 0;
+        while(pd_idx < PGDIR_PAGES) {
+            p_thread->pdpt[pd_idx] = (pgdir_phy_addr + pd_idx * PG_SIZE) | PG_P_1;
+            pd_idx++;
+        }
+        pagedir_phy_addr = V2P(p_thread->pdpt);
+#else
         pagedir_phy_addr = addr_v2p((uint32_t)p_thread->pgdir);
+#endif
+    }
+    uint32_t cr3;
+    asm volatile("movl %%cr3, %0" : "=r" (cr3));
+    if((cr3 & ~0x1f) != pagedir_phy_addr) {   // PAE下cr3只要求32字节对齐
+        //内联汇编重置cr3寄存器, 内核的全局页不会被刷新
+        asm volatile("movl %0, %%cr3" : : "r" (pagedir_phy_addr) : "memory");
     }
-    //内联汇编重置cr3寄存器
-    asm volatile("movl %0, %%cr3" : : "r" (pagedir_phy_addr) : "memory");
 }
 
 // 激活线程或进程的页表, 更新 tss 中的 esp0 为进程的特权级 0 的栈
@@ -62,39 +79,45 @@ void process_activate(struct task_struct* p_thread) {
     }
 }
 
-// 创建用户进程的页目录，将内核使用的256个PDE复制到用户进程的头部
-uint32_t* create_page_dir(void) {
+// 创建用户进程的页目录，将内核使用的PDE复制到用户进程的页目录中
+// PAE下页目录是物理上连续的4页, 当成一个2048项的页目录使用
+pte_t* create_page_dir(void) {
     // 用户进程的页表不能让用户直接访问到，所以再内核空间申请页目录表
-    uint32_t* page_dir_vaddr = get_kernel_pages(1);
+    pte_t* page_dir_vaddr = get_kernel_pages(PGDIR_PAGES);
     if (page_dir_vaddr == NULL) {
         // 分配失败
         console_put_str("create_page_dir: get_kernel_pages failed!");
         return NULL;
     }
 
-    // 复制内核页目录项的前256到新页表的前256个项
-    //0xfffff000用来访问内核页目录表的基地址
-    // 0xfffff000 + 0x300 * 4 是内核页目录的第 768 项
-    // 256 * 4 = 1024字节
-    // 就是将从内核目录的第768项的地址开始，复制1024个字节到新创建的页目录表的的768项， 从而完成了内核pde的复制
-    memcpy( (uint32_t*) ((uint32_t)page_dir_vaddr + 0x300*4 ), (uint32_t*)(0xfffff000 + 0x300*4), 1024 );
-
-    //修改最后一个页目录项，使它指向用户目录表的起始物理地址
-    uint32_t new_page_dir_phy_addr = addr_v2p((uint32_t)page_dir_vaddr) | PG_US_U | PG_RW_W | PG_P_1;;
-    page_dir_vaddr[1023] = new_page_dir_phy_addr;
+    // 复制内核页目录项到新页目录中同样的位置, 从而完成了内核pde的复制
+    // 当前页目录通过自映射在pde_ptr(KERNEL_BASE)处访问, 自映射的项之后单独设置
+    uint32_t kernel_pde_cnt = (0xffffffff >> PDE_SHIFT) + 1 - USER_PDE_CNT - PGDIR_PAGES;
+    memcpy(&page_dir_vaddr[USER_PDE_CNT], pde_ptr(KERNEL_BASE), kernel_pde_cnt * sizeof(pte_t));
+
+    //修改最后的页目录项(PAE下是最后4项)，使它们依次指向用户页目录的物理地址
+    uint32_t new_page_dir_phy_addr = addr_v2p((uint32_t)page_dir_vaddr);
+    uint32_t pd_idx = 0;
+    while(pd_idx < PGDIR_PAGES) {
+#ifdef CONFIG_PAE
+        page_dir_vaddr[USER_PDE_CNT + kernel_pde_cnt + pd_idx] = \
+            (new_page_dir_phy_addr + pd_idx * PG_SIZE) | PG_US_S | PG_RW_W | PG_P_1;
+#else
+        page_dir_vaddr[USER_PDE_CNT + kernel_pde_cnt + pd_idx] = \
+            (new_page_dir_phy_addr + pd_idx * PG_SIZE) | PG_US_U | PG_RW_W | PG_P_1;
+#endif
+        pd_idx++;
+    }
 
     return page_dir_vaddr;
 }
 
-// 创建用户进程虚拟地址位图
-void create_user_vaddr_bitmap(struct task_struct* user_prog) {
-    user_prog->userprog_vaddr.vaddr_start = USER_VADDR_START;
-    // 管理某个进程的虚拟的位图一共占用bitmap_pg_cnt个内核页面
-    uint32_t bitmap_pg_cnt = DIV_ROUND_UP((0xc0000000 - USER_VADDR_START) / PG_SIZE / 8, PG_SIZE);
-    // 使用get_kernel_pages(bitmap_pg_cnt) 申请对应的内核页数
-    user_prog->userprog_vaddr.vaddr_bitmap.bits = get_kernel_pages(bitmap_pg_cnt);
-    user_prog->userprog_vaddr.vaddr_bitmap.btmp_bytes_len = (0xc0000000 - USER_VADDR_START) / PG_SIZE / 8;
-    bitmap_init(&user_prog->userprog_vaddr.vaddr_bitmap);
+// 初始化用户进程的虚拟内存区域链表, 开始时没有任何区域
+// 区域在vaddr_get和get_a_page中按需添加, 见kernel/vma.c
+void create_user_vma_list(struct task_struct* user_prog) {
+    list_init(&user_prog->vma_list);
+    // 没有从elf加载的进程(如init)堆从用户空间的起始处开始, execv会改为新程序的末尾
+    user_prog->start_brk = user_prog->brk = USER_VADDR_START;
 }
 
 // 创建用户进程
@@ -103,7 +126,7 @@ void process_execute(void* filename, char* name) {
     struct task_struct* thread = get_kernel_pages(1);
     // 默认优先级为31
     init_thread(thread, name, default_prio);
-    create_user_vaddr_bitmap(thread);
+    create_user_vma_list(thread);
 
     // start_process函数作为调用函数而不是kernel_thread_start,filename是用户进程地址
     thread_create(thread,start_process,filename);
@@ -113,8 +136,7 @@ void process_execute(void* filename, char* name) {
     block_desc_init(thread->u_block_desc);
 
     enum intr_status old_status = intr_disable();
-    ASSERT(!elem_find(&thread_ready_list, &thread->general_tag));
-    list_append(&thread_ready_list, &thread->general_tag);
+    ready_enqueue(thread);
 
     ASSERT(!elem_find(&thread_all_list, &thread->all_list_tag));
     list_append(&thread_all_list, &thread->all_list_tag);
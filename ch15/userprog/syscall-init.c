@@ -11,7 +11,11 @@
 #include "exec.h"
 #include "wait_exit.h"
 #include "pipe.h"
-#define syscall_nr 32 
+#include "ksm.h"
+#include "mmap.h"
+#include "timer.h"
+#include "clock.h"
+#define syscall_nr 34 
 typedef void* syscall;
 syscall syscall_table[syscall_nr];
 
@@ -50,5 +54,12 @@ void syscall_init(void) {
    syscall_table[SYS_WAIT]       = sys_wait;
    syscall_table[SYS_PIPE]	    = sys_pipe;
    syscall_table[SYS_FD_REDIRECT]   = sys_fd_redirect;
+   syscall_table[SYS_BRK]          = sys_brk;
+   syscall_table[SYS_KSM_CTL]      = sys_ksm_ctl;
+   syscall_table[SYS_MMAP]         = sys_mmap;
+   syscall_table[SYS_MUNMAP]       = sys_munmap;
+   syscall_table[SYS_MEMINFO]      = sys_meminfo;
+   syscall_table[SYS_SLEEP]        = sys_sleep;
+   syscall_table[SYS_CLOCK_GETTIME] = sys_clock_gettime;
    put_str("syscall_init done\n");
 }
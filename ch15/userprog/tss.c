@@ -3,6 +3,13 @@
 #include "global.h"
 #include "string.h"
 #include "print.h"
+#include "smp.h"
+
+// gdt 在 0x900 处共 64 项, 第 4 项是 BSP 的 tss, 第 5, 6 项是用户代码段和数据段,
+// AP 的 tss 从第 7 项起依次存放
+#define GDT_VADDR 0xc0000900
+#define TSS_DESC_IDX(cpu_id) ((cpu_id) == 0 ? 4 : 6 + (cpu_id))
+#define GDT_DESC_CNT (6 + NR_CPUS)
 
 // 任务状态段 tss 结构
 struct tss {
@@ -34,11 +41,12 @@ struct tss {
     uint32_t trace;
     uint32_t io_base;
 }; 
-static struct tss tss;
+// 每个处理器一个 tss, 中断时从各自的 tss 中取 0 级栈
+static struct tss tss[NR_CPUS];
 
-// 更新 tss 中 esp0 字段的值为 pthread 的 0 级栈
+// 更新当前处理器 tss 中 esp0 字段的值为 pthread 的 0 级栈
 void update_tss_esp(struct task_struct* pthread) {
-    tss.esp0 = (uint32_t*)((uint32_t)pthread + PG_SIZE);
+    tss[this_cpu()->id].esp0 = (uint32_t*)((uint32_t)pthread + PG_SIZE);
 }
 
 // 创建 gdt 描述符
@@ -57,24 +65,34 @@ static struct gdt_desc make_gdt_desc(uint32_t* desc_addr,
     return desc;
 }
 
-// 在 gdt 中创建 tss 并重新加载 gdt
+// 初始化处理器 cpu_id 的 tss, 在 gdt 中添加 dpl 为 0 的 TSS 描述符, 重新加载 gdt 后用 ltr 载入
+static void tss_load(uint8_t cpu_id) {
+    struct tss* ptss = &tss[cpu_id];
+    uint32_t tss_size = sizeof(struct tss);
+    memset(ptss, 0, tss_size);
+    ptss->ss0 = SELECTOR_K_STACK;
+    ptss->io_base = tss_size;
+    ((struct gdt_desc*)GDT_VADDR)[TSS_DESC_IDX(cpu_id)] = \
+        make_gdt_desc((uint32_t*)ptss, tss_size - 1, TSS_ATTR_LOW, TSS_ATTR_HIGH);
+
+    // gdt 16 位的 limit 32 位的段基址, 界限包括所有处理器的 tss
+    uint64_t gdt_operand = ((8 * GDT_DESC_CNT - 1) | ((uint64_t)(uint32_t)GDT_VADDR << 16));
+    asm volatile ("lgdt %0" : : "m" (gdt_operand));
+    asm volatile ("ltr %w0" : : "r" ((uint16_t)((TSS_DESC_IDX(cpu_id) << 3) + (TI_GDT << 2) + RPL0)));
+}
+
+// 在 gdt 中创建 BSP 的 tss 和用户段描述符并重新加载 gdt
 void tss_init() {
     put_str("tss_init start\n");
-    uint32_t tss_size = sizeof(tss);
-    memset(&tss, 0, tss_size);
-    tss.ss0 = SELECTOR_K_STACK;
-    tss.io_base = tss_size;
-
-    // gdt 段基址为 0x900, 把 tss 放到第 4 个位置, 也就是 0x900+0x20 的位置
-    // 在 gdt 中添加 dpl 为 0 的 TSS 描述符
-    *((struct gdt_desc*)0xc0000920) = make_gdt_desc((uint32_t*)&tss, tss_size - 1, TSS_ATTR_LOW, TSS_ATTR_HIGH);
-    // 在 gdt 中添加 dpl 为 3 的数据段和代码段描述符
+    // gdt 段基址为 0x900, 在 gdt 中添加 dpl 为 3 的数据段和代码段描述符
     *((struct gdt_desc*)0xc0000928) = make_gdt_desc((uint32_t*)0, 0xfffff, GDT_CODE_ATTR_LOW_DPL3, GDT_ATTR_HIGH);
     *((struct gdt_desc*)0xc0000930) = make_gdt_desc((uint32_t*)0, 0xfffff, GDT_DATA_ATTR_LOW_DPL3, GDT_ATTR_HIGH);
-
-    // gdt 16 位的 limit 32 位的段基址
-    uint64_t gdt_operand = ((8 * 7 - 1) | ((uint64_t)(uint32_t)0xc0000900 << 16));
-    asm volatile ("lgdt %0" : : "m" (gdt_operand));
-    asm volatile ("ltr %w0" : : "r" (SELECTOR_TSS));
+    // 把 BSP 的 tss 放到第 4 个位置, 也就是 0x900+0x20 的位置
+    tss_load(0);
     put_str("tss_init and ltr done\n");
+}
+
+// AP 启动后加载自己的 tss, 各 AP 的描述符在 gdt 中各占一项, 互不干扰
+void tss_ap_init(uint8_t cpu_id) {
+    tss_load(cpu_id);
 }
\ No newline at end of file
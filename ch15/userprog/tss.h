@@ -3,4 +3,5 @@
 #include "thread.h"
 void update_tss_esp(struct task_struct* pthread);
 void tss_init(void);
+void tss_ap_init(uint8_t cpu_id);
 #endif
\ No newline at end of file
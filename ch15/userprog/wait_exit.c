@@ -8,52 +8,92 @@
 #include "bitmap.h"
 #include "fs.h"
 #include "file.h"
+#include "vma.h"
+#include "io.h"
+#include "swap.h"
+
+#define FREE_BATCH 64   // release_prog_resource 每攒够这么多页框就批量释放一次
 
 // 释放用户进程资源:
 // 1 页表中对应的物理页
-// 2 虚拟内存池占物理页框
+// 2 虚拟内存区域链表
 // 3 关闭打开的文件
 static void release_prog_resource(struct task_struct* release_thread) {
-    uint32_t* pgdir_vaddr = release_thread->pgdir;
-    uint16_t user_pde_nr = 768, pde_idx = 0;
-    uint32_t pde = 0;
-    uint32_t* v_pde_ptr = NULL;
-
-    uint16_t user_pte_nr = 1024, pte_idx = 0;
-    uint32_t pte = 0;
-    uint32_t* v_pte_ptr = NULL;
-
-    uint32_t* first_pte_vaddr_in_pde = NULL; // 记录 pde 中第 0 个 pte 的地址
-    uint32_t pg_phy_addr = 0;
-
-    // 回收页表中用户空间的页框
-    while (pde_idx < user_pde_nr) {
-        v_pde_ptr = pgdir_vaddr + pde_idx;
-        pde = *v_pde_ptr;
-        // 如果页目录项 p 位为 1, 表示该页目录项下可能有页表项
-        if (pde & 0x00000001) {
-            first_pte_vaddr_in_pde = pte_ptr(pde_idx*0x400000); // 一个页表表示的内存容量是 4M, 即 0x400000
+    pte_t* pgdir_vaddr = release_thread->pgdir;
+    uint32_t pde_idx = 0, pte_idx = 0;
+    pte_t pde = 0, pte = 0;
+    pte_t* first_pte_vaddr_in_pde = NULL; // 记录 pde 中第 0 个 pte 的地址
+    uint32_t pte_left = 0;                   // 页表中还没访问到的存在的 pte 个数
+
+    // 待释放的页框先攒在 frames 中, 满了再一起交给 pfree_batch
+    phys_addr_t frames[FREE_BATCH];
+    uint32_t frame_cnt = 0;
+#ifdef CONFIG_BENCH
+    uint32_t pt_cnt = 0, pg_cnt = 0;
+    uint64_t start = rdtsc();
+#endif
+
+    // 回收页表中用户空间的页框, 只访问 pde_bitmap 中登记过的页表,
+    // 每个页表中找到 pt_cnt 个存在的 pte 后就不必再往后找了.
+    // 两批之间是开中断的, 本进程可能被换下, kswapd, ksmd 和 meminfo 经 pde_bitmap 访问它的页表,
+    // 所以先把这一组页表从 pde_bitmap 中摘掉再释放, 页表本身也要先从页目录中摘掉再交给 pfree_batch
+    uint32_t word_idx = 0;
+    while (word_idx < USER_PDE_CNT / 32) {
+        uint32_t word = release_thread->pde_bitmap[word_idx];
+        release_thread->pde_bitmap[word_idx] = 0;
+        uint32_t bit_idx = 0;
+        while (word != 0) {
+            if (!(word & 1)) {
+                word >>= 1;
+                bit_idx++;
+                continue;
+            }
+            pde_idx = word_idx * 32 + bit_idx;
+            pde = pgdir_vaddr[pde_idx];
+            ASSERT(pde & 0x00000001);
+            first_pte_vaddr_in_pde = pte_ptr(pde_idx << PDE_SHIFT); // 一个页表表示的内存容量是 PDE_SPAN(4M, PAE下2M)
+            pte_left = page_table_cnt(PTE_ADDR(pde));
+#ifdef CONFIG_BENCH
+            pt_cnt++;
+            pg_cnt += pte_left;
+#endif
             pte_idx = 0;
-            while (pte_idx < user_pte_nr) {
-                v_pte_ptr = first_pte_vaddr_in_pde + pte_idx;
-                pte = *v_pte_ptr;
+            while (pte_left > 0) {
+                pte = first_pte_vaddr_in_pde[pte_idx++];
                 if (pte & 0x00000001) {
-                    // 将 pte 中记录的物理页框直接在相应内存池的位图中清 0
-                    pg_phy_addr = pte & 0xfffff000;
-                    free_a_phy_page(pg_phy_addr);
+                    // 释放对 pte 中记录的物理页框的引用, 写时复制共享的页框要等最后一个引用释放时才真正回收
+                    frames[frame_cnt++] = PTE_ADDR(pte);
+                    if (frame_cnt == FREE_BATCH) {
+                        pfree_batch(frames, frame_cnt);
+                        frame_cnt = 0;
+                    }
+                    pte_left--;
+                } else if (pte & PG_SWAP) {
+                    // 换出的页只需释放交换分区中的槽位
+                    swap_free(SWAP_SLOT(pte));
+                    pte_left--;
                 }
-                pte_idx++;
             }
-            // 将 pde 中记录的物理页框直接在相应内存池的位图中清 0
-            pg_phy_addr = pde & 0xfffff000;
-            free_a_phy_page(pg_phy_addr);
+            // pde 中记录的页表本身, 它的内容已经读完了
+            pgdir_vaddr[pde_idx] = 0;
+            frames[frame_cnt++] = PTE_ADDR(pde);
+            if (frame_cnt == FREE_BATCH) {
+                pfree_batch(frames, frame_cnt);
+                frame_cnt = 0;
+            }
+            word >>= 1;
+            bit_idx++;
         }
-        pde_idx++;
+        word_idx++;
     }
-    // 回收用户虚拟地址所占的物理内存
-    uint32_t bitmap_pg_cnt = (release_thread->userprog_vaddr.vaddr_bitmap.btmp_bytes_len) / PG_SIZE;
-    uint8_t* user_vaddr_pool_bitmap = release_thread->userprog_vaddr.vaddr_bitmap.bits;
-    mfree_page(PF_KERNEL, user_vaddr_pool_bitmap, bitmap_pg_cnt);
+    pfree_batch(frames, frame_cnt);
+#ifdef CONFIG_BENCH
+    printk("exit: pid %d freed %d pages in %d page tables, %d cycles\n", \
+           release_thread->pid, pg_cnt, pt_cnt, (uint32_t)(rdtsc() - start));
+#endif
+
+    // 回收用户虚拟内存区域
+    vma_list_destroy(&release_thread->vma_list);
 
    /* 关闭进程打开的文件 */
    uint8_t local_fd = 3;